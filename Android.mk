@@ -22,6 +22,12 @@ LOCAL_EXPORT_C_INCLUDES := $(LOCAL_C_INCLUDES)
 
 LOCAL_SRC_FILES := \
 	src/csv.c \
+	src/csvcore.c \
+	src/csvdtoa.c \
+	src/csvsniff.c \
+	src/csvzlib.c \
+	src/csvmany.c \
+	src/csvtable.c \
 	src/tclcsv.c
 
 LOCAL_CFLAGS := $(tcl_cflags) \
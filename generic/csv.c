@@ -16,15 +16,40 @@
 */
 
 #include "csv.h"
+#include "csvdtoa.h"
+#include "csvsniff.h"
 #include <ctype.h>
 
+/*
+ * Largest precision accepted by -floatformat and the buffer size for a
+ * number formatted with it. %f of the largest double has 309 digits.
+ */
+#define CSV_MAX_FLOAT_PRECISION 30
+#define CSV_NUMBER_SPACE (TCL_DOUBLE_SPACE + 310 + CSV_MAX_FLOAT_PRECISION)
+
+/* SSE2 is part of the x86-64 baseline so needs no runtime check */
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+# define CSV_HAVE_SSE2 1
+# include <emmintrin.h>
+# ifdef _MSC_VER
+#  include <intrin.h>
+# endif
+#endif
+#if CSV_ENABLE_STATS
+# ifdef _WIN32
+#  include <windows.h>
+# else
+#  include <time.h>
+# endif
+#endif
+
 static parser_t* parser_new(void);
 static int parser_init(parser_t *self);
-static int parser_add_skiprow(parser_t *self, int64_t row);
-static int parser_set_skipfirstnrows(parser_t *self, int64_t nrows);
 static void parser_set_default_options(parser_t *self);
-
-KHASH_MAP_INIT_INT64(int64, size_t)
+static void sample_next_record(parser_t *self);
+static int parser_field(void *ctx, const char *data, size_t len);
+static int parser_record(void *ctx);
 
 #ifdef NOTUSED
 static void append_warning(parser_t *self, Tcl_Obj *msgObj)
@@ -39,6 +64,9 @@ static void append_warning(parser_t *self, Tcl_Obj *msgObj)
 
 static void set_error(parser_t *self, Tcl_Obj *msgObj)
 {
+    /* parse_error(parser, file line, message) */
+    CSV_PROBE3(parse_error, self, (long) self->core.file_lines,
+               Tcl_GetString(msgObj));
     Tcl_IncrRefCount(msgObj);
     if (self->errorObj)
         Tcl_DecrRefCount(self->errorObj);
@@ -58,75 +86,367 @@ void parser_set_default_options(parser_t *self)
     self->included_fields = NULL;
     self->excluded_fields = NULL;
 
-    self->delimiter = ','; // XXX
-    self->delim_whitespace = 0;
-
-    self->doublequote = 1;
-    self->quotechar = '"';
-    self->escapechar = 0;
-
-    self->lineterminator = '\0'; /* NUL->standard logic */
+    csv_core_init(&self->core);
+    self->core.on_field = parser_field;
+    self->core.on_record = parser_record;
+    self->core.ctx = self;
 
-    self->skipinitialspace = 0;
-    self->quoting = QUOTE_MINIMAL;
     self->allow_embedded_newline = 1;
-    self->strict = 0;
-    self->skip_empty_lines = 1;
 
     self->expected_fields = -1;
     self->error_bad_lines = 0;
     self->warn_bad_lines = 0;
 
-    self->commentchar = '\0';
-
-    self->skipset = NULL;
-    self->skip_first_N_rows = -1;
     self->skip_footer = 0;
+
+    self->header = 0;
+    self->rows_as_dicts = 0;
+
+    self->sample_mode = SAMPLE_NONE;
+    self->materialize = 1;
+}
+
+/*
+ * Returns 1 if o is a list containing elements that are not integers
+ * and are therefore to be treated as field names, 0 otherwise.
+ */
+static int field_list_has_names(Tcl_Obj *o)
+{
+    Tcl_Obj **objs;
+    Tcl_Size i, nobjs;
+    int ix;
+
+    if (Tcl_ListObjGetElements(NULL, o, &nobjs, &objs) != TCL_OK)
+        return 0;
+    for (i = 0; i < nobjs; ++i) {
+        if (Tcl_GetIntFromObj(NULL, objs[i], &ix) != TCL_OK)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Returns the position of the field named by nameObj in the list
+ * headerObj or -1 if not found.
+ */
+static Tcl_Size header_field_index(Tcl_Obj *headerObj, Tcl_Obj *nameObj)
+{
+    Tcl_Obj **fields;
+    Tcl_Size i, nfields, len, flen;
+    const char *name, *field;
+
+    if (headerObj == NULL ||
+        Tcl_ListObjGetElements(NULL, headerObj, &nfields, &fields) != TCL_OK)
+        return -1;
+    name = Tcl_GetStringFromObj(nameObj, &len);
+    for (i = 0; i < nfields; ++i) {
+        field = Tcl_GetStringFromObj(fields[i], &flen);
+        if (flen == len && memcmp(field, name, len) == 0)
+            return i;
+    }
+    return -1;
 }
 
-static int parse_field_indices(Tcl_Obj *o, Tcl_Size *pnindices, char **ppindices)
+/*
+ * Converts a list of field indices into an array of indices. If headerObj
+ * is not NULL, list elements that are not integers are looked up as field
+ * names in headerObj. On a failed lookup, *pbadname is set to the
+ * offending element if pbadname is not NULL. The returned array, if
+ * any, must be freed by the caller.
+ */
+static int resolve_field_indices(Tcl_Obj *o, Tcl_Obj *headerObj,
+                                 Tcl_Size *pnixs, Tcl_Size **pixs,
+                                 Tcl_Obj **pbadname)
 {
-    char *pindices = NULL;
     Tcl_Obj **objs;
-    Tcl_Size i, imax, nobjs;
+    Tcl_Size i, nobjs;
+    Tcl_Size *ixs;
+
+    if (Tcl_ListObjGetElements(NULL, o, &nobjs, &objs) != TCL_OK)
+        return TCL_ERROR;
+
+    *pnixs = nobjs;
+    *pixs = NULL;
+    if (nobjs == 0)
+        return TCL_OK;
+
+    ixs = malloc((size_t) nobjs * sizeof(*ixs));
+    if (ixs == NULL)
+        return TCL_ERROR;
+    for (i = 0; i < nobjs; ++i) {
+        int ix;
+        if (Tcl_GetIntFromObj(NULL, objs[i], &ix) != TCL_OK) {
+            ix = (int) header_field_index(headerObj, objs[i]);
+            if (ix < 0) {
+                if (pbadname)
+                    *pbadname = objs[i];
+                free(ixs);
+                return TCL_ERROR;
+            }
+        }
+        if (ix < 0) {
+            free(ixs);
+            return TCL_ERROR;
+        }
+        ixs[i] = ix;
+    }
+    *pixs = ixs;
+    return TCL_OK;
+}
+
+/*
+ * Parses a list of field indices (or names, see resolve_field_indices)
+ * into a bit set.
+ */
+static int parse_field_indices(Tcl_Obj *o, Tcl_Obj *headerObj,
+                               size_t *pnindices, field_set_t **ppindices,
+                               Tcl_Obj **pbadname)
+{
+    field_set_t *pindices;
+    Tcl_Size i, imax, nixs;
+    Tcl_Size *ixs;
+    size_t nbits;
 
     /*
      * List of indices is unsorted and may contain duplicates.
      * Instead of building a list and searching it every time we are
-     * adding a field in end_field, we build an boolean array of size
-     * of the max index we encounter. Then just check this array in
-     * the end_field function before including/excluding the element
+     * adding a field in parser_field, we build a bit set of size
+     * of the max index we encounter. Then just check this set in
+     * the parser_field function before including/excluding the element
      */
 
-    if (Tcl_ListObjGetElements(NULL, o, &nobjs, &objs) != TCL_OK)
+    if (resolve_field_indices(o, headerObj, &nixs, &ixs, pbadname) != TCL_OK)
         return TCL_ERROR;
 
-    /* If empty list, treat as unspecified */
-    if (nobjs == 0) {
-        *pnindices = 0;
+    if (*ppindices) {
+        free(*ppindices);
         *ppindices = NULL;
-        return TCL_OK;
+        *pnindices = 0;
     }
 
+    /* If empty list, treat as unspecified */
+    if (nixs == 0)
+        return TCL_OK;
+
     imax = -1;
-    for (i = 0; i < nobjs; ++i) {
-        int ix;
-        if (Tcl_GetIntFromObj(NULL, objs[i], &ix) != TCL_OK)
-            return TCL_ERROR;
-        if (ix < 0 || ix >= 1000)
-            return TCL_ERROR; /* Limit field count to 1000 */
-        if (ix > imax)
-            imax = ix;
+    for (i = 0; i < nixs; ++i) {
+        if (ixs[i] > imax)
+            imax = ixs[i];
     }
-    pindices = calloc(imax+1, sizeof(*pindices));
-    for (i = 0; i < nobjs; ++i) {
-        int ix;
-        Tcl_GetIntFromObj(NULL, objs[i], &ix); /* No need for status check
-                                                  because of above loop */
-        pindices[ix] = 1;
+    /* imax+1 overflows Tcl_Size on 8.6 for the largest int index */
+    nbits = (size_t) imax + 1;
+    pindices = calloc(FIELD_SET_NWORDS(nbits), sizeof(*pindices));
+    if (pindices == NULL) {
+        free(ixs);
+        return TCL_ERROR;
     }
+    for (i = 0; i < nixs; ++i)
+        FIELD_SET_ADD(pindices, ixs[i]);
+    free(ixs);
     *ppindices = pindices;
-    *pnindices = imax+1;
+    *pnindices = nbits;
+    return TCL_OK;
+}
+
+static void parser_clear_columns(parser_t *self)
+{
+    Tcl_Size i;
+
+    if (self->row_cells) {
+        /* Release any values in a partially built row */
+        for (i = 0; i < self->num_columns; ++i) {
+            Tcl_Size slot = self->rows_as_dicts ? 2*i + 1 : i;
+            unref_obj_if_not_null(&self->row_cells[slot]);
+        }
+        free(self->row_cells);
+        self->row_cells = NULL;
+    }
+    if (self->column_slots) {
+        free(self->column_slots);
+        self->column_slots = NULL;
+    }
+    if (self->column_far) {
+        free(self->column_far);
+        self->column_far = NULL;
+    }
+    if (self->column_indices) {
+        free(self->column_indices);
+        self->column_indices = NULL;
+    }
+    self->num_column_slots = 0;
+    self->num_column_far = 0;
+    self->num_columns = 0;
+}
+
+/* Fields with smaller indices are projected through a direct table */
+#define CSV_COLUMN_DIRECT_MAX 4096
+
+static int column_slot_cmp(const void *a, const void *b)
+{
+    Tcl_Size ia = ((const column_slot_t *) a)->index;
+    Tcl_Size ib = ((const column_slot_t *) b)->index;
+
+    return ia < ib ? -1 : ia > ib;
+}
+
+/*
+ * Returns the position in the returned row of the field at field_index
+ * under -columns, or -1 if the field is not returned.
+ */
+static Tcl_Size parser_column_slot(parser_t *self, Tcl_Size field_index)
+{
+    Tcl_Size lo, hi, mid;
+
+    if (field_index < self->num_column_slots)
+        return self->column_slots[field_index];
+    lo = 0;
+    hi = self->num_column_far;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (self->column_far[mid].index < field_index)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo < self->num_column_far && self->column_far[lo].index == field_index)
+        return self->column_far[lo].slot;
+    return -1;
+}
+
+/*
+ * Parses the -columns option value into the projection tables. Each
+ * field may appear at most once.
+ */
+static int parse_column_indices(parser_t *self, Tcl_Obj *o, Tcl_Obj *headerObj,
+                                Tcl_Obj **pbadname)
+{
+    Tcl_Size i, nixs, ndirect, nfar, dup;
+    Tcl_Size *ixs;
+
+    if (resolve_field_indices(o, headerObj, &nixs, &ixs, pbadname) != TCL_OK)
+        return TCL_ERROR;
+
+    parser_clear_columns(self);
+
+    /* If empty list, treat as unspecified */
+    if (nixs == 0)
+        return TCL_OK;
+
+    /* The direct table only covers indices up to the largest specified */
+    ndirect = 0;
+    nfar = 0;
+    for (i = 0; i < nixs; ++i) {
+        if (ixs[i] >= CSV_COLUMN_DIRECT_MAX)
+            ++nfar;
+        else if (ixs[i] >= ndirect)
+            ndirect = ixs[i] + 1;
+    }
+    self->column_slots = malloc((size_t) (ndirect ? ndirect : 1) *
+                                sizeof(*self->column_slots));
+    if (nfar)
+        self->column_far = malloc((size_t) nfar * sizeof(*self->column_far));
+    self->row_cells = calloc(2 * (size_t) nixs, sizeof(*self->row_cells));
+    if (self->column_slots == NULL || (nfar && self->column_far == NULL) ||
+        self->row_cells == NULL) {
+        free(ixs);
+        parser_clear_columns(self);
+        return TCL_ERROR;
+    }
+    for (i = 0; i < ndirect; ++i)
+        self->column_slots[i] = -1;
+    dup = -1;
+    nfar = 0;
+    for (i = 0; i < nixs && dup < 0; ++i) {
+        if (ixs[i] >= CSV_COLUMN_DIRECT_MAX) {
+            self->column_far[nfar].index = ixs[i];
+            self->column_far[nfar++].slot = i;
+        } else if (self->column_slots[ixs[i]] >= 0) {
+            dup = i;
+        } else {
+            self->column_slots[ixs[i]] = i;
+        }
+    }
+    if (dup < 0 && nfar) {
+        qsort(self->column_far, (size_t) nfar, sizeof(*self->column_far),
+              column_slot_cmp);
+        for (i = 1; i < nfar; ++i) {
+            if (self->column_far[i].index == self->column_far[i-1].index) {
+                /* Report the later of the two occurrences */
+                dup = self->column_far[i].slot > self->column_far[i-1].slot ?
+                    self->column_far[i].slot : self->column_far[i-1].slot;
+                break;
+            }
+        }
+    }
+    if (dup >= 0) {
+        if (pbadname) {
+            Tcl_Obj **objs;
+            Tcl_ListObjGetElements(NULL, o, &nixs, &objs);
+            *pbadname = objs[dup];
+        }
+        free(ixs);
+        parser_clear_columns(self);
+        return TCL_ERROR;
+    }
+    self->num_column_slots = ndirect;
+    self->num_column_far = nfar;
+    self->column_indices = ixs;
+    self->num_columns = nixs;
+    return TCL_OK;
+}
+
+static void parser_clear_sample(parser_t *self)
+{
+    Tcl_WideInt i;
+
+    if (self->reservoir) {
+        for (i = 0; i < self->sample_size; ++i)
+            unref_obj_if_not_null(&self->reservoir[i].rowObj);
+        free(self->reservoir);
+        self->reservoir = NULL;
+    }
+}
+
+/*
+ * Parses the -sample option value which is one of
+ *   every N
+ *   reservoir K ?SEED?
+ */
+static int parse_sample_spec(parser_t *self, Tcl_Obj *o)
+{
+    Tcl_Obj **objs;
+    Tcl_Size nobjs;
+    Tcl_WideInt size, seed;
+    Tcl_Time now;
+    const char *mode;
+
+    if (Tcl_ListObjGetElements(NULL, o, &nobjs, &objs) != TCL_OK ||
+        nobjs < 2)
+        return TCL_ERROR;
+    if (Tcl_GetWideIntFromObj(NULL, objs[1], &size) != TCL_OK || size <= 0)
+        return TCL_ERROR;
+    mode = Tcl_GetString(objs[0]);
+    if (!strcmp(mode, "every") && nobjs == 2) {
+        self->sample_mode = SAMPLE_EVERY;
+    } else if (!strcmp(mode, "reservoir") && nobjs <= 3) {
+        if (nobjs == 3) {
+            if (Tcl_GetWideIntFromObj(NULL, objs[2], &seed) != TCL_OK)
+                return TCL_ERROR;
+        } else {
+            Tcl_GetTime(&now);
+            seed = ((Tcl_WideInt) now.sec << 20) ^ now.usec ^ (Tcl_WideInt) (size_t) self;
+        }
+        parser_clear_sample(self);
+        self->reservoir = calloc((size_t) size, sizeof(*self->reservoir));
+        if (self->reservoir == NULL)
+            return TCL_ERROR;
+        self->sample_mode = SAMPLE_RESERVOIR;
+        self->sample_seed = self->sample_rng = (uint64_t) seed;
+    } else {
+        return TCL_ERROR;
+    }
+    self->sample_size = size;
+    self->sample_seen = 0;
     return TCL_OK;
 }
 
@@ -135,6 +455,20 @@ static parser_t* parser_new()
     return (parser_t*) calloc(1, sizeof(parser_t));
 }
 
+static void parser_clear_header(parser_t *self)
+{
+    Tcl_Size i;
+
+    if (self->header_keys) {
+        for (i = 0; i < self->num_header_keys; ++i)
+            Tcl_DecrRefCount(self->header_keys[i]);
+        free(self->header_keys);
+        self->header_keys = NULL;
+    }
+    self->num_header_keys = 0;
+    unref_obj_if_not_null(&self->headerObj);
+}
+
 static void parser_cleanup(parser_t *self)
 {
     unref_obj_if_not_null(&self->errorObj);
@@ -142,11 +476,7 @@ static void parser_cleanup(parser_t *self)
     unref_obj_if_not_null(&self->dataObj);
     unref_obj_if_not_null(&self->rowsObj);
     unref_obj_if_not_null(&self->rowObj);
-    unref_obj_if_not_null(&self->fieldObj);
-    if (self->skipset != NULL) {
-        kh_destroy_int64((kh_int64_t*) self->skipset);
-        self->skipset = NULL;
-    }
+    csv_core_free(&self->core);
     if (self->included_fields) {
         free(self->included_fields);
         self->included_fields = NULL;
@@ -155,6 +485,17 @@ static void parser_cleanup(parser_t *self)
         free(self->excluded_fields);
         self->excluded_fields = NULL;
     }
+    parser_clear_sample(self);
+    parser_clear_columns(self);
+    parser_clear_header(self);
+    unref_obj_if_not_null(&self->column_names);
+    unref_obj_if_not_null(&self->include_names);
+    unref_obj_if_not_null(&self->exclude_names);
+    unref_obj_if_not_null(&self->stats_var);
+    if (self->inflate) {
+        csv_inflate_free(self->inflate);
+        self->inflate = NULL;
+    }
 }
 
 static int parser_init(parser_t *self)
@@ -163,7 +504,6 @@ static int parser_init(parser_t *self)
     self->warnObj = NULL;
 
     self->lines = 0;
-    self->file_lines = 0;
 
     self->field_index = 0;
 
@@ -178,1942 +518,3500 @@ static int parser_init(parser_t *self)
     Tcl_IncrRefCount(self->rowsObj);
     self->rowObj = Tcl_NewListObj(0, NULL);
     Tcl_IncrRefCount(self->rowObj);
-    self->fieldObj = Tcl_NewObj();
-    Tcl_IncrRefCount(self->fieldObj);
-
-    self->state = START_RECORD;
-
-    /* Initial index into field buffer */
-    self->field_buf_index = 0;
 
     return 0;
 }
 
 
-void parser_free(parser_t *self)
+/*
+ * Attaches the parser to a new channel. All state pertaining to the
+ * previous stream is discarded but options, field selection tables and
+ * allocated buffers are retained so a parser may be reused for many
+ * inputs with the same format.
+ */
+void parser_reset(parser_t *self, Tcl_Channel chan)
 {
-    // opposite of parser_init
-    parser_cleanup(self);
-    free(self);
-}
+    Tcl_WideInt i;
 
-static int end_field(parser_t *self)
-{
-    int included;
+    self->chan = chan;
+    unref_obj_if_not_null(&self->errorObj);
+    unref_obj_if_not_null(&self->warnObj);
 
-    /*
-     * If there is any data in our output buffer, copy it to
-     * the field object
-     */
-    if (self->field_buf_index != 0) {
-        Tcl_AppendToObj(self->fieldObj, self->field_buf, self->field_buf_index);
-        self->field_buf_index = 0;
+    self->lines = 0;
+    self->field_index = 0;
+    self->datapos = 0;
+    self->datalen = 0;
+    csv_core_reset(&self->core);
+
+    /* Reuse the result containers unless a caller still holds them */
+    if (Tcl_IsShared(self->rowsObj)) {
+        Tcl_DecrRefCount(self->rowsObj);
+        self->rowsObj = Tcl_NewListObj(0, NULL);
+        Tcl_IncrRefCount(self->rowsObj);
+    } else {
+        Tcl_SetListObj(self->rowsObj, 0, NULL);
+    }
+    if (Tcl_IsShared(self->rowObj)) {
+        Tcl_DecrRefCount(self->rowObj);
+        self->rowObj = Tcl_NewListObj(0, NULL);
+        Tcl_IncrRefCount(self->rowObj);
+    } else {
+        Tcl_SetListObj(self->rowObj, 0, NULL);
     }
 
-    /*
-     * A field is included only if it appears in the include list
-     * and not in the exclude list. No include list means all included.
-     * No exclude list means no exclusions from the include list.
-     */
-    included = 1;
-    if (self->included_fields != NULL &&
-        (self->field_index >= self->num_included_fields ||
-         self->included_fields[self->field_index] == 0))
-        included = 0;
-
-    /* If included, make sure it is not in the exclude list */
-    if (included) {
-        if (self->excluded_fields &&
-            self->field_index < self->num_excluded_fields &&
-            self->excluded_fields[self->field_index])
-            included = 0;
+    if (self->row_cells) {
+        for (i = 0; i < self->num_columns; ++i) {
+            Tcl_Size slot = self->rows_as_dicts ? 2*i + 1 : i;
+            unref_obj_if_not_null(&self->row_cells[slot]);
+        }
     }
-    if (included)
-        Tcl_ListObjAppendElement(NULL, self->rowObj, self->fieldObj);
 
-    Tcl_DecrRefCount(self->fieldObj);
-    self->field_index += 1;
-    self->fieldObj = Tcl_NewObj();
-    Tcl_IncrRefCount(self->fieldObj);
+    /* A new stream has its own header. Names are resolved against it. */
+    if (self->header) {
+        parser_clear_header(self);
+        self->header_pending = 1;
+    }
 
-    return 0;
+    if (self->reservoir) {
+        for (i = 0; i < self->sample_size; ++i)
+            unref_obj_if_not_null(&self->reservoir[i].rowObj);
+    }
+    /* The same seed gives the same sample for every stream */
+    self->sample_seen = 0;
+    self->sample_rng = self->sample_seed;
+    self->materialize = 1;
+    if (!self->header_pending)
+        sample_next_record(self);
+
+    /* Each stream has its own dialect and compression */
+    self->sniff_pending = self->sniff;
+    if (self->inflate)
+        csv_inflate_reset(self->inflate);
+
+    memset(&self->stats, 0, sizeof(self->stats));
 }
 
-
-static int end_line(parser_t *self)
+void parser_free(parser_t *self)
 {
-    Tcl_Size fields;
-
-#ifndef TBD
+    // opposite of parser_init
+    parser_cleanup(self);
+    free(self);
+}
 
-    /* TBD - don't deal with special cases */
-    if (self->state == SKIP_LINE) {
-        TRACE(("end_line: Skipping row %d\n", self->file_lines));
-        // increment file line count
-        self->file_lines++;
+/*
+ * A field is included only if it appears in the include list
+ * and not in the exclude list. No include list means all included.
+ * No exclude list means no exclusions from the include list.
+ */
+static int field_selected(parser_t *self, Tcl_Size field_index)
+{
+    if (self->included_fields != NULL &&
+        !FIELD_SET_TEST(self->included_fields, self->num_included_fields,
+                        field_index))
         return 0;
-    }
-    fields = 0;
-    Tcl_ListObjLength(NULL, self->rowObj,  &fields);
-    Tcl_ListObjAppendElement(NULL, self->rowsObj, self->rowObj);
-    Tcl_DecrRefCount(self->rowObj);
-    self->rowObj = Tcl_NewListObj(fields, NULL);
-    Tcl_IncrRefCount(self->rowObj);
 
-    TRACE(("end_line: Line end, nfields: %d\n", fields));
+    /* If included, make sure it is not in the exclude list */
+    if (self->excluded_fields &&
+        FIELD_SET_TEST(self->excluded_fields, self->num_excluded_fields,
+                       field_index))
+        return 0;
 
-    self->field_index = 0;
-    self->file_lines++;
-    self->lines++;
-#else // TBD
-    int ex_fields = self->expected_fields;
-    if (self->lines > 0) {
-        if (self->expected_fields >= 0) {
-            ex_fields = self->expected_fields;
-        } else {
-            ex_fields = self->line_fields[self->lines - 1];
-        }
-    }
+    return 1;
+}
 
-    if (self->state == SKIP_LINE) {
-        TRACE(("end_line: Skipping row %d\n", self->file_lines));
-        // increment file line count
-        self->file_lines++;
+/* Tokenizer callback for the end of each field */
+static int parser_field(void *ctx, const char *data, size_t len)
+{
+    parser_t *self = (parser_t *) ctx;
 
-        // skip the tokens from this bad line
-        self->line_start[self->lines] += fields;
+    CSV_STATS_INCR(self, fields);
 
-        // reset field count
-        self->line_fields[self->lines] = 0;
+    /* Nothing to collect if the record is not part of the sample */
+    if (!self->materialize) {
+        self->field_index += 1;
         return 0;
     }
-    /* printf("Line: %d, Fields: %d, Ex-fields: %d\n", self->lines, fields, ex_fields); */
-
-    if (!(self->lines <= self->header_end + 1)
-        && (self->expected_fields < 0 && fields > ex_fields)) {
-        // increment file line count
-        self->file_lines++;
-
-        // skip the tokens from this bad line
-        self->line_start[self->lines] += fields;
-
-        // reset field count
-        self->line_fields[self->lines] = 0;
-
-        // file_lines is now the _actual_ file line number (starting at 1)
-
-        if (self->error_bad_lines) {
-            set_error(self,
-                      Tcl_ObjPrintf("CSV parse error: expected %d fields in line %d, saw %d\n",
-                                    ex_fields, self->file_lines, fields));
+    CSV_STATS_MAX(self, max_field_length, (Tcl_WideInt) len);
 
-            TRACE(("Error at line %d, %d fields\n", self->file_lines, fields));
-
-            return -1;
-        } else {
-            // simply skip bad lines
-            if (self->warn_bad_lines) {
-                // pass up error message
-                append_warning(self,
-                               Tcl_ObjPrintf("Skipping line %d: expected %d fields, saw %d\n",
-                                             self->file_lines,
-                                             ex_fields,
-                                             fields));
+    /*
+     * The header is collected in its entirety since field selections
+     * may refer to it by name. Selection is applied once it is complete.
+     */
+    if (self->header_pending) {
+        Tcl_ListObjAppendElement(NULL, self->rowObj,
+                                 Tcl_NewStringObj(data, (Tcl_Size) len));
+        CSV_STATS_INCR(self, objects);
+    } else if (self->column_slots) {
+        Tcl_Size slot;
+        if ((slot = parser_column_slot(self, self->field_index)) >= 0) {
+            if (self->rows_as_dicts)
+                slot = 2 * slot + 1;
+            self->row_cells[slot] = Tcl_NewStringObj(data, (Tcl_Size) len);
+            Tcl_IncrRefCount(self->row_cells[slot]);
+            CSV_STATS_INCR(self, objects);
+        }
+    } else if (field_selected(self, self->field_index)) {
+        if (self->rows_as_dicts) {
+            Tcl_Size pos;
+            /* Row is a key value list so the position is half its length */
+            Tcl_ListObjLength(NULL, self->rowObj, &pos);
+            pos /= 2;
+            if (pos < self->num_header_keys) {
+                Tcl_ListObjAppendElement(NULL, self->rowObj,
+                                         self->header_keys[pos]);
+            } else {
+                Tcl_ListObjAppendElement(NULL, self->rowObj,
+                                         Tcl_NewWideIntObj(pos));
+                CSV_STATS_INCR(self, objects);
             }
         }
+        Tcl_ListObjAppendElement(NULL, self->rowObj,
+                                 Tcl_NewStringObj(data, (Tcl_Size) len));
+        CSV_STATS_INCR(self, objects);
     }
-    else {
-        /* missing trailing delimiters */
-        if ((self->lines >= self->header_end + 1) && fields < ex_fields) {
 
-            /* Might overrun the buffer when closing fields */
-            if (make_stream_space(self, ex_fields - fields) < 0) {
-                set_error(self, Tcl_NewStringObj("out of memory", -1));
-                return -1;
-            }
+    self->field_index += 1;
+    return 0;
+}
 
-            while (fields < ex_fields){
-                end_field(self);
-                /* printf("Prior word: %s\n", self->words[self->words_len - 2]); */
-                fields++;
-            }
+/*
+ * Called when the header record is complete. Resolves any field selections
+ * given as names and saves the selected header fields as the keys for
+ * subsequent rows.
+ */
+static int parser_set_header(parser_t *self)
+{
+    Tcl_Obj **fields, *badname = NULL;
+    Tcl_Size i, nfields;
+
+    if (self->include_names &&
+        parse_field_indices(self->include_names, self->rowObj,
+                            &self->num_included_fields,
+                            &self->included_fields, &badname) != TCL_OK)
+        goto bad_name;
+    if (self->exclude_names &&
+        parse_field_indices(self->exclude_names, self->rowObj,
+                            &self->num_excluded_fields,
+                            &self->excluded_fields, &badname) != TCL_OK)
+        goto bad_name;
+
+    if (self->column_names &&
+        parse_column_indices(self, self->column_names, self->rowObj,
+                             &badname) != TCL_OK)
+        goto bad_name;
+
+    parser_clear_header(self);
+    Tcl_ListObjGetElements(NULL, self->rowObj, &nfields, &fields);
+    if (self->column_slots) {
+        /* Header is in column order. Missing names keyed by index */
+        self->headerObj = Tcl_NewListObj(self->num_columns, NULL);
+        Tcl_IncrRefCount(self->headerObj);
+        self->header_keys = malloc((self->num_columns + 1) * sizeof(Tcl_Obj *));
+        for (i = 0; i < self->num_columns; ++i) {
+            Tcl_Size ix = self->column_indices[i];
+            Tcl_Obj *key = ix < nfields ? fields[ix] : Tcl_NewWideIntObj(ix);
+            Tcl_ListObjAppendElement(NULL, self->headerObj, key);
+            Tcl_IncrRefCount(key);
+            self->header_keys[self->num_header_keys++] = key;
+            if (self->rows_as_dicts)
+                self->row_cells[2*i] = key;
         }
-
-        // increment both line counts
-        self->file_lines++;
-
-        self->lines++;
-
-        /* coliter_t it; */
-        /* coliter_setup(&it, self, 5, self->lines - 1); */
-        /* printf("word at column 5: %s\n", COLITER_NEXT(it)); */
-
-        // good line, set new start point
-        if (self->lines >= self->lines_cap) {
-            TRACE(("end_line: ERROR!!! self->lines(%zu) >= self->lines_cap(%zu)\n", self->lines, self->lines_cap));
-            set_error(self, Tcl_NewStringObj("Buffer overflow caught - possible malformed input CSV data.\n", -1));
-            return PARSER_OUT_OF_MEMORY;                \
+    } else {
+        self->headerObj = Tcl_NewListObj(nfields, NULL);
+        Tcl_IncrRefCount(self->headerObj);
+        self->header_keys = malloc((nfields + 1) * sizeof(Tcl_Obj *));
+        for (i = 0; i < nfields; ++i) {
+            if (field_selected(self, i)) {
+                Tcl_ListObjAppendElement(NULL, self->headerObj, fields[i]);
+                Tcl_IncrRefCount(fields[i]);
+                self->header_keys[self->num_header_keys++] = fields[i];
+            }
         }
-        self->line_start[self->lines] = (self->line_start[self->lines - 1] +
-                                         fields);
-
-        TRACE(("end_line: new line start: %d\n", self->line_start[self->lines]));
-
-        // new line start with 0 fields
-        self->line_fields[self->lines] = 0;
     }
-#endif // TBD
+    Tcl_SetListObj(self->rowObj, 0, NULL);
+    self->header_pending = 0;
+    return 0;
 
-    TRACE(("end_line: Finished line, at %d\n", self->lines));
+bad_name:
+    if (badname && header_field_index(self->rowObj, badname) < 0)
+        set_error(self, Tcl_ObjPrintf("Field \"%s\" not found in header.",
+                                      Tcl_GetString(badname)));
+    else if (badname)
+        set_error(self, Tcl_ObjPrintf("Field \"%s\" specified more than once.",
+                                      Tcl_GetString(badname)));
+    else
+        set_error(self, Tcl_NewStringObj("Invalid field in header.", -1));
+    return -1;
+}
 
-    return 0;
+/* Returns the next value from a splitmix64 sequence */
+static uint64_t sample_random(parser_t *self)
+{
+    uint64_t z = (self->sample_rng += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
 }
 
-int parser_add_skiprow(parser_t *self, int64_t row) {
-    khiter_t k;
-    kh_int64_t *set;
-    int ret = 0;
+/*
+ * Decides whether the next record is to be part of the sample. For
+ * reservoir sampling (Algorithm R), the n'th record replaces a random
+ * slot with probability K/(n+1) once the reservoir is full.
+ */
+static void sample_next_record(parser_t *self)
+{
+    Tcl_WideInt n = self->sample_seen;
 
-    if (self->skipset == NULL) {
-        self->skipset = (void*) kh_init_int64();
+    switch (self->sample_mode) {
+    case SAMPLE_NONE:
+        self->materialize = 1;
+        break;
+    case SAMPLE_EVERY:
+        self->materialize = (n % self->sample_size) == 0;
+        break;
+    case SAMPLE_RESERVOIR:
+        if (n < self->sample_size) {
+            self->sample_slot = n;
+        } else {
+            self->sample_slot = (Tcl_WideInt) (sample_random(self) % (uint64_t) (n + 1));
+        }
+        self->materialize = self->sample_slot < self->sample_size;
+        break;
     }
+}
 
-    set = (kh_int64_t*) self->skipset;
+/* Adds a completed row to the result or the sample reservoir */
+static void emit_row(parser_t *self, Tcl_Obj *rowObj)
+{
+    sample_slot_t *slot;
 
-    k = kh_put_int64(set, row, &ret);
-    set->keys[k] = row;
+    CSV_STATS_INCR(self, rows);
 
-    return 0;
+    if (self->sample_mode == SAMPLE_RESERVOIR) {
+        slot = &self->reservoir[self->sample_slot];
+        Tcl_IncrRefCount(rowObj);
+        if (slot->rowObj)
+            Tcl_DecrRefCount(slot->rowObj);
+        slot->rowObj = rowObj;
+        slot->record = self->sample_seen;
+    } else {
+        Tcl_ListObjAppendElement(NULL, self->rowsObj, rowObj);
+    }
+    if (self->sample_mode != SAMPLE_NONE) {
+        self->sample_seen++;
+        sample_next_record(self);
+    }
 }
 
-int parser_set_skipfirstnrows(parser_t *self, int64_t nrows)
+static int compare_sample_slots(const void *a, const void *b)
 {
-    // self->file_lines is zero based so subtract 1 from nrows
-    if (nrows > 0) {
-        self->skip_first_N_rows = nrows - 1;
-    }
-
-    return 0;
+    Tcl_WideInt ra = ((const sample_slot_t *) a)->record;
+    Tcl_WideInt rb = ((const sample_slot_t *) b)->record;
+    return ra < rb ? -1 : (ra > rb);
+}
+
+/*
+ * Moves the rows in the reservoir, if any, to rowsObj in the order
+ * they appeared in the input.
+ */
+void parser_collect_sample(parser_t *self)
+{
+    Tcl_WideInt i, n;
+
+    if (self->sample_mode != SAMPLE_RESERVOIR)
+        return;
+    n = self->sample_seen < self->sample_size ?
+        self->sample_seen : self->sample_size;
+    qsort(self->reservoir, (size_t) n, sizeof(*self->reservoir),
+          compare_sample_slots);
+    for (i = 0; i < n; ++i) {
+        Tcl_ListObjAppendElement(NULL, self->rowsObj, self->reservoir[i].rowObj);
+        Tcl_DecrRefCount(self->reservoir[i].rowObj);
+        self->reservoir[i].rowObj = NULL;
+    }
+    self->sample_seen = 0;
+}
+
+/*
+ * Builds the row for a record when a column projection is in effect.
+ * Columns missing from the record are returned as empty values.
+ */
+static void end_projected_line(parser_t *self)
+{
+    Tcl_Obj *emptyObj = NULL, *rowObj;
+    Tcl_Size ncells, slot, step;
+
+    step = self->rows_as_dicts ? 2 : 1;
+    ncells = step * self->num_columns;
+    for (slot = step - 1; slot < ncells; slot += step) {
+        if (self->row_cells[slot] == NULL) {
+            if (emptyObj == NULL) {
+                emptyObj = Tcl_NewObj();
+                CSV_STATS_INCR(self, objects);
+            }
+            self->row_cells[slot] = emptyObj;
+            Tcl_IncrRefCount(emptyObj);
+        }
+    }
+    rowObj = Tcl_NewListObj(ncells, self->row_cells);
+    CSV_STATS_INCR(self, objects);
+    for (slot = step - 1; slot < ncells; slot += step) {
+        Tcl_DecrRefCount(self->row_cells[slot]);
+        self->row_cells[slot] = NULL;
+    }
+    emit_row(self, rowObj);
+}
+
+/*
+ * Tokenizer callback for the end of each record. Returns CSV_CORE_PAUSE
+ * once the requested number of records has been parsed.
+ */
+static int parser_record(void *ctx)
+{
+    parser_t *self = (parser_t *) ctx;
+    Tcl_Size fields;
+
+    if (self->header_pending) {
+        if (parser_set_header(self) != 0)
+            return CSV_CORE_ERROR;
+        TRACE(("parser_record: Header, nfields: %d\n", self->num_header_keys));
+        self->field_index = 0;
+        sample_next_record(self);
+        return CSV_CORE_OK;
+    }
+    if (!self->materialize) {
+        TRACE(("parser_record: Record %d not in sample\n", self->sample_seen));
+        CSV_PROBE4(record_end, self, (long) self->lines,
+                   (long) self->core.file_lines, (long) self->field_index);
+        self->field_index = 0;
+        self->lines++;
+        self->sample_seen++;
+        sample_next_record(self);
+        goto done;
+    }
+    if (self->column_slots) {
+        end_projected_line(self);
+        TRACE(("parser_record: Line end, nfields: %d\n", self->num_columns));
+        CSV_PROBE4(record_end, self, (long) self->lines,
+                   (long) self->core.file_lines, (long) self->field_index);
+        self->field_index = 0;
+        self->lines++;
+        goto done;
+    }
+    fields = 0;
+    Tcl_ListObjLength(NULL, self->rowObj,  &fields);
+    if (self->rows_as_dicts) {
+        /* Fields missing at the end of the row are returned as empty */
+        for (; fields < 2 * self->num_header_keys; fields += 2) {
+            Tcl_ListObjAppendElement(NULL, self->rowObj,
+                                     self->header_keys[fields / 2]);
+            Tcl_ListObjAppendElement(NULL, self->rowObj, Tcl_NewObj());
+            CSV_STATS_INCR(self, objects);
+        }
+    }
+    emit_row(self, self->rowObj);
+    Tcl_DecrRefCount(self->rowObj);
+    self->rowObj = Tcl_NewListObj(fields, NULL);
+    Tcl_IncrRefCount(self->rowObj);
+    CSV_STATS_INCR(self, objects);
+
+    TRACE(("parser_record: Line end, nfields: %d\n", fields));
+    /* record_end(parser, record index, file line, number of fields) */
+    CSV_PROBE4(record_end, self, (long) self->lines,
+               (long) self->core.file_lines, (long) self->field_index);
+
+    self->field_index = 0;
+    self->lines++;
+
+done:
+    if (self->line_limit > 0 &&
+        self->lines == self->limit_start + (Tcl_Size) self->line_limit)
+        return CSV_CORE_PAUSE;
+    return CSV_CORE_OK;
+}
+
+/* Sniffing reads the sample in chunks of this size up to the maximum */
+#define CSV_SNIFF_CHUNK 16384
+#define CSV_SNIFF_MAX_BYTES (1024 * 1024)
+
+/*
+ * Reads up to nbytes characters from the channel into the data buffer,
+ * replacing its content or appending to it. With -compression the data
+ * is inflated and decoded by csv_inflate_read instead of the channel and
+ * the count is of bytes. Returns the number read, 0 at the end of the
+ * input and -1 on error.
+ */
+static Tcl_Size parser_read(parser_t *self, Tcl_Size nbytes, int append)
+{
+    Tcl_Obj *errorObj = NULL;
+    Tcl_Size nread;
+
+    if (self->inflate == NULL) {
+        nread = Tcl_ReadChars(self->chan, self->dataObj, nbytes, append);
+        if (nread < 0) {
+            set_error(self, Tcl_ObjPrintf("Calling read(nbytes) on source failed (Error %d).", Tcl_GetErrno()));
+            return -1;
+        }
+        self->data = Tcl_GetStringFromObj(self->dataObj, &self->datalen);
+        return nread;
+    }
+
+    nread = csv_inflate_read(self->inflate, self->chan, nbytes, append,
+                             &errorObj);
+    if (nread < 0) {
+        set_error(self, errorObj);
+        return -1;
+    }
+    self->data = Tcl_DStringValue(&self->inflate->text);
+    self->datalen = Tcl_DStringLength(&self->inflate->text);
+    return nread;
+}
+
+/* Candidate delimiters when -sniff is used without -delimiter */
+static const char sniff_delimiters[] = { ',', ';', ':', '\t' };
+
+/*
+ * Sets the dialect settings that were not explicitly specified from
+ * the sniffed dialect, or to their defaults if dialect is NULL. The
+ * result is the same as passing the options returned by sniff.
+ */
+static void parser_apply_dialect(parser_t *self, const csv_dialect_t *dialect)
+{
+    int fixed = self->sniff_fixed;
+
+    if (!(fixed & SNIFF_FIXED_DELIMITER))
+        self->core.delimiter = dialect ? dialect->delimiter : ',';
+    if (!(fixed & SNIFF_FIXED_QUOTE))
+        self->core.quotechar =
+            dialect && dialect->quotechar ? dialect->quotechar : '"';
+    if (!(fixed & SNIFF_FIXED_COMMENT))
+        self->core.commentchar = dialect ? dialect->commentchar : 0;
+    if (!(fixed & SNIFF_FIXED_SKIPLEADINGSPACE))
+        self->core.skipinitialspace =
+            dialect && dialect->skipleadingspace > 0;
+    if (!(fixed & SNIFF_FIXED_DOUBLEQUOTE))
+        self->core.doublequote = 1;
+    if (!(fixed & SNIFF_FIXED_ESCAPE))
+        self->core.escapechar =
+            dialect && !dialect->doublequote ? dialect->escapechar : 0;
+}
+
+/*
+ * Sniffs the buffered data for -sniff. If no dialect can be inferred,
+ * for example for a single column, the defaults are used.
+ */
+static void parser_sniff_buffered(parser_t *self, int at_eof)
+{
+    csv_dialect_t dialect;
+    const char *delimiters = sniff_delimiters;
+    size_t ndelimiters = sizeof(sniff_delimiters);
+
+    self->sniff_pending = 0;
+    if (self->sniff_fixed & SNIFF_FIXED_DELIMITER) {
+        delimiters = &self->core.delimiter;
+        ndelimiters = 1;
+    }
+    if (csv_sniff(self->data, (size_t) self->datalen, at_eof,
+                  delimiters, ndelimiters, &dialect) == 0)
+        parser_apply_dialect(self, &dialect);
+    else
+        parser_apply_dialect(self, NULL);
+}
+
+/*
+ * Buffers a sample of the channel, sniffing it as for the sniff command,
+ * in place of the first refill. Returns as parser_buffer_bytes.
+ */
+static int parser_buffer_sample(parser_t *self)
+{
+    Tcl_Size nchars, total;
+    int at_eof;
+    CSV_STATS_CLOCK(start);
+
+    total = 0;
+    do {
+        nchars = parser_read(self, CSV_SNIFF_CHUNK, total > 0);
+        CSV_STATS_INCR(self, refills);
+        if (nchars < 0)
+            return -1;
+        total += nchars;
+        at_eof = nchars == 0 ||
+            (self->inflate == NULL && Tcl_Eof(self->chan));
+    } while (! at_eof && self->datalen < CSV_SNIFF_MAX_BYTES &&
+             csv_sniff_lines(self->data, self->datalen) <= CSV_SNIFF_RECORDS);
+    CSV_STATS_ELAPSED(self, refill_ns, start);
+    CSV_STATS_ADD(self, bytes_read, self->datalen);
+
+    parser_sniff_buffered(self, at_eof);
+    if (total == 0) {
+        self->datalen = 0;
+        return REACHED_EOF;
+    }
+    return 0;
 }
 
 static int parser_buffer_bytes(parser_t *self, size_t nbytes)
 {
     Tcl_Size chars_read;
+    CSV_STATS_CLOCK(start);
 
     self->datapos = 0;
+    if (self->chan == NULL) {
+        /* Parsing a value (csv_parse). All of it was already buffered. */
+        self->datalen = 0;
+        return REACHED_EOF;
+    }
     if (self->dataObj == NULL)
         self->dataObj = Tcl_NewObj();
+    if (self->sniff_pending)
+        return parser_buffer_sample(self);
 
-    chars_read = Tcl_ReadChars(self->chan, self->dataObj, (Tcl_Size) nbytes, 0);
+    chars_read = parser_read(self, (Tcl_Size) nbytes, 0);
+    CSV_STATS_INCR(self, refills);
+    CSV_STATS_ELAPSED(self, refill_ns, start);
     if (chars_read > 0) {
-        self->data = Tcl_GetStringFromObj(self->dataObj, &self->datalen);
+        CSV_STATS_ADD(self, bytes_read, self->datalen);
+        /* refill(parser, characters read, buffer length in bytes) */
+        CSV_PROBE3(refill, self, (long) chars_read, (long) self->datalen);
         return 0; /* Success */
     } else if (chars_read == 0) {
         /* Currently treat as EOF as we do not handle non-blocking chans */
         self->datalen = 0;
         return REACHED_EOF;
     } else {
-        set_error(self, Tcl_ObjPrintf("Calling read(nbytes) on source failed (Error %d).", Tcl_GetErrno()));
         return -1;
     }
 }
 
 
-/*
-  Tokenization macros and state machine code
-*/
-
-#define PUSH_CHAR(c)                                                    \
-    do {                                                                \
-        TRACE(("PUSH_CHAR: Pushing %c\n", c))                           \
-        if (self->field_buf_index == sizeof(self->field_buf)) {         \
-            Tcl_AppendToObj(self->fieldObj, self->field_buf, self->field_buf_index); \
-            self->field_buf_index = 0;                                  \
-        }                                                               \
-        self->field_buf[self->field_buf_index++] = c;                   \
-    } while (0)
+/* Completes the last record once the channel is exhausted */
+static int parser_handle_eof(parser_t *self)
+{
+    TRACE(("handling eof, datalen: %d, pstate: %d\n", self->datalen, self->core.state))
+    if (csv_core_finish(&self->core) != CSV_CORE_OK) {
+        if (self->core.error[0])
+            set_error(self, Tcl_NewStringObj(self->core.error, -1));
+        return -1;
+    }
+    return 0;
+}
 
-/* This is a little bit of a hack but works for now */
-#define END_FIELD()                             \
-    do {                                        \
-        if (end_field(self) < 0) {              \
-            goto parsingerror;                  \
-        }                                       \
-    } while (0)
+/* Returns a monotonic clock reading in nanoseconds */
+Tcl_WideInt csv_clock_ns(void)
+{
+#if CSV_ENABLE_STATS
+# ifdef _WIN32
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER count;
+    if (freq.QuadPart == 0)
+        QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return (Tcl_WideInt) ((double) count.QuadPart * 1e9 / (double) freq.QuadPart);
+# else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (Tcl_WideInt) ts.tv_sec * 1000000000 + ts.tv_nsec;
+# endif
+#else
+    return 0;
+#endif
+}
 
-#define END_LINE_STATE(STATE)                                           \
-    do {                                                                \
-        if (end_line(self) < 0) {                                       \
-            goto parsingerror;                                          \
-        }                                                               \
-        self->state = STATE;                                            \
-        if (line_limit > 0 && self->lines == start_lines + line_limit) { \
-            goto linelimit;                                             \
-                                                                        \
-        }                                                               \
+/*
+ * Returns the parser statistics as a dictionary. Times are in microseconds.
+ * Skipped lines are those that did not result in a record, for example
+ * blank lines, comments and lines skipped with -startline or -skiplines.
+ */
+Tcl_Obj *parser_stats_obj(parser_t *self)
+{
+    Tcl_Obj *objs[20];
+    Tcl_WideInt skipped;
+    int n = 0;
+
+#define ADD_STAT(name_, value_)                         \
+    do {                                                \
+        objs[n++] = Tcl_NewStringObj(name_, -1);        \
+        objs[n++] = Tcl_NewWideIntObj(value_);          \
     } while (0)
 
-#define END_LINE_AND_FIELD_STATE(STATE)                                 \
-    do {                                                                \
-        if (end_line(self) < 0) {                                       \
-            goto parsingerror;                                          \
-        }                                                               \
-        if (end_field(self) < 0) {                                      \
-            goto parsingerror;                                          \
-        }                                                               \
-        self->state = STATE;                                            \
-        if (line_limit > 0 && self->lines == start_lines + line_limit) { \
-            goto linelimit;                                             \
-                                                                        \
-        }                                                               \
-    } while (0)
+    skipped = self->core.file_lines - self->lines;
+    if (self->header && !self->header_pending)
+        skipped -= 1;           /* Header line */
+    ADD_STAT("bytes", self->stats.bytes_read);
+    ADD_STAT("refills", self->stats.refills);
+    ADD_STAT("refilltime", self->stats.refill_ns / 1000);
+    ADD_STAT("tokenizetime", self->stats.tokenize_ns / 1000);
+    ADD_STAT("fields", self->stats.fields);
+    ADD_STAT("rows", self->stats.rows);
+    ADD_STAT("objects", self->stats.objects);
+    ADD_STAT("maxfieldlength", self->stats.max_field_length);
+    ADD_STAT("flushes", self->core.field_grows);
+    ADD_STAT("skippedlines", skipped > 0 ? skipped : 0);
+
+#undef ADD_STAT
+
+    return Tcl_NewListObj(n, objs);
+}
 
-#define END_LINE() END_LINE_STATE(START_RECORD)
+/*
+ * Sniffs the dialect of the attached stream for -sniff if not already
+ * done. The sample is kept buffered for tokenizing. Returns 0 on
+ * success and -1 on error.
+ */
+int parser_sniff(parser_t *self)
+{
+    int status;
 
-#define IS_WHITESPACE(c) ((c == ' ' || c == '\t'))
+    if (!self->sniff_pending || self->datapos != self->datalen)
+        return 0;
+    status = parser_buffer_bytes(self, self->chunksize);
+    if (status == REACHED_EOF)
+        return 0;
+    return status;
+}
 
-typedef int (*parser_op)(parser_t *self, size_t line_limit);
+/* Returns the dialect settings in effect as a list of options */
+Tcl_Obj *parser_dialect_obj(parser_t *self)
+{
+    Tcl_Obj *objs[12];
+    char c;
+    int n = 0;
 
-#define _TOKEN_CLEANUP()                                                \
-    do { \
-        self->datapos = i;                                              \
-        TRACE(("_TOKEN_CLEANUP: datapos: %d, datalen: %d\n", self->datapos, self->datalen)); \
+#define ADD_OPT(name_, valueObj_)                       \
+    do {                                                \
+        objs[n++] = Tcl_NewStringObj(name_, -1);        \
+        objs[n++] = valueObj_;                          \
     } while (0)
 
-int skip_this_line(parser_t *self, int64_t linenum) {
-    if (self->skipset != NULL) {
-        return ( kh_get_int64((kh_int64_t*) self->skipset, self->file_lines) !=
-                 ((kh_int64_t*)self->skipset)->n_buckets );
-    }
-    else {
-        return ( linenum <= self->skip_first_N_rows );
-    }
+    c = self->core.delimiter;
+    ADD_OPT("-delimiter", Tcl_NewStringObj(&c, 1));
+    c = self->core.quotechar;
+    ADD_OPT("-quote", Tcl_NewStringObj(&c, c ? 1 : 0));
+    c = self->core.escapechar;
+    ADD_OPT("-escape", Tcl_NewStringObj(&c, c ? 1 : 0));
+    c = self->core.commentchar;
+    ADD_OPT("-comment", Tcl_NewStringObj(&c, c ? 1 : 0));
+    ADD_OPT("-doublequote", Tcl_NewBooleanObj(self->core.doublequote));
+    ADD_OPT("-skipleadingspace",
+            Tcl_NewBooleanObj(self->core.skipinitialspace));
+
+#undef ADD_OPT
+
+    return Tcl_NewListObj(n, objs);
 }
 
-int tokenize_delimited(parser_t *self, size_t line_limit)
+void debug_print_parser(parser_t *self)
 {
-    Tcl_Size i, start_lines;
-    char c;
-    char *buf = self->data + self->datapos;
-
-    start_lines = self->lines;
-
-    TRACE(("%s\n", buf));
+    int line;
 
-    for (i = self->datapos; i < self->datalen; ++i)
+    for (line = 0; line < self->lines; ++line)
     {
-        // Next character in file
-        c = *buf++;
-
-        TRACE(("tokenize_delimited - Iter: %d Char: 0x%x Line %d, state %d\n",
-               i, c, self->file_lines + 1, self->state));
-
-        switch(self->state) {
-
-        case SKIP_LINE:
-            TRACE(("tokenize_delimited SKIP_LINE 0x%x, state %d\n", c, self->state));
-            if (c == '\n') {
-                END_LINE();
-            } else if (c == '\r') {
-                self->file_lines++;
-                self->state = EAT_CRNL_NOP;
-            }
-            break;
-
-        case START_RECORD:
-            // start of record
-            if (skip_this_line(self, self->file_lines)) {
-                self->state = SKIP_LINE;
-                if (c == '\n') {
-                    END_LINE();
-                }
-                break;
-            }
-            else if (c == '\n') {
-                // \n\r possible?
-                if (self->skip_empty_lines)
-                {
-                    self->file_lines++;
-                }
-                else
-                {
-                    END_LINE();
-                }
-                break;
-            }
-            else if (c == '\r') {
-                if (self->skip_empty_lines)
-                {
-                    self->file_lines++;
-                    self->state = EAT_CRNL_NOP;
-                }
-                else
-                    self->state = EAT_CRNL;
-                break;
-            }
-            else if (c == self->commentchar) {
-                self->state = EAT_LINE_COMMENT;
-                break;
-            }
-            else if (IS_WHITESPACE(c) && c != self->delimiter && self->skip_empty_lines) {
-                self->state = WHITESPACE_LINE;
-                break;
-            }
-
-            /* normal character - handle as START_FIELD */
-            self->state = START_FIELD;
-            /* fallthru */
-
-        case START_FIELD:
-            /* expecting field */
-            if (c == '\n') {
-                END_FIELD();
-                END_LINE();
-            } else if (c == '\r') {
-                END_FIELD();
-                self->state = EAT_CRNL;
-            }
-            else if (c == self->quotechar &&
-                     self->quoting != QUOTE_NONE) {
-                /* start quoted field */
-                self->state = IN_QUOTED_FIELD;
-            }
-            else if (c == self->escapechar) {
-                /* possible escaped character */
-                self->state = ESCAPED_CHAR;
-            }
-            else if (c == ' ' && self->skipinitialspace)
-                /* ignore space at start of field */
-                ;
-            else if (c == self->delimiter) {
-                /* save empty field */
-                END_FIELD();
-            }
-            else if (c == self->commentchar) {
-                END_FIELD();
-                self->state = EAT_COMMENT;
-            }
-            else {
-                /* begin new unquoted field */
-//                if (self->quoting == QUOTE_NONNUMERIC)
-//                    self->numeric_field = 1;
-
-                // TRACE(("pushing %c", c));
-                PUSH_CHAR(c);
-                self->state = IN_FIELD;
-            }
-            break;
-
-        case WHITESPACE_LINE: // check if line is whitespace-only
-            if (c == '\n') {
-                self->file_lines++;
-                self->state = START_RECORD; // ignore empty line
-            }
-            else if (c == '\r') {
-                self->file_lines++;
-                self->state = EAT_CRNL_NOP;
-            }
-            else if (IS_WHITESPACE(c) && c != self->delimiter)
-                ;
-            else { // backtrack
-                /* We have to use i + 1 because buf has been incremented but not i */
-                do {
-                    --buf;
-                    --i;
-                } while (i + 1 > self->datapos && *buf != '\n');
-
-                if (*buf == '\n') // reached a newline rather than the beginning
-                {
-                    ++buf; // move pointer to first char after newline
-                    ++i;
-                }
-                self->state = START_FIELD;
-            }
-            break;
-
-        case ESCAPED_CHAR:
-            /* if (c == '\0') */
-            /*  c = '\n'; */
+        printf("(Parsed) Line %d: ", line);
 
-            PUSH_CHAR(c);
-            self->state = IN_FIELD;
-            break;
+#ifdef TBD
+        for (j = 0; j < self->line_fields[j]; ++j)
+        {
+            token = self->words[j + self->line_start[line]];
+            printf("%s ", token);
+        }
+        printf("\n");
+#endif
+    }
+}
 
-        case EAT_LINE_COMMENT:
-            if (c == '\n') {
-                self->file_lines++;
-                self->state = START_RECORD;
-            } else if (c == '\r') {
-                self->file_lines++;
-                self->state = EAT_CRNL_NOP;
-            }
-            break;
+/*
+  nrows : number of rows to tokenize (or until reach EOF)
+  all : tokenize all the data vs. certain number of rows
+ */
 
-        case IN_FIELD:
-            /* in unquoted field */
-            if (c == '\n') {
-                END_FIELD();
-                END_LINE();
-                /* self->state = START_RECORD; */
-            } else if (c == '\r') {
-                END_FIELD();
-                self->state = EAT_CRNL;
-            }
-            else if (c == self->escapechar) {
-                /* possible escaped character */
-                self->state = ESCAPED_CHAR;
-            }
-            else if (c == self->delimiter) {
-                // End of field. End of line not reached yet
-                END_FIELD();
-                self->state = START_FIELD;
-            }
-            else if (c == self->commentchar) {
-                END_FIELD();
-                self->state = EAT_COMMENT;
-            }
-            else {
-                /* normal character - save in field */
-                PUSH_CHAR(c);
-            }
-            break;
+int _tokenize_helper(parser_t *self, size_t nrows, int all)
+{
+    int status = 0;
+    Tcl_Size start_lines = self->lines;
+    size_t consumed;
 
-        case IN_QUOTED_FIELD:
-            /* in quoted field */
-            if (c == self->escapechar) {
-                /* Possible escape character */
-                self->state = ESCAPE_IN_QUOTED_FIELD;
-            }
-            else if (c == self->quotechar &&
-                     self->quoting != QUOTE_NONE) {
-                if (self->doublequote) {
-                    /* doublequote; " represented by "" */
-                    self->state = QUOTE_IN_QUOTED_FIELD;
-                }
-                else {
-                    /* end of quote part of field */
-                    self->state = IN_FIELD;
-                }
-            }
-            else {
-                /* normal character - save in field */
-                PUSH_CHAR(c);
-            }
-            break;
+    if (self->core.state == FINISHED) {
+        return 0;
+    }
 
-        case ESCAPE_IN_QUOTED_FIELD:
-            /* if (c == '\0') */
-            /*  c = '\n'; */
+    TRACE(("_tokenize_helper: Asked to tokenize %d rows, datapos=%d, datalen=%d\n", \
+           (int) nrows, self->datapos, self->datalen));
 
-            PUSH_CHAR(c);
-            self->state = IN_QUOTED_FIELD;
+    self->line_limit = all ? 0 : nrows;
+    self->limit_start = start_lines;
+    while (1) {
+        if (!all && self->lines - start_lines >= (Tcl_Size)nrows)
             break;
 
-        case QUOTE_IN_QUOTED_FIELD:
-            /* doublequote - seen a quote in an quoted field */
-            if (self->quoting != QUOTE_NONE && c == self->quotechar) {
-                /* save "" as " */
-
-                PUSH_CHAR(c);
-                self->state = IN_QUOTED_FIELD;
-            }
-            else if (c == self->delimiter) {
-                // End of field. End of line not reached yet
-
-                END_FIELD();
-                self->state = START_FIELD;
-            }
-            else if (c == '\n') {
-                END_FIELD();
-                END_LINE();
-                /* self->state = START_RECORD; */
-            }
-            else if (c == '\r') {
-                END_FIELD();
-                self->state = EAT_CRNL;
-            }
-            else if (!self->strict) {
-                PUSH_CHAR(c);
-                self->state = IN_FIELD;
-            }
-            else {
-                set_error(self,
-                          Tcl_ObjPrintf("CSV parse error: '%c' expected after '%c'",
-                                        self->delimiter, self->quotechar));
-                goto parsingerror;
-            }
-            break;
+        if (self->datapos == self->datalen) {
+            status = parser_buffer_bytes(self, self->chunksize);
 
-        case EAT_COMMENT:
-            if (c == '\n') {
-                END_LINE();
-            } else if (c == '\r') {
-                self->state = EAT_CRNL;
+            if (status == REACHED_EOF) {
+                // close out last line
+                status = parser_handle_eof(self);
+                break;
+            } else if (status != 0) {
+                return status;
             }
-            break;
-
-        case EAT_CRNL:
-            if (c == '\n') {
-                END_LINE();
-                /* self->state = START_RECORD; */
-            } else if (c == self->delimiter){
-                // Handle \r-delimited files
-                END_LINE_AND_FIELD_STATE(START_FIELD);
-            } else {
-                /* \r line terminator */
-
-                /* UGH. we don't actually want to consume the token. fix this later */
-                if (end_line(self) < 0) {
-                    goto parsingerror;
-                }
-                self->state = START_RECORD;
+        }
 
-                /* HACK, let's try this one again */
-                --i; buf--;
-                if (line_limit > 0 && self->lines == start_lines + line_limit) {
-                    goto linelimit;
-                }
+        TRACE(("_tokenize_helper: Trying to process %d bytes, datalen=%d, datapos= %d\n",
+               self->datalen - self->datapos, self->datalen, self->datapos));
 
-            }
-            break;
+        {
+            CSV_STATS_CLOCK(start);
+            status = csv_core_feed(&self->core, self->data + self->datapos,
+                                   self->datalen - self->datapos, &consumed);
+            self->datapos += (Tcl_Size) consumed;
+            CSV_STATS_ELAPSED(self, tokenize_ns, start);
+        }
 
-        case EAT_CRNL_NOP: /* inside an ignored comment line */
-            self->state = START_RECORD;
-            /* \r line terminator -- parse this character again */
-            if (c != '\n' && c != self->delimiter) {
-                --i;
-                --buf;
-            }
-            break;
-        default:
+        if (status == CSV_CORE_ERROR) {
+            TRACE(("_tokenize_helper: Error returned from tokenizer, breaking\n"));
+            if (self->core.error[0])
+                set_error(self, Tcl_NewStringObj(self->core.error, -1));
+            status = -1;
             break;
-
         }
+        status = 0;
     }
+    TRACE(("leaving tokenize_helper\n"));
+    return status;
+}
 
-    _TOKEN_CLEANUP();
-
-    TRACE(("Finished tokenizing input\n"))
-
-    return 0;
-
-parsingerror:
-    i++;
-    _TOKEN_CLEANUP();
-
-    return -1;
-
-linelimit:
-    i++;
-    _TOKEN_CLEANUP();
-
-    return 0;
+int tokenize_nrows(parser_t *self, size_t nrows)
+{
+    int status = _tokenize_helper(self, nrows, 0);
+    return status;
 }
 
-/* custom line terminator */
-int tokenize_delim_customterm(parser_t *self, size_t line_limit)
+int tokenize_all_rows(parser_t *self)
 {
+    int status = _tokenize_helper(self, -1, 1);
+    return status;
+}
 
-    Tcl_Size i, start_lines;
-    char c;
-    char *buf = self->data + self->datapos;
-
-    start_lines = self->lines;
-
-    TRACE(("%s\n", buf));
+/*
+ * Creates a parser attached to the channel named by the last element of
+ * objv configured with the options in the preceding elements.
+ */
+parser_t *parser_create(Tcl_Interp *ip, int objc, Tcl_Obj *const objv[], int *pnrows)
+{
+    parser_t *parser;
+    Tcl_Channel chan;
+    int mode;
 
-    for (i = self->datapos; i < self->datalen; ++i)
-    {
-        // Next character in file
-        c = *buf++;
+    if (objc < 1) {
+        Tcl_SetResult(ip, "Syntax error: CHANNEL argument must be specified.", TCL_STATIC);
+	return NULL;
+    }
 
-        TRACE(("tokenize_delim_customterm - Iter: %d Char: %c Line %d field_count %d, state %d\n",
-               i, c, self->file_lines + 1, self->state));
+    chan = Tcl_GetChannel(ip, Tcl_GetString(objv[objc-1]), &mode);
+    if (chan == NULL)
+        return NULL;
 
-        switch(self->state) {
+    parser = parser_create_detached(ip, objc-1, objv, pnrows);
+    if (parser)
+        parser->chan = chan;
+    return parser;
+}
 
-        case SKIP_LINE:
-//            TRACE(("tokenize_delim_customterm SKIP_LINE %c, state %d\n", c, self->state));
-            if (c == self->lineterminator) {
-                END_LINE();
-            }
-            break;
+/*
+ * Creates a parser configured with the options in objv that is not
+ * attached to any channel. parser_reset must be called to attach one
+ * before parsing.
+ */
+parser_t *parser_create_detached(Tcl_Interp *ip, int objc, Tcl_Obj *const objv[], int *pnrows)
+{
+    parser_t *parser;
+    int i, opt, ival, nrows;
+    Tcl_Size len;
+    char *s;
+    int res;
+    Tcl_Obj **objs;
+    static const char *switches[] = {
+        "-columns", "-comment", "-compression", "-delimiter", "-doublequote",
+        "-escape", "-excludefields", "-header", "-ignoreerrors", "-includefields",
+        "-nrows", "-quote", "-quoting", "-rows", "-sample",
+        "-skipblanklines", "-skipleadingspace", "-skiplines", "-sniff",
+        "-startline", "-statsvar", "-strict", "-terminator",
+        "-chunksize", /* Undocumented */
+        NULL
+    };
+    enum switches_e {
+        CSV_COLUMNS, CSV_COMMENT, CSV_COMPRESSION, CSV_DELIMITER,
+        CSV_DOUBLEQUOTE, CSV_ESCAPE, CSV_EXCLUDEFIELDS, CSV_HEADER, CSV_IGNOREERRORS, CSV_INCLUDEFIELDS,
+        CSV_NROWS, CSV_QUOTE, CSV_QUOTING, CSV_ROWS, CSV_SAMPLE,
+        CSV_SKIPBLANKLINES, CSV_SKIPLEADINGSPACE, CSV_SKIPLINES, CSV_SNIFF,
+        CSV_STARTLINE, CSV_STATSVAR, CSV_STRICT, CSV_TERMINATOR,
+        CSV_CHUNKSIZE,
+    };
+    parser = parser_new();
+    parser->chunksize = 10*1024; /* TBD - chunksize */
+    parser_init(parser);
+    parser_set_default_options(parser);
 
-        case START_RECORD:
-            // start of record
-            if (skip_this_line(self, self->file_lines)) {
-                self->state = SKIP_LINE;
-                if (c == self->lineterminator) {
-                    END_LINE();
-                }
-                break;
-            }
-            else if (c == self->lineterminator) {
-                // \n\r possible?
-                if (self->skip_empty_lines)
-                {
-                    self->file_lines++;
-                }
-                else
-                {
-                    END_LINE();
+    nrows = -1;
+    res = TCL_ERROR;
+    for (i = 0; i < objc; i += 2) {
+	if (Tcl_GetIndexFromObj(ip, objv[i], switches, "option", 0, &opt)
+            != TCL_OK)
+            goto error_handler;
+        if ((i+1) >= objc) {
+            Tcl_SetResult(ip, "Missing value for option.", TCL_STATIC);
+            goto error_handler;
+        }
+        s = Tcl_GetStringFromObj(objv[i+1], &len);
+        if (opt != CSV_DOUBLEQUOTE && opt != CSV_CHUNKSIZE &&
+            opt != CSV_INCLUDEFIELDS && opt != CSV_EXCLUDEFIELDS &&
+            opt != CSV_COLUMNS && opt != CSV_SAMPLE &&
+            opt != CSV_STATSVAR) {
+            s = Tcl_GetStringFromObj(objv[i+1], &len);
+            if (len > 0) {
+                if ((! isascii(*s)) ||
+                    (len > 1 && ! isascii(s[1]))) {
+                    Tcl_AppendResult(ip, "Only ASCII characters permitted for option ", Tcl_GetString(objv[i]), ".", NULL);
+                    goto error_handler;
                 }
-                break;
             }
-            else if (c == self->commentchar) {
-                self->state = EAT_LINE_COMMENT;
-                break;
-            }
-            else if (IS_WHITESPACE(c) && c != self->delimiter && self->skip_empty_lines)
-            {
-                self->state = WHITESPACE_LINE;
-                break;
-            }
-            /* normal character - handle as START_FIELD */
-            self->state = START_FIELD;
-            /* fallthru */
-        case START_FIELD:
-            /* expecting field */
-            if (c == self->lineterminator) {
-                END_FIELD();
-                END_LINE();
-                /* self->state = START_RECORD; */
-            }
-            else if (c == self->quotechar &&
-                     self->quoting != QUOTE_NONE) {
-                /* start quoted field */
-                self->state = IN_QUOTED_FIELD;
-            }
-            else if (c == self->escapechar) {
-                /* possible escaped character */
-                self->state = ESCAPED_CHAR;
-            }
-            else if (c == ' ' && self->skipinitialspace)
-                /* ignore space at start of field */
-                ;
-            else if (c == self->delimiter) {
-                /* save empty field */
-                END_FIELD();
-            }
-            else if (c == self->commentchar) {
-                END_FIELD();
-                self->state = EAT_COMMENT;
-            }
-            else {
-                /* begin new unquoted field */
-                if (self->quoting == QUOTE_NONNUMERIC)
-                    self->numeric_field = 1;
+        }
 
-                // TRACE(("pushing %c", c));
-                PUSH_CHAR(c);
-                self->state = IN_FIELD;
-            }
+        switch ((enum switches_e) opt) {
+        case CSV_COLUMNS:
+            unref_obj_if_not_null(&parser->column_names);
+            if (field_list_has_names(objv[i+1])) {
+                parser->column_names = objv[i+1];
+                Tcl_IncrRefCount(parser->column_names);
+                parser_clear_columns(parser);
+            } else if (parse_column_indices(parser, objv[i+1], NULL,
+                                            NULL) != TCL_OK)
+                goto invalid_option_value;
             break;
-
-        case WHITESPACE_LINE: // check if line is whitespace-only
-            if (c == self->lineterminator) {
-                self->file_lines++;
-                self->state = START_RECORD; // ignore empty line
-            }
-            else if (IS_WHITESPACE(c) && c != self->delimiter)
-                ;
-            else { // backtrack
-                /* We have to use i + 1 because buf has been incremented but not i */
-                do {
-                    --buf;
-                    --i;
-                } while (i + 1 > self->datapos && *buf != self->lineterminator);
-
-                if (*buf == self->lineterminator) // reached a newline rather than the beginning
-                {
-                    ++buf; // move pointer to first char after newline
-                    ++i;
-                }
-                self->state = START_FIELD;
+        case CSV_COMMENT:
+            if (len > 1)
+                goto invalid_option_value;
+            parser->core.commentchar = *s; /* '\0' -> No comment char */
+            parser->sniff_fixed |= SNIFF_FIXED_COMMENT;
+            break;
+        case CSV_COMPRESSION:
+            if (!strcmp(s, "none"))
+                ival = CSV_COMPRESSION_NONE;
+            else if (!strcmp(s, "gzip"))
+                ival = CSV_COMPRESSION_GZIP;
+            else if (!strcmp(s, "zlib"))
+                ival = CSV_COMPRESSION_ZLIB;
+            else if (!strcmp(s, "auto"))
+                ival = CSV_COMPRESSION_AUTO;
+            else
+                goto invalid_option_value;
+            if (parser->inflate) {
+                csv_inflate_free(parser->inflate);
+                parser->inflate = NULL;
             }
+            if (ival != CSV_COMPRESSION_NONE)
+                parser->inflate = csv_inflate_new((enum csv_compression) ival);
             break;
-
-        case ESCAPED_CHAR:
-            /* if (c == '\0') */
-            /*  c = '\n'; */
-
-            PUSH_CHAR(c);
-            self->state = IN_FIELD;
+        case CSV_DELIMITER:
+            if (len != 1)
+                goto invalid_option_value;
+            parser->core.delimiter = *s;
+            parser->sniff_fixed |= SNIFF_FIXED_DELIMITER;
             break;
-
-        case IN_FIELD:
-            /* in unquoted field */
-            if (c == self->lineterminator) {
-                END_FIELD();
-                END_LINE();
-                /* self->state = START_RECORD; */
-            }
-            else if (c == self->escapechar) {
-                /* possible escaped character */
-                self->state = ESCAPED_CHAR;
+        case CSV_ESCAPE:
+            if (len > 1)
+                goto invalid_option_value;
+            parser->core.escapechar = *s; /* \0 -> no escape char */
+            parser->sniff_fixed |= SNIFF_FIXED_ESCAPE;
+            break;
+        case CSV_NROWS:
+            if (pnrows == NULL) {
+                Tcl_SetResult(ip, "Option -nrows is not valid in this mode.", TCL_STATIC);
+                goto error_handler;
             }
-            else if (c == self->delimiter) {
-                // End of field. End of line not reached yet
-                END_FIELD();
-                self->state = START_FIELD;
+            res = Tcl_GetIntFromObj(ip, objv[i+1], &nrows);
+            if (res != TCL_OK)
+                goto invalid_option_value;
+            break;
+        case CSV_SAMPLE:
+            if (pnrows == NULL) {
+                Tcl_SetResult(ip, "Option -sample is not valid in this mode.", TCL_STATIC);
+                goto error_handler;
             }
-            else if (c == self->commentchar) {
-                END_FIELD();
-                self->state = EAT_COMMENT;
+            if (parse_sample_spec(parser, objv[i+1]) != TCL_OK)
+                goto invalid_option_value;
+            break;
+        case CSV_STATSVAR:
+            if (pnrows == NULL) {
+                Tcl_SetResult(ip, "Option -statsvar is not valid in this mode.", TCL_STATIC);
+                goto error_handler;
             }
+#if CSV_ENABLE_STATS
+            unref_obj_if_not_null(&parser->stats_var);
+            parser->stats_var = objv[i+1];
+            Tcl_IncrRefCount(parser->stats_var);
+#else
+            Tcl_SetResult(ip, "Parser statistics are not enabled in this build.", TCL_STATIC);
+            goto error_handler;
+#endif
+            break;
+        case CSV_QUOTE:
+            if (len > 1)
+                goto invalid_option_value;
+            parser->core.quotechar = *s;
+            parser->sniff_fixed |= SNIFF_FIXED_QUOTE;
+            break;
+        case CSV_QUOTING:
+            /*
+             * NOTE: this is currently undocumented because for readers,
+             * it does not seem to have any effect beyond what is already
+             * provided for by the -quote option where -quote "" works
+             * similar to QUOTE_NONE. The other options do not have
+             * effect on reads.
+             */
+            if (!strcmp(s, "all"))
+                parser->core.quoting = QUOTE_ALL;
+            else if (!strcmp(s, "minimal"))
+                parser->core.quoting = QUOTE_MINIMAL;
+            else if (!strcmp(s, "nonnumeric"))
+                parser->core.quoting = QUOTE_NONNUMERIC;
+            else if (!strcmp(s, "none"))
+                parser->core.quoting = QUOTE_NONE;
+            else
+                goto invalid_option_value;
+            break;
+        case CSV_SKIPLINES:
+            res = Tcl_ListObjGetElements(ip, objv[i+1], &len, &objs);
+            if (res != TCL_OK)
+                goto error_handler;
             else {
-                /* normal character - save in field */
-                PUSH_CHAR(c);
+                Tcl_Size j;
+                Tcl_WideInt wval;
+                for (j = 0; j < len; ++j) {
+                    res = Tcl_GetWideIntFromObj(ip, objs[j], &wval);
+                    if (res != TCL_OK)
+                        goto error_handler;
+                    if (wval < 0)
+                        goto invalid_option_value;
+                    csv_core_skip_line(&parser->core, wval);
+                }
             }
             break;
+        case CSV_STARTLINE:
+            res = Tcl_GetIntFromObj(ip, objv[i+1], &ival);
+            if (res != TCL_OK)
+                goto invalid_option_value;
+            csv_core_skip_first_lines(&parser->core, ival);
+            break;
+        case CSV_TERMINATOR:
+            if (len != 1)
+                goto invalid_option_value;
+            parser->core.lineterminator = *s;
+            break;
+        case CSV_DOUBLEQUOTE:
+            if (Tcl_GetBooleanFromObj(ip, objv[i+1], &ival) != TCL_OK)
+                goto invalid_option_value;
+            parser->core.doublequote = ival;
+            parser->sniff_fixed |= SNIFF_FIXED_DOUBLEQUOTE;
+            break;
+        case CSV_IGNOREERRORS:
+            /* TBD - currently not used */
+            if (Tcl_GetBooleanFromObj(ip, objv[i+1], &ival) != TCL_OK)
+                goto invalid_option_value;
+            parser->error_bad_lines = ival;
+            break;
+        case CSV_SKIPBLANKLINES:
+            if (Tcl_GetBooleanFromObj(ip, objv[i+1], &ival) != TCL_OK)
+                goto invalid_option_value;
+            parser->core.skip_empty_lines = ival;
+            break;
+        case CSV_SKIPLEADINGSPACE:
+            if (Tcl_GetBooleanFromObj(ip, objv[i+1], &ival) != TCL_OK)
+                goto invalid_option_value;
+            parser->core.skipinitialspace = ival;
+            parser->sniff_fixed |= SNIFF_FIXED_SKIPLEADINGSPACE;
+            break;
+        case CSV_SNIFF:
+            if (Tcl_GetBooleanFromObj(ip, objv[i+1], &ival) != TCL_OK)
+                goto invalid_option_value;
+            parser->sniff = ival;
+            parser->sniff_pending = ival;
+            break;
+        case CSV_STRICT:
+            if (Tcl_GetBooleanFromObj(ip, objv[i+1], &ival) != TCL_OK)
+                goto invalid_option_value;
+            parser->core.strict = ival;
+            break;
+        case CSV_HEADER:
+            if (Tcl_GetBooleanFromObj(ip, objv[i+1], &ival) != TCL_OK)
+                goto invalid_option_value;
+            parser->header = ival;
+            break;
+        case CSV_ROWS:
+            if (!strcmp(s, "list"))
+                parser->rows_as_dicts = 0;
+            else if (!strcmp(s, "dict"))
+                parser->rows_as_dicts = 1;
+            else
+                goto invalid_option_value;
+            break;
+        case CSV_INCLUDEFIELDS:
+            /* Field names are resolved when the header is read */
+            unref_obj_if_not_null(&parser->include_names);
+            if (field_list_has_names(objv[i+1])) {
+                parser->include_names = objv[i+1];
+                Tcl_IncrRefCount(parser->include_names);
+            } else if (parse_field_indices(objv[i+1], NULL,
+                                           &parser->num_included_fields,
+                                           &parser->included_fields,
+                                           NULL) != TCL_OK)
+                goto invalid_option_value;
+            break;
+        case CSV_EXCLUDEFIELDS:
+            unref_obj_if_not_null(&parser->exclude_names);
+            if (field_list_has_names(objv[i+1])) {
+                parser->exclude_names = objv[i+1];
+                Tcl_IncrRefCount(parser->exclude_names);
+            } else if (parse_field_indices(objv[i+1], NULL,
+                                           &parser->num_excluded_fields,
+                                           &parser->excluded_fields,
+                                           NULL) != TCL_OK)
+                goto invalid_option_value;
+            break;
+        case CSV_CHUNKSIZE:
+            if (Tcl_GetIntFromObj(ip, objv[i+1], &ival) != TCL_OK)
+                goto invalid_option_value;
+            if (ival <= 0)
+                goto invalid_option_value;
+            parser->chunksize = ival;
+            break;
+        }
+    }
+    if ((parser->column_slots || parser->column_names) &&
+        (parser->included_fields || parser->excluded_fields ||
+         parser->include_names || parser->exclude_names)) {
+        Tcl_SetResult(ip, "Option -columns cannot be combined with -includefields or -excludefields.", TCL_STATIC);
+        goto error_handler;
+    }
+    if (!parser->header) {
+        if (parser->include_names || parser->exclude_names ||
+            parser->column_names) {
+            Tcl_SetResult(ip, "Field names can only be used if the -header option is true.", TCL_STATIC);
+            goto error_handler;
+        }
+        if (parser->rows_as_dicts) {
+            Tcl_SetResult(ip, "Option -rows dict requires the -header option to be true.", TCL_STATIC);
+            goto error_handler;
+        }
+    }
+    parser->header_pending = parser->header;
+    if (!parser->header_pending)
+        sample_next_record(parser);
+    if (pnrows)
+        *pnrows = nrows;
+    return parser;
+
+invalid_option_value: /* objv[i] should be the invalid option */
+    Tcl_SetObjResult(ip, Tcl_ObjPrintf("Invalid value for option %s.", Tcl_GetString(objv[i])));
+    /* Fall thru to error return */
+error_handler:
+    if (parser)
+        parser_free(parser);
+    return NULL;
+}
+
+/*
+ * Runs a parser created for csv_read or csv_parse to completion and stores
+ * the rows, or the error, as the interpreter result. The parser is freed.
+ */
+static int csv_read_parser(Tcl_Interp *ip, parser_t *parser, int nrows)
+{
+    int res;
+
+    if (nrows >= 0)
+        res = tokenize_nrows(parser, nrows) == 0 ? TCL_OK : TCL_ERROR;
+    else
+        res = tokenize_all_rows(parser) == 0 ? TCL_OK : TCL_ERROR;
+
+    if (res == TCL_OK) {
+        parser_collect_sample(parser);
+        Tcl_SetObjResult(ip, parser->rowsObj);
+    }
+    else {
+        if (parser->errorObj)
+            Tcl_SetObjResult(ip, parser->errorObj);
+        else
+            Tcl_SetResult(ip, "Error parsing CSV.", TCL_STATIC);
+    }
+
+    /* Statistics are stored even on error as they may help diagnose it */
+    if (parser->stats_var) {
+        if (Tcl_ObjSetVar2(ip, parser->stats_var, NULL,
+                           parser_stats_obj(parser),
+                           TCL_LEAVE_ERR_MSG) == NULL)
+            res = TCL_ERROR;
+    }
+
+    parser_free(parser);
+    return res;
+}
+
+int csv_read_cmd(ClientData clientdata, Tcl_Interp *ip,
+                              int objc, Tcl_Obj *const objv[])
+{
+    parser_t *parser;
+    int nrows;
+
+    parser = parser_create(ip, objc-1, objv+1, &nrows);
+    if (parser == NULL)
+        return TCL_ERROR;
+
+    return csv_read_parser(ip, parser, nrows);
+}
+
+/*
+ * Attaches the parser to the contents of valueObj instead of a channel.
+ * If enc is NULL the string value is parsed in place. Otherwise the value
+ * is treated as binary data in that encoding. UTF-8 binary data is also
+ * parsed in place, other encodings are converted first.
+ */
+static int parser_attach_value(Tcl_Interp *ip, parser_t *self,
+                               Tcl_Obj *valueObj, Tcl_Encoding enc)
+{
+    Tcl_Size len;
+    char *bytes;
+
+    parser_reset(self, NULL);
+    unref_obj_if_not_null(&self->dataObj);
+    if (enc == NULL) {
+        self->dataObj = valueObj;
+        self->data = Tcl_GetStringFromObj(valueObj, &self->datalen);
+    } else {
+        bytes = (char *) Tcl_GetByteArrayFromObj(valueObj, &len);
+        if (bytes == NULL) {
+            /* Tcl 9 does not convert strings with non-byte characters */
+            Tcl_SetResult(ip, "Value is not binary data.", TCL_STATIC);
+            return TCL_ERROR;
+        }
+        if (!strcmp(Tcl_GetEncodingName(enc), "utf-8")) {
+            self->dataObj = valueObj;
+            self->data = bytes;
+            self->datalen = len;
+        } else {
+            Tcl_DString ds;
+            Tcl_ExternalToUtfDString(enc, bytes, len, &ds);
+            self->dataObj = Tcl_NewStringObj(Tcl_DStringValue(&ds),
+                                             Tcl_DStringLength(&ds));
+            Tcl_DStringFree(&ds);
+            self->data = Tcl_GetStringFromObj(self->dataObj, &self->datalen);
+        }
+    }
+    Tcl_IncrRefCount(self->dataObj);
+    self->datapos = 0;
+    CSV_STATS_ADD(self, bytes_read, self->datalen);
+    if (self->sniff_pending)
+        parser_sniff_buffered(self, 1);
+    return TCL_OK;
+}
+
+int csv_parse_cmd(ClientData clientdata, Tcl_Interp *ip,
+                  int objc, Tcl_Obj *const objv[])
+{
+    parser_t *parser;
+    Tcl_Obj *optsObj, **opts;
+    Tcl_Encoding enc = NULL;
+    Tcl_Size nopts;
+    int i, nrows;
+
+    if (objc < 2) {
+        Tcl_SetResult(ip, "Syntax error: VALUE argument must be specified.", TCL_STATIC);
+        return TCL_ERROR;
+    }
+
+    /* -encoding is ours, everything else is passed on to the parser */
+    optsObj = Tcl_NewListObj(0, NULL);
+    Tcl_IncrRefCount(optsObj);
+    for (i = 1; i < objc-1; i += 2) {
+        if ((i+1) < (objc-1) && !strcmp(Tcl_GetString(objv[i]), "-encoding")) {
+            if (enc)
+                Tcl_FreeEncoding(enc);
+            enc = Tcl_GetEncoding(ip, Tcl_GetString(objv[i+1]));
+            if (enc == NULL) {
+                Tcl_DecrRefCount(optsObj);
+                return TCL_ERROR;
+            }
+            continue;
+        }
+        Tcl_ListObjAppendElement(NULL, optsObj, objv[i]);
+        if ((i+1) < (objc-1))
+            Tcl_ListObjAppendElement(NULL, optsObj, objv[i+1]);
+    }
+
+    Tcl_ListObjGetElements(NULL, optsObj, &nopts, &opts);
+    parser = parser_create_detached(ip, (int) nopts, opts, &nrows);
+    Tcl_DecrRefCount(optsObj);
+    if (parser && parser->inflate) {
+        Tcl_SetResult(ip, "Option -compression is not valid in this mode.", TCL_STATIC);
+        parser_free(parser);
+        parser = NULL;
+    }
+    if (parser &&
+        parser_attach_value(ip, parser, objv[objc-1], enc) != TCL_OK) {
+        parser_free(parser);
+        parser = NULL;
+    }
+    if (enc)
+        Tcl_FreeEncoding(enc);
+    if (parser == NULL)
+        return TCL_ERROR;
+
+    return csv_read_parser(ip, parser, nrows);
+}
+
+void csv_write_config_init (struct csv_write_config *config)
+{
+    config->delimiter  = ',';
+    config->lineterminator1 = '\n';
+    config->lineterminator2 = '\0';
+    config->escapechar = '\0';
+    config->quotechar  = '"';
+    config->quoting    = QUOTE_MINIMAL;
+    config->doublequote = 1;
+    config->specials[0] = '\0'; /* Filled by csv_write_config_finalize */
+    config->flushsize = 10000;
+    config->binary = 0;
+    config->fast_doubles = 1;
+    config->floatformat[0] = '\0';
+    config->int_type = Tcl_GetObjType("int");
+    config->wide_type = Tcl_GetObjType("wideInt");
+    config->double_type = Tcl_GetObjType("double");
+    config->compression = CSV_COMPRESSION_NONE;
+    config->deflate = NULL;
+}
+
+/* Return 1 if s is numeric, 0 otherwise. s must be null terminated */
+static int csv_numeric(const char *s)
+{
+    const char *p = s;
+    double dval;
+
+    /*
+     * TBD - not sure if this is faster than using standard conversion
+     * routines but note that numerics include integers and decimals of
+     * arbitrary length but not hexadecimals.
+     */
+
+
+    if (*p == '\0')
+        return 0;               /* empty string */
+    else if (*p == '+' || *p == '-') {
+        if (p[1] == '\0')
+            return 0; /* Plain +/- is not a number */
+        ++p;
+    }
 
-        case IN_QUOTED_FIELD:
-            /* in quoted field */
-            if (c == self->escapechar) {
-                /* Possible escape character */
-                self->state = ESCAPE_IN_QUOTED_FIELD;
-            }
-            else if (c == self->quotechar &&
-                     self->quoting != QUOTE_NONE) {
-                if (self->doublequote) {
-                    /* doublequote; " represented by "" */
-                    self->state = QUOTE_IN_QUOTED_FIELD;
-                }
-                else {
-                    /* end of quote part of field */
-                    self->state = IN_FIELD;
-                }
-            }
-            else {
-                /* normal character - save in field */
-                PUSH_CHAR(c);
-            }
-            break;
+    CSV_ASSERT(*p != '\0');
 
-        case ESCAPE_IN_QUOTED_FIELD:
-            PUSH_CHAR(c);
-            self->state = IN_QUOTED_FIELD;
+    while (*p) {
+        if (! isascii(*p) || !isdigit(*p))
             break;
+        ++p;
+    }
 
-        case QUOTE_IN_QUOTED_FIELD:
-            /* doublequote - seen a quote in an quoted field */
-            if (self->quoting != QUOTE_NONE && c == self->quotechar) {
-                /* save "" as " */
+    if (*p == '\0')
+        return 1;               /* Integer of arbitrary length */
 
-                PUSH_CHAR(c);
-                self->state = IN_QUOTED_FIELD;
-            }
-            else if (c == self->delimiter) {
-                // End of field. End of line not reached yet
+    /* Check for decimal or arbitrary length */
+    if (*p == '.') {
+        ++p;
+        while (*p) {
+            if (! isascii(*p) || !isdigit(*p))
+                break;
+            ++p;
+        }
+        if (*p == '\0')
+            return 1;               /* Decimal fraction of arbitrary length */
+    }
 
-                END_FIELD();
-                self->state = START_FIELD;
-            }
-            else if (c == self->lineterminator) {
-                END_FIELD();
-                END_LINE();
-                /* self->state = START_RECORD; */
-            }
-            else if (!self->strict) {
-                PUSH_CHAR(c);
-                self->state = IN_FIELD;
-            }
-            else {
-                set_error(self,
-                          Tcl_ObjPrintf("CSV parse error: '%c' expected after '%c'",
-                                        self->delimiter, self->quotechar));
-                goto parsingerror;
-            }
-            break;
+    /* Finally check floating point formats */
+    if (Tcl_GetDouble(NULL, s, &dval) == TCL_OK)
+        return 1;
+    else
+        return 0;
+}
 
-        case EAT_LINE_COMMENT:
-            if (c == self->lineterminator) {
-                self->file_lines++;
-                self->state = START_RECORD;
-            }
-            break;
+#ifdef CSV_HAVE_SSE2
+/* Index of the lowest set bit. x must not be 0. */
+static int csv_ctz(unsigned int x)
+{
+# ifdef _MSC_VER
+    unsigned long i;
+    _BitScanForward(&i, x);
+    return (int) i;
+# else
+    return __builtin_ctz(x);
+# endif
+}
+#endif
 
-        case EAT_COMMENT:
-            if (c == self->lineterminator) {
-                END_LINE();
-            }
-            break;
+/*
+ * Returns a pointer to the first special character in [p,end), or end if
+ * there is none. Unlike strpbrk, the scan is bounded by length and with
+ * SSE2 compares 16 bytes against all special characters at a time.
+ */
+static const char *csv_find_special(const char *p, const char *end,
+                                    const struct csv_write_config *config)
+{
+#ifdef CSV_HAVE_SSE2
+    if (end - p >= 16) {
+        const char *sp = config->specials;
+        const __m128i v0 = _mm_set1_epi8(sp[0]);
+        const __m128i v1 = _mm_set1_epi8(sp[1]);
+        const __m128i v2 = _mm_set1_epi8(sp[2]);
+        const __m128i v3 = _mm_set1_epi8(sp[3]);
+        const __m128i v4 = _mm_set1_epi8(sp[4]);
+        do {
+            __m128i b = _mm_loadu_si128((const __m128i *) p);
+            __m128i m = _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(b, v0), _mm_cmpeq_epi8(b, v1)),
+                _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(b, v2),
+                                          _mm_cmpeq_epi8(b, v3)),
+                             _mm_cmpeq_epi8(b, v4)));
+            int mask = _mm_movemask_epi8(m);
+            if (mask)
+                return p + csv_ctz((unsigned int) mask);
+            p += 16;
+        } while (end - p >= 16);
+    }
+#endif
+    while (p < end && !config->special_map[(unsigned char) *p])
+        ++p;
+    return p;
+}
 
-        default:
-            break;
+/*
+ * If cell is a pure integer or double, i.e. one without a string
+ * representation, formats it into buf in the same form as its string
+ * representation would have and returns the length. Finite doubles are
+ * formatted with -floatformat if set, even if they have a string
+ * representation. Returns -1 for all other values. *numeric is set to
+ * whether the value counts as a number for QUOTE_NONNUMERIC, which
+ * excludes NaN as for csv_numeric.
+ */
+static int csv_format_number(Tcl_Obj *cell, struct csv_write_config *config,
+                             char buf[CSV_NUMBER_SPACE], int *numeric)
+{
+    const Tcl_ObjType *typePtr = cell->typePtr;
+    int len;
+
+    if (typePtr == NULL)
+        return -1;
 
+    if (typePtr == config->double_type) {
+        /* Not Tcl_GetDoubleFromObj as that rejects NaN */
+        double dval = cell->internalRep.doubleValue;
+        int finite = (dval - dval == 0); /* False for Inf and NaN */
+        if (config->floatformat[0] && finite) {
+            len = snprintf(buf, CSV_NUMBER_SPACE, config->floatformat, dval);
+        } else if (cell->bytes != NULL) {
+            return -1;
+        } else if (! config->fast_doubles ||
+                   (len = csv_format_double(dval, buf)) < 0) {
+            Tcl_PrintDouble(NULL, dval, buf);
+            len = (int) strlen(buf);
         }
+        *numeric = (dval == dval); /* False for NaN */
+        return len;
     }
 
-    _TOKEN_CLEANUP();
+    if (cell->bytes != NULL)
+        return -1;
 
-    TRACE(("Finished tokenizing input\n"))
+    if (typePtr == config->int_type ||
+        (typePtr == config->wide_type && typePtr != NULL)) {
+        Tcl_WideInt wide;
+        if (Tcl_GetWideIntFromObj(NULL, cell, &wide) != TCL_OK)
+            return -1;
+        *numeric = 1;
+        return snprintf(buf, CSV_NUMBER_SPACE, "%" TCL_LL_MODIFIER "d", wide);
+    }
 
-    return 0;
+    return -1;
+}
 
-parsingerror:
-    i++;
-    _TOKEN_CLEANUP();
+/*
+ * Formats the slen bytes at src as a CSV cell into dst. dst must have
+ * room for 2*slen+2 bytes. formatted is set if src was produced by
+ * csv_format_number. numeric is whether src is a number as for
+ * csv_numeric or -1 if not known, in which case src must be NUL
+ * terminated. Returns a pointer past the output. Only calls Tcl if
+ * numeric is -1 with QUOTE_NONNUMERIC.
+ */
+static char *csv_format_bytes(char *dst, const char *src, Tcl_Size slen,
+                              int formatted, int numeric,
+                              const struct csv_write_config *config)
+{
+    const char *end = src + slen, *p, *q;
+    char quotechar, escapechar;
+    int need_quotes = 0; /* Init just to keep gcc happy */
 
-    return -1;
+    /*
+     * Get the location of the first special character in source, if any.
+     * Numbers need no scan unless a special character is one that can
+     * appear in a formatted number.
+     */
+    if (formatted && !config->numbers_special)
+        p = end;
+    else
+        p = csv_find_special(src, end, config);
+
+    /* See if we need to quote */
+    switch (config->quoting) {
+    case QUOTE_NONE:
+        need_quotes = 0;        /* Never quote */
+        CSV_ASSERT(config->escapechar);
+        break;
+    case QUOTE_MINIMAL:
+        need_quotes = (p != end); /* Quote if special chars present */
+        break;
+    case QUOTE_NONNUMERIC:
+        /* Need quotes unless strictly digits or special chars */
+        if (numeric < 0)
+            numeric = csv_numeric(src);
+        if (p != end || ! numeric)
+            need_quotes = 1;
+        else
+            need_quotes = 0;
+        break;
+    case QUOTE_ALL:
+        need_quotes = 1;
+        break;
+    }
 
-linelimit:
-    i++;
-    _TOKEN_CLEANUP();
+    quotechar      = config->quotechar;
+    escapechar     = config->escapechar;
 
-    return 0;
+    if (need_quotes)
+        *dst++ = quotechar;
+
+    /* Copy the characters before the first special char, if any */
+    memcpy(dst, src, p - src);
+    dst += p - src;
+    src = p;
+
+    if (src == end) {
+        /* No special chars. */
+    } else if (need_quotes) {
+        /*
+         * For quoted strings, we only need to take care of quotes in
+         * content. Depending on settings they are either doubled up
+         * or escaped. Runs between quotes are copied in bulk.
+         */
+        while ((q = memchr(src, quotechar, end - src)) != NULL) {
+            memcpy(dst, src, q - src);
+            dst += q - src;
+            if (config->doublequote) {
+                *dst++ = quotechar; /* Double the quote */
+            } else {
+                CSV_ASSERT(escapechar != '\0');
+                *dst++ = escapechar; /* Escape the quote */
+            }
+            *dst++ = quotechar;
+            src = q + 1;
+        }
+        memcpy(dst, src, end - src);
+        dst += end - src;
+    } else {
+        /* Special characters but no quoting permitted so use escapes */
+        CSV_ASSERT(escapechar != '\0');
+        while (src < end) {
+            *dst++ = escapechar;
+            *dst++ = *src++;
+            p = csv_find_special(src, end, config);
+            memcpy(dst, src, p - src);
+            dst += p - src;
+            src = p;
+        }
+    }
+
+    if (need_quotes)
+        *dst++ = quotechar;     /* Terminating quote */
+
+    return dst;
 }
 
-int tokenize_whitespace(parser_t *self, size_t line_limit)
+void csv_format_cell(Tcl_DString *ds, Tcl_Obj *cell, struct csv_write_config *config)
 {
-    Tcl_Size i, start_lines;
-    char c;
-    char *buf = self->data + self->datapos;
+    const char *src;
+    char *dst, *start;
+    char numbuf[CSV_NUMBER_SPACE];
+    Tcl_Size slen, dlen;
+    int numeric = -1;    /* Not known yet */
+
+    slen = csv_format_number(cell, config, numbuf, &numeric);
+    if (slen >= 0)
+        src = numbuf;
+    else
+        src = Tcl_GetStringFromObj(cell, &slen);
+    dlen = Tcl_DStringLength(ds);
 
-    start_lines = self->lines;
+    /*
+     * We do not want to keep checking for destination space so make sure
+     * the DString has enough space to begin with. The max length would be
+     * length of source string plus possibly two bytes for leading and trailing
+     * quotes plus either an escape or doubled quote for each special character
+     * which in worst case is entire source string.
+     */
+    Tcl_DStringSetLength(ds, dlen + 1 + slen + slen + 1);
 
-    TRACE(("%s\n", buf));
+    /* Get pointer to string AFTER above since DString might be reallocated */
+    start = Tcl_DStringValue(ds);
+    dst = csv_format_bytes(start + dlen, src, slen, src == numbuf, numeric,
+                           config);
 
-    for (i = self->datapos; i < self->datalen; ++i)
-    {
-        // Next character in file
-        c = *buf++;
-
-        TRACE(("tokenize_whitespace - Iter: %d Char: %c Line %d field_count %d, state %d\n",
-               i, c, self->file_lines + 1, self->state));
-
-        switch(self->state) {
-        case SKIP_LINE:
-//            TRACE(("tokenize_whitespace SKIP_LINE %c, state %d\n", c, self->state));
-            if (c == '\n') {
-                END_LINE();
-            } else if (c == '\r') {
-                self->file_lines++;
-                self->state = EAT_CRNL_NOP;
-            }
-            break;
+    CSV_ASSERT((dst-start) < Tcl_DStringLength(ds)); /* Assert no buf overflo */
+    Tcl_DStringSetLength(ds, (Tcl_Size) (dst - start));
+}
 
-        case WHITESPACE_LINE:
-            if (c == '\n') {
-                self->file_lines++;
-                self->state = START_RECORD;
-                break;
-            }
-            else if (c == '\r') {
-                self->file_lines++;
-                self->state = EAT_CRNL_NOP;
-                break;
-            }
-            // fall through
+/*
+ * Validates the settings in config and computes derived values. Must be
+ * called before config is passed to csv_format_cell.
+ */
+int csv_write_config_finalize(Tcl_Interp *ip, struct csv_write_config *config)
+{
+    int r;
 
-        case EAT_WHITESPACE:
-            if (c == '\n') {
-                END_LINE();
-                self->state = START_RECORD;
-                break;
-            } else if (c == '\r') {
-                self->state = EAT_CRNL;
-                break;
-            } else if (!IS_WHITESPACE(c)) {
-                // END_FIELD();
-                self->state = START_FIELD;
-                // Fall through to subsequent state
-            } else {
-                // if whitespace char, keep slurping
-                break;
-            }
+    /*
+     * Quoting is turned off either via quotechar being empty or
+     * quoting policy being QUOTE_NONE.
+     */
+    if (config->quotechar == '\0')
+        config->quoting = QUOTE_NONE;
+    else if (config->quoting == QUOTE_NONE)
+        config->quotechar = '\0';
 
-        case START_RECORD:
-            // start of record
-            if (skip_this_line(self, self->file_lines)) {
-                self->state = SKIP_LINE;
-                if (c == '\n') {
-                    END_LINE();
-                }
-                break;
-            } else  if (c == '\n') {
-                if (self->skip_empty_lines)
-                // \n\r possible?
-                {
-                    self->file_lines++;
-                }
-                else
-                {
-                    END_LINE();
-                }
-                break;
-            } else if (c == '\r') {
-                if (self->skip_empty_lines)
-                {
-                    self->file_lines++;
-                    self->state = EAT_CRNL_NOP;
-                }
-                else
-                    self->state = EAT_CRNL;
-                break;
-            } else if (IS_WHITESPACE(c)) {
-                /*if (self->skip_empty_lines)
-                    self->state = WHITESPACE_LINE;
-                    else*/
-                    self->state = EAT_WHITESPACE;
-                break;
-            } else if (c == self->commentchar) {
-                self->state = EAT_LINE_COMMENT;
-                break;
-            } else {
-                /* normal character - handle as START_FIELD */
-                self->state = START_FIELD;
-            }
-            /* fallthru */
-        case START_FIELD:
-            /* expecting field */
-            if (c == '\n') {
-                END_FIELD();
-                END_LINE();
-                /* self->state = START_RECORD; */
-            } else if (c == '\r') {
-                END_FIELD();
-                self->state = EAT_CRNL;
-            }
-            else if (c == self->quotechar &&
-                     self->quoting != QUOTE_NONE) {
-                /* start quoted field */
-                self->state = IN_QUOTED_FIELD;
-            }
-            else if (c == self->escapechar) {
-                /* possible escaped character */
-                self->state = ESCAPED_CHAR;
-            }
-            /* else if (c == ' ' && self->skipinitialspace) */
-            /*     /\* ignore space at start of field *\/ */
-            /*     ; */
-            else if (IS_WHITESPACE(c)) {
-                self->state = EAT_WHITESPACE;
-            }
-            else if (c == self->commentchar) {
-                END_FIELD();
-                self->state = EAT_COMMENT;
-            }
-            else {
-                /* begin new unquoted field */
-                if (self->quoting == QUOTE_NONNUMERIC)
-                    self->numeric_field = 1;
+    if (config->escapechar == '\0') {
+        /* No escape char specified. Must allow quoting then for delimiters */
+        if (config->quoting == QUOTE_NONE) {
+            Tcl_SetResult(ip, "An escape character must be specified if quoting is disabled.", TCL_STATIC);
+            return TCL_ERROR;
+        }
+        if (! config->doublequote) {
+            Tcl_SetResult(ip, "An escape character must be specified if doubling of quotes is disabled.", TCL_STATIC);
+            return TCL_ERROR;
+        }
+    }
 
-                // TRACE(("pushing %c", c));
-                PUSH_CHAR(c);
-                self->state = IN_FIELD;
-            }
-            break;
+    /*
+     * Construct list of characters that are special based on settings.
+     * Really used in csv_format_cell but we do it here as to avoid repeating
+     * the initialization within the loop.
+     */
+    r = 0;
+    config->specials[r++] = config->delimiter;
+    if (config->lineterminator1)
+        config->specials[r++] = config->lineterminator1;
+    if (config->lineterminator2)
+        config->specials[r++] = config->lineterminator2;
+    if (config->quotechar)
+        config->specials[r++] = config->quotechar;
+    if (config->escapechar)
+        config->specials[r++] = config->escapechar;
+    /* Unused slots repeat the delimiter so all can always be compared */
+    while (r < (int) sizeof(config->specials))
+        config->specials[r++] = config->delimiter;
+    memset(config->special_map, 0, sizeof(config->special_map));
+    for (r = 0; r < (int) sizeof(config->specials); ++r)
+        config->special_map[(unsigned char) config->specials[r]] = 1;
 
-        case EAT_LINE_COMMENT:
-            if (c == '\n') {
-                self->file_lines++;
-                self->state = START_RECORD;
-            } else if (c == '\r') {
-                self->file_lines++;
-                self->state = EAT_CRNL_NOP;
-            }
-            break;
+    /*
+     * Shortest formatting only matches Tcl_PrintDouble at the default
+     * tcl_precision. Checked once here so later changes to tcl_precision
+     * do not affect a writer that already exists.
+     */
+    config->fast_doubles = 1;
+    if (ip) {
+        Tcl_Obj *precObj = Tcl_GetVar2Ex(ip, "tcl_precision", NULL,
+                                         TCL_GLOBAL_ONLY);
+        int precision;
+        if (precObj &&
+            Tcl_GetIntFromObj(NULL, precObj, &precision) == TCL_OK &&
+            precision != 0)
+            config->fast_doubles = 0;
+    }
 
-        case ESCAPED_CHAR:
-            /* if (c == '\0') */
-            /*  c = '\n'; */
+    /* Characters that may appear in numbers formatted by csv_format_number */
+    config->numbers_special = 0;
+    for (r = 0; r < (int) sizeof(config->specials); ++r) {
+        if (strchr("0123456789+-.eEInfNa", config->specials[r]))
+            config->numbers_special = 1;
+    }
 
-            PUSH_CHAR(c);
-            self->state = IN_FIELD;
-            break;
+    /* Released by csv_write_finish */
+    return csv_deflate_begin(ip, config);
+}
 
-        case IN_FIELD:
-            /* in unquoted field */
-            if (c == '\n') {
-                END_FIELD();
-                END_LINE();
-                /* self->state = START_RECORD; */
-            } else if (c == '\r') {
-                END_FIELD();
-                self->state = EAT_CRNL;
-            }
-            else if (c == self->escapechar) {
-                /* possible escaped character */
-                self->state = ESCAPED_CHAR;
-            }
-            else if (IS_WHITESPACE(c)) {
-                // End of field. End of line not reached yet
-                END_FIELD();
-                self->state = EAT_WHITESPACE;
-            }
-            else if (c == self->commentchar) {
-                END_FIELD();
-                self->state = EAT_COMMENT;
-            }
-            else {
-                /* normal character - save in field */
-                PUSH_CHAR(c);
-            }
-            break;
+/*
+ * Appends the CSV formatted record for the ncells cells, including the
+ * line terminator, to ds.
+ */
+void csv_format_record(Tcl_DString *ds, Tcl_Size ncells,
+                       Tcl_Obj *const cells[], struct csv_write_config *config)
+{
+    Tcl_Size c;
 
-        case IN_QUOTED_FIELD:
-            /* in quoted field */
-            if (c == self->escapechar) {
-                /* Possible escape character */
-                self->state = ESCAPE_IN_QUOTED_FIELD;
-            }
-            else if (c == self->quotechar &&
-                     self->quoting != QUOTE_NONE) {
-                if (self->doublequote) {
-                    /* doublequote; " represented by "" */
-                    self->state = QUOTE_IN_QUOTED_FIELD;
-                }
-                else {
-                    /* end of quote part of field */
-                    self->state = IN_FIELD;
-                }
-            }
-            else {
-                /* normal character - save in field */
-                PUSH_CHAR(c);
-            }
-            break;
+    for (c = 0; c < ncells; ++c) {
+        csv_format_cell(ds, cells[c], config);
+        /* Append delimiter unless this is the last cell */
+        if (c != (ncells-1))
+            Tcl_DStringAppend(ds, &config->delimiter, 1);
+    }
+    Tcl_DStringAppend(ds, &config->lineterminator1, 1);
+    if (config->lineterminator2)
+        Tcl_DStringAppend(ds, &config->lineterminator2, 1);
+}
 
-        case ESCAPE_IN_QUOTED_FIELD:
-            /* if (c == '\0') */
-            /*  c = '\n'; */
+/*
+ * Appends the CSV formatted record for the list of cells in rowObj,
+ * including the line terminator, to ds.
+ */
+int csv_format_row(Tcl_Interp *ip, Tcl_DString *ds, Tcl_Obj *rowObj,
+                   struct csv_write_config *config)
+{
+    Tcl_Obj **cells;
+    Tcl_Size ncells;
 
-            PUSH_CHAR(c);
-            self->state = IN_QUOTED_FIELD;
-            break;
+    if (Tcl_ListObjGetElements(ip, rowObj, &ncells, &cells) != TCL_OK)
+        return TCL_ERROR;
 
-        case QUOTE_IN_QUOTED_FIELD:
-            /* doublequote - seen a quote in an quoted field */
-            if (self->quoting != QUOTE_NONE && c == self->quotechar) {
-                /* save "" as " */
+    csv_format_record(ds, ncells, cells, config);
+    return TCL_OK;
+}
 
-                PUSH_CHAR(c);
-                self->state = IN_QUOTED_FIELD;
-            }
-            else if (IS_WHITESPACE(c)) {
-                // End of field. End of line not reached yet
+/*
+ * Returns 1 if the UTF-8 in p may contain sequences that Tcl uses
+ * internally but are not valid UTF-8. These are C0 80 for NUL and, in
+ * some Tcl versions, surrogates encoded as ED A0-BF xx. Hangul also
+ * starts with ED so this may return 1 for valid data as well.
+ */
+static int csv_utf8_needs_conversion(const char *p, Tcl_Size len)
+{
+    return memchr(p, 0xC0, len) != NULL || memchr(p, 0xED, len) != NULL;
+}
 
-                END_FIELD();
-                self->state = EAT_WHITESPACE;
-            }
-            else if (c == '\n') {
-                END_FIELD();
-                END_LINE();
-                /* self->state = START_RECORD; */
-            }
-            else if (c == '\r') {
-                END_FIELD();
-                self->state = EAT_CRNL;
-            }
-            else if (!self->strict) {
-                PUSH_CHAR(c);
-                self->state = IN_FIELD;
-            }
-            else {
-                set_error(self,
-                          Tcl_ObjPrintf("CSV parse error: '%c' expected after '%c'",
-                                        self->delimiter, self->quotechar));
-                goto parsingerror;
-            }
-            break;
+/*
+ * Writes out the len formatted bytes to chan. nrows is only used for
+ * tracing. ip may be NULL in which case errors are not reported.
+ *
+ * With the -binary option, the bytes are written with Tcl_Write as UTF-8,
+ * bypassing the encoding pass of the channel. The rare buffers containing
+ * Tcl internal forms (see above) are converted to UTF-8 first.
+ */
+static int csv_write_bytes(Tcl_Interp *ip, Tcl_Channel chan,
+                           const char *bytes, Tcl_Size len, Tcl_Size nrows,
+                           const struct csv_write_config *config)
+{
+    Tcl_Size written;
 
-        case EAT_CRNL:
-            if (c == '\n') {
-                END_LINE();
-                /* self->state = START_RECORD; */
-            } else if (IS_WHITESPACE(c)){
-                // Handle \r-delimited files
-                END_LINE_STATE(EAT_WHITESPACE);
-            } else {
-                /* XXX
-                 * first character of a new record--need to back up and reread
-                 * to handle properly...
-                 */
-                i--; buf--; /* back up one character (HACK!) */
-                END_LINE_STATE(START_RECORD);
-            }
-            break;
+    (void) nrows;               /* Unused without probes */
+    if (len == 0)
+        return TCL_OK;
+    /* write_flush(channel, bytes, rows formatted so far) */
+    CSV_PROBE3(write_flush, chan, (long) len, (long) nrows);
+    if (config->deflate) {
+        return csv_deflate_write(ip, chan, bytes, len, TCL_ZLIB_NO_FLUSH,
+                                 config);
+    } else if (! config->binary) {
+        written = Tcl_WriteChars(chan, bytes, len);
+    } else if (! csv_utf8_needs_conversion(bytes, len)) {
+        written = Tcl_Write(chan, bytes, len);
+    } else {
+        Tcl_Encoding enc = Tcl_GetEncoding(NULL, "utf-8");
+        Tcl_DString utf8;
+        Tcl_UtfToExternalDString(enc, bytes, len, &utf8);
+        written = Tcl_Write(chan, Tcl_DStringValue(&utf8),
+                            Tcl_DStringLength(&utf8));
+        Tcl_DStringFree(&utf8);
+        Tcl_FreeEncoding(enc);
+    }
+    if (written < 0) {
+        if (ip)
+            Tcl_SetResult(ip, "Error writing to channel.", TCL_STATIC);
+        return TCL_ERROR;
+    }
+    return TCL_OK;
+}
 
-        case EAT_CRNL_NOP: // inside an ignored comment line
-            self->state = START_RECORD;
-            /* \r line terminator -- parse this character again */
-            if (c != '\n' && c != self->delimiter) {
-                --i;
-                --buf;
-            }
-            break;
+/*
+ * Writes out the formatted data in ds to chan and empties ds. See
+ * csv_write_bytes.
+ */
+int csv_write_flush(Tcl_Interp *ip, Tcl_Channel chan, Tcl_DString *ds,
+                    Tcl_Size nrows, const struct csv_write_config *config)
+{
+    if (csv_write_bytes(ip, chan, Tcl_DStringValue(ds), Tcl_DStringLength(ds),
+                        nrows, config) != TCL_OK)
+        return TCL_ERROR;
+    Tcl_DStringSetLength(ds, 0);
+    return TCL_OK;
+}
 
-        case EAT_COMMENT:
-            if (c == '\n') {
-                END_LINE();
-            } else if (c == '\r') {
-                self->state = EAT_CRNL;
-            }
-            break;
+/*
+ * Completes the output to chan after all data has been flushed. For
+ * compressed output, this writes out the end of the compressed stream.
+ * If chan is NULL, as after an error, the stream is only released.
+ */
+int csv_write_finish(Tcl_Interp *ip, Tcl_Channel chan,
+                     struct csv_write_config *config)
+{
+    int res = TCL_OK;
 
-        default:
-            break;
+    if (config->deflate && chan)
+        res = csv_deflate_write(ip, chan, "", 0, TCL_ZLIB_FINALIZE, config);
+    csv_deflate_end(config);
+    return res;
+}
 
+/* The rows passed to csv_write and the state needed to pick out cells */
+struct csv_write_rows {
+    enum csv_layout layout;
+    Tcl_Obj **items;            /* Rows, columns or dicts */
+    Tcl_Size nrows;
+    Tcl_Size ncols;             /* Number of cells for columns and dicts */
+    Tcl_Obj **names;            /* Keys for dicts */
+    Tcl_Obj ***colv;            /* Elements of each column */
+    Tcl_Size *collen;           /* Length of each column */
+    Tcl_Obj **cells;            /* Current row for columns and dicts */
+    Tcl_Obj *emptyObj;          /* Used for missing cells */
+};
 
+/*
+ * Returns the cells of row r in *cellsP. For the column and dict layouts
+ * they are stored in rows->cells so are only valid until the next call.
+ */
+static int csv_write_row_cells(Tcl_Interp *ip, struct csv_write_rows *rows,
+                               Tcl_Size r, Tcl_Size *ncellsP,
+                               Tcl_Obj ***cellsP)
+{
+    Tcl_Size c;
+
+    switch (rows->layout) {
+    case CSV_LAYOUT_ROWS:
+        return Tcl_ListObjGetElements(ip, rows->items[r], ncellsP, cellsP);
+    case CSV_LAYOUT_COLUMNS:
+        for (c = 0; c < rows->ncols; ++c) {
+            rows->cells[c] = r < rows->collen[c] ?
+                rows->colv[c][r] : rows->emptyObj;
         }
-
+        break;
+    case CSV_LAYOUT_DICTS:
+        for (c = 0; c < rows->ncols; ++c) {
+            if (Tcl_DictObjGet(ip, rows->items[r], rows->names[c],
+                               &rows->cells[c]) != TCL_OK)
+                return TCL_ERROR;
+            /* Missing keys result in empty cells */
+            if (rows->cells[c] == NULL)
+                rows->cells[c] = rows->emptyObj;
+        }
+        break;
     }
+    *ncellsP = rows->ncols;
+    *cellsP = rows->cells;
+    return TCL_OK;
+}
 
-    _TOKEN_CLEANUP();
+/*
+ * Parallel formatting for csv_write -threads. Tcl_Obj's may only be
+ * accessed from the interpreter thread so that captures the bytes of a
+ * batch of cells. Worker threads then format disjoint ranges of rows into
+ * their own buffers which the interpreter thread writes out in order.
+ */
 
-    TRACE(("Finished tokenizing input\n"))
+/* Rows captured at a time. Bounds the memory used for the capture. */
+#define CSV_WRITE_BATCH_ROWS 65536
+/* Ranges smaller than this are not worth a thread */
+#define CSV_WRITE_MIN_THREAD_ROWS 1024
 
-    return 0;
+/* Bytes of a cell captured for formatting in a worker thread */
+struct csv_cell_span {
+    const char *bytes;          /* NUL terminated */
+    Tcl_Size off;               /* Offset of pure numbers in number buffer */
+    Tcl_Size len;
+    int formatted;              /* As for csv_format_bytes */
+    int numeric;
+};
 
-parsingerror:
-    i++;
-    _TOKEN_CLEANUP();
+/* A range of rows formatted by one thread */
+struct csv_format_job {
+    const struct csv_write_config *config;
+    const struct csv_cell_span *spans;
+    const Tcl_Size *row_start;  /* Index of first span of each row */
+    Tcl_Size first, last;       /* Rows first to last-1 */
+    char *buf;                  /* Formatted output */
+    size_t len;
+    Tcl_ThreadId tid;
+    int started;                /* Whether run in its own thread */
+    int no_memory;              /* Set if buf could not be allocated */
+};
 
-    return -1;
+/*
+ * Formats the rows of a job. Does not call Tcl so may run in any thread.
+ * Sets job->no_memory if the output buffer cannot be allocated.
+ */
+static void csv_format_job_run(struct csv_format_job *job)
+{
+    const struct csv_write_config *config = job->config;
+    Tcl_Size r, i, end;
+    size_t size = 0;
+    char *dst;
+
+    /* Worst case as in csv_format_cell plus delimiters and terminators */
+    for (i = job->row_start[job->first]; i < job->row_start[job->last]; ++i)
+        size += 2 * (size_t) job->spans[i].len + 3;
+    size += 2 * (size_t) (job->last - job->first) + 1;
+    job->buf = malloc(size);
+    if (job->buf == NULL) {
+        job->no_memory = 1;
+        return;
+    }
 
-linelimit:
-    i++;
-    _TOKEN_CLEANUP();
+    dst = job->buf;
+    for (r = job->first; r < job->last; ++r) {
+        end = job->row_start[r + 1];
+        for (i = job->row_start[r]; i < end; ++i) {
+            const struct csv_cell_span *span = &job->spans[i];
+            dst = csv_format_bytes(dst, span->bytes, span->len,
+                                   span->formatted, span->numeric, config);
+            /* Append delimiter unless this is the last cell */
+            if (i != (end - 1))
+                *dst++ = config->delimiter;
+        }
+        *dst++ = config->lineterminator1;
+        if (config->lineterminator2)
+            *dst++ = config->lineterminator2;
+    }
+    job->len = dst - job->buf;
+}
 
-    return 0;
+static Tcl_ThreadCreateType csv_format_worker(ClientData clientData)
+{
+    csv_format_job_run((struct csv_format_job *) clientData);
+    Tcl_ExitThread(0);
+    TCL_THREAD_CREATE_RETURN;
 }
 
-static int parser_handle_eof(parser_t *self)
+static int csv_write_parallel(Tcl_Interp *ip, Tcl_Channel chan,
+                              struct csv_write_rows *rows, int nthreads,
+                              struct csv_write_config *config)
 {
-    TRACE(("handling eof, datalen: %d, pstate: %d\n", self->datalen, self->state))
-    if (self->datalen == 0 && (self->state != START_RECORD)) {
-        // test cases needed here
-        // TODO: empty field at end of line
-        TRACE(("handling eof\n"));
-
-        if (self->state == IN_FIELD || self->state == START_FIELD) {
-            if (end_field(self) < 0)
-                return -1;
-        } else if (self->state == QUOTE_IN_QUOTED_FIELD) {
-            if (end_field(self) < 0)
-                return -1;
-        } else if (self->state == IN_QUOTED_FIELD) {
-            set_error(self,
-                      Tcl_ObjPrintf("CSV parse error: EOF inside string starting at line %" TCL_SIZE_MODIFIER "d",
-                                    self->file_lines));
-            return -1;
+    struct csv_cell_span *spans = NULL;
+    struct csv_format_job *jobs;
+    Tcl_Size *row_start;
+    Tcl_Size i, c, r, first, last, nbatch, ncells, nspans, capacity = 0;
+    Tcl_Obj **cells;
+    Tcl_DString numbers;        /* Formatted pure numbers */
+    char numbuf[CSV_NUMBER_SPACE];
+    int j, njobs, no_memory = 0, res = TCL_OK;
+
+    row_start = malloc((CSV_WRITE_BATCH_ROWS + 1) * sizeof(*row_start));
+    if (row_start == NULL) {
+        Tcl_SetResult(ip, "Out of memory.", TCL_STATIC);
+        return TCL_ERROR;
+    }
+    jobs = ckalloc(nthreads * sizeof(*jobs));
+    Tcl_DStringInit(&numbers);
+
+    for (first = 0; first < rows->nrows && res == TCL_OK; first = last) {
+        last = first + CSV_WRITE_BATCH_ROWS;
+        if (last > rows->nrows)
+            last = rows->nrows;
+        nbatch = last - first;
+
+        /* Capture the cells of the batch */
+        nspans = 0;
+        Tcl_DStringSetLength(&numbers, 0);
+        for (r = 0; r < nbatch; ++r) {
+            row_start[r] = nspans;
+            if (csv_write_row_cells(ip, rows, first + r, &ncells, &cells)
+                != TCL_OK) {
+                res = TCL_ERROR;
+                break;
+            }
+            if (nspans + ncells > capacity) {
+                struct csv_cell_span *grown;
+                size_t want = 2 * ((size_t) nspans + ncells) + 1024;
+                grown = want > SIZE_MAX / sizeof(*spans) ? NULL :
+                    realloc(spans, want * sizeof(*spans));
+                if (grown == NULL) {
+                    no_memory = 1;
+                    res = TCL_ERROR;
+                    break;
+                }
+                spans = grown;
+                capacity = (Tcl_Size) want;
+            }
+            for (c = 0; c < ncells; ++c) {
+                struct csv_cell_span *span = &spans[nspans++];
+                span->numeric = -1;
+                span->len = csv_format_number(cells[c], config, numbuf,
+                                              &span->numeric);
+                span->formatted = span->len >= 0;
+                if (span->formatted) {
+                    /* Pointer set below as numbers may be reallocated */
+                    span->bytes = NULL;
+                    span->off = Tcl_DStringLength(&numbers);
+                    Tcl_DStringAppend(&numbers, numbuf, span->len + 1);
+                } else {
+                    span->bytes = Tcl_GetStringFromObj(cells[c], &span->len);
+                    /* csv_numeric may call Tcl so not done in workers */
+                    if (config->quoting == QUOTE_NONNUMERIC)
+                        span->numeric = csv_numeric(span->bytes);
+                }
+            }
+        }
+        if (res != TCL_OK)
+            break;
+        row_start[nbatch] = nspans;
+        for (i = 0; i < nspans; ++i) {
+            if (spans[i].bytes == NULL)
+                spans[i].bytes = Tcl_DStringValue(&numbers) + spans[i].off;
         }
 
-        if (end_line(self) < 0)
-            return -1;
+        /* Split into ranges. The first is done in this thread. */
+        njobs = (int) (nbatch / CSV_WRITE_MIN_THREAD_ROWS);
+        if (njobs > nthreads)
+            njobs = nthreads;
+        if (njobs < 1)
+            njobs = 1;
+        for (j = 0; j < njobs; ++j) {
+            jobs[j].config = config;
+            jobs[j].spans = spans;
+            jobs[j].row_start = row_start;
+            jobs[j].first = (nbatch * j) / njobs;
+            jobs[j].last = (nbatch * (j + 1)) / njobs;
+            jobs[j].buf = NULL;
+            jobs[j].no_memory = 0;
+            jobs[j].started = j > 0 &&
+                Tcl_CreateThread(&jobs[j].tid, csv_format_worker, &jobs[j],
+                                 TCL_THREAD_STACK_DEFAULT,
+                                 TCL_THREAD_JOINABLE) == TCL_OK;
+        }
+        /* Ranges for which threads could not be started are done here */
+        for (j = 0; j < njobs; ++j) {
+            if (! jobs[j].started)
+                csv_format_job_run(&jobs[j]);
+        }
+        for (j = 0; j < njobs; ++j) {
+            int code;
+            if (jobs[j].started)
+                Tcl_JoinThread(jobs[j].tid, &code);
+        }
 
-        return 0;
-    }
-    else if (self->datalen == 0 && (self->state == START_RECORD)) {
-        return 0;
+        for (j = 0; j < njobs; ++j) {
+            if (jobs[j].no_memory && res == TCL_OK) {
+                no_memory = 1;
+                res = TCL_ERROR;
+            }
+        }
+
+        for (j = 0; j < njobs; ++j) {
+            if (res == TCL_OK)
+                res = csv_write_bytes(ip, chan, jobs[j].buf,
+                                      (Tcl_Size) jobs[j].len,
+                                      first + jobs[j].last, config);
+            free(jobs[j].buf);
+        }
     }
 
-    return -1;
+    Tcl_DStringFree(&numbers);
+    ckfree(jobs);
+    free(row_start);
+    if (spans)
+        free(spans);
+    if (no_memory)
+        Tcl_SetResult(ip, "Out of memory.", TCL_STATIC);
+    return res;
 }
 
-void debug_print_parser(parser_t *self)
-{
-    int line;
-
-    for (line = 0; line < self->lines; ++line)
-    {
-        printf("(Parsed) Line %d: ", line);
+/* Options of csv_write and csv_format that are not format options */
+struct csv_write_input {
+    enum csv_layout layout;     /* How the rows are laid out */
+    Tcl_Obj *namesObj;          /* Column names or NULL */
+    int header;                 /* Whether to write names as first row */
+    int nthreads;               /* Threads for formatting */
+};
 
-#ifdef TBD
-        for (j = 0; j < self->line_fields[j]; ++j)
-        {
-            token = self->words[j + self->line_start[line]];
-            printf("%s ", token);
+/*
+ * Returns an estimate of the length of the formatted rows and of the
+ * nnames header cells in names, so the output buffer may be allocated
+ * once. Quotes are counted where the quoting policy always adds them.
+ * Pure numbers are not converted to strings and are assumed to be of
+ * typical length. As csv_format_cell needs room for 2*slen+2 bytes,
+ * headroom for the worst case of the largest cell is included.
+ */
+static Tcl_Size csv_write_estimate(struct csv_write_rows *rows,
+                                   Tcl_Size nnames, Tcl_Obj **names,
+                                   struct csv_write_config *config)
+{
+    Tcl_Obj **cells;
+    Tcl_Size c, r, ncells, len, maxlen = 0, total = 0;
+    Tcl_Size quotes = config->quoting == QUOTE_ALL ||
+        config->quoting == QUOTE_NONNUMERIC ? 2 : 0;
+
+    for (r = -1; r < rows->nrows; ++r) {
+        if (r < 0) {
+            cells = names;
+            ncells = nnames;
+        } else if (csv_write_row_cells(NULL, rows, r, &ncells, &cells)
+                   != TCL_OK) {
+            break;              /* Error will be reported when formatting */
         }
-        printf("\n");
-#endif
+        for (c = 0; c < ncells; ++c) {
+            Tcl_Obj *cell = cells[c];
+            if (cell->bytes == NULL && cell->typePtr != NULL &&
+                (cell->typePtr == config->int_type ||
+                 cell->typePtr == config->wide_type ||
+                 cell->typePtr == config->double_type)) {
+                total += 20 + 1; /* Plus delimiter, never quoted */
+                len = CSV_NUMBER_SPACE;
+            } else {
+                Tcl_GetStringFromObj(cell, &len);
+                total += len + quotes + 1;
+            }
+            if (len > maxlen)
+                maxlen = len;
+        }
+        total += 2;             /* Terminator */
     }
+    /* Beyond the cell itself, up to another slen+2 bytes when formatting */
+    return total + maxlen + 2;
 }
 
 /*
-  nrows : number of rows to tokenize (or until reach EOF)
-  all : tokenize all the data vs. certain number of rows
+ * Writes the rows in dataObj, laid out as per input->layout, to chan. If
+ * chan is NULL the formatted rows are returned as the interpreter result
+ * instead. For the column and dict layouts cells are picked out of
+ * dataObj as each row is formatted so no intermediate row lists are
+ * constructed. input->namesObj, if not NULL, holds the column names, used
+ * as keys for the dict layout and written as the first row if
+ * input->header is set. If input->nthreads is greater than 1, rows are
+ * formatted in parallel.
  */
-
-int _tokenize_helper(parser_t *self, size_t nrows, int all)
+static int csv_write(Tcl_Interp *ip, Tcl_Channel chan, Tcl_Obj *dataObj,
+                     const struct csv_write_input *input,
+                     struct csv_write_config *config)
 {
-    parser_op tokenize_bytes;
+    struct csv_write_rows rows;
+    Tcl_Obj **names = NULL, **cells, *namesObj = input->namesObj;
+    Tcl_Size c, r, nitems, nnames = 0, ncells;
+    Tcl_DString ds;
+    enum csv_layout layout = input->layout;
+    int header = input->header;
+    int status = TCL_ERROR;
 
-    int status = 0;
-    Tcl_Size start_lines = self->lines;
+    if (csv_write_config_finalize(ip, config) != TCL_OK)
+        return TCL_ERROR;
 
-    if (self->delim_whitespace) {
-        tokenize_bytes = tokenize_whitespace;
-    } else if (self->lineterminator == '\0') {
-        tokenize_bytes = tokenize_delimited;
-    } else {
-        tokenize_bytes = tokenize_delim_customterm;
+    memset(&rows, 0, sizeof(rows));
+    if (Tcl_ListObjGetElements(ip, dataObj, &nitems, &rows.items) != TCL_OK) {
+        csv_deflate_end(config);
+        return TCL_ERROR;
     }
 
-    if (self->state == FINISHED) {
-        return 0;
+    rows.layout = layout;
+    rows.emptyObj = Tcl_NewObj();
+    Tcl_IncrRefCount(rows.emptyObj);
+    if (namesObj) {
+        Tcl_IncrRefCount(namesObj);
+    } else if (layout == CSV_LAYOUT_DICTS && nitems > 0) {
+        /* Columns default to the keys of the first dict */
+        Tcl_DictSearch search;
+        Tcl_Obj *keyObj;
+        int done;
+        if (Tcl_DictObjFirst(ip, rows.items[0], &search, &keyObj, NULL, &done)
+            != TCL_OK)
+            goto vamoose;
+        namesObj = Tcl_NewListObj(0, NULL);
+        Tcl_IncrRefCount(namesObj);
+        for (; !done; Tcl_DictObjNext(&search, &keyObj, NULL, &done))
+            Tcl_ListObjAppendElement(NULL, namesObj, keyObj);
+        Tcl_DictObjDone(&search);
+    }
+    if (namesObj &&
+        Tcl_ListObjGetElements(ip, namesObj, &nnames, &names) != TCL_OK)
+        goto vamoose;
+    if (header && namesObj == NULL && layout != CSV_LAYOUT_DICTS) {
+        Tcl_SetResult(ip, "Option -header requires -columns.", TCL_STATIC);
+        goto vamoose;
     }
 
-    TRACE(("_tokenize_helper: Asked to tokenize %d rows, datapos=%d, datalen=%d\n", \
-           (int) nrows, self->datapos, self->datalen));
+    switch (layout) {
+    case CSV_LAYOUT_ROWS:
+        rows.nrows = nitems;
+        break;
+    case CSV_LAYOUT_COLUMNS:
+        rows.ncols = nitems;
+        if (namesObj && nnames != rows.ncols) {
+            Tcl_SetResult(ip, "Number of column names does not match number of columns.", TCL_STATIC);
+            goto vamoose;
+        }
+        rows.colv = malloc((rows.ncols + 1) * sizeof(*rows.colv));
+        rows.collen = malloc((rows.ncols + 1) * sizeof(*rows.collen));
+        for (c = 0; c < rows.ncols; ++c) {
+            if (Tcl_ListObjGetElements(ip, rows.items[c], &rows.collen[c],
+                                       &rows.colv[c]) != TCL_OK)
+                goto vamoose;
+            /* Shorter columns are padded with empty cells */
+            if (rows.collen[c] > rows.nrows)
+                rows.nrows = rows.collen[c];
+        }
+        break;
+    case CSV_LAYOUT_DICTS:
+        rows.ncols = nnames;
+        rows.names = names;
+        rows.nrows = nitems;
+        break;
+    }
+    if (rows.ncols)
+        rows.cells = malloc(rows.ncols * sizeof(*rows.cells));
 
-    while (1) {
-        if (!all && self->lines - start_lines >= (Tcl_Size)nrows)
-            break;
+    Tcl_DStringInit(&ds);
+    if (chan == NULL) {
+        /* Allocate once, retaining the storage after setting length 0 */
+        Tcl_Size len = csv_write_estimate(&rows, header ? nnames : 0, names,
+                                          config);
+        Tcl_DStringSetLength(&ds, len);
+        Tcl_DStringSetLength(&ds, 0);
+    }
 
-        if (self->datapos == self->datalen) {
-            status = parser_buffer_bytes(self, self->chunksize);
+    if (header && nnames)
+        csv_format_record(&ds, nnames, names, config);
 
-            if (status == REACHED_EOF) {
-                // close out last line
-                status = parser_handle_eof(self);
-                self->state = FINISHED;
-                break;
-            } else if (status != 0) {
-                return status;
-            }
-        }
+    if (input->nthreads > 1 && chan) {
+        if (csv_write_flush(ip, chan, &ds, 0, config) == TCL_OK &&
+            csv_write_parallel(ip, chan, &rows, input->nthreads, config)
+            == TCL_OK &&
+            csv_write_finish(ip, chan, config) == TCL_OK)
+            status = TCL_OK;
+        goto done;
+    }
 
-        TRACE(("_tokenize_helper: Trying to process %d bytes, datalen=%d, datapos= %d\n",
-               self->datalen - self->datapos, self->datalen, self->datapos));
-        /* TRACE(("sourcetype: %c, status: %d\n", self->sourcetype, status)); */
+    for (r = 0; r < rows.nrows; ++r) {
+        if (csv_write_row_cells(ip, &rows, r, &ncells, &cells) != TCL_OK)
+            goto done;
+        csv_format_record(&ds, ncells, cells, config);
+        /* Minimize number of I/O but at same time, keep memory reasonable */
+        if (chan && Tcl_DStringLength(&ds) > config->flushsize &&
+            csv_write_flush(ip, chan, &ds, r + 1, config) != TCL_OK)
+            goto done;
+    }
 
-        status = tokenize_bytes(self, nrows);
+    if (chan == NULL) {
+        Tcl_DStringResult(ip, &ds);
+        status = TCL_OK;
+    } else if (csv_write_flush(ip, chan, &ds, rows.nrows, config) == TCL_OK &&
+               csv_write_finish(ip, chan, config) == TCL_OK) {
+        /* Wrote any remaining bytes */
+        status = TCL_OK;
+    }
 
-        /* debug_print_parser(self); */
+done: /* ds must have been initialized */
+    Tcl_DStringFree(&ds);
 
-        if (status < 0) {
-            // XXX
-            TRACE(("_tokenize_helper: Status %d returned from tokenize_bytes, breaking\n",
-                   status));
-            status = -1;
-            break;
-        }
-    }
-    TRACE(("leaving tokenize_helper\n"));
+vamoose:
+    if (rows.cells)
+        free(rows.cells);
+    if (rows.colv)
+        free(rows.colv);
+    if (rows.collen)
+        free(rows.collen);
+    if (namesObj)
+        Tcl_DecrRefCount(namesObj);
+    Tcl_DecrRefCount(rows.emptyObj);
+    /* Releases any compression stream not completed due to an error */
+    csv_deflate_end(config);
     return status;
 }
 
-int tokenize_nrows(parser_t *self, size_t nrows)
+/*
+ * Returns 1 if the len bytes in s are an empty string or a printf format
+ * with optional precision up to CSV_MAX_FLOAT_PRECISION and a single
+ * f, e or g conversion, 0 otherwise.
+ */
+static int csv_floatformat_valid(const char *s, Tcl_Size len)
 {
-    int status = _tokenize_helper(self, nrows, 0);
-    return status;
-}
+    int precision = 0;
+    const char *p = s;
 
-int tokenize_all_rows(parser_t *self)
-{
-    int status = _tokenize_helper(self, -1, 1);
-    return status;
+    if (len == 0)
+        return 1;
+    if (*p++ != '%')
+        return 0;
+    if (*p == '.') {
+        if (! isdigit((unsigned char) *++p))
+            return 0;
+        while (isdigit((unsigned char) *p)) {
+            precision = 10 * precision + (*p++ - '0');
+            if (precision > CSV_MAX_FLOAT_PRECISION)
+                return 0;
+        }
+    }
+    if (*p == '\0' || strchr("fFeEgG", *p) == NULL)
+        return 0;
+    return (p + 1 - s) == len;
 }
 
-parser_t *parser_create(Tcl_Interp *ip, int objc, Tcl_Obj *const objv[], int *pnrows)
+/*
+ * Parses the objc option and value pairs in objv into config. config
+ * should have been initialized with csv_write_config_init.
+ */
+int csv_write_config_parse(Tcl_Interp *ip, int objc, Tcl_Obj *const objv[],
+                           struct csv_write_config *config)
 {
-    parser_t *parser;
-    int i, mode, opt, ival, nrows;
-    Tcl_Size len;
-    char *s;
-    int res;
-    Tcl_Obj **objs;
-    Tcl_Channel chan;
+    int i, ival;
     static const char *switches[] = {
-        "-comment", "-delimiter", "-doublequote", "-escape",
-        "-excludefields", "-ignoreerrors", "-includefields",
-        "-nrows", "-quote", "-quoting",
-        "-skipblanklines", "-skipleadingspace", "-skiplines",
-        "-startline", "-strict", "-terminator",
-        "-chunksize", /* Undocumented */
+        "-binary", "-compression", "-delimiter", "-doublequote", "-escape",
+        "-floatformat", "-flushsize", "-quote", "-quoting", "-terminator",
         NULL
     };
     enum switches_e {
-        CSV_COMMENT, CSV_DELIMITER, CSV_DOUBLEQUOTE, CSV_ESCAPE,
-        CSV_EXCLUDEFIELDS, CSV_IGNOREERRORS, CSV_INCLUDEFIELDS,
-        CSV_NROWS, CSV_QUOTE, CSV_QUOTING,
-        CSV_SKIPBLANKLINES, CSV_SKIPLEADINGSPACE, CSV_SKIPLINES,
-        CSV_STARTLINE, CSV_STRICT, CSV_TERMINATOR,
-        CSV_CHUNKSIZE,
+        CSV_BINARY, CSV_COMPRESSION, CSV_DELIMITER, CSV_DOUBLEQUOTE,
+        CSV_ESCAPE, CSV_FLOATFORMAT, CSV_FLUSHSIZE, CSV_QUOTE, CSV_QUOTING,
+        CSV_TERMINATOR,
     };
-    if (objc < 1) {
-        Tcl_SetResult(ip, "Syntax error: CHANNEL argument must be specified.", TCL_STATIC);
-	return NULL;
-    }
-
-    chan = Tcl_GetChannel(ip, Tcl_GetString(objv[objc-1]), &mode);
-    if (chan == NULL)
-        return NULL;
-
-    parser = parser_new();
-    parser->chunksize = 10*1024; /* TBD - chunksize */
-    parser_init(parser);
-    parser_set_default_options(parser);
-    parser->chan = chan;
 
-    nrows = -1;
-    res = TCL_ERROR;
-    for (i = 0; i < objc-1; i += 2) {
+    for (i = 0; i < objc; i += 2) {
+        int opt;
+        Tcl_Size len = 0;
+        char *s = NULL;
 	if (Tcl_GetIndexFromObj(ip, objv[i], switches, "option", 0, &opt)
             != TCL_OK)
-            goto error_handler;
-        if ((i+1) >= (objc-1)) {
+            return TCL_ERROR;
+
+        if ((i+1) >= objc) {
             Tcl_SetResult(ip, "Missing value for option.", TCL_STATIC);
-            goto error_handler;
+            return TCL_ERROR;
         }
-        s = Tcl_GetStringFromObj(objv[i+1], &len);
-        if (opt != CSV_DOUBLEQUOTE && opt != CSV_CHUNKSIZE) {
+        if (opt != CSV_BINARY && opt != CSV_DOUBLEQUOTE &&
+            opt != CSV_FLUSHSIZE) {
             s = Tcl_GetStringFromObj(objv[i+1], &len);
             if (len > 0) {
                 if ((! isascii(*s)) ||
                     (len > 1 && ! isascii(s[1]))) {
                     Tcl_AppendResult(ip, "Only ASCII characters permitted for option ", Tcl_GetString(objv[i]), ".", NULL);
-                    return NULL;
+                    return TCL_ERROR;
                 }
             }
         }
-
         switch ((enum switches_e) opt) {
-        case CSV_COMMENT:
-            if (len > 1)
-                goto invalid_option_value;
-            parser->commentchar = *s; /* '\0' -> No comment char */
-            break;
-        case CSV_DELIMITER:
-            if (len != 1)
-                goto invalid_option_value;
-            parser->delimiter = *s;
-            break;
-        case CSV_ESCAPE:
-            if (len > 1)
-                goto invalid_option_value;
-            parser->escapechar = *s; /* \0 -> no escape char */
-            break;
-        case CSV_NROWS:
-            if (pnrows == NULL) {
-                Tcl_SetResult(ip, "Option -nrows is not valid in this mode.", TCL_STATIC);
-                goto error_handler;
-            }
-            res = Tcl_GetIntFromObj(ip, objv[i+1], &nrows);
-            if (res != TCL_OK)
-                goto invalid_option_value;
-            break;
-        case CSV_QUOTE:
-            if (len > 1)
-                goto invalid_option_value;
-            parser->quotechar = *s;
-            break;
-        case CSV_QUOTING:
-            /*
-             * NOTE: this is currently undocumented because for readers,
-             * it does not seem to have any effect beyond what is already
-             * provided for by the -quote option where -quote "" works
-             * similar to QUOTE_NONE. The other options do not have
-             * effect on reads.
-             */
-            if (!strcmp(s, "all"))
-                parser->quoting = QUOTE_ALL;
-            else if (!strcmp(s, "minimal"))
-                parser->quoting = QUOTE_MINIMAL;
-            else if (!strcmp(s, "nonnumeric"))
-                parser->quoting = QUOTE_NONNUMERIC;
-            else if (!strcmp(s, "none"))
-                parser->quoting = QUOTE_NONE;
-            else
-                goto invalid_option_value;
-            break;
-        case CSV_SKIPLINES:
-            res = Tcl_ListObjGetElements(ip, objv[i+1], &len, &objs);
-            if (res != TCL_OK)
-                goto error_handler;
-            else {
-                Tcl_Size j;
-                Tcl_WideInt wval;
-                for (j = 0; j < len; ++j) {
-                    res = Tcl_GetWideIntFromObj(ip, objs[j], &wval);
-                    if (res != TCL_OK)
-                        goto error_handler;
-                    if (wval < 0)
-                        goto invalid_option_value;
-                    parser_add_skiprow(parser, wval);
-                }
-            }
-            break;
-        case CSV_STARTLINE:
-            res = Tcl_GetIntFromObj(ip, objv[i+1], &ival);
-            if (res != TCL_OK)
+        case CSV_BINARY:
+            if (Tcl_GetBooleanFromObj(ip, objv[i+1], &ival) != TCL_OK)
                 goto invalid_option_value;
-            parser_set_skipfirstnrows(parser, ival);
+            config->binary = ival;
             break;
-        case CSV_TERMINATOR:
-            if (len != 1)
+        case CSV_COMPRESSION:
+            if (!strcmp(s, "none"))
+                config->compression = CSV_COMPRESSION_NONE;
+            else if (!strcmp(s, "gzip"))
+                config->compression = CSV_COMPRESSION_GZIP;
+            else if (!strcmp(s, "zlib"))
+                config->compression = CSV_COMPRESSION_ZLIB;
+            else
                 goto invalid_option_value;
-            parser->lineterminator = *s;
             break;
-        case CSV_DOUBLEQUOTE:
-            if (Tcl_GetBooleanFromObj(ip, objv[i+1], &ival) != TCL_OK)
+        case CSV_DELIMITER:
+            if (len != 1)
                 goto invalid_option_value;
-            parser->doublequote = ival;
+            config->delimiter = *s;
             break;
-        case CSV_IGNOREERRORS:
-            /* TBD - currently not used */
-            if (Tcl_GetBooleanFromObj(ip, objv[i+1], &ival) != TCL_OK)
+        case CSV_ESCAPE:
+            if (len > 1)
                 goto invalid_option_value;
-            parser->error_bad_lines = ival;
+            config->escapechar = *s; /* \0 -> no escape char */
             break;
-        case CSV_SKIPBLANKLINES:
-            if (Tcl_GetBooleanFromObj(ip, objv[i+1], &ival) != TCL_OK)
+        case CSV_FLOATFORMAT:
+            if (csv_floatformat_valid(s, len) == 0)
                 goto invalid_option_value;
-            parser->skip_empty_lines = ival;
+            memcpy(config->floatformat, s, len + 1);
             break;
-        case CSV_SKIPLEADINGSPACE:
-            if (Tcl_GetBooleanFromObj(ip, objv[i+1], &ival) != TCL_OK)
+        case CSV_FLUSHSIZE:
+            if (Tcl_GetSizeIntFromObj(NULL, objv[i+1], &len) != TCL_OK ||
+                len < 0)
                 goto invalid_option_value;
-            parser->skipinitialspace = ival;
+            config->flushsize = len;
             break;
-        case CSV_STRICT:
-            if (Tcl_GetBooleanFromObj(ip, objv[i+1], &ival) != TCL_OK)
+        case CSV_QUOTE:
+            if (len > 1)
                 goto invalid_option_value;
-            parser->strict = ival;
+            config->quotechar = *s;
             break;
-        case CSV_INCLUDEFIELDS:
-            if (parse_field_indices(objv[i+1],
-                                    &parser->num_included_fields,
-                                    &parser->included_fields) != TCL_OK)
+        case CSV_QUOTING:
+            if (!strcmp(s, "all"))
+                config->quoting = QUOTE_ALL;
+            else if (!strcmp(s, "minimal"))
+                config->quoting = QUOTE_MINIMAL;
+            else if (!strcmp(s, "nonnumeric"))
+                config->quoting = QUOTE_NONNUMERIC;
+            else if (!strcmp(s, "none"))
+                config->quoting = QUOTE_NONE;
+            else
                 goto invalid_option_value;
             break;
-        case CSV_EXCLUDEFIELDS:
-            if (parse_field_indices(objv[i+1],
-                                    &parser->num_excluded_fields,
-                                    &parser->excluded_fields) != TCL_OK)
+        case CSV_TERMINATOR:
+            if (len != 1 && len != 2)
                 goto invalid_option_value;
+            config->lineterminator1 = *s;
+            config->lineterminator2 = s[1]; /* May be \0 */
             break;
-        case CSV_CHUNKSIZE:
-            if (Tcl_GetIntFromObj(ip, objv[i+1], &ival) != TCL_OK)
-                goto invalid_option_value;
-            if (ival <= 0)
+        case CSV_DOUBLEQUOTE:
+            if (Tcl_GetBooleanFromObj(ip, objv[i+1], &ival) != TCL_OK)
                 goto invalid_option_value;
-            parser->chunksize = ival;
+            config->doublequote = ival;
             break;
         }
     }
-    if (pnrows)
-        *pnrows = nrows;
-    return parser;
+    return TCL_OK;
 
 invalid_option_value: /* objv[i] should be the invalid option */
     Tcl_SetObjResult(ip, Tcl_ObjPrintf("Invalid value for option %s.", Tcl_GetString(objv[i])));
-    /* Fall thru to error return */
-error_handler:
-    if (parser)
-        parser_free(parser);
-    return NULL;
+    return TCL_ERROR;
 }
 
-int csv_read_cmd(ClientData clientdata, Tcl_Interp *ip,
-                              int objc, Tcl_Obj *const objv[])
+/*
+ * Parses the objc option and value pairs in objv for csv_write and
+ * csv_format. -layout, -columns, -header and -threads control how ROWS
+ * is read and are stored in input. Everything else is a format option
+ * stored in config.
+ */
+static int csv_write_parse_options(Tcl_Interp *ip, int objc,
+                                   Tcl_Obj *const objv[],
+                                   struct csv_write_input *input,
+                                   struct csv_write_config *config)
+{
+    int i, ival;
+    Tcl_Obj *optsObj, **opts;
+    Tcl_Size len, nopts;
+    static const char *layouts[] = { "rows", "columns", "dicts", NULL };
+
+    input->layout = CSV_LAYOUT_ROWS;
+    input->namesObj = NULL;
+    input->header = 0;
+    input->nthreads = 1;
+
+    optsObj = Tcl_NewListObj(0, NULL);
+    Tcl_IncrRefCount(optsObj);
+    for (i = 0; i < objc; i += 2) {
+        const char *opt = Tcl_GetString(objv[i]);
+        if ((i+1) < objc) {
+            if (!strcmp(opt, "-layout")) {
+                if (Tcl_GetIndexFromObj(NULL, objv[i+1], layouts, "layout",
+                                        TCL_EXACT, &ival) != TCL_OK)
+                    goto invalid_option_value;
+                input->layout = (enum csv_layout) ival;
+                continue;
+            }
+            if (!strcmp(opt, "-columns")) {
+                if (Tcl_ListObjLength(NULL, objv[i+1], &len) != TCL_OK)
+                    goto invalid_option_value;
+                input->namesObj = objv[i+1];
+                continue;
+            }
+            if (!strcmp(opt, "-threads")) {
+                if (Tcl_GetIntFromObj(NULL, objv[i+1], &input->nthreads)
+                    != TCL_OK ||
+                    input->nthreads <= 0 || input->nthreads > 256)
+                    goto invalid_option_value;
+                continue;
+            }
+            if (!strcmp(opt, "-header")) {
+                if (Tcl_GetBooleanFromObj(NULL, objv[i+1], &input->header)
+                    != TCL_OK)
+                    goto invalid_option_value;
+                continue;
+            }
+        }
+        Tcl_ListObjAppendElement(NULL, optsObj, objv[i]);
+        if ((i+1) < objc)
+            Tcl_ListObjAppendElement(NULL, optsObj, objv[i+1]);
+    }
+
+    Tcl_ListObjGetElements(NULL, optsObj, &nopts, &opts);
+    csv_write_config_init(config);
+    if (csv_write_config_parse(ip, (int) nopts, opts, config) != TCL_OK) {
+        Tcl_DecrRefCount(optsObj);
+        return TCL_ERROR;
+    }
+    Tcl_DecrRefCount(optsObj);
+    return TCL_OK;
+
+invalid_option_value: /* objv[i] should be the invalid option */
+    Tcl_DecrRefCount(optsObj);
+    Tcl_SetObjResult(ip, Tcl_ObjPrintf("Invalid value for option %s.", Tcl_GetString(objv[i])));
+    return TCL_ERROR;
+}
+
+int csv_write_cmd(ClientData clientdata, Tcl_Interp *ip,
+                  int objc, Tcl_Obj *const objv[])
+{
+    int mode;
+    struct csv_write_config config;
+    struct csv_write_input input;
+    Tcl_Channel chan;
+
+    if (objc < 3) {
+        Tcl_WrongNumArgs(ip, 1, objv, "?options? CHANNEL ROWS");
+        return TCL_ERROR;
+    }
+    chan = Tcl_GetChannel(ip, Tcl_GetString(objv[objc-2]), &mode);
+    if (chan == NULL)
+        return TCL_ERROR;
+    if (!(mode & TCL_WRITABLE)) {
+        Tcl_SetResult(ip, "Channel is not open for writing.", TCL_STATIC);
+        return TCL_ERROR;
+    }
+
+    if (csv_write_parse_options(ip, objc-3, objv+1, &input, &config)
+        != TCL_OK)
+        return TCL_ERROR;
+
+    return csv_write(ip, chan, objv[objc-1], &input, &config);
+}
+
+int csv_format_cmd(ClientData clientdata, Tcl_Interp *ip,
+                   int objc, Tcl_Obj *const objv[])
 {
+    struct csv_write_config config;
+    struct csv_write_input input;
+
+    if (objc < 2) {
+        Tcl_WrongNumArgs(ip, 1, objv, "?options? ROWS");
+        return TCL_ERROR;
+    }
+
+    if (csv_write_parse_options(ip, objc-2, objv+1, &input, &config)
+        != TCL_OK)
+        return TCL_ERROR;
+    if (config.binary) {
+        Tcl_SetResult(ip, "Option -binary is not valid in this mode.", TCL_STATIC);
+        return TCL_ERROR;
+    }
+    if (config.compression != CSV_COMPRESSION_NONE) {
+        Tcl_SetResult(ip, "Option -compression is not valid in this mode.", TCL_STATIC);
+        return TCL_ERROR;
+    }
+    if (input.nthreads > 1) {
+        Tcl_SetResult(ip, "Option -threads is not valid in this mode.", TCL_STATIC);
+        return TCL_ERROR;
+    }
+
+    return csv_write(ip, NULL, objv[objc-1], &input, &config);
+}
+
+/*
+ * State for csv_convert. Passed as the context to the tokenizer callbacks
+ * in place of the parser so fields are formatted straight from the spans
+ * reported by the tokenizer without creating Tcl_Obj's for them.
+ */
+struct csv_convert {
     parser_t *parser;
-    int nrows, res;
+    Tcl_Interp *ip;
+    Tcl_Channel chan;
+    struct csv_write_config config;
+    Tcl_DString ds;             /* Formatted output not yet written */
+    Tcl_DString scratch;        /* NUL terminated copies of fields */
+    Tcl_Size *spans;            /* Offset and length in scratch of each
+                                   projected column. Offset -1 if missing */
+    Tcl_Size ncells;            /* Cells formatted for current record */
+    int write_error;            /* Set if writing to chan failed */
+};
 
-    parser = parser_create(ip, objc-1, objv+1, &nrows);
-    if (parser == NULL)
+/*
+ * Allocates the spans for projected columns. Columns given as names are
+ * only known once the header has been read.
+ */
+static void convert_alloc_spans(struct csv_convert *cv)
+{
+    parser_t *self = cv->parser;
+    Tcl_Size i;
+
+    if (self->column_slots == NULL || cv->spans != NULL)
+        return;
+    cv->spans = ckalloc(2 * (self->num_columns + 1) * sizeof(Tcl_Size));
+    for (i = 0; i < 2 * self->num_columns; ++i)
+        cv->spans[i] = -1;
+}
+
+/*
+ * Appends the len bytes at data as the next cell of the current record.
+ * numeric is as for csv_format_bytes. Fields with no special characters
+ * are copied as is.
+ */
+static void convert_cell(struct csv_convert *cv, const char *data,
+                         Tcl_Size len, int numeric)
+{
+    Tcl_Size dlen;
+    char *start, *dst;
+
+    if (cv->ncells++ > 0)
+        Tcl_DStringAppend(&cv->ds, &cv->config.delimiter, 1);
+    dlen = Tcl_DStringLength(&cv->ds);
+    Tcl_DStringSetLength(&cv->ds, dlen + 1 + len + len + 1);
+    start = Tcl_DStringValue(&cv->ds);
+    dst = csv_format_bytes(start + dlen, data, len, 0, numeric, &cv->config);
+    Tcl_DStringSetLength(&cv->ds, (Tcl_Size) (dst - start));
+}
+
+/* Tokenizer callback for the end of each field when converting */
+static int convert_field(void *ctx, const char *data, size_t len)
+{
+    struct csv_convert *cv = (struct csv_convert *) ctx;
+    parser_t *self = cv->parser;
+    Tcl_Size slot;
+    int numeric = 0;
+
+    /* The header is collected as for reads to resolve field names */
+    if (self->header_pending)
+        return parser_field(self, data, len);
+
+    if (self->column_slots) {
+        /* Held until the end of the record as columns may be reordered */
+        if ((slot = parser_column_slot(self, self->field_index)) >= 0) {
+            cv->spans[2*slot] = Tcl_DStringLength(&cv->scratch);
+            cv->spans[2*slot+1] = (Tcl_Size) len;
+            Tcl_DStringAppend(&cv->scratch, data, (Tcl_Size) len);
+            Tcl_DStringAppend(&cv->scratch, "", 1);
+        }
+    } else if (field_selected(self, self->field_index)) {
+        if (cv->config.quoting == QUOTE_NONNUMERIC) {
+            /* csv_numeric needs a NUL terminated string */
+            Tcl_DStringSetLength(&cv->scratch, 0);
+            Tcl_DStringAppend(&cv->scratch, data, (Tcl_Size) len);
+            numeric = csv_numeric(Tcl_DStringValue(&cv->scratch));
+        }
+        convert_cell(cv, data, (Tcl_Size) len, numeric);
+    }
+
+    self->field_index += 1;
+    return CSV_CORE_OK;
+}
+
+/*
+ * Tokenizer callback for the end of each record when converting. Writes
+ * out the formatted records once they exceed the flush size.
+ */
+static int convert_record(void *ctx)
+{
+    struct csv_convert *cv = (struct csv_convert *) ctx;
+    parser_t *self = cv->parser;
+    Tcl_Obj **keys;
+    Tcl_Size i, nkeys;
+    const char *data;
+    int numeric = 0;
+
+    if (self->header_pending) {
+        if (parser_set_header(self) != 0)
+            return CSV_CORE_ERROR;
+        /* Header after selection and projection of columns */
+        Tcl_ListObjGetElements(NULL, self->headerObj, &nkeys, &keys);
+        csv_format_record(&cv->ds, nkeys, keys, &cv->config);
+        convert_alloc_spans(cv);
+        self->field_index = 0;
+        goto done;
+    }
+
+    if (self->column_slots) {
+        for (i = 0; i < self->num_columns; ++i) {
+            /* Columns missing from the record are empty */
+            if (cv->spans[2*i] < 0) {
+                convert_cell(cv, "", 0, 0);
+                continue;
+            }
+            data = Tcl_DStringValue(&cv->scratch) + cv->spans[2*i];
+            if (cv->config.quoting == QUOTE_NONNUMERIC)
+                numeric = csv_numeric(data);
+            convert_cell(cv, data, cv->spans[2*i+1], numeric);
+            cv->spans[2*i] = -1;
+        }
+        Tcl_DStringSetLength(&cv->scratch, 0);
+    }
+    Tcl_DStringAppend(&cv->ds, &cv->config.lineterminator1, 1);
+    if (cv->config.lineterminator2)
+        Tcl_DStringAppend(&cv->ds, &cv->config.lineterminator2, 1);
+    cv->ncells = 0;
+    self->field_index = 0;
+    self->lines++;
+
+done:
+    if (Tcl_DStringLength(&cv->ds) >= cv->config.flushsize) {
+        if (csv_write_flush(cv->ip, cv->chan, &cv->ds, self->lines,
+                            &cv->config) != TCL_OK) {
+            cv->write_error = 1;
+            return CSV_CORE_ERROR;
+        }
+    }
+    if (self->line_limit > 0 &&
+        self->lines == self->limit_start + (Tcl_Size) self->line_limit)
+        return CSV_CORE_PAUSE;
+    return CSV_CORE_OK;
+}
+
+/*
+ * Implements csv_convert. Reads CSV from the input channel and writes it
+ * to the output channel in the dialect given by the write options. Only
+ * the current record and up to the flush size of output are held in
+ * memory.
+ */
+int csv_convert_cmd(ClientData clientdata, Tcl_Interp *ip,
+                    int objc, Tcl_Obj *const objv[])
+{
+    struct csv_convert cv;
+    parser_t *parser;
+    Tcl_Size i;
+    int mode, nrows, res;
+
+    /* Read options come in pairs so INCHANNEL is the first non-option */
+    for (i = 1; i < objc-1; i += 2) {
+        if (Tcl_GetString(objv[i])[0] != '-')
+            break;
+    }
+    if (i >= objc-1) {
+        Tcl_WrongNumArgs(ip, 1, objv, "?readoptions? INCHANNEL ?writeoptions? OUTCHANNEL");
+        return TCL_ERROR;
+    }
+
+    cv.chan = Tcl_GetChannel(ip, Tcl_GetString(objv[objc-1]), &mode);
+    if (cv.chan == NULL)
+        return TCL_ERROR;
+    if (!(mode & TCL_WRITABLE)) {
+        Tcl_SetResult(ip, "Channel is not open for writing.", TCL_STATIC);
+        return TCL_ERROR;
+    }
+    csv_write_config_init(&cv.config);
+    if (csv_write_config_parse(ip, (int) (objc-2-i), objv+i+1, &cv.config)
+        != TCL_OK ||
+        csv_write_config_finalize(ip, &cv.config) != TCL_OK)
         return TCL_ERROR;
 
+    parser = parser_create(ip, (int) i, objv+1, &nrows);
+    if (parser == NULL) {
+        csv_deflate_end(&cv.config);
+        return TCL_ERROR;
+    }
+    if (parser->sample_mode != SAMPLE_NONE) {
+        Tcl_SetResult(ip, "Option -sample is not valid in this mode.", TCL_STATIC);
+        parser_free(parser);
+        csv_deflate_end(&cv.config);
+        return TCL_ERROR;
+    }
+    if (parser->stats_var) {
+        Tcl_SetResult(ip, "Option -statsvar is not valid in this mode.", TCL_STATIC);
+        parser_free(parser);
+        csv_deflate_end(&cv.config);
+        return TCL_ERROR;
+    }
+    /* Output is always plain records */
+    if (parser->rows_as_dicts) {
+        Tcl_SetResult(ip, "Option -rows is not valid in this mode.", TCL_STATIC);
+        parser_free(parser);
+        csv_deflate_end(&cv.config);
+        return TCL_ERROR;
+    }
+
+    cv.parser = parser;
+    cv.ip = ip;
+    cv.spans = NULL;
+    cv.ncells = 0;
+    cv.write_error = 0;
+    Tcl_DStringInit(&cv.ds);
+    Tcl_DStringInit(&cv.scratch);
+    parser->core.on_field = convert_field;
+    parser->core.on_record = convert_record;
+    parser->core.ctx = &cv;
+
+    convert_alloc_spans(&cv);
     if (nrows >= 0)
-        res = tokenize_nrows(parser, nrows) == 0 ? TCL_OK : TCL_ERROR;
+        res = tokenize_nrows(parser, nrows);
     else
-        res = tokenize_all_rows(parser) == 0 ? TCL_OK : TCL_ERROR;
-
-    if (res == TCL_OK)
-        Tcl_SetObjResult(ip, parser->rowsObj);
-    else {
+        res = tokenize_all_rows(parser);
+    if (res == 0)
+        res = csv_write_flush(ip, cv.chan, &cv.ds, parser->lines,
+                              &cv.config) == TCL_OK &&
+            csv_write_finish(ip, cv.chan, &cv.config) == TCL_OK ? 0 : -1;
+    else if (! cv.write_error) {
         if (parser->errorObj)
             Tcl_SetObjResult(ip, parser->errorObj);
         else
             Tcl_SetResult(ip, "Error parsing CSV.", TCL_STATIC);
     }
 
+    if (cv.spans)
+        ckfree(cv.spans);
+    Tcl_DStringFree(&cv.ds);
+    Tcl_DStringFree(&cv.scratch);
+    csv_deflate_end(&cv.config);
     parser_free(parser);
-    return res;
+    return res == 0 ? TCL_OK : TCL_ERROR;
 }
 
-struct csv_write_config {
-    char delimiter;      /* Delimiter character */
-    char lineterminator1; /* Character to use as line terminator */
-    char lineterminator2; /* Character to use as line terminator */
-    char escapechar;     /* `\0` or character to use as escape char */
-    char quotechar;      /* `\0` or character to use for quoting */
-    char quoting;        /* QUOTE_MINIMAL etc. that controls level of quoting */
-    char doublequote;    /* Whether quote characters in data should be doubled */
-    char specials[6];    /* Used for search for special characters */
+/*
+ * State for csv_spans_parse. Passed as the context to the tokenizer
+ * callbacks in place of the parser so fields are appended to the native
+ * buffers without creating Tcl_Obj's for them.
+ */
+struct csv_spans_state {
+    parser_t *parser;
+    csv_spans_t *spans;
+    Tcl_DString scratch;        /* Projected fields of the current record */
+    Tcl_Size *pending;          /* Offset and length in scratch of each
+                                   projected column. Offset -1 if missing */
+    size_t *slot_rows;          /* Row holding each reservoir slot */
 };
 
-static void csv_write_config_init (struct csv_write_config *config)
+/*
+ * Ensures *pp has room for need elements of size elem, doubling the
+ * capacity. Returns -1 if memory could not be allocated, leaving *pp
+ * unchanged.
+ */
+static int spans_reserve(void **pp, size_t *pcapacity, size_t need,
+                         size_t elem)
 {
-    config->delimiter  = ',';
-    config->lineterminator1 = '\n';
-    config->lineterminator2 = '\0';
-    config->escapechar = '\0';
-    config->quotechar  = '"';
-    config->quoting    = QUOTE_MINIMAL;
-    config->doublequote = 1;
-    config->specials[0] = '\0'; /* Filled later */
+    size_t capacity = *pcapacity ? *pcapacity : 64;
+    void *p;
+
+    if (need <= *pcapacity)
+        return 0;
+    while (capacity < need) {
+        if (capacity > ((size_t) -1) / 2 / elem)
+            return -1;
+        capacity *= 2;
+    }
+    p = realloc(*pp, capacity * elem);
+    if (p == NULL)
+        return -1;
+    *pp = p;
+    *pcapacity = capacity;
+    return 0;
 }
 
-/* Return 1 if s is numeric, 0 otherwise. s must be null terminated */
-static int csv_numeric(const char *s)
+/* Appends a cell to the current row. Returns -1 if out of memory. */
+static int spans_add_cell(csv_spans_t *spans, const char *data, size_t len)
 {
-    const char *p = s;
-    double dval;
+    if (spans->len + len < len ||
+        spans_reserve((void **) &spans->data, &spans->data_capacity,
+                      spans->len + len, 1) != 0 ||
+        spans_reserve((void **) &spans->cells, &spans->cells_capacity,
+                      spans->ncells + 2, sizeof(*spans->cells)) != 0)
+        return -1;
+    memcpy(spans->data + spans->len, data, len);
+    spans->len += len;
+    spans->cells[++spans->ncells] = spans->len;
+    return 0;
+}
 
-    /*
-     * TBD - not sure if this is faster than using standard conversion
-     * routines but note that numerics include integers and decimals of
-     * arbitrary length but not hexadecimals.
-     */
+/* Completes the current row. Returns -1 if out of memory. */
+static int spans_end_row(csv_spans_t *spans)
+{
+    if (spans_reserve((void **) &spans->rows, &spans->rows_capacity,
+                      spans->nrows + 2, sizeof(*spans->rows)) != 0)
+        return -1;
+    spans->rows[++spans->nrows] = spans->ncells;
+    return 0;
+}
 
+static int spans_no_memory(struct csv_spans_state *st)
+{
+    set_error(st->parser, Tcl_NewStringObj("Out of memory.", -1));
+    return CSV_CORE_ERROR;
+}
 
-    if (*p == '\0')
-        return 0;               /* empty string */
-    else if (*p == '+' || *p == '-') {
-        if (p[1] == '\0')
-            return 0; /* Plain +/- is not a number */
-        ++p;
-    }
+/*
+ * Allocates the spans for projected columns. Columns given as names are
+ * only known once the header has been read.
+ */
+static int spans_alloc_pending(struct csv_spans_state *st)
+{
+    parser_t *self = st->parser;
+    Tcl_Size i;
 
-    CSV_ASSERT(*p != '\0');
+    if (self->column_slots == NULL || st->pending != NULL)
+        return 0;
+    st->pending = malloc(2 * ((size_t) self->num_columns + 1) *
+                         sizeof(*st->pending));
+    if (st->pending == NULL)
+        return -1;
+    for (i = 0; i < 2 * self->num_columns; ++i)
+        st->pending[i] = -1;
+    return 0;
+}
 
-    while (*p) {
-        if (! isascii(*p) || !isdigit(*p))
-            break;
-        ++p;
+/* Tokenizer callback for the end of each field when collecting spans */
+static int spans_field(void *ctx, const char *data, size_t len)
+{
+    struct csv_spans_state *st = (struct csv_spans_state *) ctx;
+    parser_t *self = st->parser;
+    Tcl_Size slot;
+
+    /* The header is collected as for reads to resolve field names */
+    if (self->header_pending)
+        return parser_field(self, data, len);
+
+    CSV_STATS_INCR(self, fields);
+    if (!self->materialize) {
+        /* Record is not part of the sample */
+    } else if (self->column_slots) {
+        /* Held until the end of the record as columns may be reordered */
+        if ((slot = parser_column_slot(self, self->field_index)) >= 0) {
+            st->pending[2*slot] = Tcl_DStringLength(&st->scratch);
+            st->pending[2*slot+1] = (Tcl_Size) len;
+            Tcl_DStringAppend(&st->scratch, data, (Tcl_Size) len);
+        }
+    } else if (field_selected(self, self->field_index)) {
+        if (spans_add_cell(st->spans, data, len) != 0)
+            return spans_no_memory(st);
     }
 
-    if (*p == '\0')
-        return 1;               /* Integer of arbitrary length */
+    self->field_index += 1;
+    return CSV_CORE_OK;
+}
 
-    /* Check for decimal or arbitrary length */
-    if (*p == '.') {
-        ++p;
-        while (*p) {
-            if (! isascii(*p) || !isdigit(*p))
-                break;
-            ++p;
+/* Tokenizer callback for the end of each record when collecting spans */
+static int spans_record(void *ctx)
+{
+    struct csv_spans_state *st = (struct csv_spans_state *) ctx;
+    parser_t *self = st->parser;
+    csv_spans_t *spans = st->spans;
+    Tcl_Obj **keys;
+    Tcl_Size i, nkeys, len;
+    const char *key;
+    int status;
+
+    if (self->header_pending) {
+        if (parser_set_header(self) != 0)
+            return CSV_CORE_ERROR;
+        /* Header after selection and projection of columns */
+        Tcl_ListObjGetElements(NULL, self->headerObj, &nkeys, &keys);
+        for (i = 0; i < nkeys; ++i) {
+            key = Tcl_GetStringFromObj(keys[i], &len);
+            if (spans_add_cell(spans, key, (size_t) len) != 0)
+                return spans_no_memory(st);
         }
-        if (*p == '\0')
-            return 1;               /* Decimal fraction of arbitrary length */
+        if (spans_end_row(spans) != 0 || spans_alloc_pending(st) != 0)
+            return spans_no_memory(st);
+        self->field_index = 0;
+        sample_next_record(self);
+        return CSV_CORE_OK;
+    }
+
+    if (!self->materialize) {
+        self->sample_seen++;
+        sample_next_record(self);
+        goto next;
+    }
+    if (self->column_slots) {
+        for (i = 0; i < self->num_columns; ++i) {
+            /* Columns missing from the record are empty */
+            if (st->pending[2*i] < 0)
+                status = spans_add_cell(spans, "", 0);
+            else
+                status = spans_add_cell(spans, Tcl_DStringValue(&st->scratch) +
+                                        st->pending[2*i],
+                                        (size_t) st->pending[2*i+1]);
+            if (status != 0)
+                return spans_no_memory(st);
+            st->pending[2*i] = -1;
+        }
+        Tcl_DStringSetLength(&st->scratch, 0);
+    } else if (self->rows_as_dicts) {
+        /* Fields missing at the end of the row are returned as empty */
+        while (spans->ncells - spans->rows[spans->nrows] <
+               (size_t) self->num_header_keys) {
+            if (spans_add_cell(spans, "", 0) != 0)
+                return spans_no_memory(st);
+        }
+    }
+    if (spans_end_row(spans) != 0)
+        return spans_no_memory(st);
+    CSV_STATS_INCR(self, rows);
+
+    if (self->sample_mode == SAMPLE_RESERVOIR) {
+        /* A replaced row is dropped when the sample is collected */
+        st->slot_rows[self->sample_slot] = spans->nrows - 1;
+    }
+    if (self->sample_mode != SAMPLE_NONE) {
+        self->sample_seen++;
+        sample_next_record(self);
     }
 
-    /* Finally check floating point formats */
-    if (Tcl_GetDouble(NULL, s, &dval) == TCL_OK)
-        return 1;
-    else
-        return 0;
+next:
+    CSV_PROBE4(record_end, self, (long) self->lines,
+               (long) self->core.file_lines, (long) self->field_index);
+    self->field_index = 0;
+    self->lines++;
+    if (self->line_limit > 0 &&
+        self->lines == self->limit_start + (Tcl_Size) self->line_limit)
+        return CSV_CORE_PAUSE;
+    return CSV_CORE_OK;
 }
 
-static void csv_format_cell(Tcl_DString *ds, Tcl_Obj *cell, struct csv_write_config *config)
+static int compare_sizes(const void *a, const void *b)
 {
-    char *src, *dst, *p, *end;
-    Tcl_Size slen, dlen;
-    char lineterminator1, lineterminator2, delimiter, quotechar, escapechar;
-    int need_quotes = 0; /* Init just to keep gcc happy */
-
-    src = Tcl_GetStringFromObj(cell, &slen);
-    end = src + slen;
-    dlen = Tcl_DStringLength(ds);
-
-    /*
-     * We do not want to keep checking for destination space so make sure
-     * the DString has enough space to begin with. The max length would be
-     * length of source string plus possibly two bytes for leading and trailing
-     * quotes plus either an escape or doubled quote for each special character
-     * which in worst case is entire source string.
-     */
-    Tcl_DStringSetLength(ds, dlen + 1 + slen + slen + 1);
-
-    /* Get pointer to string AFTER above since DString might be reallocated */
-    dst = Tcl_DStringValue(ds);
-    dst += dlen;
+    size_t sa = *(const size_t *) a;
+    size_t sb = *(const size_t *) b;
+    return sa < sb ? -1 : (sa > sb);
+}
 
-    /* Get the location of the first special character in source, if any */
-    p = strpbrk(src, config->specials);
+/*
+ * Keeps only the header and the rows in the reservoir. Rows are appended
+ * in input order so sorting the row numbers also orders the sample and
+ * the rows can be moved down in place.
+ */
+static void spans_collect_sample(struct csv_spans_state *st)
+{
+    parser_t *self = st->parser;
+    csv_spans_t *spans = st->spans;
+    size_t i, c, n, row, first, start, ncells, nbytes, cell_base, byte_base;
+
+    n = (size_t) (self->sample_seen < self->sample_size ?
+                  self->sample_seen : self->sample_size);
+    qsort(st->slot_rows, n, sizeof(*st->slot_rows), compare_sizes);
+    cell_base = spans->rows[1];
+    byte_base = spans->cells[cell_base];
+    for (i = 0; i < n; ++i) {
+        row = st->slot_rows[i];
+        first = spans->rows[row];
+        ncells = spans->rows[row+1] - first;
+        start = spans->cells[first];
+        nbytes = spans->cells[first + ncells] - start;
+        memmove(spans->data + byte_base, spans->data + start, nbytes);
+        for (c = 1; c <= ncells; ++c)
+            spans->cells[cell_base + c] = byte_base +
+                spans->cells[first + c] - start;
+        cell_base += ncells;
+        byte_base += nbytes;
+        spans->rows[i+2] = cell_base;
+    }
+    spans->nrows = n + 1;
+    spans->ncells = cell_base;
+    spans->len = byte_base;
+    self->sample_seen = 0;
+}
 
-    /* See if we need to quote */
-    switch (config->quoting) {
-    case QUOTE_NONE:
-        need_quotes = 0;        /* Never quote */
-        CSV_ASSERT(config->escapechar);
-        break;
-    case QUOTE_MINIMAL:
-        need_quotes = (p != NULL); /* Quote if special chars present */
-        break;
-    case QUOTE_NONNUMERIC:
-        /* Need quotes unless strictly digits or special chars */
-        if (p != NULL || ! csv_numeric(src))
-            need_quotes = 1;
-        else
-            need_quotes = 0;
-        break;
-    case QUOTE_ALL:
-        need_quotes = 1;
-        break;
+/*
+ * Parses up to nrows records, or all if negative, from the parser's
+ * channel into spans, which should be zero initialized. Returns 0 on
+ * success. On error, returns -1 with the message in the parser's errorObj
+ * and spans released.
+ */
+int csv_spans_parse(parser_t *parser, int nrows, csv_spans_t *spans)
+{
+    struct csv_spans_state st;
+    int res = -1;
+
+    st.parser = parser;
+    st.spans = spans;
+    st.pending = NULL;
+    st.slot_rows = NULL;
+    Tcl_DStringInit(&st.scratch);
+
+    if (spans_reserve((void **) &spans->rows, &spans->rows_capacity, 1,
+                      sizeof(*spans->rows)) != 0 ||
+        spans_reserve((void **) &spans->cells, &spans->cells_capacity, 1,
+                      sizeof(*spans->cells)) != 0 ||
+        spans_alloc_pending(&st) != 0)
+        goto no_memory;
+    spans->rows[0] = 0;
+    spans->cells[0] = 0;
+    /* Row 0 is the header, empty if there is none */
+    if (!parser->header_pending && spans_end_row(spans) != 0)
+        goto no_memory;
+    if (parser->sample_mode == SAMPLE_RESERVOIR) {
+        st.slot_rows = malloc((size_t) parser->sample_size *
+                              sizeof(*st.slot_rows));
+        if (st.slot_rows == NULL)
+            goto no_memory;
     }
 
-    lineterminator1 = config->lineterminator1;
-    lineterminator2 = config->lineterminator2;
-    delimiter      = config->delimiter;
-    quotechar      = config->quotechar;
-    escapechar     = config->escapechar;
+    parser->core.on_field = spans_field;
+    parser->core.on_record = spans_record;
+    parser->core.ctx = &st;
+    if (nrows >= 0)
+        res = tokenize_nrows(parser, nrows);
+    else
+        res = tokenize_all_rows(parser);
+    parser->core.on_field = parser_field;
+    parser->core.on_record = parser_record;
+    parser->core.ctx = parser;
+
+    if (res == 0 && spans->nrows == 0 && spans_end_row(spans) != 0)
+        goto no_memory;
+    if (res == 0 && st.slot_rows)
+        spans_collect_sample(&st);
+    goto vamoose;
+
+no_memory:
+    set_error(parser, Tcl_NewStringObj("Out of memory.", -1));
+    res = -1;
+vamoose:
+    if (res != 0)
+        csv_spans_free(spans);
+    free(st.pending);
+    free(st.slot_rows);
+    Tcl_DStringFree(&st.scratch);
+    return res;
+}
 
-    if (need_quotes)
-        *dst++ = quotechar;
+void csv_spans_free(csv_spans_t *spans)
+{
+    free(spans->data);
+    free(spans->cells);
+    free(spans->rows);
+    memset(spans, 0, sizeof(*spans));
+}
 
-    if (p == NULL) {
-        /* No special chars. Just copy everything over */
-        strncpy(dst, src, slen);
-        dst += slen;
-        if (need_quotes)
-            *dst++ = quotechar;
-        p = Tcl_DStringValue(ds);
-        CSV_ASSERT((dst-p) < Tcl_DStringLength(ds)); /* Assert no buf overflo */
-        Tcl_DStringSetLength(ds, (Tcl_Size) (dst - p));
-        return;
+/*
+ * Returns the dialect options for the data in a channel, as a list of
+ * option value pairs for csv_read. Only the first CSV_SNIFF_RECORDS
+ * records are looked at. The channel must be seekable and is returned
+ * to its original position.
+ */
+int csv_sniff_cmd(ClientData clientdata, Tcl_Interp *ip,
+                  int objc, Tcl_Obj *const objv[])
+{
+    Tcl_Channel chan;
+    Tcl_WideInt pos;
+    Tcl_Obj *dataObj, *resultObj, **delimObjs;
+    Tcl_Size i, len, ndelims, nchars;
+    char delimiters[256];
+    char *data;
+    int mode, at_eof, res;
+    csv_dialect_t dialect;
+
+    if (objc != 3) {
+        Tcl_WrongNumArgs(ip, 1, objv, "CHANNEL DELIMITERS");
+        return TCL_ERROR;
+    }
+    chan = Tcl_GetChannel(ip, Tcl_GetString(objv[1]), &mode);
+    if (chan == NULL)
+        return TCL_ERROR;
+    if (Tcl_ListObjGetElements(ip, objv[2], &ndelims, &delimObjs) != TCL_OK)
+        return TCL_ERROR;
+    if (ndelims > (Tcl_Size) sizeof(delimiters))
+        goto invalid_delimiters;
+    for (i = 0; i < ndelims; ++i) {
+        const char *s = Tcl_GetStringFromObj(delimObjs[i], &len);
+        if (len != 1 || ! isascii(*s))
+            goto invalid_delimiters;
+        delimiters[i] = *s;
     }
 
-    /* Copy the characters before the first special char */
-    if (p != NULL) {
-        ptrdiff_t len = p - src;
-        strncpy(dst, src, len);
-        dst += len;
-        src += len;
+    pos = Tcl_Tell(chan);
+    if (pos == -1) {
+        Tcl_SetResult(ip, "Channel is not seekable", TCL_STATIC);
+        return TCL_ERROR;
     }
 
-    /* Now copy the remaining characters.  */
-    if (need_quotes) {
-        /*
-         * For quoted strings, we only need to take care of quotes in
-         * content. Depending on settings they are either doubled up
-         * or escaped.
-         */
-        if (config->doublequote) {
-            while (src < end) {
-                if (*src == quotechar)
-                    *dst++ = quotechar; /* Double the quote */
-                *dst++ = *src++;
-            }
-        } else {
-            CSV_ASSERT(escapechar != '\0');
-            while (src < end) {
-                if (*src == quotechar)
-                    *dst++ = escapechar; /* Escape the quote */
-                *dst++ = *src++;
-            }
+    /* Read until the sample has enough lines or the input is exhausted */
+    dataObj = Tcl_NewObj();
+    Tcl_IncrRefCount(dataObj);
+    res = TCL_OK;
+    do {
+        nchars = Tcl_ReadChars(chan, dataObj, CSV_SNIFF_CHUNK, 1);
+        if (nchars < 0) {
+            Tcl_SetObjResult(ip, Tcl_ObjPrintf("Calling read(nbytes) on source failed (Error %d).", Tcl_GetErrno()));
+            res = TCL_ERROR;
+            break;
         }
-
-        *dst++ = quotechar;     /* Terminating quote */
-    } else {
-        /* Special characters but no quoting permitted so use escapes */
-        CSV_ASSERT(escapechar != '\0');
-        while (src < end) {
-            if (*src == quotechar ||
-                *src == lineterminator1 ||
-                *src == lineterminator2 ||
-                *src == escapechar ||
-                *src == delimiter)
-                *dst++ = escapechar;
-            *dst++ = *src++;
+        at_eof = nchars == 0 || Tcl_Eof(chan);
+        data = Tcl_GetStringFromObj(dataObj, &len);
+    } while (! at_eof && len < CSV_SNIFF_MAX_BYTES &&
+             csv_sniff_lines(data, len) <= CSV_SNIFF_RECORDS);
+    Tcl_Seek(chan, pos, SEEK_SET);
+
+    if (res == TCL_OK) {
+        if (csv_sniff(data, len, at_eof, delimiters, ndelims,
+                      &dialect) != 0) {
+            Tcl_SetResult(ip, "Failed to find lines with expected number of fields", TCL_STATIC);
+            res = TCL_ERROR;
         }
     }
+    Tcl_DecrRefCount(dataObj);
+    if (res != TCL_OK)
+        return res;
 
-    p = Tcl_DStringValue(ds);
-    CSV_ASSERT((dst-p) < Tcl_DStringLength(ds)); /* Assert no buf overflo */
-    Tcl_DStringSetLength(ds, (Tcl_Size) (dst - p));
+    resultObj = Tcl_NewListObj(0, NULL);
+#define ADD_OPT(name_, valueObj_)                                       \
+    do {                                                                \
+        Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj(name_, -1)); \
+        Tcl_ListObjAppendElement(NULL, resultObj, valueObj_);           \
+    } while (0)
+    ADD_OPT("-delimiter", Tcl_NewStringObj(&dialect.delimiter, 1));
+    if (dialect.skipleadingspace >= 0)
+        ADD_OPT("-skipleadingspace",
+                Tcl_NewBooleanObj(dialect.skipleadingspace));
+    if (dialect.quotechar)
+        ADD_OPT("-quote", Tcl_NewStringObj(&dialect.quotechar, 1));
+    if (dialect.commentchar)
+        ADD_OPT("-comment", Tcl_NewStringObj(&dialect.commentchar, 1));
+    if (dialect.doublequote)
+        ADD_OPT("-doublequote", Tcl_NewBooleanObj(1));
+    else if (dialect.escapechar)
+        ADD_OPT("-escape", Tcl_NewStringObj(&dialect.escapechar, 1));
+#undef ADD_OPT
+
+    Tcl_SetObjResult(ip, resultObj);
+    return TCL_OK;
+
+invalid_delimiters:
+    Tcl_SetResult(ip, "Delimiters must be single ASCII characters.", TCL_STATIC);
+    return TCL_ERROR;
 }
 
-static int csv_write(Tcl_Interp *ip, Tcl_Channel chan, Tcl_Obj *rowObj, struct csv_write_config *config)
-{
-    Tcl_Obj **rows, **cells;
-    Tcl_Size r, c, nrows, ncells, len;
-    Tcl_DString ds;
+/*
+ * Column type inference for sniff_header. Fields of records with the
+ * same number of fields as the first record are collected in batches.
+ * Each batch is classified in ranges of records, with -threads in
+ * several threads, and the per-range column states are merged.
+ */
 
-    Tcl_DStringInit(&ds);
+/* Records classified at a time. Bounds the memory used for a batch. */
+#define CSV_TYPES_BATCH_ROWS 65536
+/* Ranges smaller than this are not worth a thread */
+#define CSV_TYPES_MIN_THREAD_ROWS 4096
 
-    /*
-     * Quoting is turned off either via quotechar being empty or
-     * quoting policy being QUOTE_NONE.
-     */
-    if (config->quotechar == '\0')
-        config->quoting = QUOTE_NONE;
-    else if (config->quoting == QUOTE_NONE)
-        config->quotechar = '\0';
+/* State for sniff_header, passed to the tokenizer callbacks as ctx */
+struct csv_types {
+    parser_t *parser;
+    Tcl_Obj *firstObj;          /* Fields of the first record */
+    Tcl_Size width;             /* Number of fields in the first record */
+    Tcl_Size nrecords;          /* Records seen including the first */
+    Tcl_Size nfields;           /* Fields seen in the current record */
+    csv_column_t *columns;      /* Merged state of each column */
+    Tcl_DString bytes;          /* Field bytes of the batch */
+    Tcl_Size *spans;            /* Offset and length of each field */
+    Tcl_Size nspans;            /* Fields collected in the batch */
+    Tcl_Size capacity;          /* Number of fields spans can hold */
+    Tcl_Size nrows;             /* Complete records in the batch */
+    int nthreads;
+};
 
-    if (config->escapechar == '\0') {
-        /* No escape char specified. Must allow quoting then for delimiters */
-        if (config->quoting == QUOTE_NONE) {
-            Tcl_SetResult(ip, "An escape character must be specified if quoting is disabled.", TCL_STATIC);
-            return TCL_ERROR;
-        }
-        if (! config->doublequote) {
-            Tcl_SetResult(ip, "An escape character must be specified if doubling of quotes is disabled.", TCL_STATIC);
-            return TCL_ERROR;
-        }
-    }
+/* A range of records classified by one thread */
+struct csv_types_job {
+    const char *bytes;
+    const Tcl_Size *spans;
+    Tcl_Size width;
+    Tcl_Size first, last;       /* Records first to last-1 */
+    csv_column_t *columns;
+    Tcl_ThreadId tid;
+    int started;                /* Whether run in its own thread */
+};
 
-    if (Tcl_ListObjGetElements(ip, rowObj, &nrows, &rows) != TCL_OK)
-        return TCL_ERROR;
+/* Classifies the records of a job. Does not call Tcl. */
+static void csv_types_job_run(struct csv_types_job *job)
+{
+    Tcl_Size r, c;
+    const Tcl_Size *span;
+
+    for (r = job->first; r < job->last; ++r) {
+        span = job->spans + 2 * r * job->width;
+        for (c = 0; c < job->width; ++c, span += 2)
+            csv_column_update(&job->columns[c], job->bytes + span[0],
+                              (size_t) span[1]);
+    }
+}
 
-    /*
-     * Construct list of characters that are special based on settings.
-     * Really used in csv_format_cell but we do it here as to avoid repeating
-     * the initialization within the loop.
-     */
-    r = 0;
-    config->specials[r++] = config->delimiter;
-    if (config->lineterminator1)
-        config->specials[r++] = config->lineterminator1;
-    if (config->lineterminator2)
-        config->specials[r++] = config->lineterminator2;
-    if (config->quotechar)
-        config->specials[r++] = config->quotechar;
-    if (config->escapechar)
-        config->specials[r++] = config->escapechar;
-    config->specials[r] = '\0';
+static Tcl_ThreadCreateType csv_types_worker(ClientData clientData)
+{
+    csv_types_job_run((struct csv_types_job *) clientData);
+    Tcl_ExitThread(0);
+    TCL_THREAD_CREATE_RETURN;
+}
 
-    for (r = 0; r < nrows; ++r) {
-        if (Tcl_ListObjGetElements(ip, rows[r], &ncells, &cells) != TCL_OK)
-            goto error_exit;
+/* Classifies the records in the batch and empties it */
+static void csv_types_flush(struct csv_types *ct)
+{
+    struct csv_types_job *jobs;
+    Tcl_Size c;
+    int j, njobs;
 
-        for (c = 0; c < ncells; ++c) {
-            csv_format_cell(&ds, cells[c], config);
-            /* Append delimiter unless this is the last cell */
-            if (c != (ncells-1))
-                Tcl_DStringAppend(&ds, &config->delimiter, 1);
-        }
-        Tcl_DStringAppend(&ds, &config->lineterminator1, 1);
-        if (config->lineterminator2)
-            Tcl_DStringAppend(&ds, &config->lineterminator2, 1);
-        /* Minimize number of I/O but at same time, keep memory reasonable */
-        len = Tcl_DStringLength(&ds);
-        if (len > 10000) {
-            if (Tcl_WriteChars(chan, Tcl_DStringValue(&ds), len) < 0)
-                goto io_error;
-            Tcl_DStringSetLength(&ds, 0);
+    if (ct->nrows == 0)
+        return;
+    njobs = (int) (ct->nrows / CSV_TYPES_MIN_THREAD_ROWS);
+    if (njobs > ct->nthreads)
+        njobs = ct->nthreads;
+    if (njobs < 1)
+        njobs = 1;
+
+    /* The first range is classified directly into the merged state */
+    jobs = ckalloc(njobs * sizeof(*jobs));
+    for (j = 0; j < njobs; ++j) {
+        jobs[j].bytes = Tcl_DStringValue(&ct->bytes);
+        jobs[j].spans = ct->spans;
+        jobs[j].width = ct->width;
+        jobs[j].first = (ct->nrows * j) / njobs;
+        jobs[j].last = (ct->nrows * (j + 1)) / njobs;
+        if (j == 0) {
+            jobs[j].columns = ct->columns;
+        } else {
+            jobs[j].columns = ckalloc(ct->width * sizeof(csv_column_t));
+            for (c = 0; c < ct->width; ++c)
+                csv_column_init(&jobs[j].columns[c]);
         }
+        jobs[j].started = j > 0 &&
+            Tcl_CreateThread(&jobs[j].tid, csv_types_worker, &jobs[j],
+                             TCL_THREAD_STACK_DEFAULT,
+                             TCL_THREAD_JOINABLE) == TCL_OK;
+    }
+    /* Ranges for which threads could not be started are done here */
+    for (j = 0; j < njobs; ++j) {
+        if (! jobs[j].started)
+            csv_types_job_run(&jobs[j]);
     }
+    for (j = 1; j < njobs; ++j) {
+        int code;
+        if (jobs[j].started)
+            Tcl_JoinThread(jobs[j].tid, &code);
+        for (c = 0; c < ct->width; ++c)
+            csv_column_merge(&ct->columns[c], &jobs[j].columns[c]);
+        ckfree(jobs[j].columns);
+    }
+    ckfree(jobs);
+
+    Tcl_DStringSetLength(&ct->bytes, 0);
+    ct->nspans = 0;
+    ct->nrows = 0;
+}
 
-    /* Write any remaining bytes */
-    len = Tcl_DStringLength(&ds);
-    if (len > 0) {
-        if (Tcl_WriteChars(chan, Tcl_DStringValue(&ds), len) < 0)
-            goto io_error;
+/* Tokenizer callback for the end of each field for sniff_header */
+static int types_field(void *ctx, const char *data, size_t len)
+{
+    struct csv_types *ct = (struct csv_types *) ctx;
+    parser_t *self = ct->parser;
+
+    if (self->header_pending)
+        return parser_field(self, data, len);
+
+    if (field_selected(self, self->field_index)) {
+        if (ct->nrecords == 0) {
+            Tcl_ListObjAppendElement(NULL, ct->firstObj,
+                                     Tcl_NewStringObj(data, (Tcl_Size) len));
+        } else if (ct->nfields < ct->width) {
+            /* Fields past the width are not needed as the record is skipped */
+            if (ct->nspans == ct->capacity) {
+                Tcl_Size *spans;
+                size_t capacity = ct->capacity ? 2 * (size_t) ct->capacity
+                    : 1024;
+                spans = capacity > TCL_SIZE_MAX ||
+                    capacity > SIZE_MAX / (2 * sizeof(Tcl_Size)) ? NULL :
+                    realloc(ct->spans, 2 * capacity * sizeof(Tcl_Size));
+                if (spans == NULL) {
+                    set_error(self, Tcl_NewStringObj("Out of memory.", -1));
+                    return CSV_CORE_ERROR;
+                }
+                ct->spans = spans;
+                ct->capacity = (Tcl_Size) capacity;
+            }
+            ct->spans[2*ct->nspans] = Tcl_DStringLength(&ct->bytes);
+            ct->spans[2*ct->nspans+1] = (Tcl_Size) len;
+            ct->nspans++;
+            Tcl_DStringAppend(&ct->bytes, data, (Tcl_Size) len);
+        }
+        ct->nfields++;
     }
-    Tcl_DStringFree(&ds);
+    self->field_index += 1;
+    return CSV_CORE_OK;
+}
 
-    return TCL_OK;
+/* Tokenizer callback for the end of each record for sniff_header */
+static int types_record(void *ctx)
+{
+    struct csv_types *ct = (struct csv_types *) ctx;
+    parser_t *self = ct->parser;
+    Tcl_Size c;
+
+    if (self->header_pending) {
+        if (parser_set_header(self) != 0)
+            return CSV_CORE_ERROR;
+        self->field_index = 0;
+        return CSV_CORE_OK;
+    }
 
-io_error: /* ds must have been initialized */
-    Tcl_SetResult(ip, "Error writing to channel.", TCL_STATIC);
+    if (ct->nrecords == 0) {
+        Tcl_ListObjLength(NULL, ct->firstObj, &ct->width);
+        ct->columns = ckalloc((ct->width + 1) * sizeof(csv_column_t));
+        for (c = 0; c < ct->width; ++c)
+            csv_column_init(&ct->columns[c]);
+    } else if (ct->nfields == ct->width) {
+        if (++ct->nrows == CSV_TYPES_BATCH_ROWS)
+            csv_types_flush(ct);
+    } else {
+        /* Records with a different number of fields are ignored */
+        ct->nspans = ct->nrows * ct->width;
+        Tcl_DStringSetLength(&ct->bytes, ct->nspans ?
+                             ct->spans[2*ct->nspans-2] +
+                             ct->spans[2*ct->nspans-1] : 0);
+    }
+    ct->nrecords++;
+    ct->nfields = 0;
+    self->field_index = 0;
+    self->lines++;
 
-error_exit: /* ds must have been initialized */
-    Tcl_DStringFree(&ds);
-    return TCL_ERROR;
+    if (self->line_limit > 0 &&
+        self->lines == self->limit_start + (Tcl_Size) self->line_limit)
+        return CSV_CORE_PAUSE;
+    return CSV_CORE_OK;
 }
 
-
-int csv_write_cmd(ClientData clientdata, Tcl_Interp *ip,
-                  int objc, Tcl_Obj *const objv[])
+/*
+ * Guesses the type of each column and whether the first record is a
+ * header. Returns a list containing the list of column types and, if
+ * there is a header, the list of header fields. -nrows gives the number
+ * of records to look at, all if negative, and -threads the number of
+ * threads to classify them with. Other options are as for csv_read.
+ */
+int csv_sniff_header_cmd(ClientData clientdata, Tcl_Interp *ip,
+                         int objc, Tcl_Obj *const objv[])
 {
-    int i, mode, ival;
-    static const char *switches[] = {
-        "-delimiter", "-doublequote", "-escape",
-        "-quote", "-quoting", "-terminator",
-        NULL
+    static const char *type_names[] = {
+        "string", "integer", "real", "boolean", "date", "string"
     };
-    enum switches_e {
-        CSV_DELIMITER, CSV_DOUBLEQUOTE, CSV_ESCAPE,
-        CSV_QUOTE, CSV_QUOTING, CSV_TERMINATOR,
-    };
-    struct csv_write_config config;
-    Tcl_Channel chan;
+    struct csv_types ct;
+    parser_t *parser;
+    Tcl_Obj *optsObj, **opts, **fields, *typesObj, *resultObj;
+    Tcl_WideInt pos;
+    Tcl_Size i, nopts, len;
+    int nrows = 100, res, probably_header;
 
-    if (objc < 3) {
-        Tcl_WrongNumArgs(ip, 1, objv, "?options? CHANNEL ROWS");
+    if (objc < 2) {
+        Tcl_WrongNumArgs(ip, 1, objv, "?options? CHANNEL");
         return TCL_ERROR;
     }
-    chan = Tcl_GetChannel(ip, Tcl_GetString(objv[objc-2]), &mode);
-    if (chan == NULL)
+
+    ct.nthreads = 1;
+    optsObj = Tcl_NewListObj(0, NULL);
+    Tcl_IncrRefCount(optsObj);
+    for (i = 1; i < objc - 1; i += 2) {
+        const char *opt = Tcl_GetString(objv[i]);
+        if ((i+1) < objc - 1) {
+            if (!strcmp(opt, "-nrows")) {
+                if (Tcl_GetIntFromObj(NULL, objv[i+1], &nrows) != TCL_OK)
+                    goto invalid_option_value;
+                continue;
+            }
+            if (!strcmp(opt, "-threads")) {
+                if (Tcl_GetIntFromObj(NULL, objv[i+1], &ct.nthreads)
+                    != TCL_OK ||
+                    ct.nthreads <= 0 || ct.nthreads > 256)
+                    goto invalid_option_value;
+                continue;
+            }
+        }
+        Tcl_ListObjAppendElement(NULL, optsObj, objv[i]);
+        if ((i+1) < objc - 1)
+            Tcl_ListObjAppendElement(NULL, optsObj, objv[i+1]);
+    }
+    Tcl_ListObjAppendElement(NULL, optsObj, objv[objc-1]);
+    Tcl_ListObjGetElements(NULL, optsObj, &nopts, &opts);
+    parser = parser_create(ip, (int) nopts, opts, NULL);
+    Tcl_DecrRefCount(optsObj);
+    if (parser == NULL)
         return TCL_ERROR;
-    if (!(mode & TCL_WRITABLE)) {
-        Tcl_SetResult(ip, "Channel is not open for writing.", TCL_STATIC);
+    if (parser->column_slots || parser->column_names) {
+        Tcl_SetResult(ip, "Option -columns is not valid in this mode.", TCL_STATIC);
+        parser_free(parser);
         return TCL_ERROR;
     }
 
-    csv_write_config_init(&config);
-    for (i = 1; i < objc-2; i += 2) {
-        int opt;
-        Tcl_Size len;
-        char *s;
-	if (Tcl_GetIndexFromObj(ip, objv[i], switches, "option", 0, &opt)
-            != TCL_OK)
-            return TCL_ERROR;
+    pos = Tcl_Tell(parser->chan);
+    if (pos == -1) {
+        Tcl_SetResult(ip, "Channel is not seekable", TCL_STATIC);
+        parser_free(parser);
+        return TCL_ERROR;
+    }
 
-        if ((i+1) >= (objc-2)) {
-            Tcl_SetResult(ip, "Missing value for option.", TCL_STATIC);
-            return TCL_ERROR;
-        }
-        if (opt != CSV_DOUBLEQUOTE) {
-            s = Tcl_GetStringFromObj(objv[i+1], &len);
-            if (len > 0) {
-                if ((! isascii(*s)) ||
-                    (len > 1 && ! isascii(s[1]))) {
-                    Tcl_AppendResult(ip, "Only ASCII characters permitted for option ", Tcl_GetString(objv[i]), ".", NULL);
-                    return TCL_ERROR;
-                }
-            }
-        }
-        switch ((enum switches_e) opt) {
-        case CSV_DELIMITER:
-            if (len != 1)
-                goto invalid_option_value;
-            config.delimiter = *s;
-            break;
-        case CSV_ESCAPE:
-            if (len > 1)
-                goto invalid_option_value;
-            config.escapechar = *s; /* \0 -> no escape char */
-            break;
-        case CSV_QUOTE:
-            if (len > 1)
-                goto invalid_option_value;
-            config.quotechar = *s;
+    ct.parser = parser;
+    ct.firstObj = Tcl_NewListObj(0, NULL);
+    Tcl_IncrRefCount(ct.firstObj);
+    ct.width = 0;
+    ct.nrecords = 0;
+    ct.nfields = 0;
+    ct.columns = NULL;
+    Tcl_DStringInit(&ct.bytes);
+    ct.spans = NULL;
+    ct.nspans = 0;
+    ct.capacity = 0;
+    ct.nrows = 0;
+    parser->core.on_field = types_field;
+    parser->core.on_record = types_record;
+    parser->core.ctx = &ct;
+
+    if (nrows >= 0)
+        res = tokenize_nrows(parser, nrows);
+    else
+        res = tokenize_all_rows(parser);
+    if (res == 0)
+        csv_types_flush(&ct);
+    Tcl_Seek(parser->chan, pos, SEEK_SET);
+
+    if (res != 0) {
+        if (parser->errorObj)
+            Tcl_SetObjResult(ip, parser->errorObj);
+        else
+            Tcl_SetResult(ip, "Error parsing CSV.", TCL_STATIC);
+        res = TCL_ERROR;
+        goto vamoose;
+    }
+    if (ct.nrecords < 2) {
+        Tcl_SetResult(ip, "Insufficient rows in CSV data to sniff headers.", TCL_STATIC);
+        res = TCL_ERROR;
+        goto vamoose;
+    }
+
+    /*
+     * If any column was found to be of a type other than string but the
+     * field in the first record is not of that type, the first record
+     * is assumed to be a header. In addition, for columns of fixed width,
+     * a first field of a different width is a vote for a header and one
+     * of the same width a vote against.
+     */
+    probably_header = 0;
+    Tcl_ListObjGetElements(NULL, ct.firstObj, &len, &fields);
+    for (i = 0; i < ct.width; ++i) {
+        csv_column_t *col = &ct.columns[i];
+        const char *s = Tcl_GetStringFromObj(fields[i], &len);
+        if (! csv_value_is(col->type, s, (size_t) len)) {
+            probably_header = 1;
             break;
-        case CSV_QUOTING:
-            if (!strcmp(s, "all"))
-                config.quoting = QUOTE_ALL;
-            else if (!strcmp(s, "minimal"))
-                config.quoting = QUOTE_MINIMAL;
-            else if (!strcmp(s, "nonnumeric"))
-                config.quoting = QUOTE_NONNUMERIC;
-            else if (!strcmp(s, "none"))
-                config.quoting = QUOTE_NONE;
+        }
+        if (col->length >= 0) {
+            if (col->length == (int64_t) Tcl_GetCharLength(fields[i]))
+                probably_header -= 1;
             else
-                goto invalid_option_value;
-            break;
-        case CSV_TERMINATOR:
-            if (len != 1 && len != 2)
-                goto invalid_option_value;
-            config.lineterminator1 = *s;
-            config.lineterminator2 = s[1]; /* May be \0 */
-            break;
-        case CSV_DOUBLEQUOTE:
-            if (Tcl_GetBooleanFromObj(ip, objv[i+1], &ival) != TCL_OK)
-                goto invalid_option_value;
-            config.doublequote = ival;
-            break;
+                probably_header += 1;
         }
     }
 
-    return csv_write(ip, chan, objv[objc-1], &config);
+    typesObj = Tcl_NewListObj(ct.width, NULL);
+    for (i = 0; i < ct.width; ++i) {
+        Tcl_ListObjAppendElement(NULL, typesObj,
+                                 Tcl_NewStringObj(type_names[ct.columns[i].type], -1));
+    }
+    resultObj = Tcl_NewListObj(1, &typesObj);
+    if (probably_header > 0)
+        Tcl_ListObjAppendElement(NULL, resultObj, ct.firstObj);
+    Tcl_SetObjResult(ip, resultObj);
+    res = TCL_OK;
+
+vamoose:
+    Tcl_DecrRefCount(ct.firstObj);
+    Tcl_DStringFree(&ct.bytes);
+    if (ct.spans)
+        free(ct.spans);
+    if (ct.columns)
+        ckfree(ct.columns);
+    parser_free(parser);
+    return res;
 
 invalid_option_value: /* objv[i] should be the invalid option */
+    Tcl_DecrRefCount(optsObj);
     Tcl_SetObjResult(ip, Tcl_ObjPrintf("Invalid value for option %s.", Tcl_GetString(objv[i])));
     return TCL_ERROR;
 }
@@ -20,6 +20,7 @@ BSD
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <limits.h>
 
 #if defined(_MSC_VER)
 #include "ms_stdint.h"
@@ -28,7 +29,7 @@ BSD
 #endif
 
 #include "tcl.h"
-#include "khash.h"
+#include "csvcore.h"
 
 #if TCL_MAJOR_VERSION > 8 || (TCL_MAJOR_VERSION == 8 && TCL_MINOR_VERSION > 6)
 #define USE_TCL87_API 1
@@ -40,6 +41,9 @@ typedef int Tcl_Size;
 #define TCL_SIZE_MODIFIER ""
 #define Tcl_GetSizeIntFromObj Tcl_GetIntFromObj
 #endif
+#ifndef TCL_SIZE_MAX
+#define TCL_SIZE_MAX INT_MAX
+#endif
 
 #if CSV_ENABLE_ASSERT
 #  if CSV_ENABLE_ASSERT == 1
@@ -72,36 +76,144 @@ typedef int Tcl_Size;
 #define TRACE(X)
 #endif
 
+/*
+ * Static tracepoints for perf, bpftrace, SystemTap etc. When sys/sdt.h is
+ * available these compile to a nop instruction plus an ELF note and cost
+ * nothing unless a tracer is attached. Otherwise, or if CSV_DISABLE_USDT
+ * is defined, they compile to nothing. The provider name is tclcsv.
+ */
+#if !defined(CSV_DISABLE_USDT) && defined(__linux__) && defined(__has_include)
+# if __has_include(<sys/sdt.h>)
+#  include <sys/sdt.h>
+#  define CSV_HAVE_USDT 1
+# endif
+#endif
+
+#ifdef CSV_HAVE_USDT
+# define CSV_PROBE2(name_, a1_, a2_) DTRACE_PROBE2(tclcsv, name_, a1_, a2_)
+# define CSV_PROBE3(name_, a1_, a2_, a3_) \
+    DTRACE_PROBE3(tclcsv, name_, a1_, a2_, a3_)
+# define CSV_PROBE4(name_, a1_, a2_, a3_, a4_) \
+    DTRACE_PROBE4(tclcsv, name_, a1_, a2_, a3_, a4_)
+#else
+# define CSV_PROBE2(name_, a1_, a2_) ((void) 0)
+# define CSV_PROBE3(name_, a1_, a2_, a3_) ((void) 0)
+# define CSV_PROBE4(name_, a1_, a2_, a3_, a4_) ((void) 0)
+#endif
 
-#define PARSER_OUT_OF_MEMORY -1
 
+#define PARSER_OUT_OF_MEMORY -1
 
 /*
- *  XXX Might want to couple count_rows() with read_rows() to avoid duplication
- *      of some file I/O.
+ * Parser statistics. Counting and timing are compiled out if
+ * CSV_ENABLE_STATS is defined as 0.
  */
+#ifndef CSV_ENABLE_STATS
+#define CSV_ENABLE_STATS 1
+#endif
+
+#if CSV_ENABLE_STATS
+# define CSV_STATS_INCR(self_, field_) ((self_)->stats.field_ += 1)
+# define CSV_STATS_ADD(self_, field_, n_) ((self_)->stats.field_ += (n_))
+# define CSV_STATS_MAX(self_, field_, n_)                               \
+    do {                                                                \
+        if ((n_) > (self_)->stats.field_)                               \
+            (self_)->stats.field_ = (n_);                               \
+    } while (0)
+# define CSV_STATS_CLOCK(var_) Tcl_WideInt var_ = csv_clock_ns()
+# define CSV_STATS_ELAPSED(self_, field_, start_) \
+    ((self_)->stats.field_ += csv_clock_ns() - (start_))
+#else
+# define CSV_STATS_INCR(self_, field_) ((void) 0)
+# define CSV_STATS_ADD(self_, field_, n_) ((void) 0)
+# define CSV_STATS_MAX(self_, field_, n_) ((void) 0)
+# define CSV_STATS_CLOCK(var_) ((void) 0)
+# define CSV_STATS_ELAPSED(self_, field_, start_) ((void) 0)
+#endif
+
+typedef struct parser_stats_t {
+    Tcl_WideInt bytes_read;     /* Bytes (after encoding conversion) read */
+    Tcl_WideInt refills;        /* Calls to read from the channel */
+    Tcl_WideInt refill_ns;      /* Time spent reading and converting */
+    Tcl_WideInt tokenize_ns;    /* Time spent in the state machines */
+    Tcl_WideInt fields;         /* Fields tokenized */
+    Tcl_WideInt rows;           /* Rows built */
+    Tcl_WideInt objects;        /* Tcl_Obj's allocated for fields and rows */
+    Tcl_WideInt max_field_length; /* Bytes in longest returned field */
+} parser_stats_t;
+
+/* Bit sets used for field selection */
+typedef unsigned int field_set_t;
+#define FIELD_SET_WORD_BITS (8 * sizeof(field_set_t))
+#define FIELD_SET_NWORDS(nbits_) \
+    (((nbits_) + FIELD_SET_WORD_BITS - 1) / FIELD_SET_WORD_BITS)
+#define FIELD_SET_TEST(set_, nbits_, ix_)                               \
+    ((size_t) (ix_) < (nbits_) &&                                       \
+     (((set_)[(ix_) / FIELD_SET_WORD_BITS] >> ((ix_) % FIELD_SET_WORD_BITS)) & 1))
+#define FIELD_SET_ADD(set_, ix_) \
+    ((set_)[(ix_) / FIELD_SET_WORD_BITS] |= 1u << ((ix_) % FIELD_SET_WORD_BITS))
+
+/* Output slot of a -columns field beyond the direct lookup table */
+typedef struct column_slot_t {
+    Tcl_Size index;             /* Field index in the input */
+    Tcl_Size slot;              /* Position in the returned row */
+} column_slot_t;
 
-typedef enum {
-    START_RECORD,
-    START_FIELD,
-    ESCAPED_CHAR,
-    IN_FIELD,
-    IN_QUOTED_FIELD,
-    ESCAPE_IN_QUOTED_FIELD,
-    QUOTE_IN_QUOTED_FIELD,
-    EAT_CRNL,
-    EAT_CRNL_NOP,
-    EAT_WHITESPACE,
-    EAT_COMMENT,
-    EAT_LINE_COMMENT,
-    WHITESPACE_LINE,
-    SKIP_LINE,
-    FINISHED
-} ParserState;
 
 typedef enum {
-    QUOTE_MINIMAL, QUOTE_ALL, QUOTE_NONNUMERIC, QUOTE_NONE
-} QuoteStyle;
+    SAMPLE_NONE, SAMPLE_EVERY, SAMPLE_RESERVOIR
+} SampleMode;
+
+/* Dialect options specified explicitly and therefore not sniffed */
+#define SNIFF_FIXED_DELIMITER        0x01
+#define SNIFF_FIXED_QUOTE            0x02
+#define SNIFF_FIXED_ESCAPE           0x04
+#define SNIFF_FIXED_COMMENT          0x08
+#define SNIFF_FIXED_DOUBLEQUOTE      0x10
+#define SNIFF_FIXED_SKIPLEADINGSPACE 0x20
+
+/* Values of the -compression option */
+enum csv_compression {
+    CSV_COMPRESSION_NONE,
+    CSV_COMPRESSION_GZIP,
+    CSV_COMPRESSION_ZLIB,
+    CSV_COMPRESSION_AUTO        /* Input only, detected from magic bytes */
+};
+
+/*
+ * Compressed input. Bytes are read from the channel bypassing its
+ * encoding and translation, inflated and then decoded with the channel's
+ * encoding into text the tokenizer works on directly.
+ */
+typedef struct csv_inflate_t {
+    enum csv_compression compression; /* As specified */
+    enum csv_compression format;      /* As detected */
+    int detected;               /* Whether format is known */
+    int input_eof;              /* Channel has been read to the end */
+    Tcl_ZlibStream zstream;     /* NULL if the input is not compressed */
+    Tcl_Obj *outObj;            /* Inflated bytes not yet decoded */
+    Tcl_Encoding encoding;      /* Encoding of the channel */
+    Tcl_EncodingState state;
+    int encoding_flags;
+    Tcl_DString text;           /* Decoded data */
+} csv_inflate_t;
+
+/*
+ * Compressed output. Tcl 8.6 ignores a flush request that carries no
+ * data so the last byte of every unflushed write is held back to be put
+ * together with the next flush.
+ */
+typedef struct csv_deflate_t {
+    Tcl_ZlibStream zstream;
+    int nheld;                  /* 1 if held is valid, else 0 */
+    unsigned char held;
+} csv_deflate_t;
+
+/* Slot in the reservoir used for -sample reservoir */
+typedef struct sample_slot_t {
+    Tcl_WideInt record;         /* Index of record in sampled records */
+    Tcl_Obj *rowObj;            /* The row */
+} sample_slot_t;
 
 
 typedef struct parser_t {
@@ -116,41 +228,54 @@ typedef struct parser_t {
     // Tcl_Obj containing the read rows
     Tcl_Obj *rowsObj; // List of built rows
     Tcl_Obj *rowObj;  // The row being built
-    Tcl_Obj *fieldObj; // The field being built
 
     Tcl_Size lines;            // Number of (good) lines observed
-    Tcl_Size file_lines;       // Number of file lines observed (including bad or skipped)
 
     /*
      * Caller can specify which fields are to be included / excluded.
      * A field is included if its index appears in included_fields but
      * not in excluded_fields. included_fields and excluded_fields are
-     * boolean (char) arrays indexed by field index.
+     * bit sets indexed by field index (see FIELD_SET_TEST).
      */
-    char *included_fields;      /* If NULL, all included */
-    Tcl_Size  num_included_fields;   /* Size of included_fields */
-    char *excluded_fields;      /* If NULL, no exclusions */
-    Tcl_Size  num_excluded_fields;   /* Size of excluded_fields */
-    Tcl_Size  field_index;           /* Index of current field being parsed */
+    field_set_t *included_fields;      /* If NULL, all included */
+    size_t    num_included_fields;   /* Number of bits in included_fields */
+    field_set_t *excluded_fields;      /* If NULL, no exclusions */
+    size_t    num_excluded_fields;   /* Number of bits in excluded_fields */
+
+    /*
+     * Alternatively, the caller may specify the fields to be returned
+     * and their order with -columns. column_slots maps a field index
+     * in the input to its position in the returned row, or -1 if the
+     * field is not returned. Indices beyond its size are looked up in
+     * column_far, sorted by index, so the table does not grow with the
+     * largest index specified. column_indices is the inverse map. Fields
+     * are collected into row_cells and the row is built once the record
+     * is complete. When rows are returned as dictionaries, row_cells
+     * holds interleaved keys and values.
+     */
+    Tcl_Size *column_slots;      /* If NULL, no projection */
+    Tcl_Size  num_column_slots;  /* Size of column_slots */
+    column_slot_t *column_far;   /* Slots of larger indices, may be NULL */
+    Tcl_Size  num_column_far;    /* Size of column_far */
+    Tcl_Size *column_indices;    /* Field index for each output slot */
+    Tcl_Size  num_columns;       /* Number of output slots */
+    Tcl_Obj **row_cells;         /* Cells of the row being built */
+    Tcl_Obj *column_names;       /* -columns containing names */
 
+    Tcl_Size  field_index;           /* Index of current field being parsed */
 
-    // Tokenizing stuff
-    ParserState state;
-    int doublequote;            /* is " represented by ""? */
-    char delimiter;             /* field separator */
-    int delim_whitespace;       /* delimit by consuming space/tabs instead */
-    char quotechar;             /* quote character */
-    char escapechar;            /* escape character */
-    char lineterminator;
-    int skipinitialspace;       /* ignore spaces following delimiter? */
-    int quoting;                /* style of quoting to write */
 
-    // krufty, hmm =/
-    int numeric_field;
+    /*
+     * Tokenizer, including the dialect and line skipping settings. Fields
+     * and records are received through the parser_field and parser_record
+     * callbacks. The tokenizer pauses once line_limit records (0 for no
+     * limit) have been completed since limit_start.
+     */
+    csv_core_t core;
+    size_t line_limit;
+    Tcl_Size limit_start;
 
-    char commentchar;
     int allow_embedded_newline;
-    int strict;                 /* raise exception on bad CSV */
 
     int expected_fields;
     int error_bad_lines;
@@ -160,22 +285,59 @@ typedef struct parser_t {
     int header_start; // header row start
     int header_end;   // header row end
 
-    void *skipset;
-    int64_t skip_first_N_rows;
+    /*
+     * When header is set, the first record that is not skipped is
+     * collected into headerObj instead of being returned. The
+     * header_keys array holds the header fields that survive field
+     * selection. These are shared as keys by all rows when rows are
+     * returned as dictionaries so each key is allocated only once.
+     * Field selections specified as names are held in include_names /
+     * exclude_names until the header is seen.
+     */
+    int header_pending;         /* Next record is the header */
+    int rows_as_dicts;          /* Return rows as key value lists */
+    Tcl_Obj *headerObj;         /* Header fields (after selection) */
+    Tcl_Obj **header_keys;      /* Elements of headerObj, each ref counted */
+    Tcl_Size num_header_keys;
+    Tcl_Obj *include_names;     /* -includefields containing names */
+    Tcl_Obj *exclude_names;     /* -excludefields containing names */
+
     int skip_footer;
 
+    /*
+     * Row sampling. Records that are not selected are tokenized but
+     * no Tcl_Obj's are created for them. materialize is set if the
+     * record being parsed is to be returned. For reservoir sampling,
+     * selected rows are collected in reservoir and sample_slot is
+     * the slot to be used for the record being parsed.
+     */
+    SampleMode sample_mode;
+    Tcl_WideInt sample_size;    /* N for every, K for reservoir */
+    Tcl_WideInt sample_seen;    /* Number of records seen so far */
+    Tcl_WideInt sample_slot;
+    uint64_t sample_rng;        /* Random number generator state */
+    uint64_t sample_seed;       /* Initial state for each stream */
+    sample_slot_t *reservoir;
+    int materialize;
+
     // error handling
     Tcl_Obj *warnObj;
     Tcl_Obj *errorObj;
 
-    int skip_empty_lines;
+    parser_stats_t stats;
+    Tcl_Obj *stats_var;         /* -statsvar variable name */
 
-    /* 
-     * We want to avoid calling Tcl_AppendBuf for every
-     * char so collect here and call when buffer is full
+    /*
+     * With -sniff, dialect settings that were not explicitly specified
+     * are inferred from the data. The first refill buffers a sample which
+     * is sniffed and then tokenized like any other buffered data so the
+     * channel need not be seekable and nothing is read twice.
      */
-    char field_buf[200];
-    int  field_buf_index;
+    int sniff;                  /* -sniff was specified */
+    int sniff_pending;          /* Sample for the stream not yet sniffed */
+    int sniff_fixed;            /* SNIFF_FIXED_* bits of explicit options */
+
+    csv_inflate_t *inflate;     /* NULL if -compression is none */
 } parser_t;
 
 #ifdef BUILD_tclcsv
@@ -190,12 +352,111 @@ int tokenize_nrows(parser_t *self, size_t nrows);
 
 int tokenize_all_rows(parser_t *self);
 
+void parser_collect_sample(parser_t *self);
+
+/*
+ * Rows parsed into native buffers without creating Tcl_Obj's for the
+ * fields, for data held outside an interpreter. Row 0 is the header after
+ * field selection, empty if there is none. Row r holds cells rows[r] to
+ * rows[r+1]-1 and cell c is the bytes data[cells[c]] to data[cells[c+1]]-1.
+ * Rows returned as dictionaries hold only the values, keyed by the header.
+ */
+typedef struct csv_spans_t {
+    char *data;
+    size_t len;
+    size_t data_capacity;
+    size_t *cells;              /* ncells+1 offsets into data */
+    size_t ncells;
+    size_t cells_capacity;
+    size_t *rows;               /* nrows+1 offsets into cells */
+    size_t nrows;               /* Including the header */
+    size_t rows_capacity;
+} csv_spans_t;
+
+int csv_spans_parse(parser_t *parser, int nrows, csv_spans_t *spans);
+void csv_spans_free(csv_spans_t *spans);
+
+Tcl_WideInt csv_clock_ns(void);
+Tcl_Obj *parser_stats_obj(parser_t *self);
+
 parser_t *parser_create(Tcl_Interp *, int objc, Tcl_Obj *const objv[], int *pnrows);
+parser_t *parser_create_detached(Tcl_Interp *, int objc, Tcl_Obj *const objv[], int *pnrows);
 void parser_free(parser_t *self);
+void parser_reset(parser_t *self, Tcl_Channel chan);
+int parser_sniff(parser_t *self);
+Tcl_Obj *parser_dialect_obj(parser_t *self);
+
+/* How the rows passed to csv_write are laid out */
+enum csv_layout {
+    CSV_LAYOUT_ROWS,            /* List of rows, each a list of cells */
+    CSV_LAYOUT_COLUMNS,         /* List of columns, each a list of cells */
+    CSV_LAYOUT_DICTS            /* List of rows, each a dict */
+};
+
+struct csv_write_config {
+    char delimiter;      /* Delimiter character */
+    char lineterminator1; /* Character to use as line terminator */
+    char lineterminator2; /* Character to use as line terminator */
+    char escapechar;     /* `\0` or character to use as escape char */
+    char quotechar;      /* `\0` or character to use for quoting */
+    char quoting;        /* QUOTE_MINIMAL etc. that controls level of quoting */
+    char doublequote;    /* Whether quote characters in data should be doubled */
+    char specials[5];    /* Special characters, padded with the delimiter */
+    unsigned char special_map[256]; /* Non-zero for special characters */
+    Tcl_Size flushsize;  /* Buffered output size that triggers a write */
+    char binary;         /* Write UTF-8 bytes bypassing channel encoding */
+    char numbers_special; /* Whether formatted numbers may contain specials */
+    char fast_doubles;   /* Use csv_format_double, false if tcl_precision set */
+    char floatformat[8]; /* Validated printf format for doubles or "" */
+    const Tcl_ObjType *int_type;    /* Types formatted from their internal */
+    const Tcl_ObjType *wide_type;   /* representation. wide_type may be NULL */
+    const Tcl_ObjType *double_type;
+    char compression;    /* CSV_COMPRESSION_NONE, _GZIP or _ZLIB */
+    csv_deflate_t *deflate; /* Created by csv_write_config_finalize */
+};
+
+void csv_write_config_init(struct csv_write_config *config);
+int csv_write_config_finalize(Tcl_Interp *ip, struct csv_write_config *config);
+int csv_write_config_parse(Tcl_Interp *ip, int objc, Tcl_Obj *const objv[],
+                           struct csv_write_config *config);
+void csv_format_cell(Tcl_DString *ds, Tcl_Obj *cell, struct csv_write_config *config);
+void csv_format_record(Tcl_DString *ds, Tcl_Size ncells,
+                       Tcl_Obj *const cells[], struct csv_write_config *config);
+int csv_format_row(Tcl_Interp *ip, Tcl_DString *ds, Tcl_Obj *rowObj,
+                   struct csv_write_config *config);
+int csv_write_flush(Tcl_Interp *ip, Tcl_Channel chan, Tcl_DString *ds,
+                    Tcl_Size nrows, const struct csv_write_config *config);
+int csv_write_finish(Tcl_Interp *ip, Tcl_Channel chan,
+                     struct csv_write_config *config);
+
+csv_inflate_t *csv_inflate_new(enum csv_compression compression);
+void csv_inflate_reset(csv_inflate_t *inf);
+void csv_inflate_free(csv_inflate_t *inf);
+Tcl_Size csv_inflate_read(csv_inflate_t *inf, Tcl_Channel chan,
+                          Tcl_Size nbytes, int append, Tcl_Obj **errorObjPtr);
+int csv_deflate_begin(Tcl_Interp *ip, struct csv_write_config *config);
+int csv_deflate_write(Tcl_Interp *ip, Tcl_Channel chan, const char *bytes,
+                      Tcl_Size len, int flush,
+                      const struct csv_write_config *config);
+void csv_deflate_end(struct csv_write_config *config);
 
 int csv_read_cmd(ClientData clientdata, Tcl_Interp *ip,
                  int objc, Tcl_Obj *const objv[]);
 int csv_write_cmd(ClientData clientdata, Tcl_Interp *ip,
                  int objc, Tcl_Obj *const objv[]);
+int csv_format_cmd(ClientData clientdata, Tcl_Interp *ip,
+                   int objc, Tcl_Obj *const objv[]);
+int csv_convert_cmd(ClientData clientdata, Tcl_Interp *ip,
+                    int objc, Tcl_Obj *const objv[]);
+int csv_sniff_cmd(ClientData clientdata, Tcl_Interp *ip,
+                  int objc, Tcl_Obj *const objv[]);
+int csv_sniff_header_cmd(ClientData clientdata, Tcl_Interp *ip,
+                         int objc, Tcl_Obj *const objv[]);
+int csv_parse_cmd(ClientData clientdata, Tcl_Interp *ip,
+                  int objc, Tcl_Obj *const objv[]);
+int csv_read_many_cmd(ClientData clientdata, Tcl_Interp *ip,
+                      int objc, Tcl_Obj *const objv[]);
+int csv_table_cmd(ClientData clientdata, Tcl_Interp *ip,
+                  int objc, Tcl_Obj *const objv[]);
 
 #endif /* _TCLCSV_H */
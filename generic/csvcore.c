@@ -0,0 +1,1125 @@
+/*
+
+  CSV tokenizer core - Heavily adapted for tclcsv
+
+  From:
+  Copyright (c) 2012, Lambda Foundry, Inc., except where noted
+
+  Incorporates components of WarrenWeckesser/textreader, licensed under 3-clause
+  BSD
+   Low-level ascii-file processing from pandas. Combines some elements from
+   Python's built-in csv module and Warren Weckesser's textreader project on
+   GitHub. See Python Software Foundation License and BSD licenses for these.
+
+  Modifications for tclcsv (c) 2016 by Ashok P. Nadkarni. See license.terms.
+
+  This file must not depend on Tcl. See csvcore.h for the interface.
+
+*/
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "csvcore.h"
+#include "khash.h"
+
+KHASH_MAP_INIT_INT64(int64, size_t)
+
+#define CSV_CORE_READ_SIZE 65536
+
+void csv_core_init(csv_core_t *core)
+{
+    memset(core, 0, sizeof(*core));
+    core->delimiter = ',';
+    core->quotechar = '"';
+    core->doublequote = 1;
+    core->quoting = QUOTE_MINIMAL;
+    core->skip_empty_lines = 1;
+    core->skip_first_lines = 0;
+    core->state = START_RECORD;
+}
+
+/*
+ * Prepares for a new input. The dialect, callbacks, lines to be skipped
+ * and buffers are retained.
+ */
+void csv_core_reset(csv_core_t *core)
+{
+    core->state = START_RECORD;
+    core->file_lines = 0;
+    core->field_len = 0;
+    core->field_grows = 0;
+    core->error[0] = '\0';
+}
+
+void csv_core_free(csv_core_t *core)
+{
+    if (core->skipset != NULL) {
+        kh_destroy_int64((kh_int64_t*) core->skipset);
+        core->skipset = NULL;
+    }
+    free(core->field);
+    core->field = NULL;
+    core->field_len = core->field_cap = 0;
+}
+
+/* Marks a line (0-based) to be skipped */
+int csv_core_skip_line(csv_core_t *core, int64_t line)
+{
+    int ret = 0;
+
+    if (core->skipset == NULL) {
+        core->skipset = (void*) kh_init_int64();
+        if (core->skipset == NULL)
+            return CSV_CORE_ERROR;
+    }
+    kh_put_int64((kh_int64_t*) core->skipset, line, &ret);
+    return ret < 0 ? CSV_CORE_ERROR : CSV_CORE_OK;
+}
+
+/*
+ * Skips the first nlines lines of the input. Ignored if lines are also
+ * skipped with csv_core_skip_line.
+ */
+void csv_core_skip_first_lines(csv_core_t *core, int64_t nlines)
+{
+    core->skip_first_lines = nlines > 0 ? nlines : 0;
+}
+
+static void csv_core_set_error(csv_core_t *core, const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(core->error, sizeof(core->error), fmt, args);
+    va_end(args);
+}
+
+static int skip_this_line(csv_core_t *core)
+{
+    if (core->skipset != NULL) {
+        kh_int64_t *set = (kh_int64_t*) core->skipset;
+        return kh_get_int64(set, core->file_lines) != set->n_buckets;
+    }
+    else {
+        return core->file_lines < core->skip_first_lines;
+    }
+}
+
+static int grow_field(csv_core_t *core)
+{
+    size_t cap = core->field_cap ? 2 * core->field_cap : 256;
+    char *field = realloc(core->field, cap);
+    if (field == NULL) {
+        csv_core_set_error(core, "Out of memory.");
+        return CSV_CORE_ERROR;
+    }
+    core->field = field;
+    core->field_cap = cap;
+    core->field_grows++;
+    return CSV_CORE_OK;
+}
+
+static int end_field(csv_core_t *core)
+{
+    int rc = CSV_CORE_OK;
+    if (core->on_field)
+        rc = core->on_field(core->ctx, core->field ? core->field : "",
+                            core->field_len);
+    core->field_len = 0;
+    return rc < 0 ? CSV_CORE_ERROR : CSV_CORE_OK;
+}
+
+static int end_line(csv_core_t *core)
+{
+    int rc = CSV_CORE_OK;
+
+    if (core->state != SKIP_LINE && core->on_record)
+        rc = core->on_record(core->ctx);
+    if (rc >= 0)
+        core->file_lines++;
+    return rc;
+}
+
+/*
+  Tokenization macros and state machine code
+*/
+
+#define PUSH_CHAR(c)                                                    \
+    do {                                                                \
+        if (core->field_len == core->field_cap && grow_field(core) != 0) \
+            goto parsingerror;                                          \
+        core->field[core->field_len++] = c;                             \
+    } while (0)
+
+#define END_FIELD()                             \
+    do {                                        \
+        if (end_field(core) < 0) {              \
+            goto parsingerror;                  \
+        }                                       \
+    } while (0)
+
+#define END_LINE_STATE(STATE)                                           \
+    do {                                                                \
+        int rc_ = end_line(core);                                       \
+        if (rc_ < 0) {                                                  \
+            goto parsingerror;                                          \
+        }                                                               \
+        core->state = STATE;                                            \
+        if (rc_ == CSV_CORE_PAUSE) {                                    \
+            goto paused;                                                \
+        }                                                               \
+    } while (0)
+
+#define END_LINE_AND_FIELD_STATE(STATE)                                 \
+    do {                                                                \
+        int rc_ = end_line(core);                                       \
+        if (rc_ < 0) {                                                  \
+            goto parsingerror;                                          \
+        }                                                               \
+        if (end_field(core) < 0) {                                      \
+            goto parsingerror;                                          \
+        }                                                               \
+        core->state = STATE;                                            \
+        if (rc_ == CSV_CORE_PAUSE) {                                    \
+            goto paused;                                                \
+        }                                                               \
+    } while (0)
+
+#define END_LINE() END_LINE_STATE(START_RECORD)
+
+#define IS_WHITESPACE(c) ((c == ' ' || c == '\t'))
+
+static int tokenize_delimited(csv_core_t *core, const char *data, size_t len,
+                              size_t *consumed)
+{
+    size_t i;
+    char c;
+    const char *buf = data;
+
+    for (i = 0; i < len; ++i)
+    {
+        // Next character in file
+        c = *buf++;
+
+        switch(core->state) {
+
+        case SKIP_LINE:
+            if (c == '\n') {
+                END_LINE();
+            } else if (c == '\r') {
+                core->file_lines++;
+                core->state = EAT_CRNL_NOP;
+            }
+            break;
+
+        case START_RECORD:
+            // start of record
+            if (skip_this_line(core)) {
+                core->state = SKIP_LINE;
+                if (c == '\n') {
+                    END_LINE();
+                }
+                break;
+            }
+            else if (c == '\n') {
+                // \n\r possible?
+                if (core->skip_empty_lines)
+                {
+                    core->file_lines++;
+                }
+                else
+                {
+                    END_LINE();
+                }
+                break;
+            }
+            else if (c == '\r') {
+                if (core->skip_empty_lines)
+                {
+                    core->file_lines++;
+                    core->state = EAT_CRNL_NOP;
+                }
+                else
+                    core->state = EAT_CRNL;
+                break;
+            }
+            else if (c == core->commentchar) {
+                core->state = EAT_LINE_COMMENT;
+                break;
+            }
+            else if (IS_WHITESPACE(c) && c != core->delimiter && core->skip_empty_lines) {
+                core->state = WHITESPACE_LINE;
+                break;
+            }
+
+            /* normal character - handle as START_FIELD */
+            core->state = START_FIELD;
+            /* fallthru */
+
+        case START_FIELD:
+            /* expecting field */
+            if (c == '\n') {
+                END_FIELD();
+                END_LINE();
+            } else if (c == '\r') {
+                END_FIELD();
+                core->state = EAT_CRNL;
+            }
+            else if (c == core->quotechar &&
+                     core->quoting != QUOTE_NONE) {
+                /* start quoted field */
+                core->state = IN_QUOTED_FIELD;
+            }
+            else if (c == core->escapechar) {
+                /* possible escaped character */
+                core->state = ESCAPED_CHAR;
+            }
+            else if (c == ' ' && core->skipinitialspace)
+                /* ignore space at start of field */
+                ;
+            else if (c == core->delimiter) {
+                /* save empty field */
+                END_FIELD();
+            }
+            else if (c == core->commentchar) {
+                END_FIELD();
+                core->state = EAT_COMMENT;
+            }
+            else {
+                /* begin new unquoted field */
+                PUSH_CHAR(c);
+                core->state = IN_FIELD;
+            }
+            break;
+
+        case WHITESPACE_LINE: // check if line is whitespace-only
+            if (c == '\n') {
+                core->file_lines++;
+                core->state = START_RECORD; // ignore empty line
+            }
+            else if (c == '\r') {
+                core->file_lines++;
+                core->state = EAT_CRNL_NOP;
+            }
+            else if (IS_WHITESPACE(c) && c != core->delimiter)
+                ;
+            else { // backtrack
+                /* We have to use i + 1 because buf has been incremented but not i */
+                do {
+                    --buf;
+                    --i;
+                } while (i + 1 > 0 && *buf != '\n');
+
+                if (*buf == '\n') // reached a newline rather than the beginning
+                {
+                    ++buf; // move pointer to first char after newline
+                    ++i;
+                }
+                core->state = START_FIELD;
+            }
+            break;
+
+        case ESCAPED_CHAR:
+            /* if (c == '\0') */
+            /*  c = '\n'; */
+
+            PUSH_CHAR(c);
+            core->state = IN_FIELD;
+            break;
+
+        case EAT_LINE_COMMENT:
+            if (c == '\n') {
+                core->file_lines++;
+                core->state = START_RECORD;
+            } else if (c == '\r') {
+                core->file_lines++;
+                core->state = EAT_CRNL_NOP;
+            }
+            break;
+
+        case IN_FIELD:
+            /* in unquoted field */
+            if (c == '\n') {
+                END_FIELD();
+                END_LINE();
+                /* core->state = START_RECORD; */
+            } else if (c == '\r') {
+                END_FIELD();
+                core->state = EAT_CRNL;
+            }
+            else if (c == core->escapechar) {
+                /* possible escaped character */
+                core->state = ESCAPED_CHAR;
+            }
+            else if (c == core->delimiter) {
+                // End of field. End of line not reached yet
+                END_FIELD();
+                core->state = START_FIELD;
+            }
+            else if (c == core->commentchar) {
+                END_FIELD();
+                core->state = EAT_COMMENT;
+            }
+            else {
+                /* normal character - save in field */
+                PUSH_CHAR(c);
+            }
+            break;
+
+        case IN_QUOTED_FIELD:
+            /* in quoted field */
+            if (c == core->escapechar) {
+                /* Possible escape character */
+                core->state = ESCAPE_IN_QUOTED_FIELD;
+            }
+            else if (c == core->quotechar &&
+                     core->quoting != QUOTE_NONE) {
+                if (core->doublequote) {
+                    /* doublequote; " represented by "" */
+                    core->state = QUOTE_IN_QUOTED_FIELD;
+                }
+                else {
+                    /* end of quote part of field */
+                    core->state = IN_FIELD;
+                }
+            }
+            else {
+                /* normal character - save in field */
+                PUSH_CHAR(c);
+            }
+            break;
+
+        case ESCAPE_IN_QUOTED_FIELD:
+            /* if (c == '\0') */
+            /*  c = '\n'; */
+
+            PUSH_CHAR(c);
+            core->state = IN_QUOTED_FIELD;
+            break;
+
+        case QUOTE_IN_QUOTED_FIELD:
+            /* doublequote - seen a quote in an quoted field */
+            if (core->quoting != QUOTE_NONE && c == core->quotechar) {
+                /* save "" as " */
+
+                PUSH_CHAR(c);
+                core->state = IN_QUOTED_FIELD;
+            }
+            else if (c == core->delimiter) {
+                // End of field. End of line not reached yet
+
+                END_FIELD();
+                core->state = START_FIELD;
+            }
+            else if (c == '\n') {
+                END_FIELD();
+                END_LINE();
+                /* core->state = START_RECORD; */
+            }
+            else if (c == '\r') {
+                END_FIELD();
+                core->state = EAT_CRNL;
+            }
+            else if (!core->strict) {
+                PUSH_CHAR(c);
+                core->state = IN_FIELD;
+            }
+            else {
+                csv_core_set_error(core, "CSV parse error: '%c' expected after '%c'",
+                                   core->delimiter, core->quotechar);
+                goto parsingerror;
+            }
+            break;
+
+        case EAT_COMMENT:
+            if (c == '\n') {
+                END_LINE();
+            } else if (c == '\r') {
+                core->state = EAT_CRNL;
+            }
+            break;
+
+        case EAT_CRNL:
+            if (c == '\n') {
+                END_LINE();
+                /* core->state = START_RECORD; */
+            } else if (c == core->delimiter){
+                // Handle \r-delimited files
+                END_LINE_AND_FIELD_STATE(START_FIELD);
+            } else {
+                /* \r line terminator */
+
+                /* UGH. we don't actually want to consume the token. fix this later */
+                int rc = end_line(core);
+                if (rc < 0) {
+                    goto parsingerror;
+                }
+                core->state = START_RECORD;
+
+                /* HACK, let's try this one again */
+                --i; buf--;
+                if (rc == CSV_CORE_PAUSE) {
+                    goto paused;
+                }
+
+            }
+            break;
+
+        case EAT_CRNL_NOP: /* inside an ignored comment line */
+            core->state = START_RECORD;
+            /* \r line terminator -- parse this character again */
+            if (c != '\n' && c != core->delimiter) {
+                --i;
+                --buf;
+            }
+            break;
+        default:
+            break;
+
+        }
+    }
+
+    *consumed = i;
+    return CSV_CORE_OK;
+
+parsingerror:
+    *consumed = i + 1;
+    return CSV_CORE_ERROR;
+
+paused:
+    *consumed = i + 1;
+    return CSV_CORE_PAUSE;
+}
+
+static int tokenize_delim_customterm(csv_core_t *core, const char *data, size_t len,
+                                     size_t *consumed)
+{
+    size_t i;
+    char c;
+    const char *buf = data;
+
+    for (i = 0; i < len; ++i)
+    {
+        // Next character in file
+        c = *buf++;
+
+        switch(core->state) {
+
+        case SKIP_LINE:
+            if (c == core->lineterminator) {
+                END_LINE();
+            }
+            break;
+
+        case START_RECORD:
+            // start of record
+            if (skip_this_line(core)) {
+                core->state = SKIP_LINE;
+                if (c == core->lineterminator) {
+                    END_LINE();
+                }
+                break;
+            }
+            else if (c == core->lineterminator) {
+                // \n\r possible?
+                if (core->skip_empty_lines)
+                {
+                    core->file_lines++;
+                }
+                else
+                {
+                    END_LINE();
+                }
+                break;
+            }
+            else if (c == core->commentchar) {
+                core->state = EAT_LINE_COMMENT;
+                break;
+            }
+            else if (IS_WHITESPACE(c) && c != core->delimiter && core->skip_empty_lines)
+            {
+                core->state = WHITESPACE_LINE;
+                break;
+            }
+            /* normal character - handle as START_FIELD */
+            core->state = START_FIELD;
+            /* fallthru */
+        case START_FIELD:
+            /* expecting field */
+            if (c == core->lineterminator) {
+                END_FIELD();
+                END_LINE();
+                /* core->state = START_RECORD; */
+            }
+            else if (c == core->quotechar &&
+                     core->quoting != QUOTE_NONE) {
+                /* start quoted field */
+                core->state = IN_QUOTED_FIELD;
+            }
+            else if (c == core->escapechar) {
+                /* possible escaped character */
+                core->state = ESCAPED_CHAR;
+            }
+            else if (c == ' ' && core->skipinitialspace)
+                /* ignore space at start of field */
+                ;
+            else if (c == core->delimiter) {
+                /* save empty field */
+                END_FIELD();
+            }
+            else if (c == core->commentchar) {
+                END_FIELD();
+                core->state = EAT_COMMENT;
+            }
+            else {
+                /* begin new unquoted field */
+                PUSH_CHAR(c);
+                core->state = IN_FIELD;
+            }
+            break;
+
+        case WHITESPACE_LINE: // check if line is whitespace-only
+            if (c == core->lineterminator) {
+                core->file_lines++;
+                core->state = START_RECORD; // ignore empty line
+            }
+            else if (IS_WHITESPACE(c) && c != core->delimiter)
+                ;
+            else { // backtrack
+                /* We have to use i + 1 because buf has been incremented but not i */
+                do {
+                    --buf;
+                    --i;
+                } while (i + 1 > 0 && *buf != core->lineterminator);
+
+                if (*buf == core->lineterminator) // reached a newline rather than the beginning
+                {
+                    ++buf; // move pointer to first char after newline
+                    ++i;
+                }
+                core->state = START_FIELD;
+            }
+            break;
+
+        case ESCAPED_CHAR:
+            /* if (c == '\0') */
+            /*  c = '\n'; */
+
+            PUSH_CHAR(c);
+            core->state = IN_FIELD;
+            break;
+
+        case IN_FIELD:
+            /* in unquoted field */
+            if (c == core->lineterminator) {
+                END_FIELD();
+                END_LINE();
+                /* core->state = START_RECORD; */
+            }
+            else if (c == core->escapechar) {
+                /* possible escaped character */
+                core->state = ESCAPED_CHAR;
+            }
+            else if (c == core->delimiter) {
+                // End of field. End of line not reached yet
+                END_FIELD();
+                core->state = START_FIELD;
+            }
+            else if (c == core->commentchar) {
+                END_FIELD();
+                core->state = EAT_COMMENT;
+            }
+            else {
+                /* normal character - save in field */
+                PUSH_CHAR(c);
+            }
+            break;
+
+        case IN_QUOTED_FIELD:
+            /* in quoted field */
+            if (c == core->escapechar) {
+                /* Possible escape character */
+                core->state = ESCAPE_IN_QUOTED_FIELD;
+            }
+            else if (c == core->quotechar &&
+                     core->quoting != QUOTE_NONE) {
+                if (core->doublequote) {
+                    /* doublequote; " represented by "" */
+                    core->state = QUOTE_IN_QUOTED_FIELD;
+                }
+                else {
+                    /* end of quote part of field */
+                    core->state = IN_FIELD;
+                }
+            }
+            else {
+                /* normal character - save in field */
+                PUSH_CHAR(c);
+            }
+            break;
+
+        case ESCAPE_IN_QUOTED_FIELD:
+            PUSH_CHAR(c);
+            core->state = IN_QUOTED_FIELD;
+            break;
+
+        case QUOTE_IN_QUOTED_FIELD:
+            /* doublequote - seen a quote in an quoted field */
+            if (core->quoting != QUOTE_NONE && c == core->quotechar) {
+                /* save "" as " */
+
+                PUSH_CHAR(c);
+                core->state = IN_QUOTED_FIELD;
+            }
+            else if (c == core->delimiter) {
+                // End of field. End of line not reached yet
+
+                END_FIELD();
+                core->state = START_FIELD;
+            }
+            else if (c == core->lineterminator) {
+                END_FIELD();
+                END_LINE();
+                /* core->state = START_RECORD; */
+            }
+            else if (!core->strict) {
+                PUSH_CHAR(c);
+                core->state = IN_FIELD;
+            }
+            else {
+                csv_core_set_error(core, "CSV parse error: '%c' expected after '%c'",
+                                   core->delimiter, core->quotechar);
+                goto parsingerror;
+            }
+            break;
+
+        case EAT_LINE_COMMENT:
+            if (c == core->lineterminator) {
+                core->file_lines++;
+                core->state = START_RECORD;
+            }
+            break;
+
+        case EAT_COMMENT:
+            if (c == core->lineterminator) {
+                END_LINE();
+            }
+            break;
+
+        default:
+            break;
+
+        }
+    }
+
+    *consumed = i;
+    return CSV_CORE_OK;
+
+parsingerror:
+    *consumed = i + 1;
+    return CSV_CORE_ERROR;
+
+paused:
+    *consumed = i + 1;
+    return CSV_CORE_PAUSE;
+}
+
+static int tokenize_whitespace(csv_core_t *core, const char *data, size_t len,
+                               size_t *consumed)
+{
+    size_t i;
+    char c;
+    const char *buf = data;
+
+    for (i = 0; i < len; ++i)
+    {
+        // Next character in file
+        c = *buf++;
+
+        switch(core->state) {
+        case SKIP_LINE:
+            if (c == '\n') {
+                END_LINE();
+            } else if (c == '\r') {
+                core->file_lines++;
+                core->state = EAT_CRNL_NOP;
+            }
+            break;
+
+        case WHITESPACE_LINE:
+            if (c == '\n') {
+                core->file_lines++;
+                core->state = START_RECORD;
+                break;
+            }
+            else if (c == '\r') {
+                core->file_lines++;
+                core->state = EAT_CRNL_NOP;
+                break;
+            }
+            // fall through
+
+        case EAT_WHITESPACE:
+            if (c == '\n') {
+                END_LINE();
+                core->state = START_RECORD;
+                break;
+            } else if (c == '\r') {
+                core->state = EAT_CRNL;
+                break;
+            } else if (!IS_WHITESPACE(c)) {
+                // END_FIELD();
+                core->state = START_FIELD;
+                // Fall through to subsequent state
+            } else {
+                // if whitespace char, keep slurping
+                break;
+            }
+
+        case START_RECORD:
+            // start of record
+            if (skip_this_line(core)) {
+                core->state = SKIP_LINE;
+                if (c == '\n') {
+                    END_LINE();
+                }
+                break;
+            } else  if (c == '\n') {
+                if (core->skip_empty_lines)
+                // \n\r possible?
+                {
+                    core->file_lines++;
+                }
+                else
+                {
+                    END_LINE();
+                }
+                break;
+            } else if (c == '\r') {
+                if (core->skip_empty_lines)
+                {
+                    core->file_lines++;
+                    core->state = EAT_CRNL_NOP;
+                }
+                else
+                    core->state = EAT_CRNL;
+                break;
+            } else if (IS_WHITESPACE(c)) {
+                /*if (core->skip_empty_lines)
+                    core->state = WHITESPACE_LINE;
+                    else*/
+                    core->state = EAT_WHITESPACE;
+                break;
+            } else if (c == core->commentchar) {
+                core->state = EAT_LINE_COMMENT;
+                break;
+            } else {
+                /* normal character - handle as START_FIELD */
+                core->state = START_FIELD;
+            }
+            /* fallthru */
+        case START_FIELD:
+            /* expecting field */
+            if (c == '\n') {
+                END_FIELD();
+                END_LINE();
+                /* core->state = START_RECORD; */
+            } else if (c == '\r') {
+                END_FIELD();
+                core->state = EAT_CRNL;
+            }
+            else if (c == core->quotechar &&
+                     core->quoting != QUOTE_NONE) {
+                /* start quoted field */
+                core->state = IN_QUOTED_FIELD;
+            }
+            else if (c == core->escapechar) {
+                /* possible escaped character */
+                core->state = ESCAPED_CHAR;
+            }
+            /* else if (c == ' ' && core->skipinitialspace) */
+            /*     /\* ignore space at start of field *\/ */
+            /*     ; */
+            else if (IS_WHITESPACE(c)) {
+                core->state = EAT_WHITESPACE;
+            }
+            else if (c == core->commentchar) {
+                END_FIELD();
+                core->state = EAT_COMMENT;
+            }
+            else {
+                /* begin new unquoted field */
+                PUSH_CHAR(c);
+                core->state = IN_FIELD;
+            }
+            break;
+
+        case EAT_LINE_COMMENT:
+            if (c == '\n') {
+                core->file_lines++;
+                core->state = START_RECORD;
+            } else if (c == '\r') {
+                core->file_lines++;
+                core->state = EAT_CRNL_NOP;
+            }
+            break;
+
+        case ESCAPED_CHAR:
+            /* if (c == '\0') */
+            /*  c = '\n'; */
+
+            PUSH_CHAR(c);
+            core->state = IN_FIELD;
+            break;
+
+        case IN_FIELD:
+            /* in unquoted field */
+            if (c == '\n') {
+                END_FIELD();
+                END_LINE();
+                /* core->state = START_RECORD; */
+            } else if (c == '\r') {
+                END_FIELD();
+                core->state = EAT_CRNL;
+            }
+            else if (c == core->escapechar) {
+                /* possible escaped character */
+                core->state = ESCAPED_CHAR;
+            }
+            else if (IS_WHITESPACE(c)) {
+                // End of field. End of line not reached yet
+                END_FIELD();
+                core->state = EAT_WHITESPACE;
+            }
+            else if (c == core->commentchar) {
+                END_FIELD();
+                core->state = EAT_COMMENT;
+            }
+            else {
+                /* normal character - save in field */
+                PUSH_CHAR(c);
+            }
+            break;
+
+        case IN_QUOTED_FIELD:
+            /* in quoted field */
+            if (c == core->escapechar) {
+                /* Possible escape character */
+                core->state = ESCAPE_IN_QUOTED_FIELD;
+            }
+            else if (c == core->quotechar &&
+                     core->quoting != QUOTE_NONE) {
+                if (core->doublequote) {
+                    /* doublequote; " represented by "" */
+                    core->state = QUOTE_IN_QUOTED_FIELD;
+                }
+                else {
+                    /* end of quote part of field */
+                    core->state = IN_FIELD;
+                }
+            }
+            else {
+                /* normal character - save in field */
+                PUSH_CHAR(c);
+            }
+            break;
+
+        case ESCAPE_IN_QUOTED_FIELD:
+            /* if (c == '\0') */
+            /*  c = '\n'; */
+
+            PUSH_CHAR(c);
+            core->state = IN_QUOTED_FIELD;
+            break;
+
+        case QUOTE_IN_QUOTED_FIELD:
+            /* doublequote - seen a quote in an quoted field */
+            if (core->quoting != QUOTE_NONE && c == core->quotechar) {
+                /* save "" as " */
+
+                PUSH_CHAR(c);
+                core->state = IN_QUOTED_FIELD;
+            }
+            else if (IS_WHITESPACE(c)) {
+                // End of field. End of line not reached yet
+
+                END_FIELD();
+                core->state = EAT_WHITESPACE;
+            }
+            else if (c == '\n') {
+                END_FIELD();
+                END_LINE();
+                /* core->state = START_RECORD; */
+            }
+            else if (c == '\r') {
+                END_FIELD();
+                core->state = EAT_CRNL;
+            }
+            else if (!core->strict) {
+                PUSH_CHAR(c);
+                core->state = IN_FIELD;
+            }
+            else {
+                csv_core_set_error(core, "CSV parse error: '%c' expected after '%c'",
+                                   core->delimiter, core->quotechar);
+                goto parsingerror;
+            }
+            break;
+
+        case EAT_CRNL:
+            if (c == '\n') {
+                END_LINE();
+                /* core->state = START_RECORD; */
+            } else if (IS_WHITESPACE(c)){
+                // Handle \r-delimited files
+                END_LINE_STATE(EAT_WHITESPACE);
+            } else {
+                /* XXX
+                 * first character of a new record--need to back up and reread
+                 * to handle properly...
+                 */
+                i--; buf--; /* back up one character (HACK!) */
+                END_LINE_STATE(START_RECORD);
+            }
+            break;
+
+        case EAT_CRNL_NOP: // inside an ignored comment line
+            core->state = START_RECORD;
+            /* \r line terminator -- parse this character again */
+            if (c != '\n' && c != core->delimiter) {
+                --i;
+                --buf;
+            }
+            break;
+
+        case EAT_COMMENT:
+            if (c == '\n') {
+                END_LINE();
+            } else if (c == '\r') {
+                core->state = EAT_CRNL;
+            }
+            break;
+
+        default:
+            break;
+
+
+        }
+
+    }
+
+    *consumed = i;
+    return CSV_CORE_OK;
+
+parsingerror:
+    *consumed = i + 1;
+    return CSV_CORE_ERROR;
+
+paused:
+    *consumed = i + 1;
+    return CSV_CORE_PAUSE;
+}
+
+/*
+ * Tokenizes len bytes at data. On return, *consumed holds the number of
+ * bytes consumed which is less than len only if parsing stopped early.
+ * Returns CSV_CORE_OK if all data was consumed, CSV_CORE_PAUSE if
+ * on_record asked to pause and CSV_CORE_ERROR on errors. For errors
+ * detected by the tokenizer, as opposed to a callback, core->error holds
+ * a message.
+ */
+int csv_core_feed(csv_core_t *core, const char *data, size_t len,
+                  size_t *consumed)
+{
+    if (core->state == FINISHED) {
+        *consumed = 0;
+        return CSV_CORE_OK;
+    }
+    if (core->delim_whitespace)
+        return tokenize_whitespace(core, data, len, consumed);
+    else if (core->lineterminator == '\0')
+        return tokenize_delimited(core, data, len, consumed);
+    else
+        return tokenize_delim_customterm(core, data, len, consumed);
+}
+
+/* Completes the last record at the end of input */
+int csv_core_finish(csv_core_t *core)
+{
+    int rc = CSV_CORE_OK;
+
+    switch (core->state) {
+    case START_RECORD:
+    case FINISHED:
+        break;
+    case IN_QUOTED_FIELD:
+        csv_core_set_error(core, "CSV parse error: EOF inside string starting at line %lld",
+                           (long long) core->file_lines);
+        rc = CSV_CORE_ERROR;
+        break;
+    case IN_FIELD:
+    case START_FIELD:
+    case QUOTE_IN_QUOTED_FIELD:
+        if (end_field(core) < 0) {
+            rc = CSV_CORE_ERROR;
+            break;
+        }
+        /* fallthru */
+    default:
+        /* end_line ignores lines being skipped */
+        if (end_line(core) < 0)
+            rc = CSV_CORE_ERROR;
+        break;
+    }
+    core->state = FINISHED;
+    return rc;
+}
+
+/*
+ * Tokenizes all input returned by read_fn and completes the last record.
+ * Returns CSV_CORE_OK at the end of input, CSV_CORE_ERROR on errors and
+ * CSV_CORE_PAUSE if on_record asked to pause in which case the rest of the
+ * input is not parsed.
+ */
+int csv_core_parse(csv_core_t *core, csv_core_read_fn read_fn, void *read_ctx)
+{
+    char *buf;
+    ptrdiff_t nread;
+    size_t pos, consumed;
+    int status = CSV_CORE_OK;
+
+    buf = malloc(CSV_CORE_READ_SIZE);
+    if (buf == NULL) {
+        csv_core_set_error(core, "Out of memory.");
+        return CSV_CORE_ERROR;
+    }
+    while (status == CSV_CORE_OK) {
+        nread = read_fn(read_ctx, buf, CSV_CORE_READ_SIZE);
+        if (nread < 0) {
+            csv_core_set_error(core, "Error reading input.");
+            status = CSV_CORE_ERROR;
+            break;
+        }
+        if (nread == 0) {
+            status = csv_core_finish(core);
+            break;
+        }
+        for (pos = 0; status == CSV_CORE_OK && pos < (size_t) nread;
+             pos += consumed) {
+            status = csv_core_feed(core, buf + pos, nread - pos, &consumed);
+        }
+    }
+    free(buf);
+    return status;
+}
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 4
+ * fill-column: 78
+ * tab-width: 8
+ * End:
+ */
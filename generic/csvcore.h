@@ -0,0 +1,132 @@
+/*
+ * Copyright (c) 2015-2023, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file license.terms for license
+ */
+
+/*
+ * CSV tokenizer core. Independent of Tcl so it may be used from plain C.
+ *
+ * Input is supplied as byte buffers, either pushed by the caller with
+ * csv_core_feed or pulled through a read callback by csv_core_parse.
+ * Each field is reported through the on_field callback as a span of bytes
+ * and the end of each record through on_record. Typical use:
+ *
+ *     csv_core_t core;
+ *     csv_core_init(&core);
+ *     core.delimiter = ';';
+ *     core.on_field = my_field;
+ *     core.on_record = my_record;
+ *     core.ctx = my_data;
+ *     while (more input)
+ *         status = csv_core_feed(&core, buf, len, &consumed);
+ *     status = csv_core_finish(&core);
+ *     csv_core_free(&core);
+ *
+ * Blank lines (when skip_empty_lines is set), comment lines and lines
+ * selected for skipping do not result in callbacks.
+ */
+
+#ifndef _CSVCORE_H
+#define _CSVCORE_H
+
+#include <stddef.h>
+
+#if defined(_MSC_VER)
+#include "ms_stdint.h"
+#else
+#include <stdint.h>
+#endif
+
+/* Return codes from the csv_core_* functions and callbacks */
+#define CSV_CORE_OK     0
+#define CSV_CORE_ERROR  (-1)
+#define CSV_CORE_PAUSE  1       /* on_record: stop after this record */
+
+typedef enum {
+    START_RECORD,
+    START_FIELD,
+    ESCAPED_CHAR,
+    IN_FIELD,
+    IN_QUOTED_FIELD,
+    ESCAPE_IN_QUOTED_FIELD,
+    QUOTE_IN_QUOTED_FIELD,
+    EAT_CRNL,
+    EAT_CRNL_NOP,
+    EAT_WHITESPACE,
+    EAT_COMMENT,
+    EAT_LINE_COMMENT,
+    WHITESPACE_LINE,
+    SKIP_LINE,
+    FINISHED
+} ParserState;
+
+typedef enum {
+    QUOTE_MINIMAL, QUOTE_ALL, QUOTE_NONNUMERIC, QUOTE_NONE
+} QuoteStyle;
+
+/*
+ * Called at the end of each field. data is not NUL terminated and is only
+ * valid for the duration of the call. Returns CSV_CORE_OK to continue or
+ * CSV_CORE_ERROR to stop parsing.
+ */
+typedef int (*csv_core_field_fn)(void *ctx, const char *data, size_t len);
+
+/*
+ * Called at the end of each record. Returns CSV_CORE_OK to continue,
+ * CSV_CORE_PAUSE to have csv_core_feed return after this record or
+ * CSV_CORE_ERROR to stop parsing.
+ */
+typedef int (*csv_core_record_fn)(void *ctx);
+
+/*
+ * Used by csv_core_parse to fill buf with up to len bytes. Returns the
+ * number of bytes read, 0 at end of input or a negative value on error.
+ */
+typedef ptrdiff_t (*csv_core_read_fn)(void *ctx, char *buf, size_t len);
+
+typedef struct csv_core_t {
+    /* Dialect. May be changed after csv_core_init, before parsing. */
+    char delimiter;             /* Field separator */
+    int delim_whitespace;       /* Runs of spaces and tabs separate fields */
+    char quotechar;             /* Quote character */
+    char escapechar;            /* Escape character, 0 if none */
+    char lineterminator;        /* 0 for \n, \r or \r\n */
+    char commentchar;           /* Comment character, 0 if none */
+    int doublequote;            /* Is " represented by "" ? */
+    int skipinitialspace;       /* Ignore spaces following delimiter */
+    int quoting;                /* QUOTE_NONE disables quote handling */
+    int strict;                 /* Error on bad quoting */
+    int skip_empty_lines;       /* Ignore empty and whitespace lines */
+
+    /* Callbacks */
+    csv_core_field_fn on_field;
+    csv_core_record_fn on_record;
+    void *ctx;
+
+    /* State. Read-only for callers. */
+    ParserState state;
+    int64_t file_lines;         /* Lines consumed including skipped ones */
+    char *field;                /* Field being collected */
+    size_t field_len;
+    size_t field_cap;
+    int64_t field_grows;        /* Number of times field was enlarged */
+    char error[120];            /* Message if tokenizer detected an error */
+
+    /* Lines to skip. Set through csv_core_skip_* */
+    void *skipset;
+    int64_t skip_first_lines;
+} csv_core_t;
+
+void csv_core_init(csv_core_t *core);
+void csv_core_reset(csv_core_t *core);
+void csv_core_free(csv_core_t *core);
+int csv_core_skip_line(csv_core_t *core, int64_t line);
+void csv_core_skip_first_lines(csv_core_t *core, int64_t nlines);
+int csv_core_feed(csv_core_t *core, const char *data, size_t len,
+                  size_t *consumed);
+int csv_core_finish(csv_core_t *core);
+int csv_core_parse(csv_core_t *core, csv_core_read_fn read_fn, void *read_ctx);
+
+#endif /* _CSVCORE_H */
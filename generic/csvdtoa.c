@@ -0,0 +1,432 @@
+/*
+ * Copyright (c) 2015-2023, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file license.terms for license
+ */
+
+/*
+ * Shortest round-trip conversion of doubles to decimal using the Grisu3
+ * algorithm of Florian Loitsch, "Printing Floating-Point Numbers Quickly
+ * and Accurately with Integers", PLDI 2010. The structure follows the
+ * fast-dtoa implementation in the double-conversion library.
+ *
+ * Grisu3 works with 64-bit integer approximations and so is much faster
+ * than the bignum based conversion in Tcl. For about 0.5% of values it
+ * cannot guarantee the result is the shortest and closest and reports
+ * failure. Callers then fall back to Tcl_PrintDouble.
+ *
+ * This file must not depend on Tcl. See csvdtoa.h for the interface.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#if defined(_MSC_VER)
+#include "ms_stdint.h"
+#else
+#include <stdint.h>
+#endif
+
+#include "csvdtoa.h"
+
+#ifndef UINT64_C
+#define UINT64_C(x) (x ## ULL)
+#endif
+
+/* Floating point number f * 2^e with a 64-bit significand */
+typedef struct diy_fp {
+    uint64_t f;
+    int e;
+} diy_fp;
+
+/* Range of binary exponents of the scaled values that DigitGen handles */
+#define MIN_TARGET_EXPONENT (-60)
+#define MAX_TARGET_EXPONENT (-32)
+
+/*
+ * Normalized 64-bit approximations, rounded to nearest, of 10^k for
+ * k = -348, -340, ... 340 as {significand, binary exponent, k}.
+ */
+static const struct {
+    uint64_t f;
+    int16_t e;
+    int16_t k;
+} cached_powers[] = {
+    {UINT64_C(0xfa8fd5a0081c0288), -1220, -348},
+    {UINT64_C(0xbaaee17fa23ebf76), -1193, -340},
+    {UINT64_C(0x8b16fb203055ac76), -1166, -332},
+    {UINT64_C(0xcf42894a5dce35ea), -1140, -324},
+    {UINT64_C(0x9a6bb0aa55653b2d), -1113, -316},
+    {UINT64_C(0xe61acf033d1a45df), -1087, -308},
+    {UINT64_C(0xab70fe17c79ac6ca), -1060, -300},
+    {UINT64_C(0xff77b1fcbebcdc4f), -1034, -292},
+    {UINT64_C(0xbe5691ef416bd60c), -1007, -284},
+    {UINT64_C(0x8dd01fad907ffc3c), -980, -276},
+    {UINT64_C(0xd3515c2831559a83), -954, -268},
+    {UINT64_C(0x9d71ac8fada6c9b5), -927, -260},
+    {UINT64_C(0xea9c227723ee8bcb), -901, -252},
+    {UINT64_C(0xaecc49914078536d), -874, -244},
+    {UINT64_C(0x823c12795db6ce57), -847, -236},
+    {UINT64_C(0xc21094364dfb5637), -821, -228},
+    {UINT64_C(0x9096ea6f3848984f), -794, -220},
+    {UINT64_C(0xd77485cb25823ac7), -768, -212},
+    {UINT64_C(0xa086cfcd97bf97f4), -741, -204},
+    {UINT64_C(0xef340a98172aace5), -715, -196},
+    {UINT64_C(0xb23867fb2a35b28e), -688, -188},
+    {UINT64_C(0x84c8d4dfd2c63f3b), -661, -180},
+    {UINT64_C(0xc5dd44271ad3cdba), -635, -172},
+    {UINT64_C(0x936b9fcebb25c996), -608, -164},
+    {UINT64_C(0xdbac6c247d62a584), -582, -156},
+    {UINT64_C(0xa3ab66580d5fdaf6), -555, -148},
+    {UINT64_C(0xf3e2f893dec3f126), -529, -140},
+    {UINT64_C(0xb5b5ada8aaff80b8), -502, -132},
+    {UINT64_C(0x87625f056c7c4a8b), -475, -124},
+    {UINT64_C(0xc9bcff6034c13053), -449, -116},
+    {UINT64_C(0x964e858c91ba2655), -422, -108},
+    {UINT64_C(0xdff9772470297ebd), -396, -100},
+    {UINT64_C(0xa6dfbd9fb8e5b88f), -369, -92},
+    {UINT64_C(0xf8a95fcf88747d94), -343, -84},
+    {UINT64_C(0xb94470938fa89bcf), -316, -76},
+    {UINT64_C(0x8a08f0f8bf0f156b), -289, -68},
+    {UINT64_C(0xcdb02555653131b6), -263, -60},
+    {UINT64_C(0x993fe2c6d07b7fac), -236, -52},
+    {UINT64_C(0xe45c10c42a2b3b06), -210, -44},
+    {UINT64_C(0xaa242499697392d3), -183, -36},
+    {UINT64_C(0xfd87b5f28300ca0e), -157, -28},
+    {UINT64_C(0xbce5086492111aeb), -130, -20},
+    {UINT64_C(0x8cbccc096f5088cc), -103, -12},
+    {UINT64_C(0xd1b71758e219652c), -77, -4},
+    {UINT64_C(0x9c40000000000000), -50, 4},
+    {UINT64_C(0xe8d4a51000000000), -24, 12},
+    {UINT64_C(0xad78ebc5ac620000), 3, 20},
+    {UINT64_C(0x813f3978f8940984), 30, 28},
+    {UINT64_C(0xc097ce7bc90715b3), 56, 36},
+    {UINT64_C(0x8f7e32ce7bea5c70), 83, 44},
+    {UINT64_C(0xd5d238a4abe98068), 109, 52},
+    {UINT64_C(0x9f4f2726179a2245), 136, 60},
+    {UINT64_C(0xed63a231d4c4fb27), 162, 68},
+    {UINT64_C(0xb0de65388cc8ada8), 189, 76},
+    {UINT64_C(0x83c7088e1aab65db), 216, 84},
+    {UINT64_C(0xc45d1df942711d9a), 242, 92},
+    {UINT64_C(0x924d692ca61be758), 269, 100},
+    {UINT64_C(0xda01ee641a708dea), 295, 108},
+    {UINT64_C(0xa26da3999aef774a), 322, 116},
+    {UINT64_C(0xf209787bb47d6b85), 348, 124},
+    {UINT64_C(0xb454e4a179dd1877), 375, 132},
+    {UINT64_C(0x865b86925b9bc5c2), 402, 140},
+    {UINT64_C(0xc83553c5c8965d3d), 428, 148},
+    {UINT64_C(0x952ab45cfa97a0b3), 455, 156},
+    {UINT64_C(0xde469fbd99a05fe3), 481, 164},
+    {UINT64_C(0xa59bc234db398c25), 508, 172},
+    {UINT64_C(0xf6c69a72a3989f5c), 534, 180},
+    {UINT64_C(0xb7dcbf5354e9bece), 561, 188},
+    {UINT64_C(0x88fcf317f22241e2), 588, 196},
+    {UINT64_C(0xcc20ce9bd35c78a5), 614, 204},
+    {UINT64_C(0x98165af37b2153df), 641, 212},
+    {UINT64_C(0xe2a0b5dc971f303a), 667, 220},
+    {UINT64_C(0xa8d9d1535ce3b396), 694, 228},
+    {UINT64_C(0xfb9b7cd9a4a7443c), 720, 236},
+    {UINT64_C(0xbb764c4ca7a44410), 747, 244},
+    {UINT64_C(0x8bab8eefb6409c1a), 774, 252},
+    {UINT64_C(0xd01fef10a657842c), 800, 260},
+    {UINT64_C(0x9b10a4e5e9913129), 827, 268},
+    {UINT64_C(0xe7109bfba19c0c9d), 853, 276},
+    {UINT64_C(0xac2820d9623bf429), 880, 284},
+    {UINT64_C(0x80444b5e7aa7cf85), 907, 292},
+    {UINT64_C(0xbf21e44003acdd2d), 933, 300},
+    {UINT64_C(0x8e679c2f5e44ff8f), 960, 308},
+    {UINT64_C(0xd433179d9c8cb841), 986, 316},
+    {UINT64_C(0x9e19db92b4e31ba9), 1013, 324},
+    {UINT64_C(0xeb96bf6ebadf77d9), 1039, 332},
+    {UINT64_C(0xaf87023b9bf0ee6b), 1066, 340},
+};
+#define CACHED_POWERS_OFFSET 348     /* -k of first entry */
+#define CACHED_POWERS_STEP 8         /* Decimal exponent distance */
+
+static const uint32_t small_powers_of_ten[] = {
+    0, 1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000,
+    1000000000
+};
+
+/* Upper 64 bits of the 128-bit product x*y, rounded */
+static diy_fp diy_fp_multiply(diy_fp x, diy_fp y)
+{
+    const uint64_t M32 = 0xFFFFFFFFu;
+    uint64_t a = x.f >> 32, b = x.f & M32;
+    uint64_t c = y.f >> 32, d = y.f & M32;
+    uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+    uint64_t tmp = (bd >> 32) + (ad & M32) + (bc & M32);
+    diy_fp r;
+
+    tmp += 1U << 31;            /* Round */
+    r.f = ac + (ad >> 32) + (bc >> 32) + (tmp >> 32);
+    r.e = x.e + y.e + 64;
+    return r;
+}
+
+static diy_fp diy_fp_normalize(diy_fp x)
+{
+    while (! (x.f & UINT64_C(0xFFC0000000000000))) {
+        x.f <<= 10;
+        x.e -= 10;
+    }
+    while (! (x.f & UINT64_C(0x8000000000000000))) {
+        x.f <<= 1;
+        x.e -= 1;
+    }
+    return x;
+}
+
+/*
+ * Returns the power of ten whose binary exponent lies within
+ * [min_exponent, max_exponent] and its decimal exponent in *k.
+ */
+static diy_fp cached_power(int min_exponent, int *k)
+{
+    /* ceil((min_exponent + 63) * log10(2)) */
+    double dk = (min_exponent + 63) * 0.30102999566398114;
+    int ik = (int) dk;
+    int index;
+    diy_fp p;
+
+    if (ik < dk)
+        ++ik;
+    index = (CACHED_POWERS_OFFSET + ik - 1) / CACHED_POWERS_STEP + 1;
+    p.f = cached_powers[index].f;
+    p.e = cached_powers[index].e;
+    *k = cached_powers[index].k;
+    return p;
+}
+
+/*
+ * Adjusts the last digit of the generated number toward w and checks
+ * the result is guaranteed to be the closest shortest representation.
+ * All arguments are in units of the scaled values. Returns 0 if that
+ * cannot be guaranteed.
+ */
+static int round_weed(char *buffer, int length,
+                      uint64_t distance_too_high_w, uint64_t unsafe_interval,
+                      uint64_t rest, uint64_t ten_kappa, uint64_t unit)
+{
+    uint64_t small_distance = distance_too_high_w - unit;
+    uint64_t big_distance = distance_too_high_w + unit;
+
+    while (rest < small_distance &&
+           unsafe_interval - rest >= ten_kappa &&
+           (rest + ten_kappa < small_distance ||
+            small_distance - rest >= rest + ten_kappa - small_distance)) {
+        buffer[length - 1]--;
+        rest += ten_kappa;
+    }
+
+    /*
+     * If a further decrement would also bring us closer to the upper
+     * bound of w's uncertainty, we cannot tell which is closer.
+     */
+    if (rest < big_distance &&
+        unsafe_interval - rest >= ten_kappa &&
+        (rest + ten_kappa < big_distance ||
+         big_distance - rest > rest + ten_kappa - big_distance))
+        return 0;
+
+    /* The rest must be clear of the uncertainty at both ends */
+    return (2 * unit <= rest) && (rest <= unsafe_interval - 4 * unit);
+}
+
+/*
+ * Generates the shortest digits of w within the interval (low, high).
+ * All three must share an exponent in the target range. On success
+ * returns the number of digits and the value is digits * 10^kappa.
+ */
+static int digit_gen(diy_fp low, diy_fp w, diy_fp high,
+                     char *buffer, int *kappa)
+{
+    uint64_t unit = 1;
+    diy_fp too_low, too_high, one;
+    uint64_t unsafe_interval, fractionals, rest;
+    uint32_t integrals, divisor;
+    int length = 0;
+
+    /*
+     * low, w and high are imprecise by up to one unit. Generating digits
+     * within the larger interval and checking them in round_weed is
+     * what makes the algorithm report failure rather than be wrong.
+     */
+    too_low.f = low.f - unit;
+    too_low.e = low.e;
+    too_high.f = high.f + unit;
+    too_high.e = high.e;
+    unsafe_interval = too_high.f - too_low.f;
+    one.f = UINT64_C(1) << -w.e;
+    one.e = w.e;
+    integrals = (uint32_t) (too_high.f >> -one.e);
+    fractionals = too_high.f & (one.f - 1);
+
+    /* Largest power of ten not exceeding integrals, which is never 0 */
+    *kappa = 10;
+    while (integrals < small_powers_of_ten[*kappa])
+        --*kappa;
+    divisor = small_powers_of_ten[*kappa];
+
+    while (*kappa > 0) {
+        buffer[length++] = (char) ('0' + integrals / divisor);
+        integrals %= divisor;
+        --*kappa;
+        rest = ((uint64_t) integrals << -one.e) + fractionals;
+        if (rest < unsafe_interval) {
+            if (! round_weed(buffer, length, too_high.f - w.f,
+                             unsafe_interval, rest,
+                             (uint64_t) divisor << -one.e, unit))
+                return 0;
+            return length;
+        }
+        divisor /= 10;
+    }
+
+    for (;;) {
+        fractionals *= 10;
+        unit *= 10;
+        unsafe_interval *= 10;
+        buffer[length++] = (char) ('0' + (fractionals >> -one.e));
+        fractionals &= one.f - 1;
+        --*kappa;
+        if (fractionals < unsafe_interval) {
+            if (! round_weed(buffer, length, (too_high.f - w.f) * unit,
+                             unsafe_interval, fractionals, one.f, unit))
+                return 0;
+            return length;
+        }
+    }
+}
+
+/*
+ * Stores the shortest digits that read back as v, which must be positive
+ * and finite, NUL terminated in digits. *exponent is set so that the
+ * value is d.ddd * 10^exponent. Returns the number of digits or 0 if
+ * the fast algorithm could not produce a guaranteed result.
+ */
+int csv_dtoa_shortest(double v, char digits[18], int *exponent)
+{
+    uint64_t bits, significand;
+    int biased_e, mk, kappa, length;
+    diy_fp w, m_plus, m_minus, ten_mk;
+
+    memcpy(&bits, &v, sizeof(bits));
+    biased_e = (int) ((bits >> 52) & 0x7FF);
+    significand = bits & UINT64_C(0x000FFFFFFFFFFFFF);
+    if (biased_e == 0x7FF || (biased_e == 0 && significand == 0))
+        return 0;               /* Inf, NaN or zero */
+    if (biased_e == 0) {
+        w.f = significand;      /* Denormal */
+        w.e = -1074;
+    } else {
+        w.f = significand | UINT64_C(0x0010000000000000);
+        w.e = biased_e - 1075;
+    }
+
+    /*
+     * Boundaries are midway to the neighbouring doubles. The lower one is
+     * closer when the significand is a power of two, except at the
+     * smallest normal exponent.
+     */
+    m_plus.f = (w.f << 1) + 1;
+    m_plus.e = w.e - 1;
+    m_plus = diy_fp_normalize(m_plus);
+    if (significand == 0 && biased_e > 1) {
+        m_minus.f = (w.f << 2) - 1;
+        m_minus.e = w.e - 2;
+    } else {
+        m_minus.f = (w.f << 1) - 1;
+        m_minus.e = w.e - 1;
+    }
+    m_minus.f <<= m_minus.e - m_plus.e;
+    m_minus.e = m_plus.e;
+    w = diy_fp_normalize(w);
+
+    /* Scale by 10^mk so the exponent lands in the target range */
+    ten_mk = cached_power(MIN_TARGET_EXPONENT - (w.e + 64), &mk);
+    w = diy_fp_multiply(w, ten_mk);
+    m_minus = diy_fp_multiply(m_minus, ten_mk);
+    m_plus = diy_fp_multiply(m_plus, ten_mk);
+
+    length = digit_gen(m_minus, w, m_plus, digits, &kappa);
+    if (length == 0)
+        return 0;
+    /* Shortest digits do not end in 0 but be safe */
+    while (length > 1 && digits[length - 1] == '0') {
+        --length;
+        ++kappa;
+    }
+    digits[length] = '\0';
+    *exponent = kappa - mk + length - 1;
+    return length;
+}
+
+/*
+ * Formats v into buf as Tcl_PrintDouble does when tcl_precision is 0.
+ * Returns the length of the output or -1 if v is not finite or the fast
+ * conversion failed, in which case buf contents are undefined.
+ */
+int csv_format_double(double v, char buf[CSV_DTOA_SPACE])
+{
+    char digits[18];
+    char *dst = buf;
+    const char *p;
+    uint64_t bits;
+    int exponent;
+
+    memcpy(&bits, &v, sizeof(bits));
+
+    /*
+     * For powers of two outside 2^-23 to 2^63 Tcl does not always produce
+     * the shortest digits. Leave those to Tcl so output matches the
+     * string representation of the value.
+     */
+    if ((bits & UINT64_C(0x000FFFFFFFFFFFFF)) == 0) {
+        int biased_e = (int) ((bits >> 52) & 0x7FF);
+        if (biased_e != 0 && (biased_e < 1000 || biased_e > 1086))
+            return -1;
+    }
+
+    if (bits >> 63) {
+        *dst++ = '-';
+        v = -v;
+    }
+    if (v == 0) {
+        digits[0] = '0';
+        digits[1] = '\0';
+        exponent = 0;
+    } else if (csv_dtoa_shortest(v, digits, &exponent) == 0) {
+        return -1;
+    }
+
+    p = digits;
+    if (exponent < -4 || exponent > 16) {
+        /* E format with the minimum number of exponent digits */
+        *dst++ = *p++;
+        if (*p) {
+            *dst++ = '.';
+            while (*p)
+                *dst++ = *p++;
+        }
+        dst += sprintf(dst, "e%+d", exponent);
+    } else {
+        /* F format always with a fractional part */
+        if (exponent < 0)
+            *dst++ = '0';
+        while (exponent-- >= 0)
+            *dst++ = *p ? *p++ : '0';
+        *dst++ = '.';
+        if (*p == '\0') {
+            *dst++ = '0';
+        } else {
+            while (++exponent < -1)
+                *dst++ = '0';
+            while (*p)
+                *dst++ = *p++;
+        }
+        *dst = '\0';
+    }
+    return (int) (dst - buf);
+}
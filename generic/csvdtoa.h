@@ -0,0 +1,27 @@
+/*
+ * Copyright (c) 2015-2023, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file license.terms for license
+ */
+
+/*
+ * Shortest round-trip formatting of doubles. Independent of Tcl.
+ *
+ * csv_format_double produces the same text as Tcl_PrintDouble with
+ * tcl_precision at its default of 0, without allocating memory. It
+ * fails for the rare values where the fast algorithm cannot prove its
+ * digits are the shortest, and for infinities and NaN, so callers must
+ * have a fallback.
+ */
+
+#ifndef _CSVDTOA_H
+#define _CSVDTOA_H
+
+/* Buffer size sufficient for any output of csv_format_double */
+#define CSV_DTOA_SPACE 32
+
+int csv_dtoa_shortest(double v, char digits[18], int *exponent);
+int csv_format_double(double v, char buf[CSV_DTOA_SPACE]);
+
+#endif /* _CSVDTOA_H */
@@ -0,0 +1,447 @@
+/*
+ * Copyright (c) 2015-2023, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file license.terms for license
+ */
+
+/*
+ * csv_read_many - parses a list of files on multiple threads.
+ *
+ * Tcl_Obj's cannot be passed between threads. Each worker thread therefore
+ * has its own parser and collects the fields of a file straight into native
+ * buffers with csv_spans_parse, without an interpreter or Tcl_Obj's for
+ * the fields. The calling thread converts the buffers into Tcl lists
+ * either in input order or, if a callback is specified, in the order that
+ * files are completed.
+ */
+
+#include "csv.h"
+
+typedef enum {
+    JOB_PENDING, JOB_RUNNING, JOB_DONE
+} JobState;
+
+typedef struct csv_many_job_t {
+    char *path;                 /* Normalized path (UTF-8) */
+    JobState state;
+    char *error;                /* Error message if parsing failed */
+    csv_spans_t spans;          /* Parsed rows, row 0 being the header */
+    struct csv_many_job_t *next_done; /* Completion queue link */
+} csv_many_job_t;
+
+typedef struct csv_many_t {
+    Tcl_Mutex mutex;            /* Protects the fields below */
+    Tcl_Condition job_done;     /* Signalled when a job completes */
+    csv_many_job_t *jobs;
+    Tcl_Size njobs;
+    Tcl_Size next_job;          /* Next job to be picked up */
+    int cancel;                 /* Workers should not start new jobs */
+    int nworkers;               /* Workers still running */
+    csv_many_job_t *done_head;  /* Jobs completed but not delivered */
+    csv_many_job_t **done_tail;
+
+    /* Read only once workers are started */
+    char *options;              /* Parser options as a Tcl list */
+    char *encoding;             /* Channel encoding or NULL */
+} csv_many_t;
+
+/* A static message is used if the message itself cannot be allocated */
+static char csv_many_no_memory[] = "Out of memory.";
+
+static void csv_many_set_error(csv_many_job_t *job, const char *msg)
+{
+    job->error = malloc(strlen(msg) + 1);
+    if (job->error)
+        strcpy(job->error, msg);
+    else
+        job->error = csv_many_no_memory;
+}
+
+/* Parses a single file. Called in a worker thread. */
+static void csv_many_parse(parser_t *parser, int nrows, csv_many_job_t *job,
+                           const char *encoding)
+{
+    Tcl_Channel chan;
+
+    chan = Tcl_OpenFileChannel(NULL, job->path, "r", 0);
+    if (chan == NULL) {
+        Tcl_Obj *msgObj = Tcl_ObjPrintf("couldn't open \"%s\": %s",
+                                        job->path,
+                                        Tcl_ErrnoMsg(Tcl_GetErrno()));
+        Tcl_IncrRefCount(msgObj);
+        csv_many_set_error(job, Tcl_GetString(msgObj));
+        Tcl_DecrRefCount(msgObj);
+        return;
+    }
+    /* The encoding was validated by the caller */
+    if (encoding)
+        Tcl_SetChannelOption(NULL, chan, "-encoding", encoding);
+
+    parser_reset(parser, chan);
+    if (csv_spans_parse(parser, nrows, &job->spans) != 0) {
+        csv_many_set_error(job, parser->errorObj ?
+                           Tcl_GetString(parser->errorObj) :
+                           "Error parsing CSV.");
+    }
+    Tcl_Close(NULL, chan);
+    /* Detach from the closed channel */
+    parser_reset(parser, NULL);
+}
+
+/* Processes jobs until there are none left or the caller cancels */
+static void csv_many_work(csv_many_t *many)
+{
+    Tcl_Obj *optsObj, **objs;
+    Tcl_Size nobjs;
+    parser_t *parser = NULL;
+    csv_many_job_t *job;
+    int nrows = -1;
+
+    /*
+     * The options were validated by the caller so no interpreter is
+     * needed to report errors.
+     */
+    optsObj = Tcl_NewStringObj(many->options, -1);
+    Tcl_IncrRefCount(optsObj);
+    if (Tcl_ListObjGetElements(NULL, optsObj, &nobjs, &objs) == TCL_OK)
+        parser = parser_create_detached(NULL, (int) nobjs, objs, &nrows);
+
+    while (1) {
+        Tcl_MutexLock(&many->mutex);
+        if (many->cancel || many->next_job >= many->njobs) {
+            Tcl_MutexUnlock(&many->mutex);
+            break;
+        }
+        job = &many->jobs[many->next_job++];
+        job->state = JOB_RUNNING;
+        Tcl_MutexUnlock(&many->mutex);
+
+        if (parser)
+            csv_many_parse(parser, nrows, job, many->encoding);
+        else
+            csv_many_set_error(job, "Invalid parser options.");
+
+        Tcl_MutexLock(&many->mutex);
+        job->state = JOB_DONE;
+        *many->done_tail = job;
+        many->done_tail = &job->next_done;
+        Tcl_ConditionNotify(&many->job_done);
+        Tcl_MutexUnlock(&many->mutex);
+    }
+
+    if (parser)
+        parser_free(parser);
+    Tcl_DecrRefCount(optsObj);
+}
+
+static Tcl_ThreadCreateType csv_many_worker(ClientData clientData)
+{
+    csv_many_t *many = (csv_many_t *) clientData;
+
+    csv_many_work(many);
+
+    Tcl_MutexLock(&many->mutex);
+    many->nworkers--;
+    Tcl_ConditionNotify(&many->job_done);
+    Tcl_MutexUnlock(&many->mutex);
+
+    Tcl_ExitThread(0);
+    TCL_THREAD_CREATE_RETURN;
+}
+
+/*
+ * Converts the native rows of a job into a list of rows. Rows returned as
+ * dictionaries share the key objects made from the header. Fields beyond
+ * the header are keyed by their position.
+ */
+static Tcl_Obj *csv_many_rows_obj(csv_many_job_t *job, int rows_as_dicts)
+{
+    csv_spans_t *spans = &job->spans;
+    Tcl_Obj *rowsObj, **cells = NULL, **keys = NULL;
+    size_t r, c, first, ncells, nkeys = 0, max_cells = 0;
+
+    if (spans->nrows == 0)
+        return Tcl_NewObj();
+    if (rows_as_dicts) {
+        nkeys = spans->rows[1];
+        keys = ckalloc((nkeys + 1) * sizeof(*keys));
+        for (c = 0; c < nkeys; ++c) {
+            keys[c] = Tcl_NewStringObj(spans->data + spans->cells[c],
+                                       (Tcl_Size) (spans->cells[c+1] -
+                                                   spans->cells[c]));
+            Tcl_IncrRefCount(keys[c]);
+        }
+    }
+    rowsObj = Tcl_NewListObj((Tcl_Size) (spans->nrows - 1), NULL);
+    for (r = 1; r < spans->nrows; ++r) {
+        first = spans->rows[r];
+        ncells = spans->rows[r+1] - first;
+        if (2 * ncells > max_cells) {
+            max_cells = 2 * ncells;
+            cells = ckrealloc(cells, max_cells * sizeof(*cells));
+        }
+        for (c = 0; c < ncells; ++c) {
+            Tcl_Obj *valueObj;
+            valueObj = Tcl_NewStringObj(
+                spans->data + spans->cells[first + c],
+                (Tcl_Size) (spans->cells[first + c + 1] -
+                            spans->cells[first + c]));
+            if (rows_as_dicts) {
+                cells[2*c] = c < nkeys ? keys[c] :
+                    Tcl_NewWideIntObj((Tcl_WideInt) c);
+                cells[2*c+1] = valueObj;
+            } else {
+                cells[c] = valueObj;
+            }
+        }
+        Tcl_ListObjAppendElement(NULL, rowsObj, Tcl_NewListObj(
+                                     (Tcl_Size) (rows_as_dicts ? 2 * ncells :
+                                                 ncells), cells));
+    }
+    for (c = 0; c < nkeys; ++c)
+        Tcl_DecrRefCount(keys[c]);
+    if (keys)
+        ckfree(keys);
+    if (cells)
+        ckfree(cells);
+    return rowsObj;
+}
+
+/* Invokes the callback for a completed job */
+static int csv_many_callback(Tcl_Interp *ip, Tcl_Obj *cmdObj,
+                             csv_many_job_t *job, int rows_as_dicts)
+{
+    Tcl_Obj *evalObj;
+    int res;
+
+    evalObj = Tcl_DuplicateObj(cmdObj);
+    Tcl_IncrRefCount(evalObj);
+    Tcl_ListObjAppendElement(NULL, evalObj, Tcl_NewStringObj(job->path, -1));
+    if (job->error) {
+        Tcl_ListObjAppendElement(NULL, evalObj, Tcl_NewStringObj("error", 5));
+        Tcl_ListObjAppendElement(NULL, evalObj,
+                                 Tcl_NewStringObj(job->error, -1));
+    } else {
+        Tcl_ListObjAppendElement(NULL, evalObj, Tcl_NewStringObj("ok", 2));
+        Tcl_ListObjAppendElement(NULL, evalObj,
+                                 csv_many_rows_obj(job, rows_as_dicts));
+    }
+    res = Tcl_EvalObjEx(ip, evalObj, TCL_EVAL_GLOBAL);
+    Tcl_DecrRefCount(evalObj);
+    return res;
+}
+
+static void csv_many_free_job(csv_many_job_t *job)
+{
+    free(job->path);
+    if (job->error != csv_many_no_memory)
+        free(job->error);
+    csv_spans_free(&job->spans);
+    job->path = job->error = NULL;
+}
+
+int csv_read_many_cmd(ClientData clientdata, Tcl_Interp *ip,
+                      int objc, Tcl_Obj *const objv[])
+{
+    static const char *switches[] = {
+        "-command", "-encoding", "-threads", NULL
+    };
+    enum switches_e {
+        CSV_COMMAND, CSV_ENCODING, CSV_THREADS
+    };
+    csv_many_t many;
+    Tcl_Obj *optsObj, **objs, *cmdObj = NULL, *resultObj = NULL;
+    Tcl_Obj **paths;
+    Tcl_Size i, nobjs, npaths;
+    Tcl_ThreadId *tids = NULL;
+    parser_t *parser;
+    int opt, nthreads = 4, nstarted = 0, rows_as_dicts, nrows, res;
+
+    if (objc < 2) {
+        Tcl_WrongNumArgs(ip, 1, objv, "?options? PATHLIST");
+        return TCL_ERROR;
+    }
+
+    /* Separate our own options from those for the parser */
+    optsObj = Tcl_NewListObj(0, NULL);
+    Tcl_IncrRefCount(optsObj);
+    for (i = 1; i < objc-1; i += 2) {
+        if ((i+1) >= (objc-1)) {
+            Tcl_SetResult(ip, "Missing value for option.", TCL_STATIC);
+            goto error_return;
+        }
+        if (Tcl_GetIndexFromObj(NULL, objv[i], switches, "option",
+                                TCL_EXACT, &opt) != TCL_OK) {
+            Tcl_ListObjAppendElement(NULL, optsObj, objv[i]);
+            Tcl_ListObjAppendElement(NULL, optsObj, objv[i+1]);
+            continue;
+        }
+        switch ((enum switches_e) opt) {
+        case CSV_COMMAND:
+            if (Tcl_ListObjLength(NULL, objv[i+1], &nobjs) != TCL_OK)
+                goto invalid_option_value;
+            cmdObj = nobjs ? objv[i+1] : NULL;
+            break;
+        case CSV_ENCODING:
+            {
+                Tcl_Encoding enc;
+                enc = Tcl_GetEncoding(ip, Tcl_GetString(objv[i+1]));
+                if (enc == NULL)
+                    goto error_return;
+                Tcl_FreeEncoding(enc);
+            }
+            break;
+        case CSV_THREADS:
+            if (Tcl_GetIntFromObj(NULL, objv[i+1], &nthreads) != TCL_OK ||
+                nthreads <= 0 || nthreads > 256)
+                goto invalid_option_value;
+            break;
+        }
+    }
+
+    /* Validate parser options here so errors are not reported per file */
+    Tcl_ListObjGetElements(NULL, optsObj, &nobjs, &objs);
+    parser = parser_create_detached(ip, (int) nobjs, objs, &nrows);
+    if (parser == NULL)
+        goto error_return;
+    rows_as_dicts = parser->rows_as_dicts;
+    res = parser->stats_var != NULL;
+    parser_free(parser);
+    if (res) {
+        Tcl_SetResult(ip, "Option -statsvar is not valid in this mode.", TCL_STATIC);
+        goto error_return;
+    }
+
+    if (Tcl_ListObjGetElements(ip, objv[objc-1], &npaths, &paths) != TCL_OK)
+        goto error_return;
+
+    memset(&many, 0, sizeof(many));
+    many.done_tail = &many.done_head;
+    many.options = malloc(strlen(Tcl_GetString(optsObj)) + 1);
+    strcpy(many.options, Tcl_GetString(optsObj));
+    for (i = 1; i < objc-1; i += 2) {
+        if (!strcmp(Tcl_GetString(objv[i]), "-encoding")) {
+            free(many.encoding);
+            many.encoding = malloc(strlen(Tcl_GetString(objv[i+1])) + 1);
+            strcpy(many.encoding, Tcl_GetString(objv[i+1]));
+        }
+    }
+    many.jobs = calloc(npaths ? npaths : 1, sizeof(*many.jobs));
+    many.njobs = npaths;
+    for (i = 0; i < npaths; ++i) {
+        Tcl_Obj *normObj = Tcl_FSGetNormalizedPath(ip, paths[i]);
+        const char *path = Tcl_GetString(normObj ? normObj : paths[i]);
+        many.jobs[i].path = malloc(strlen(path) + 1);
+        strcpy(many.jobs[i].path, path);
+    }
+
+    if (nthreads > npaths)
+        nthreads = (int) npaths;
+    if (nthreads > 0)
+        tids = ckalloc(nthreads * sizeof(*tids));
+    for (i = 0; i < nthreads; ++i) {
+        Tcl_MutexLock(&many.mutex);
+        many.nworkers++;
+        Tcl_MutexUnlock(&many.mutex);
+        if (Tcl_CreateThread(&tids[nstarted], csv_many_worker, &many,
+                             TCL_THREAD_STACK_DEFAULT,
+                             TCL_THREAD_JOINABLE) != TCL_OK) {
+            Tcl_MutexLock(&many.mutex);
+            many.nworkers--;
+            Tcl_MutexUnlock(&many.mutex);
+            break;
+        }
+        nstarted++;
+    }
+    /* If threads are not available, do the work in this thread */
+    if (nstarted == 0)
+        csv_many_work(&many);
+
+    res = TCL_OK;
+    if (cmdObj) {
+        /* Deliver in order of completion */
+        while (1) {
+            csv_many_job_t *job;
+            Tcl_MutexLock(&many.mutex);
+            while (many.done_head == NULL && many.nworkers > 0)
+                Tcl_ConditionWait(&many.job_done, &many.mutex, NULL);
+            job = many.done_head;
+            if (job) {
+                many.done_head = job->next_done;
+                if (many.done_head == NULL)
+                    many.done_tail = &many.done_head;
+            }
+            Tcl_MutexUnlock(&many.mutex);
+            if (job == NULL)
+                break;
+            res = csv_many_callback(ip, cmdObj, job, rows_as_dicts);
+            csv_many_free_job(job);
+            if (res != TCL_OK) {
+                Tcl_MutexLock(&many.mutex);
+                many.cancel = 1;
+                Tcl_MutexUnlock(&many.mutex);
+                break;
+            }
+        }
+        if (res == TCL_OK)
+            Tcl_ResetResult(ip);
+    } else {
+        /* Deliver in input order */
+        resultObj = Tcl_NewListObj(npaths, NULL);
+        Tcl_IncrRefCount(resultObj);
+        for (i = 0; i < npaths; ++i) {
+            csv_many_job_t *job = &many.jobs[i];
+            Tcl_MutexLock(&many.mutex);
+            while (job->state != JOB_DONE)
+                Tcl_ConditionWait(&many.job_done, &many.mutex, NULL);
+            Tcl_MutexUnlock(&many.mutex);
+            if (job->error) {
+                Tcl_SetObjResult(ip, Tcl_ObjPrintf("%s: %s", job->path,
+                                                   job->error));
+                Tcl_MutexLock(&many.mutex);
+                many.cancel = 1;
+                Tcl_MutexUnlock(&many.mutex);
+                res = TCL_ERROR;
+                break;
+            }
+            Tcl_ListObjAppendElement(NULL, resultObj,
+                                     csv_many_rows_obj(job, rows_as_dicts));
+            csv_many_free_job(job);
+        }
+        if (res == TCL_OK)
+            Tcl_SetObjResult(ip, resultObj);
+        Tcl_DecrRefCount(resultObj);
+    }
+
+    for (i = 0; i < nstarted; ++i) {
+        int code;
+        Tcl_JoinThread(tids[i], &code);
+    }
+    if (tids)
+        ckfree(tids);
+    for (i = 0; i < npaths; ++i)
+        csv_many_free_job(&many.jobs[i]);
+    free(many.jobs);
+    free(many.options);
+    free(many.encoding);
+    Tcl_ConditionFinalize(&many.job_done);
+    Tcl_MutexFinalize(&many.mutex);
+    Tcl_DecrRefCount(optsObj);
+    return res;
+
+invalid_option_value: /* objv[i] should be the invalid option */
+    Tcl_SetObjResult(ip, Tcl_ObjPrintf("Invalid value for option %s.", Tcl_GetString(objv[i])));
+error_return:
+    Tcl_DecrRefCount(optsObj);
+    return TCL_ERROR;
+}
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 4
+ * fill-column: 78
+ * tab-width: 8
+ * End:
+ */
@@ -0,0 +1,648 @@
+/*
+ * Copyright (c) 2015-2023, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file license.terms for license
+ */
+
+/*
+ * CSV dialect detection. See csvsniff.h for the interface.
+ *
+ * The heuristics are those of the original Tcl implementation of sniff.
+ * The delimiter is the candidate whose records most often have the same
+ * number of fields, weighted towards more fields. Leading spaces are
+ * skipped if the same columns have them in every record or if quoted
+ * fields follow them, and a comment character is one that most records
+ * with too few fields start with.
+ *
+ * Column types also follow the Tcl implementation of sniff_header. Values
+ * with a leading zero, other than 0 itself and decimal fractions, are
+ * strings so that codes like zip codes are not taken for numbers.
+ * Surrounding whitespace is ignored.
+ *
+ * This file must not depend on Tcl.
+ */
+
+#include <ctype.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_MSC_VER)
+#include "ms_stdint.h"
+#else
+#include <stdint.h>
+#endif
+
+#include "csvsniff.h"
+
+/* Summary of a record as seen by one candidate */
+typedef struct sniff_record {
+    int nfields;
+    int nspaces;                /* Fields with a leading space */
+    uint32_t spacehash;         /* Hash of the columns with leading spaces */
+    int stray;                  /* A quoted field had text after its end */
+    unsigned char first;        /* First character other than whitespace */
+} sniff_record;
+
+/* Tokenizing state for one combination of delimiter and quote */
+typedef struct sniff_machine {
+    char delimiter;
+    char quotechar;
+    int done;                   /* CSV_SNIFF_RECORDS records seen */
+    int in_quotes;
+    int field_start;            /* Only spaces seen in field so far */
+    int field_space;            /* Field has a leading space */
+    int nonempty;               /* Current line has characters */
+    sniff_record cur;
+    int nrecords;
+    long quoted;                /* Fields starting with a quote */
+    long space_quoted;          /* Quoted fields with leading spaces */
+    long doubled;               /* Doubled quotes within quoted fields */
+    long crlf, cr, lf;          /* Line terminators outside quotes */
+    long escapes[256];          /* Characters preceding embedded quotes */
+    sniff_record records[CSV_SNIFF_RECORDS];
+} sniff_machine;
+
+static const char sniff_quotes[] = { '"', '\'' };
+
+static int sniff_is_eol(char c)
+{
+    return c == '\n' || c == '\r';
+}
+
+static void sniff_end_record(sniff_machine *m)
+{
+    /* Empty lines are ignored. Lines with only spaces are not. */
+    if (m->nonempty) {
+        m->cur.nfields += 1;
+        m->records[m->nrecords++] = m->cur;
+        if (m->nrecords == CSV_SNIFF_RECORDS)
+            m->done = 1;
+    }
+    memset(&m->cur, 0, sizeof(m->cur));
+    m->nonempty = 0;
+    m->in_quotes = 0;
+    m->field_start = 1;
+    m->field_space = 0;
+}
+
+/*
+ * Runs the machine over the len bytes of data until CSV_SNIFF_RECORDS
+ * records have been seen. Quoted text and runs of ordinary characters
+ * within fields are skipped over in bulk.
+ */
+static void sniff_run(sniff_machine *m, const char *data, size_t len)
+{
+    unsigned char special[256];
+    size_t i = 0;
+    char c, next, prev;
+    const char *q;
+
+    memset(special, 0, sizeof(special));
+    special[(unsigned char) m->delimiter] = 1;
+    special['\r'] = 1;
+    special['\n'] = 1;
+
+    while (i < len && ! m->done) {
+        if (m->in_quotes) {
+            /* Delimiters and line ends are part of quoted fields */
+            q = memchr(data + i, m->quotechar, len - i);
+            if (q == NULL)
+                break;
+            i = q - data;
+            next = (i + 1) < len ? data[i+1] : '\0';
+            prev = data[i-1];  /* Opening quote at least precedes it */
+            if (next == m->quotechar) {
+                m->doubled++;
+                i += 2;
+                continue;
+            }
+            if ((i + 1) >= len || next == m->delimiter ||
+                sniff_is_eol(next)) {
+                m->in_quotes = 0;
+            } else if (!isalnum((unsigned char) prev) && prev != ' ' &&
+                       prev != m->quotechar && !(prev & 0x80)) {
+                /* Quote within the field preceded by a possible escape */
+                m->escapes[(unsigned char) prev]++;
+            } else {
+                m->in_quotes = 0; /* Stray quote. Treat as closing. */
+                m->cur.stray = 1;
+            }
+            i++;
+            continue;
+        }
+
+        c = data[i];
+        if (c == m->delimiter) {
+            m->nonempty = 1;
+            m->cur.nfields++;
+            m->field_start = 1;
+            m->field_space = 0;
+            if (m->cur.first == 0)
+                m->cur.first = (unsigned char) c;
+            i++;
+            continue;
+        }
+        if (sniff_is_eol(c)) {
+            next = (i + 1) < len ? data[i+1] : '\0';
+            if (c == '\r' && next == '\n') {
+                m->crlf++;
+                i++;
+            } else if (c == '\r') {
+                m->cr++;
+            } else {
+                m->lf++;
+            }
+            sniff_end_record(m);
+            i++;
+            continue;
+        }
+        m->nonempty = 1;
+        if (m->field_start) {
+            if (c == ' ') {
+                if (! m->field_space) {
+                    m->field_space = 1;
+                    m->cur.nspaces++;
+                    m->cur.spacehash = 31 * m->cur.spacehash +
+                        (uint32_t) m->cur.nfields + 1;
+                }
+                i++;
+                continue;
+            }
+            m->field_start = 0;
+            if (c == m->quotechar) {
+                m->in_quotes = 1;
+                m->quoted++;
+                if (m->field_space)
+                    m->space_quoted++;
+                if (m->cur.first == 0)
+                    m->cur.first = (unsigned char) c;
+                i++;
+                continue;
+            }
+        }
+        /* Rest of an unquoted field */
+        while (m->cur.first == 0 && i < len &&
+               ! special[(unsigned char) data[i]]) {
+            if (data[i] != '\t')
+                m->cur.first = (unsigned char) data[i];
+            i++;
+        }
+        while (i < len && ! special[(unsigned char) data[i]])
+            i++;
+    }
+}
+
+/*
+ * Returns the most common number of fields in the machine's records and
+ * stores the number of records having it in *pcount. Ties go to the
+ * larger number of fields. Records with stray quotes are not counted as
+ * they suggest the data is not being split correctly.
+ */
+static int sniff_mode(const sniff_machine *m, int *pcount)
+{
+    /* Distinct field counts and their frequencies. Usually very few. */
+    int values[CSV_SNIFF_RECORDS], counts[CSV_SNIFF_RECORDS];
+    int i, j, ndistinct = 0, mode = 0, mode_count = 0;
+
+    for (i = 0; i < m->nrecords; ++i) {
+        if (m->records[i].stray)
+            continue;
+        for (j = 0; j < ndistinct; ++j) {
+            if (values[j] == m->records[i].nfields)
+                break;
+        }
+        if (j == ndistinct) {
+            values[ndistinct] = m->records[i].nfields;
+            counts[ndistinct++] = 0;
+        }
+        counts[j]++;
+    }
+    for (j = 0; j < ndistinct; ++j) {
+        if (counts[j] > mode_count ||
+            (counts[j] == mode_count && values[j] > mode)) {
+            mode = values[j];
+            mode_count = counts[j];
+        }
+    }
+    *pcount = mode_count;
+    return mode;
+}
+
+/*
+ * Returns the number of lines in data, counting \r\n as one line end.
+ * Used by callers to decide whether a sample is large enough.
+ */
+size_t csv_sniff_lines(const char *data, size_t len)
+{
+    size_t i, n = 0;
+
+    for (i = 0; i < len; ++i) {
+        if (data[i] == '\n')
+            n++;
+        else if (data[i] == '\r' && (i + 1 == len || data[i+1] != '\n'))
+            n++;
+    }
+    return n;
+}
+
+/*
+ * Guesses the dialect of the len bytes of CSV data. at_eof should be set
+ * if data extends to the end of the input, in which case a final record
+ * without a line terminator is included. Only single byte delimiters are
+ * supported. Returns 0 on success and -1 if there were no records.
+ */
+int csv_sniff(const char *data, size_t len, int at_eof,
+              const char *delimiters, size_t ndelimiters,
+              csv_dialect_t *dialect)
+{
+    sniff_machine *machines, *m, *best;
+    size_t nmachines, k;
+    double weight, best_weight = 0;
+    const sniff_record *first_good;
+    int q, mode, mode_count, best_mode = 0, nshort, mismatch;
+    long counts[256], escape_count, max_quoted;
+    char quotechar;
+
+    nmachines = 0;
+    machines = calloc(ndelimiters * 2 + 1, sizeof(*machines));
+    if (machines == NULL)
+        return -1;
+    for (k = 0; k < ndelimiters; ++k) {
+        for (q = 0; q < (int) sizeof(sniff_quotes); ++q) {
+            if (delimiters[k] == sniff_quotes[q])
+                continue;
+            m = &machines[nmachines++];
+            m->delimiter = delimiters[k];
+            m->quotechar = sniff_quotes[q];
+            m->field_start = 1;
+        }
+    }
+
+    for (k = 0; k < nmachines; ++k)
+        sniff_run(&machines[k], data, len);
+    if (at_eof) {
+        for (k = 0; k < nmachines; ++k) {
+            if (! machines[k].done)
+                sniff_end_record(&machines[k]);
+        }
+    }
+
+    /*
+     * The quote character is the one seen at the start of fields most
+     * often under any delimiter, by default a double quote. Comparing
+     * delimiters under the wrong quote character would favor those that
+     * split quoted fields into more pieces.
+     */
+    quotechar = sniff_quotes[0];
+    max_quoted = 0;
+    for (k = 0; k < nmachines; ++k) {
+        if (machines[k].quoted > max_quoted) {
+            max_quoted = machines[k].quoted;
+            quotechar = machines[k].quotechar;
+        }
+    }
+
+    /*
+     * Delimiters whose records more often have the same number of fields
+     * are preferred, and then those with more fields as it is less
+     * likely a character occurs several times in every line by chance.
+     * A delimiter that does not occur at all is consistent for every
+     * record, comment lines included, but is no evidence of anything so
+     * its weight is halved.
+     */
+    best = NULL;
+    for (k = 0; k < nmachines; ++k) {
+        m = &machines[k];
+        if (m->nrecords == 0 || m->quotechar != quotechar)
+            continue;
+        mode = sniff_mode(m, &mode_count);
+        weight = sqrt((double) mode) * mode_count / m->nrecords;
+        if (mode == 1)
+            weight /= 2;
+        if (best == NULL || weight > best_weight) {
+            best = m;
+            best_weight = weight;
+            best_mode = mode;
+        }
+    }
+    if (best == NULL) {
+        free(machines);
+        return -1;
+    }
+
+    m = best;
+    memset(dialect, 0, sizeof(*dialect));
+    dialect->delimiter = m->delimiter;
+    dialect->nfields = best_mode;
+    dialect->nrecords = m->nrecords;
+    if (m->quoted > 0)
+        dialect->quotechar = m->quotechar;
+    if (m->doubled > 0) {
+        dialect->doublequote = 1;
+    } else {
+        escape_count = 0;
+        for (k = 0; k < 256; ++k) {
+            if (m->escapes[k] > escape_count) {
+                escape_count = m->escapes[k];
+                dialect->escapechar = (char) k;
+            }
+        }
+    }
+    if (m->crlf >= m->lf && m->crlf >= m->cr && m->crlf > 0)
+        strcpy(dialect->lineterminator, "\r\n");
+    else if (m->cr > m->lf)
+        strcpy(dialect->lineterminator, "\r");
+    else
+        strcpy(dialect->lineterminator, "\n");
+
+    /*
+     * Leading spaces are skipped if records with the expected number of
+     * fields all have them in the same set of columns.
+     */
+    dialect->skipleadingspace = -1;
+    first_good = NULL;
+    mismatch = 0;
+    nshort = 0;
+    memset(counts, 0, sizeof(counts));
+    for (k = 0; k < (size_t) m->nrecords; ++k) {
+        const sniff_record *r = &m->records[k];
+        if (r->nfields == best_mode) {
+            if (first_good == NULL)
+                first_good = r;
+            if (r->nspaces > 0)
+                dialect->skipleadingspace = 1;
+            if (r->nspaces != first_good->nspaces ||
+                r->spacehash != first_good->spacehash)
+                mismatch = 1;
+        } else if (r->nfields < best_mode) {
+            counts[r->first]++;
+            nshort++;
+        }
+    }
+    if (dialect->skipleadingspace == 1 && mismatch)
+        dialect->skipleadingspace = 0;
+    /* Quotes after leading spaces are only recognized if they are skipped */
+    if (m->space_quoted > 0)
+        dialect->skipleadingspace = 1;
+
+    /* The bulk of the short records starting with the same punctuation */
+    for (k = 0; k < 256 && nshort > 0; ++k) {
+        if (counts[k] > 0 && (double) counts[k] / nshort > 0.8 &&
+            k < 128 && ispunct((int) k) && (char) k != m->delimiter &&
+            (char) k != m->quotechar) {
+            dialect->commentchar = (char) k;
+            break;
+        }
+    }
+
+    free(machines);
+    return 0;
+}
+
+/* Returns the number of characters in the len bytes of UTF-8 at s */
+size_t csv_utf8_length(const char *s, size_t len)
+{
+    size_t i, n = 0;
+
+    for (i = 0; i < len; ++i) {
+        if ((s[i] & 0xC0) != 0x80)
+            n++;
+    }
+    return n;
+}
+
+/* Removes leading and trailing whitespace from the value at *ps */
+static void trim_value(const char **ps, size_t *plen)
+{
+    const char *s = *ps, *end = *ps + *plen;
+
+    while (s < end && isspace((unsigned char) *s))
+        ++s;
+    while (end > s && isspace((unsigned char) end[-1]))
+        --end;
+    *ps = s;
+    *plen = end - s;
+}
+
+/* Advances *ps past decimal digits and returns how many there were */
+static size_t skip_digits(const char **ps, const char *end)
+{
+    const char *s = *ps;
+
+    while (s < end && *s >= '0' && *s <= '9')
+        ++s;
+    end = *ps;
+    *ps = s;
+    return s - end;
+}
+
+/* Parses an n digit number at *ps. Returns -1 if not all digits. */
+static int parse_fixed(const char **ps, const char *end, int n)
+{
+    const char *s = *ps;
+    int value = 0;
+
+    if (end - s < n)
+        return -1;
+    while (n--) {
+        if (*s < '0' || *s > '9')
+            return -1;
+        value = 10 * value + (*s++ - '0');
+    }
+    *ps = s;
+    return value;
+}
+
+static int match_word(const char *s, size_t len, const char *word)
+{
+    size_t i;
+
+    for (i = 0; i < len; ++i) {
+        if (word[i] == '\0' || tolower((unsigned char) s[i]) != word[i])
+            return 0;
+    }
+    return word[len] == '\0';
+}
+
+/* Decimal integer with optional sign */
+static int is_integer(const char *s, const char *end)
+{
+    if (s < end && (*s == '+' || *s == '-'))
+        ++s;
+    return skip_digits(&s, end) > 0 && s == end;
+}
+
+/* Decimal or exponential notation, infinity or NaN */
+static int is_real(const char *s, const char *end)
+{
+    size_t ndigits;
+
+    if (s < end && (*s == '+' || *s == '-'))
+        ++s;
+    if (match_word(s, end - s, "inf") || match_word(s, end - s, "infinity") ||
+        match_word(s, end - s, "nan"))
+        return 1;
+    ndigits = skip_digits(&s, end);
+    if (s < end && *s == '.') {
+        ++s;
+        ndigits += skip_digits(&s, end);
+    }
+    if (ndigits == 0)
+        return 0;
+    if (s < end && (*s == 'e' || *s == 'E')) {
+        ++s;
+        if (s < end && (*s == '+' || *s == '-'))
+            ++s;
+        if (skip_digits(&s, end) == 0)
+            return 0;
+    }
+    return s == end;
+}
+
+static int is_boolean(const char *s, const char *end)
+{
+    static const char *words[] = {
+        "true", "false", "yes", "no", "on", "off", NULL
+    };
+    int i;
+
+    for (i = 0; words[i]; ++i) {
+        if (match_word(s, end - s, words[i]))
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * ISO 8601 date YYYY-MM-DD, optionally followed by a time hh:mm[:ss[.f]]
+ * separated by T or a space and an optional Z or numeric time zone.
+ */
+static int is_date(const char *s, const char *end)
+{
+    static const int mdays[] = {31,29,31,30,31,30,31,31,30,31,30,31};
+    int year, month, day, hour, minute, second;
+
+    if ((year = parse_fixed(&s, end, 4)) < 0 || s == end || *s++ != '-' ||
+        (month = parse_fixed(&s, end, 2)) < 1 || month > 12 ||
+        s == end || *s++ != '-' ||
+        (day = parse_fixed(&s, end, 2)) < 1 || day > mdays[month-1])
+        return 0;
+    if (month == 2 && day == 29 &&
+        (year % 4 != 0 || (year % 100 == 0 && year % 400 != 0)))
+        return 0;
+    if (s == end)
+        return 1;
+
+    if (*s != 'T' && *s != ' ')
+        return 0;
+    ++s;
+    if ((hour = parse_fixed(&s, end, 2)) < 0 || hour > 23 ||
+        s == end || *s++ != ':' ||
+        (minute = parse_fixed(&s, end, 2)) < 0 || minute > 59)
+        return 0;
+    if (s < end && *s == ':') {
+        ++s;
+        /* 60 for leap seconds */
+        if ((second = parse_fixed(&s, end, 2)) < 0 || second > 60)
+            return 0;
+        if (s < end && *s == '.') {
+            ++s;
+            if (skip_digits(&s, end) == 0)
+                return 0;
+        }
+    }
+    if (s < end && *s == 'Z')
+        ++s;
+    else if (s < end && (*s == '+' || *s == '-')) {
+        ++s;
+        if (parse_fixed(&s, end, 2) < 0)
+            return 0;
+        if (s < end && *s == ':')
+            ++s;
+        if (parse_fixed(&s, end, 2) < 0)
+            return 0;
+    }
+    return s == end;
+}
+
+/*
+ * Returns 1 if the value is a valid value of the type irrespective of
+ * leading zeroes, 0 otherwise. Any value is valid for strings.
+ */
+int csv_value_is(csv_type_t type, const char *s, size_t len)
+{
+    trim_value(&s, &len);
+    switch (type) {
+    case CSV_TYPE_INTEGER:
+        return is_integer(s, s + len);
+    case CSV_TYPE_REAL:
+        return is_real(s, s + len);
+    case CSV_TYPE_BOOLEAN:
+        return is_boolean(s, s + len);
+    case CSV_TYPE_DATE:
+        return is_date(s, s + len);
+    default:
+        return 1;
+    }
+}
+
+/* Returns the most specific type of the value */
+csv_type_t csv_value_type(const char *s, size_t len)
+{
+    const char *end;
+
+    trim_value(&s, &len);
+    end = s + len;
+    if (len == 0)
+        return CSV_TYPE_STRING;
+    if (*s == '0' && len > 1 && s[1] != '.')
+        return CSV_TYPE_STRING; /* Leading zero */
+    if (is_integer(s, end))
+        return CSV_TYPE_INTEGER;
+    if (is_real(s, end))
+        return CSV_TYPE_REAL;
+    if (is_boolean(s, end))
+        return CSV_TYPE_BOOLEAN;
+    if (is_date(s, end))
+        return CSV_TYPE_DATE;
+    return CSV_TYPE_STRING;
+}
+
+void csv_column_init(csv_column_t *col)
+{
+    col->type = CSV_TYPE_UNKNOWN;
+    col->length = -2;
+}
+
+/* Combines the state of a column for other values into into */
+void csv_column_merge(csv_column_t *into, const csv_column_t *from)
+{
+    if (into->length == -2)
+        into->length = from->length;
+    else if (from->length != -2 && from->length != into->length)
+        into->length = -1;
+
+    if (into->type == CSV_TYPE_UNKNOWN)
+        into->type = from->type;
+    else if (from->type == CSV_TYPE_UNKNOWN || from->type == into->type)
+        ;
+    else if ((into->type == CSV_TYPE_INTEGER && from->type == CSV_TYPE_REAL) ||
+             (into->type == CSV_TYPE_REAL && from->type == CSV_TYPE_INTEGER))
+        into->type = CSV_TYPE_REAL;
+    else
+        into->type = CSV_TYPE_STRING;
+}
+
+/* Updates the state of a column with the len bytes of a value at s */
+void csv_column_update(csv_column_t *col, const char *s, size_t len)
+{
+    csv_column_t value;
+
+    value.length = (int64_t) csv_utf8_length(s, len);
+    /* Once a string, only the length can change */
+    value.type = col->type == CSV_TYPE_STRING ?
+        CSV_TYPE_STRING : csv_value_type(s, len);
+    csv_column_merge(col, &value);
+}
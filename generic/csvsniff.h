@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2015-2023, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file license.terms for license
+ */
+
+/*
+ * Dialect and column type detection for CSV data. Independent of Tcl.
+ *
+ * csv_sniff looks at a sample of the data. Every combination of
+ * candidate delimiter and quote character is run over it by a small
+ * state machine so delimiters and line ends within quoted fields are
+ * not mistaken for field and record separators. The combination whose
+ * records most consistently have the same number of fields is picked
+ * and the remaining settings are derived from it.
+ *
+ * csv_column_update infers the type of a column one value at a time.
+ * Column states may be computed over parts of the data independently
+ * and combined with csv_column_merge in any order.
+ */
+
+#ifndef _CSVSNIFF_H
+#define _CSVSNIFF_H
+
+#include <stddef.h>
+
+#if defined(_MSC_VER)
+#include "ms_stdint.h"
+#else
+#include <stdint.h>
+#endif
+
+/* Maximum number of records looked at */
+#define CSV_SNIFF_RECORDS 101
+
+typedef struct csv_dialect_t {
+    char delimiter;
+    char quotechar;             /* 0 if no quoted fields were seen */
+    char escapechar;            /* 0 if none was seen */
+    char commentchar;           /* 0 if none was seen */
+    int doublequote;            /* 1 if doubled quotes were seen */
+    int skipleadingspace;       /* -1 if no field had leading spaces */
+    char lineterminator[3];     /* "\n", "\r\n" or "\r" */
+    int nfields;                /* Most common number of fields */
+    int nrecords;               /* Number of records looked at */
+} csv_dialect_t;
+
+/*
+ * Column types. A column whose values have different types is treated
+ * as real if they are all numbers and as string otherwise.
+ */
+typedef enum {
+    CSV_TYPE_UNKNOWN,           /* No values seen */
+    CSV_TYPE_INTEGER,
+    CSV_TYPE_REAL,
+    CSV_TYPE_BOOLEAN,
+    CSV_TYPE_DATE,
+    CSV_TYPE_STRING
+} csv_type_t;
+
+typedef struct csv_column_t {
+    csv_type_t type;
+    int64_t length;             /* Characters in each value, -1 if they
+                                   differ and -2 if no values seen */
+} csv_column_t;
+
+size_t csv_sniff_lines(const char *data, size_t len);
+int csv_sniff(const char *data, size_t len, int at_eof,
+              const char *delimiters, size_t ndelimiters,
+              csv_dialect_t *dialect);
+
+size_t csv_utf8_length(const char *s, size_t len);
+int csv_value_is(csv_type_t type, const char *s, size_t len);
+csv_type_t csv_value_type(const char *s, size_t len);
+void csv_column_init(csv_column_t *col);
+void csv_column_update(csv_column_t *col, const char *s, size_t len);
+void csv_column_merge(csv_column_t *into, const csv_column_t *from);
+
+#endif /* _CSVSNIFF_H */
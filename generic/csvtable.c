@@ -0,0 +1,420 @@
+/*
+ * Copyright (c) 2015-2023, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file license.terms for license
+ */
+
+/*
+ * Native tables - parsed CSV data held in a contiguous buffer that can be
+ * shared by handle between interpreters in different threads.
+ *
+ * A table is immutable once created. Tables are kept in a process-wide
+ * registry and reference counted. Cell values are converted to Tcl_Obj's
+ * only when accessed so each thread pays only for the cells it uses.
+ */
+
+#include "csv.h"
+
+typedef struct csv_table_t {
+    /*
+     * handles counts retain/release references through the handle and
+     * keeps the table in the registry. refs additionally counts commands
+     * currently accessing the table. Both are protected by tablesMutex.
+     */
+    Tcl_Size handles;
+    Tcl_Size refs;
+    Tcl_Size nrows;         /* Number of rows, not including the header */
+    /*
+     * Row r of the table holds cells rows[r] to rows[r+1]-1. Row 0 is the
+     * header and is empty if there is none. See csv_spans_t.
+     */
+    size_t *rows;
+    size_t *cells;          /* Cell c is data[cells[c]] to data[cells[c+1]] */
+    char *data;
+} csv_table_t;
+
+TCL_DECLARE_MUTEX(tablesMutex)
+static Tcl_HashTable tables;        /* Handle -> csv_table_t */
+static int tablesInitialized;
+static unsigned long tablesCounter;
+
+static void csv_table_free(csv_table_t *table)
+{
+    free(table->rows);
+    free(table->cells);
+    free(table->data);
+    free(table);
+}
+
+/*
+ * Builds a table from parsed spans, taking over their buffers. Returns
+ * NULL if out of memory or the table has too many rows, leaving the spans
+ * untouched.
+ */
+static csv_table_t *csv_table_new(csv_spans_t *spans)
+{
+    csv_table_t *table;
+
+    if (spans->nrows - 1 > (size_t) TCL_SIZE_MAX)
+        return NULL;
+    table = malloc(sizeof(*table));
+    if (table == NULL)
+        return NULL;
+    table->handles = 0;
+    table->refs = 0;
+    table->nrows = (Tcl_Size) (spans->nrows - 1);
+    table->rows = spans->rows;
+    table->cells = spans->cells;
+    table->data = spans->data;
+    memset(spans, 0, sizeof(*spans));
+    return table;
+}
+
+/* Adds a table to the registry and returns its handle */
+static Tcl_Obj *csv_table_register(csv_table_t *table)
+{
+    Tcl_HashEntry *he;
+    char handle[40];
+    int new_entry;
+
+    Tcl_MutexLock(&tablesMutex);
+    if (! tablesInitialized) {
+        Tcl_InitHashTable(&tables, TCL_STRING_KEYS);
+        tablesInitialized = 1;
+    }
+    sprintf(handle, "csvtable%lu", ++tablesCounter);
+    he = Tcl_CreateHashEntry(&tables, handle, &new_entry);
+    Tcl_SetHashValue(he, table);
+    table->handles = 1;
+    table->refs = 1;            /* Released when removed from registry */
+    Tcl_MutexUnlock(&tablesMutex);
+    return Tcl_NewStringObj(handle, -1);
+}
+
+/*
+ * Looks up a table and adds a reference to it so it stays valid even if
+ * another thread releases it. The reference must be dropped with
+ * csv_table_unref.
+ */
+static csv_table_t *csv_table_ref(Tcl_Interp *ip, Tcl_Obj *handleObj)
+{
+    Tcl_HashEntry *he = NULL;
+    csv_table_t *table = NULL;
+
+    Tcl_MutexLock(&tablesMutex);
+    if (tablesInitialized)
+        he = Tcl_FindHashEntry(&tables, Tcl_GetString(handleObj));
+    if (he) {
+        table = Tcl_GetHashValue(he);
+        table->refs++;
+    }
+    Tcl_MutexUnlock(&tablesMutex);
+    if (table == NULL && ip)
+        Tcl_SetObjResult(ip, Tcl_ObjPrintf("Invalid table handle \"%s\".",
+                                           Tcl_GetString(handleObj)));
+    return table;
+}
+
+static void csv_table_unref(csv_table_t *table)
+{
+    Tcl_MutexLock(&tablesMutex);
+    if (--table->refs > 0)
+        table = NULL;
+    Tcl_MutexUnlock(&tablesMutex);
+    if (table)
+        csv_table_free(table);
+}
+
+/* Drops a handle reference. The table is freed once unused. */
+static int csv_table_release(Tcl_Interp *ip, Tcl_Obj *handleObj)
+{
+    Tcl_HashEntry *he = NULL;
+    csv_table_t *table = NULL;
+    int found = 0;
+
+    Tcl_MutexLock(&tablesMutex);
+    if (tablesInitialized)
+        he = Tcl_FindHashEntry(&tables, Tcl_GetString(handleObj));
+    if (he) {
+        found = 1;
+        table = Tcl_GetHashValue(he);
+        if (--table->handles == 0) {
+            Tcl_DeleteHashEntry(he);
+            if (--table->refs > 0)
+                table = NULL;   /* Still being accessed */
+        } else
+            table = NULL;
+    }
+    Tcl_MutexUnlock(&tablesMutex);
+    if (! found) {
+        Tcl_SetObjResult(ip, Tcl_ObjPrintf("Invalid table handle \"%s\".",
+                                           Tcl_GetString(handleObj)));
+        return TCL_ERROR;
+    }
+    if (table)
+        csv_table_free(table);
+    return TCL_OK;
+}
+
+static Tcl_Obj *csv_table_cell_obj(csv_table_t *table, size_t cell)
+{
+    return Tcl_NewStringObj(table->data + table->cells[cell],
+                            (Tcl_Size) (table->cells[cell+1] -
+                                        table->cells[cell]));
+}
+
+/* Returns row r (0 is the header) as a list */
+static Tcl_Obj *csv_table_row_obj(csv_table_t *table, Tcl_Size r)
+{
+    Tcl_Obj *rowObj;
+    size_t c, first = table->rows[r], last = table->rows[r+1];
+
+    rowObj = Tcl_NewListObj((Tcl_Size) (last - first), NULL);
+    for (c = first; c < last; ++c)
+        Tcl_ListObjAppendElement(NULL, rowObj, csv_table_cell_obj(table, c));
+    return rowObj;
+}
+
+static int csv_table_index(Tcl_Interp *ip, Tcl_Obj *indexObj,
+                           Tcl_Size limit, const char *what, Tcl_Size *pindex)
+{
+    Tcl_Size index;
+    if (Tcl_GetSizeIntFromObj(ip, indexObj, &index) != TCL_OK)
+        return TCL_ERROR;
+    if (index < 0 || index >= limit) {
+        Tcl_SetObjResult(ip, Tcl_ObjPrintf("%s index out of range.", what));
+        return TCL_ERROR;
+    }
+    *pindex = index;
+    return TCL_OK;
+}
+
+/*
+ * Parses a channel into a new table. Fields are copied into the table
+ * buffers as they are tokenized without creating Tcl_Obj's for them.
+ */
+static int csv_table_read(Tcl_Interp *ip, int objc, Tcl_Obj *const objv[])
+{
+    parser_t *parser;
+    csv_table_t *table;
+    csv_spans_t spans;
+    int nrows, res;
+
+    parser = parser_create(ip, objc, objv, &nrows);
+    if (parser == NULL)
+        return TCL_ERROR;
+    if (parser->stats_var) {
+        parser_free(parser);
+        Tcl_SetResult(ip, "Option -statsvar is not valid in this mode.", TCL_STATIC);
+        return TCL_ERROR;
+    }
+    /* Cells are indexed by column so rows must be lists */
+    if (parser->rows_as_dicts) {
+        parser_free(parser);
+        Tcl_SetResult(ip, "Option -rows dict is not valid in this mode.", TCL_STATIC);
+        return TCL_ERROR;
+    }
+
+    memset(&spans, 0, sizeof(spans));
+    res = csv_spans_parse(parser, nrows, &spans) == 0 ? TCL_OK : TCL_ERROR;
+    if (res == TCL_OK) {
+        table = csv_table_new(&spans);
+        if (table)
+            Tcl_SetObjResult(ip, csv_table_register(table));
+        else {
+            csv_spans_free(&spans);
+            Tcl_SetResult(ip, "Out of memory.", TCL_STATIC);
+            res = TCL_ERROR;
+        }
+    } else {
+        if (parser->errorObj)
+            Tcl_SetObjResult(ip, parser->errorObj);
+        else
+            Tcl_SetResult(ip, "Error parsing CSV.", TCL_STATIC);
+    }
+    parser_free(parser);
+    return res;
+}
+
+int csv_table_cmd(ClientData clientdata, Tcl_Interp *ip,
+                  int objc, Tcl_Obj *const objv[])
+{
+    static const char *cmdNames[] = {
+        "cell", "column", "header", "read", "release", "retain",
+        "row", "rows", "size", NULL
+    };
+    enum cmds {
+        CMD_cell, CMD_column, CMD_header, CMD_read, CMD_release, CMD_retain,
+        CMD_row, CMD_rows, CMD_size
+    };
+    csv_table_t *table;
+    Tcl_Obj *resultObj;
+    Tcl_Size r, c, first, last;
+    int cmd, res = TCL_OK;
+
+    if (objc < 2) {
+        Tcl_WrongNumArgs(ip, 1, objv, "option ?arg arg ...?");
+        return TCL_ERROR;
+    }
+    if (Tcl_GetIndexFromObj(ip, objv[1], cmdNames, "option", 0, &cmd)
+        != TCL_OK)
+        return TCL_ERROR;
+
+    switch ((enum cmds) cmd) {
+    case CMD_read:
+        if (objc < 3) {
+            Tcl_WrongNumArgs(ip, 2, objv, "?options? CHANNEL");
+            return TCL_ERROR;
+        }
+        return csv_table_read(ip, objc-2, objv+2);
+    case CMD_release:
+        if (objc != 3) {
+            Tcl_WrongNumArgs(ip, 2, objv, "TABLE");
+            return TCL_ERROR;
+        }
+        return csv_table_release(ip, objv[2]);
+    default:
+        break;
+    }
+
+    if (objc < 3) {
+        Tcl_WrongNumArgs(ip, 2, objv, "TABLE ?arg arg ...?");
+        return TCL_ERROR;
+    }
+    table = csv_table_ref(ip, objv[2]);
+    if (table == NULL)
+        return TCL_ERROR;
+
+    switch ((enum cmds) cmd) {
+    case CMD_retain:
+        if (objc != 3) {
+            Tcl_WrongNumArgs(ip, 2, objv, "TABLE");
+            res = TCL_ERROR;
+            break;
+        }
+        Tcl_MutexLock(&tablesMutex);
+        table->handles++;
+        Tcl_MutexUnlock(&tablesMutex);
+        Tcl_SetObjResult(ip, objv[2]);
+        break;
+    case CMD_size:
+        if (objc != 3) {
+            Tcl_WrongNumArgs(ip, 2, objv, "TABLE");
+            res = TCL_ERROR;
+            break;
+        }
+        Tcl_SetObjResult(ip, Tcl_NewWideIntObj(table->nrows));
+        break;
+    case CMD_header:
+        if (objc != 3) {
+            Tcl_WrongNumArgs(ip, 2, objv, "TABLE");
+            res = TCL_ERROR;
+            break;
+        }
+        Tcl_SetObjResult(ip, csv_table_row_obj(table, 0));
+        break;
+    case CMD_row:
+        if (objc != 4) {
+            Tcl_WrongNumArgs(ip, 2, objv, "TABLE ROW");
+            res = TCL_ERROR;
+            break;
+        }
+        res = csv_table_index(ip, objv[3], table->nrows, "Row", &r);
+        if (res == TCL_OK)
+            Tcl_SetObjResult(ip, csv_table_row_obj(table, r+1));
+        break;
+    case CMD_cell:
+        if (objc != 5) {
+            Tcl_WrongNumArgs(ip, 2, objv, "TABLE ROW COLUMN");
+            res = TCL_ERROR;
+            break;
+        }
+        res = csv_table_index(ip, objv[3], table->nrows, "Row", &r);
+        if (res != TCL_OK)
+            break;
+        /* Cells missing from short rows are treated as empty */
+        res = Tcl_GetSizeIntFromObj(ip, objv[4], &c);
+        if (res != TCL_OK)
+            break;
+        if (c < 0) {
+            Tcl_SetResult(ip, "Column index out of range.", TCL_STATIC);
+            res = TCL_ERROR;
+            break;
+        }
+        if (table->rows[r+1] + (size_t) c < table->rows[r+2])
+            Tcl_SetObjResult(ip, csv_table_cell_obj(table,
+                                                    table->rows[r+1] + c));
+        break;
+    case CMD_rows:
+    case CMD_column:
+        /* rows TABLE ?FIRST? ?LAST?, column TABLE COLUMN ?FIRST? ?LAST? */
+        {
+            int argbase = cmd == CMD_column ? 4 : 3;
+            if (objc < argbase || objc > argbase + 2) {
+                Tcl_WrongNumArgs(ip, 2, objv, cmd == CMD_column ?
+                                 "TABLE COLUMN ?FIRST? ?LAST?" :
+                                 "TABLE ?FIRST? ?LAST?");
+                res = TCL_ERROR;
+                break;
+            }
+            c = 0;
+            if (cmd == CMD_column) {
+                res = Tcl_GetSizeIntFromObj(ip, objv[3], &c);
+                if (res != TCL_OK)
+                    break;
+                if (c < 0) {
+                    Tcl_SetResult(ip, "Column index out of range.", TCL_STATIC);
+                    res = TCL_ERROR;
+                    break;
+                }
+            }
+            first = 0;
+            last = table->nrows - 1;
+            if (objc > argbase) {
+                res = Tcl_GetSizeIntFromObj(ip, objv[argbase], &first);
+                if (res != TCL_OK)
+                    break;
+                if (first < 0)
+                    first = 0;
+            }
+            if (objc > argbase + 1) {
+                res = Tcl_GetSizeIntFromObj(ip, objv[argbase+1], &last);
+                if (res != TCL_OK)
+                    break;
+                if (last >= table->nrows)
+                    last = table->nrows - 1;
+            }
+            resultObj = Tcl_NewListObj(last >= first ? last - first + 1 : 0,
+                                       NULL);
+            for (r = first; r <= last; ++r) {
+                if (cmd == CMD_rows)
+                    Tcl_ListObjAppendElement(NULL, resultObj,
+                                             csv_table_row_obj(table, r+1));
+                else if (table->rows[r+1] + c < table->rows[r+2])
+                    Tcl_ListObjAppendElement(
+                        NULL, resultObj,
+                        csv_table_cell_obj(table, table->rows[r+1] + c));
+                else
+                    Tcl_ListObjAppendElement(NULL, resultObj,
+                                             Tcl_NewObj());
+            }
+            Tcl_SetObjResult(ip, resultObj);
+        }
+        break;
+    default:
+        break;
+    }
+
+    csv_table_unref(table);
+    return res;
+}
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 4
+ * fill-column: 78
+ * tab-width: 8
+ * End:
+ */
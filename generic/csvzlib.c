@@ -0,0 +1,400 @@
+/*
+ * Copyright (c) 2015-2023, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file license.terms for license
+ */
+
+/*
+ * Compressed input and output for -compression using the zlib stream
+ * API built into Tcl.
+ *
+ * On input, compressed bytes are read from the channel with Tcl_ReadRaw,
+ * bypassing its encoding and translation, inflated and decoded with the
+ * channel's encoding straight into the buffer the tokenizer works on.
+ * This avoids the extra buffering and copies of a zlib transform pushed
+ * on the channel. With CSV_COMPRESSION_AUTO the format is detected from
+ * the first bytes and input that is neither gzip nor zlib is passed
+ * through as is.
+ *
+ * On output, formatted data is encoded, deflated and written with
+ * Tcl_WriteRaw. The compressed stream is terminated by csv_write_finish.
+ *
+ * As with zlib push, only the first member of a gzip file containing
+ * several concatenated members is read.
+ */
+
+#include "csv.h"
+
+/* Compressed bytes read from the channel at a time */
+#define CSV_INFLATE_CHUNK 65536
+
+/* Compression level for output, the zlib default */
+#define CSV_DEFLATE_LEVEL 6
+
+/* Returns the encoding configured for chan. "binary" maps to iso8859-1. */
+static Tcl_Encoding channel_encoding(Tcl_Channel chan)
+{
+    Tcl_DString ds;
+    Tcl_Encoding encoding;
+    const char *name = "iso8859-1";
+
+    Tcl_DStringInit(&ds);
+    if (Tcl_GetChannelOption(NULL, chan, "-encoding", &ds) == TCL_OK &&
+        strcmp(Tcl_DStringValue(&ds), "binary"))
+        name = Tcl_DStringValue(&ds);
+    encoding = Tcl_GetEncoding(NULL, name);
+    Tcl_DStringFree(&ds);
+    return encoding;
+}
+
+/*
+ * Returns the compression format indicated by the first bytes of the
+ * data. A zlib header is a deflate method byte whose check bits make
+ * the first two bytes a multiple of 31, without a preset dictionary.
+ */
+static enum csv_compression detect_compression(const unsigned char *p,
+                                               Tcl_Size len)
+{
+    if (len < 2)
+        return CSV_COMPRESSION_NONE;
+    if (p[0] == 0x1f && p[1] == 0x8b)
+        return CSV_COMPRESSION_GZIP;
+    if ((p[0] & 0x0f) == 8 && (p[0] >> 4) <= 7 && !(p[1] & 0x20) &&
+        ((p[0] << 8) | p[1]) % 31 == 0)
+        return CSV_COMPRESSION_ZLIB;
+    return CSV_COMPRESSION_NONE;
+}
+
+csv_inflate_t *csv_inflate_new(enum csv_compression compression)
+{
+    csv_inflate_t *inf = ckalloc(sizeof(*inf));
+
+    memset(inf, 0, sizeof(*inf));
+    inf->compression = compression;
+    inf->outObj = Tcl_NewByteArrayObj(NULL, 0);
+    Tcl_IncrRefCount(inf->outObj);
+    Tcl_DStringInit(&inf->text);
+    csv_inflate_reset(inf);
+    return inf;
+}
+
+/* Prepares for a new input stream */
+void csv_inflate_reset(csv_inflate_t *inf)
+{
+    if (inf->zstream) {
+        Tcl_ZlibStreamClose(inf->zstream);
+        inf->zstream = NULL;
+    }
+    if (inf->encoding) {
+        Tcl_FreeEncoding(inf->encoding);
+        inf->encoding = NULL;
+    }
+    inf->detected = 0;
+    inf->input_eof = 0;
+    Tcl_SetByteArrayLength(inf->outObj, 0);
+    inf->encoding_flags = TCL_ENCODING_START;
+    Tcl_DStringSetLength(&inf->text, 0);
+}
+
+void csv_inflate_free(csv_inflate_t *inf)
+{
+    csv_inflate_reset(inf);
+    Tcl_DecrRefCount(inf->outObj);
+    Tcl_DStringFree(&inf->text);
+    ckfree(inf);
+}
+
+/* Appends the bytes in srcObj to the byte array dstObj */
+static void append_bytes(Tcl_Obj *dstObj, Tcl_Obj *srcObj)
+{
+    const unsigned char *src;
+    unsigned char *dst;
+    Tcl_Size srclen, dstlen;
+
+    src = Tcl_GetByteArrayFromObj(srcObj, &srclen);
+    Tcl_GetByteArrayFromObj(dstObj, &dstlen);
+    dst = Tcl_SetByteArrayLength(dstObj, dstlen + srclen);
+    memcpy(dst + dstlen, src, srclen);
+}
+
+/*
+ * Reads the next chunk of bytes from chan. Returns a new object with a
+ * reference count of 1 or NULL on error. Sets input_eof at the end of
+ * the channel.
+ */
+static Tcl_Obj *inflate_read_raw(csv_inflate_t *inf, Tcl_Channel chan,
+                                 Tcl_Obj **errorObjPtr)
+{
+    Tcl_Obj *rawObj;
+    unsigned char *bytes;
+    Tcl_Size nread;
+
+    rawObj = Tcl_NewObj();
+    Tcl_IncrRefCount(rawObj);
+    bytes = Tcl_SetByteArrayLength(rawObj, CSV_INFLATE_CHUNK);
+    nread = Tcl_ReadRaw(chan, (char *) bytes, CSV_INFLATE_CHUNK);
+    if (nread < 0) {
+        *errorObjPtr = Tcl_ObjPrintf("Calling read(nbytes) on source failed (Error %d).", Tcl_GetErrno());
+        Tcl_DecrRefCount(rawObj);
+        return NULL;
+    }
+    Tcl_SetByteArrayLength(rawObj, nread);
+    if (nread == 0)
+        inf->input_eof = 1;
+    return rawObj;
+}
+
+/*
+ * Appends up to nbytes inflated bytes to outObj. Returns 0 if any were
+ * added, 1 at the end of the input and -1 on error.
+ */
+static int inflate_fill(csv_inflate_t *inf, Tcl_Channel chan, Tcl_Size nbytes,
+                        Tcl_Obj **errorObjPtr)
+{
+    Tcl_Obj *rawObj;
+    Tcl_Size before, after;
+    int format, res;
+
+    while (1) {
+        if (inf->zstream) {
+            Tcl_GetByteArrayFromObj(inf->outObj, &before);
+            if (Tcl_ZlibStreamGet(inf->zstream, inf->outObj, nbytes)
+                != TCL_OK) {
+                *errorObjPtr = Tcl_NewStringObj("Invalid compressed data.", -1);
+                return -1;
+            }
+            Tcl_GetByteArrayFromObj(inf->outObj, &after);
+            if (after > before)
+                return 0;
+            if (Tcl_ZlibStreamEof(inf->zstream))
+                return 1;
+            if (inf->input_eof) {
+                *errorObjPtr = Tcl_NewStringObj("Compressed data is truncated.", -1);
+                return -1;
+            }
+        } else if (inf->input_eof) {
+            return 1;
+        }
+
+        rawObj = inflate_read_raw(inf, chan, errorObjPtr);
+        if (rawObj == NULL)
+            return -1;
+
+        if (! inf->detected) {
+            const unsigned char *bytes;
+            Tcl_Size len;
+
+            /* Make sure the magic bytes are there unless input is shorter */
+            bytes = Tcl_GetByteArrayFromObj(rawObj, &len);
+            while (len < 2 && !inf->input_eof) {
+                Tcl_Obj *moreObj = inflate_read_raw(inf, chan, errorObjPtr);
+                if (moreObj == NULL) {
+                    Tcl_DecrRefCount(rawObj);
+                    return -1;
+                }
+                append_bytes(rawObj, moreObj);
+                Tcl_DecrRefCount(moreObj);
+                bytes = Tcl_GetByteArrayFromObj(rawObj, &len);
+            }
+            inf->detected = 1;
+            inf->format = inf->compression;
+            if (inf->format == CSV_COMPRESSION_AUTO)
+                inf->format = detect_compression(bytes, len);
+            if (inf->format != CSV_COMPRESSION_NONE) {
+                format = inf->format == CSV_COMPRESSION_GZIP ?
+                    TCL_ZLIB_FORMAT_GZIP : TCL_ZLIB_FORMAT_ZLIB;
+                if (Tcl_ZlibStreamInit(NULL, TCL_ZLIB_STREAM_INFLATE, format,
+                                       0, NULL, &inf->zstream) != TCL_OK) {
+                    *errorObjPtr = Tcl_NewStringObj("Could not initialize decompression.", -1);
+                    Tcl_DecrRefCount(rawObj);
+                    return -1;
+                }
+            }
+        }
+
+        if (inf->zstream) {
+            res = Tcl_ZlibStreamPut(inf->zstream, rawObj,
+                                    inf->input_eof ? TCL_ZLIB_FINALIZE :
+                                    TCL_ZLIB_NO_FLUSH);
+        } else {
+            /* Not compressed. Passed through for decoding. */
+            append_bytes(inf->outObj, rawObj);
+            res = TCL_OK;
+            if (! inf->input_eof) {
+                Tcl_DecrRefCount(rawObj);
+                return 0;
+            }
+        }
+        Tcl_DecrRefCount(rawObj);
+        if (res != TCL_OK) {
+            *errorObjPtr = Tcl_NewStringObj("Invalid compressed data.", -1);
+            return -1;
+        }
+    }
+}
+
+/*
+ * Decodes the inflated bytes into text. Bytes of a character split
+ * across chunks are kept for the next call unless at_end is set.
+ * Returns 0 on success and -1 on error.
+ */
+static int inflate_decode(csv_inflate_t *inf, int at_end,
+                          Tcl_Obj **errorObjPtr)
+{
+    unsigned char *src;
+    Tcl_Size srclen, dstlen, room;
+    int res, flags, nread, nwritten;
+
+    src = Tcl_GetByteArrayFromObj(inf->outObj, &srclen);
+    if (srclen == 0 && !at_end)
+        return 0;
+    flags = inf->encoding_flags | (at_end ? TCL_ENCODING_END : 0);
+    do {
+        dstlen = Tcl_DStringLength(&inf->text);
+        room = 2 * srclen + 16;
+        Tcl_DStringSetLength(&inf->text, dstlen + room);
+        res = Tcl_ExternalToUtf(NULL, inf->encoding, (const char *) src,
+                                srclen, flags, &inf->state,
+                                Tcl_DStringValue(&inf->text) + dstlen, room,
+                                &nread, &nwritten, NULL);
+        flags &= ~TCL_ENCODING_START;
+        Tcl_DStringSetLength(&inf->text, dstlen + nwritten);
+        src += nread;
+        srclen -= nread;
+    } while (res == TCL_CONVERT_NOSPACE);
+    inf->encoding_flags = 0;
+
+    if (res != TCL_OK && res != TCL_CONVERT_MULTIBYTE) {
+        *errorObjPtr = Tcl_NewStringObj("Invalid data for the channel encoding.", -1);
+        return -1;
+    }
+    memmove(Tcl_GetByteArrayFromObj(inf->outObj, NULL), src, srclen);
+    Tcl_SetByteArrayLength(inf->outObj, srclen);
+    return 0;
+}
+
+/*
+ * Reads at least nbytes bytes of text, unless the end of the input is
+ * reached, into inf->text, replacing its content or appending to it.
+ * Returns the number of bytes added, 0 at the end of the input and -1
+ * on error with an error message in *errorObjPtr.
+ */
+Tcl_Size csv_inflate_read(csv_inflate_t *inf, Tcl_Channel chan,
+                          Tcl_Size nbytes, int append, Tcl_Obj **errorObjPtr)
+{
+    Tcl_Size start;
+    int status;
+
+    if (! append)
+        Tcl_DStringSetLength(&inf->text, 0);
+    start = Tcl_DStringLength(&inf->text);
+    if (inf->encoding == NULL)
+        inf->encoding = channel_encoding(chan);
+
+    while (Tcl_DStringLength(&inf->text) - start < nbytes) {
+        status = inflate_fill(inf, chan, nbytes, errorObjPtr);
+        if (status < 0 || inflate_decode(inf, status, errorObjPtr) != 0)
+            return -1;
+        if (status == 1)
+            break;
+    }
+    return Tcl_DStringLength(&inf->text) - start;
+}
+
+/*
+ * Creates the compression stream for output if the configuration calls
+ * for one. Called from csv_write_config_finalize.
+ */
+int csv_deflate_begin(Tcl_Interp *ip, struct csv_write_config *config)
+{
+    Tcl_ZlibStream zstream;
+    int format;
+
+    if (config->compression == CSV_COMPRESSION_NONE ||
+        config->deflate != NULL)
+        return TCL_OK;
+    format = config->compression == CSV_COMPRESSION_GZIP ?
+        TCL_ZLIB_FORMAT_GZIP : TCL_ZLIB_FORMAT_ZLIB;
+    if (Tcl_ZlibStreamInit(ip, TCL_ZLIB_STREAM_DEFLATE, format,
+                           CSV_DEFLATE_LEVEL, NULL, &zstream) != TCL_OK)
+        return TCL_ERROR;
+    config->deflate = ckalloc(sizeof(csv_deflate_t));
+    config->deflate->zstream = zstream;
+    config->deflate->nheld = 0;
+    return TCL_OK;
+}
+
+/*
+ * Encodes len bytes of formatted data, as UTF-8 for -binary and with the
+ * channel's encoding otherwise, compresses them and writes out whatever
+ * compressed data is available. flush is one of the TCL_ZLIB_* flush
+ * values. TCL_ZLIB_FLUSH makes everything written so far decompressible
+ * and TCL_ZLIB_FINALIZE terminates the compressed stream.
+ */
+int csv_deflate_write(Tcl_Interp *ip, Tcl_Channel chan, const char *bytes,
+                      Tcl_Size len, int flush,
+                      const struct csv_write_config *config)
+{
+    csv_deflate_t *def = config->deflate;
+    Tcl_Encoding encoding;
+    Tcl_DString ds;
+    Tcl_Obj *inObj, *outObj;
+    unsigned char *in, *out;
+    Tcl_Size inlen, outlen;
+    int res;
+
+    encoding = config->binary ?
+        Tcl_GetEncoding(NULL, "utf-8") : channel_encoding(chan);
+    Tcl_UtfToExternalDString(encoding, bytes, len, &ds);
+    Tcl_FreeEncoding(encoding);
+    inlen = Tcl_DStringLength(&ds) + def->nheld;
+    inObj = Tcl_NewByteArrayObj(NULL, inlen);
+    in = Tcl_GetByteArrayFromObj(inObj, NULL);
+    if (def->nheld)
+        in[0] = def->held;
+    memcpy(in + def->nheld, Tcl_DStringValue(&ds), Tcl_DStringLength(&ds));
+    Tcl_DStringFree(&ds);
+    def->nheld = 0;
+    if (flush == TCL_ZLIB_NO_FLUSH && inlen > 0) {
+        def->held = in[inlen-1];
+        def->nheld = 1;
+        Tcl_SetByteArrayLength(inObj, inlen-1);
+    }
+
+    Tcl_IncrRefCount(inObj);
+    res = Tcl_ZlibStreamPut(def->zstream, inObj, flush);
+    Tcl_DecrRefCount(inObj);
+    if (res != TCL_OK)
+        goto write_error;
+
+    outObj = Tcl_NewObj();
+    Tcl_IncrRefCount(outObj);
+    res = Tcl_ZlibStreamGet(def->zstream, outObj, -1);
+    if (res == TCL_OK) {
+        out = Tcl_GetByteArrayFromObj(outObj, &outlen);
+        /* Anything already buffered in the channel goes first */
+        if (outlen > 0 &&
+            (Tcl_Flush(chan) != TCL_OK ||
+             Tcl_WriteRaw(chan, (const char *) out, outlen) != outlen))
+            res = TCL_ERROR;
+    }
+    Tcl_DecrRefCount(outObj);
+    if (res == TCL_OK)
+        return TCL_OK;
+
+write_error:
+    if (ip)
+        Tcl_SetResult(ip, "Error writing to channel.", TCL_STATIC);
+    return TCL_ERROR;
+}
+
+/* Releases the compression stream without writing anything further */
+void csv_deflate_end(struct csv_write_config *config)
+{
+    if (config->deflate) {
+        Tcl_ZlibStreamClose(config->deflate->zstream);
+        ckfree(config->deflate);
+        config->deflate = NULL;
+    }
+}
@@ -14,6 +14,14 @@ typedef struct {
     parser_t *parser;	/* CSV parser pointer. */
 } CSVParser;
 
+typedef struct {
+    Tcl_Command cmd;	/* Command associated with this instance. */
+    Tcl_Channel chan;	/* Output channel. Registered to keep it open. */
+    Tcl_DString buf;	/* Formatted rows not yet written to chan. */
+    Tcl_WideInt rows;	/* Number of rows put so far. */
+    struct csv_write_config config;
+} CSVWriter;
+
 typedef struct {
     int counter;	/* For creating instance names. */
 } CSVClass;
@@ -106,16 +114,58 @@ CSVParserNext(CSVParser *csvPtr, Tcl_Interp *interp,
     return TCL_OK;
 }
 
+/*
+ * Attaches the reader to a new channel keeping all options. This avoids
+ * the cost of creating a new reader for each of many inputs.
+ */
+static int
+CSVParserReset(CSVParser *csvPtr, Tcl_Interp *interp, Tcl_Obj *chanObj)
+{
+    Tcl_Channel chan;
+    int mode;
+
+    chan = Tcl_GetChannel(interp, Tcl_GetString(chanObj), &mode);
+    if (chan == NULL)
+	return TCL_ERROR;
+    parser_reset(csvPtr->parser, chan);
+    csvPtr->eof = 0;
+    return TCL_OK;
+}
+
+/* Returns all remaining rows in the channel */
+static int
+CSVParserReadAll(CSVParser *csvPtr, Tcl_Interp *interp)
+{
+    parser_t *parser = csvPtr->parser;
+
+    if (tokenize_all_rows(parser) != 0) {
+	if (parser->errorObj) {
+	    Tcl_SetObjResult(interp, parser->errorObj);
+	} else {
+	    Tcl_SetResult(interp, "Error parsing CSV", TCL_STATIC);
+	}
+	return TCL_ERROR;
+    }
+    csvPtr->eof = 1;
+    Tcl_SetObjResult(interp, parser->rowsObj);
+    Tcl_DecrRefCount(parser->rowsObj);
+    parser->rowsObj = Tcl_NewListObj(0, NULL);
+    Tcl_IncrRefCount(parser->rowsObj);
+    return TCL_OK;
+}
+
 static int
 CSVInstanceCmd(ClientData clientData, Tcl_Interp *interp,
 	       int objc, Tcl_Obj* const* objv)
 {
     CSVParser *csvPtr = (CSVParser *) clientData;
     static const char *cmdNames[] = {
-	"destroy", "eof", "methods", "next"
+	"destroy", "dialect", "eof", "header", "methods", "next", "read",
+	"reset", "stats", NULL
     };
     enum cmds {
-	CMD_destroy, CMD_eof, CMD_methods, CMD_next
+	CMD_destroy, CMD_dialect, CMD_eof, CMD_header, CMD_methods, CMD_next,
+	CMD_read, CMD_reset, CMD_stats
     };
     int cmd;
 
@@ -140,6 +190,25 @@ CSVInstanceCmd(ClientData clientData, Tcl_Interp *interp,
 	Tcl_DeleteCommandFromToken(interp, tcmd);
 	return TCL_OK;
     }
+    case CMD_dialect: {
+	parser_t *parser = csvPtr->parser;
+
+	if (objc != 2) {
+	    Tcl_WrongNumArgs(interp, 2, objv, NULL);
+	    return TCL_ERROR;
+	}
+	/* With -sniff, buffer the sample if nothing has been read yet */
+	if (parser_sniff(parser) != 0) {
+	    if (parser->errorObj) {
+		Tcl_SetObjResult(interp, parser->errorObj);
+	    } else {
+		Tcl_SetResult(interp, "Error parsing CSV", TCL_STATIC);
+	    }
+	    return TCL_ERROR;
+	}
+	Tcl_SetObjResult(interp, parser_dialect_obj(parser));
+	return TCL_OK;
+    }
     case CMD_eof: {
 	if (objc != 2) {
 	    Tcl_WrongNumArgs(interp, 2, objv, NULL);
@@ -148,39 +217,87 @@ CSVInstanceCmd(ClientData clientData, Tcl_Interp *interp,
 	Tcl_SetObjResult(interp, Tcl_NewIntObj(csvPtr->eof));
 	return TCL_OK;
     }
+    case CMD_header: {
+	parser_t *parser = csvPtr->parser;
+
+	if (objc != 2) {
+	    Tcl_WrongNumArgs(interp, 2, objv, NULL);
+	    return TCL_ERROR;
+	}
+	/*
+	 * Read ahead if the header has not been seen yet. Any data row
+	 * read as a side effect is kept for the next call to next.
+	 */
+	if (parser->header_pending && tokenize_nrows(parser, 1) != 0) {
+	    if (parser->errorObj) {
+		Tcl_SetObjResult(interp, parser->errorObj);
+	    } else {
+		Tcl_SetResult(interp, "Error parsing CSV", TCL_STATIC);
+	    }
+	    return TCL_ERROR;
+	}
+	if (parser->headerObj)
+	    Tcl_SetObjResult(interp, parser->headerObj);
+	return TCL_OK;
+    }
     case CMD_methods: {
-	Tcl_Obj *str[4];
+	Tcl_Obj *str[sizeof(cmdNames)/sizeof(cmdNames[0])];
+	int i;
 
 	if (objc != 2) {
 	    Tcl_WrongNumArgs(interp, 2, objv, NULL);
 	    return TCL_ERROR;
 	}
-	str[0] = Tcl_NewStringObj(cmdNames[0], -1);
-	str[1] = Tcl_NewStringObj(cmdNames[1], -1);
-	str[2] = Tcl_NewStringObj(cmdNames[2], -1);
-	str[3] = Tcl_NewStringObj(cmdNames[3], -1);
-	Tcl_SetObjResult(interp, Tcl_NewListObj(4, str));
+	for (i = 0; cmdNames[i] != NULL; ++i)
+	    str[i] = Tcl_NewStringObj(cmdNames[i], -1);
+	Tcl_SetObjResult(interp, Tcl_NewListObj(i, str));
 	return TCL_OK;
     }
     case CMD_next:
 	return CSVParserNext(csvPtr, interp, objc, objv);
+    case CMD_read:
+	if (objc > 3) {
+	    Tcl_WrongNumArgs(interp, 2, objv, "?CHANNEL?");
+	    return TCL_ERROR;
+	}
+	if (objc == 3 && CSVParserReset(csvPtr, interp, objv[2]) != TCL_OK)
+	    return TCL_ERROR;
+	return CSVParserReadAll(csvPtr, interp);
+    case CMD_reset:
+	if (objc != 3) {
+	    Tcl_WrongNumArgs(interp, 2, objv, "CHANNEL");
+	    return TCL_ERROR;
+	}
+	return CSVParserReset(csvPtr, interp, objv[2]);
+    case CMD_stats:
+	if (objc != 2) {
+	    Tcl_WrongNumArgs(interp, 2, objv, NULL);
+	    return TCL_ERROR;
+	}
+#if CSV_ENABLE_STATS
+	Tcl_SetObjResult(interp, parser_stats_obj(csvPtr->parser));
+	return TCL_OK;
+#else
+	Tcl_SetResult(interp, "Parser statistics are not enabled in this build.",
+		      TCL_STATIC);
+	return TCL_ERROR;
+#endif
     }
     return TCL_ERROR;
 }
 
-static int
-CSVParserNew(const char *name, Tcl_Interp *interp,
-	     int objc, Tcl_Obj* const* objv)
+/*
+ * Returns the fully qualified command name for a new instance of
+ * className, putting the command into the current namespace if
+ * necessary. The returned Tcl_Obj has its reference count incremented.
+ * Returns NULL with an error in the interpreter if the command exists.
+ */
+static Tcl_Obj *
+CSVInstanceName(Tcl_Interp *interp, const char *name, const char *className)
 {
-    CSVParser *csvPtr;
     Tcl_Obj *fqn;
     Tcl_CmdInfo ci;
 
-    /*
-     * Compute the fully qualified command name to use, putting
-     * the command into the current namespace if necessary.
-     */
-
     if (!Tcl_StringMatch (name, "::*")) {
 	/* Relative name. Prefix with current namespace. */
 
@@ -209,11 +326,26 @@ CSVParserNew(const char *name, Tcl_Interp *interp,
 	err = Tcl_NewObj();
 	Tcl_AppendToObj(err, "command \"", -1);
 	Tcl_AppendObjToObj(err, fqn);
-	Tcl_AppendToObj(err, "\" already exists, unable to create ::tclcsv::reader instance", -1);
+	Tcl_AppendToObj(err, "\" already exists, unable to create ", -1);
+	Tcl_AppendToObj(err, className, -1);
+	Tcl_AppendToObj(err, " instance", -1);
 	Tcl_DecrRefCount(fqn);
 	Tcl_SetObjResult(interp, err);
-	return TCL_ERROR;
+	return NULL;
     }
+    return fqn;
+}
+
+static int
+CSVParserNew(const char *name, Tcl_Interp *interp,
+	     int objc, Tcl_Obj* const* objv)
+{
+    CSVParser *csvPtr;
+    Tcl_Obj *fqn;
+
+    fqn = CSVInstanceName(interp, name, "::tclcsv::reader");
+    if (fqn == NULL)
+	return TCL_ERROR;
 
     /*
      * Construct instance data and command.
@@ -242,7 +374,7 @@ CSVClassCmd(ClientData clientData, Tcl_Interp *interp,
 {
     CSVClass *clsPtr = (CSVClass *) clientData;
     static const char *cmdNames[] = {
-	"create", "methods", "new"
+	"create", "methods", "new", NULL
     };
     enum cmds {
 	CMD_create, CMD_methods, CMD_new
@@ -292,10 +424,255 @@ CSVClassCmd(ClientData clientData, Tcl_Interp *interp,
     return TCL_ERROR;
 }
 
+/*
+ * Writes out buffered rows to the writer's channel. If flush_chan is
+ * true, the channel's own buffers are flushed as well.
+ */
+static int
+CSVWriterFlush(CSVWriter *wPtr, Tcl_Interp *interp, int flush_chan)
+{
+    if (csv_write_flush(interp, wPtr->chan, &wPtr->buf, wPtr->rows,
+			&wPtr->config) != TCL_OK)
+	return TCL_ERROR;
+    /* Make everything written so far decompressible */
+    if (flush_chan && wPtr->config.deflate &&
+	csv_deflate_write(interp, wPtr->chan, "", 0, TCL_ZLIB_FLUSH,
+			  &wPtr->config) != TCL_OK)
+	return TCL_ERROR;
+    if (flush_chan && Tcl_Flush(wPtr->chan) != TCL_OK) {
+	Tcl_SetResult(interp, "Error writing to channel.", TCL_STATIC);
+	return TCL_ERROR;
+    }
+    return TCL_OK;
+}
+
+static void
+CSVWriterRelease(ClientData clientData)
+{
+    CSVWriter *wPtr = (CSVWriter *) clientData;
+
+    /*
+     * Buffered rows are written out on a best effort basis if the writer
+     * is deleted without being closed. Errors cannot be reported here.
+     */
+    if (csv_write_flush(NULL, wPtr->chan, &wPtr->buf, wPtr->rows,
+			&wPtr->config) == TCL_OK)
+	csv_write_finish(NULL, wPtr->chan, &wPtr->config);
+    else
+	csv_deflate_end(&wPtr->config);
+    Tcl_DStringFree(&wPtr->buf);
+    Tcl_UnregisterChannel(NULL, wPtr->chan);
+    ckfree((char *) wPtr);
+}
+
+/* Formats rows into the writer's buffer, writing it out when full */
+static int
+CSVWriterPut(CSVWriter *wPtr, Tcl_Interp *interp, Tcl_Obj *const rows[],
+	     Tcl_Size nrows)
+{
+    Tcl_Size r;
+
+    for (r = 0; r < nrows; ++r) {
+	if (csv_format_row(interp, &wPtr->buf, rows[r], &wPtr->config)
+	    != TCL_OK)
+	    return TCL_ERROR;
+	wPtr->rows++;
+	if (Tcl_DStringLength(&wPtr->buf) > wPtr->config.flushsize &&
+	    CSVWriterFlush(wPtr, interp, 0) != TCL_OK)
+	    return TCL_ERROR;
+    }
+    return TCL_OK;
+}
+
+static int
+CSVWriterInstanceCmd(ClientData clientData, Tcl_Interp *interp,
+		     int objc, Tcl_Obj* const* objv)
+{
+    CSVWriter *wPtr = (CSVWriter *) clientData;
+    static const char *cmdNames[] = {
+	"close", "flush", "methods", "put", "putrows", NULL
+    };
+    enum cmds {
+	CMD_close, CMD_flush, CMD_methods, CMD_put, CMD_putrows
+    };
+    int cmd;
+
+    if (objc < 2) {
+	Tcl_WrongNumArgs(interp, objc, objv, "option ?arg arg ...?");
+	return TCL_ERROR;
+    }
+    if (Tcl_GetIndexFromObj(interp, objv [1], cmdNames, "option", 0, &cmd)
+	!= TCL_OK) {
+	return TCL_ERROR;
+    }
+    switch ((enum cmds) cmd) {
+    case CMD_close: {
+	Tcl_Command tcmd;
+	int res;
+
+	if (objc != 2) {
+	    Tcl_WrongNumArgs(interp, 2, objv, NULL);
+	    return TCL_ERROR;
+	}
+	/* The writer is deleted even if the final write fails */
+	res = CSVWriterFlush(wPtr, interp, 0);
+	if (res == TCL_OK)
+	    res = csv_write_finish(interp, wPtr->chan, &wPtr->config);
+	if (res == TCL_OK && Tcl_Flush(wPtr->chan) != TCL_OK) {
+	    Tcl_SetResult(interp, "Error writing to channel.", TCL_STATIC);
+	    res = TCL_ERROR;
+	}
+	csv_deflate_end(&wPtr->config);
+	Tcl_DStringSetLength(&wPtr->buf, 0);
+	tcmd = wPtr->cmd;
+	wPtr->cmd = NULL;
+	Tcl_DeleteCommandFromToken(interp, tcmd);
+	return res;
+    }
+    case CMD_flush:
+	if (objc != 2) {
+	    Tcl_WrongNumArgs(interp, 2, objv, NULL);
+	    return TCL_ERROR;
+	}
+	return CSVWriterFlush(wPtr, interp, 1);
+    case CMD_methods: {
+	Tcl_Obj *str[sizeof(cmdNames)/sizeof(cmdNames[0])];
+	int i;
+
+	if (objc != 2) {
+	    Tcl_WrongNumArgs(interp, 2, objv, NULL);
+	    return TCL_ERROR;
+	}
+	for (i = 0; cmdNames[i] != NULL; ++i)
+	    str[i] = Tcl_NewStringObj(cmdNames[i], -1);
+	Tcl_SetObjResult(interp, Tcl_NewListObj(i, str));
+	return TCL_OK;
+    }
+    case CMD_put:
+	if (objc != 3) {
+	    Tcl_WrongNumArgs(interp, 2, objv, "ROW");
+	    return TCL_ERROR;
+	}
+	return CSVWriterPut(wPtr, interp, objv + 2, 1);
+    case CMD_putrows: {
+	Tcl_Obj **rows;
+	Tcl_Size nrows;
+
+	if (objc != 3) {
+	    Tcl_WrongNumArgs(interp, 2, objv, "ROWS");
+	    return TCL_ERROR;
+	}
+	if (Tcl_ListObjGetElements(interp, objv[2], &nrows, &rows) != TCL_OK)
+	    return TCL_ERROR;
+	return CSVWriterPut(wPtr, interp, rows, nrows);
+    }
+    }
+    return TCL_ERROR;
+}
+
+static int
+CSVWriterNew(const char *name, Tcl_Interp *interp,
+	     int objc, Tcl_Obj* const* objv)
+{
+    CSVWriter *wPtr;
+    Tcl_Obj *fqn;
+    Tcl_Channel chan;
+    struct csv_write_config config;
+    int mode;
+
+    if (objc < 1) {
+	Tcl_SetResult(interp, "Syntax error: CHANNEL argument must be specified.", TCL_STATIC);
+	return TCL_ERROR;
+    }
+    chan = Tcl_GetChannel(interp, Tcl_GetString(objv[objc-1]), &mode);
+    if (chan == NULL)
+	return TCL_ERROR;
+    if (!(mode & TCL_WRITABLE)) {
+	Tcl_SetResult(interp, "Channel is not open for writing.", TCL_STATIC);
+	return TCL_ERROR;
+    }
+    csv_write_config_init(&config);
+    if (csv_write_config_parse(interp, objc-1, objv, &config) != TCL_OK ||
+	csv_write_config_finalize(interp, &config) != TCL_OK)
+	return TCL_ERROR;
+
+    fqn = CSVInstanceName(interp, name, "::tclcsv::writer");
+    if (fqn == NULL) {
+	csv_deflate_end(&config);
+	return TCL_ERROR;
+    }
+
+    wPtr = (CSVWriter *) ckalloc(sizeof(CSVWriter));
+    wPtr->chan = chan;
+    Tcl_RegisterChannel(NULL, chan);
+    Tcl_DStringInit(&wPtr->buf);
+    wPtr->rows = 0;
+    wPtr->config = config;
+    wPtr->cmd = Tcl_CreateObjCommand(interp, Tcl_GetString(fqn),
+				     CSVWriterInstanceCmd,
+				     (ClientData) wPtr,
+				     CSVWriterRelease);
+    Tcl_SetObjResult(interp, fqn);
+    Tcl_DecrRefCount(fqn);
+    return TCL_OK;
+}
+
+static int
+CSVWriterClassCmd(ClientData clientData, Tcl_Interp *interp,
+		  int objc, Tcl_Obj* const* objv)
+{
+    CSVClass *clsPtr = (CSVClass *) clientData;
+    static const char *cmdNames[] = {
+	"create", "methods", "new", NULL
+    };
+    enum cmds {
+	CMD_create, CMD_methods, CMD_new
+    };
+    int cmd;
+
+    if (objc < 2) {
+	Tcl_WrongNumArgs(interp, objc, objv, "option ?arg ...?");
+	return TCL_ERROR;
+    }
+    if (Tcl_GetIndexFromObj(interp, objv [1], cmdNames, "option", 0, &cmd)
+	!= TCL_OK) {
+	return TCL_ERROR;
+    }
+    switch ((enum cmds) cmd) {
+    case CMD_create:
+	if (objc < 3) {
+	    Tcl_WrongNumArgs(interp, 1, objv, "name ?arg ...?");
+	    return TCL_ERROR;
+	}
+	return CSVWriterNew(Tcl_GetString(objv[2]), interp, objc - 3, objv + 3);
+    case CMD_methods: {
+	Tcl_Obj *str[3];
+
+	if (objc != 2) {
+	    Tcl_WrongNumArgs(interp, 2, objv, NULL);
+	    return TCL_ERROR;
+	}
+	str[0] = Tcl_NewStringObj(cmdNames[0], -1);
+	str[1] = Tcl_NewStringObj(cmdNames[1], -1);
+	str[2] = Tcl_NewStringObj(cmdNames[2], -1);
+	Tcl_SetObjResult(interp, Tcl_NewListObj(3, str));
+	return TCL_OK;
+    }
+    case CMD_new: {
+	char buffer[128];
+
+	clsPtr->counter++;
+	sprintf(buffer, "::tclcsv::writer%d", clsPtr->counter);
+	return CSVWriterNew(buffer, interp, objc - 2, objv + 2);
+    }
+    }
+    return TCL_ERROR;
+}
+
 int
 Tclcsv_Init(Tcl_Interp *interp)
 {
-    CSVClass *clsPtr;
+    CSVClass *clsPtr, *wclsPtr;
 
 #ifdef USE_TCL_STUBS
     if (Tcl_InitStubs(interp,TCL_VERSION, 0) == NULL) {
@@ -308,12 +685,30 @@ Tclcsv_Init(Tcl_Interp *interp)
 #endif
     clsPtr = (CSVClass *) ckalloc(sizeof (CSVClass));
     clsPtr->counter = 0;
+    wclsPtr = (CSVClass *) ckalloc(sizeof (CSVClass));
+    wclsPtr->counter = 0;
     Tcl_CreateObjCommand(interp, "::tclcsv::csv_read", csv_read_cmd,
 			 NULL, NULL);
     Tcl_CreateObjCommand(interp, "::tclcsv::csv_write", csv_write_cmd,
 			 NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::tclcsv::csv_format", csv_format_cmd,
+			 NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::tclcsv::csv_convert", csv_convert_cmd,
+			 NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::tclcsv::_sniff", csv_sniff_cmd,
+			 NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::tclcsv::sniff_header", csv_sniff_header_cmd,
+			 NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::tclcsv::csv_parse", csv_parse_cmd,
+			 NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::tclcsv::csv_read_many", csv_read_many_cmd,
+			 NULL, NULL);
+    Tcl_CreateObjCommand(interp, "::tclcsv::table", csv_table_cmd,
+			 NULL, NULL);
     Tcl_CreateObjCommand(interp, "::tclcsv::reader", CSVClassCmd,
 			 (ClientData) clsPtr, CSVClassRelease);
+    Tcl_CreateObjCommand(interp, "::tclcsv::writer", CSVWriterClassCmd,
+			 (ClientData) wclsPtr, CSVClassRelease);
     Tcl_PkgProvide(interp, PACKAGE_NAME, PACKAGE_VERSION);
     return TCL_OK;
 }
@@ -441,6 +441,12 @@ snit::widget tclcsv::dialectpicker {
         if {![dict exists $val integer]} {
             dict set val integer {display Integer align right}
         }
+        if {![dict exists $val boolean]} {
+            dict set val boolean {display Boolean align left}
+        }
+        if {![dict exists $val date]} {
+            dict set val date {display Date align left}
+        }
         set options(-columntypes) $val
 
         dict for {tok meta} $options(-columntypes) {
@@ -0,0 +1,375 @@
+#
+# Copyright (c) 2015, Ashok P. Nadkarni
+# All rights reserved.
+#
+# See the file license.terms for license
+#
+# Throughput benchmarks for tclcsv. Run through "make bench" or directly as
+#   tclsh bench.tcl ?-size MB? ?-iterations N? ?-output FILE? ?-tag TAG?
+#                   ?-match PATTERN? ?-datadir DIR? ?-keepdata BOOLEAN?
+#
+# Every run prints a summary table to stdout. If -output is specified,
+# one CSV record per benchmark is also appended to FILE (the header is
+# written only when the file is created) so that results from successive
+# commits can be compared.
+
+package require tclcsv
+
+namespace eval bench {
+    variable opts
+    array set opts {
+        -size 4
+        -iterations 3
+        -output ""
+        -tag ""
+        -match *
+        -datadir ""
+        -keepdata 0
+    }
+
+    variable corpora {narrow wide quoted multiline utf8 tsv}
+
+    # Result fields in the order written to -output
+    variable fields {
+        timestamp tag tcl_version benchmark corpus variant
+        bytes rows seconds mb_per_s rows_per_s peak_rss_kb
+    }
+
+    variable results {}
+    variable seed 1
+}
+
+# Deterministic pseudo-random integer in [0, n). A simple LCG is used so
+# that corpora are identical across platforms and Tcl versions.
+proc bench::rand {n} {
+    variable seed
+    set seed [expr {($seed * 1103515245 + 12345) & 0x7fffffff}]
+    return [expr {($seed >> 8) % $n}]
+}
+
+proc bench::word {{len 0}} {
+    if {$len == 0} {
+        set len [expr {3 + [rand 8]}]
+    }
+    set w ""
+    for {set i 0} {$i < $len} {incr i} {
+        append w [format %c [expr {97 + [rand 26]}]]
+    }
+    return $w
+}
+
+proc bench::utf8word {} {
+    # Mix of Latin-1, Greek, Cyrillic and CJK characters
+    set ranges {{0xe0 0x20} {0x3b1 0x18} {0x430 0x20} {0x4e00 0x200}}
+    set w ""
+    set len [expr {2 + [rand 6]}]
+    for {set i 0} {$i < $len} {incr i} {
+        lassign [lindex $ranges [rand [llength $ranges]]] base count
+        append w [format %c [expr {$base + [rand $count]}]]
+    }
+    return $w
+}
+
+# Returns a list of field values for one record of the given corpus shape.
+proc bench::record {corpus} {
+    switch -exact -- $corpus {
+        narrow - tsv {
+            return [list [rand 100000] [word] [word] [rand 1000].[rand 100] [word]]
+        }
+        wide {
+            set row {}
+            for {set i 0} {$i < 50} {incr i} {
+                if {$i % 3 == 0} {
+                    lappend row [rand 1000000]
+                } else {
+                    lappend row [word]
+                }
+            }
+            return $row
+        }
+        quoted {
+            return [list [rand 100000] \
+                        "[word], [word]" \
+                        "[word] \"[word]\" [word]" \
+                        [word] \
+                        "[word],[word],[word]"]
+        }
+        multiline {
+            return [list [rand 100000] \
+                        "[word]\n[word] [word]" \
+                        [word] \
+                        "[word], [word]\n[word]\n[word]"]
+        }
+        utf8 {
+            return [list [rand 100000] [utf8word] [utf8word] [word] [utf8word]]
+        }
+        default {
+            error "Unknown corpus $corpus"
+        }
+    }
+}
+
+proc bench::dialect_opts {corpus {direction read}} {
+    if {$corpus eq "tsv"} {
+        return [tclcsv::dialect excel-tab $direction]
+    }
+    return [tclcsv::dialect excel $direction]
+}
+
+# Generates the corpus file if it does not already exist and returns its path.
+proc bench::corpus_file {corpus} {
+    variable opts
+    variable seed
+
+    set path [file join $opts(-datadir) $corpus-$opts(-size)MB.csv]
+    if {[file exists $path]} {
+        return $path
+    }
+
+    # Seed per corpus so each file is independent of generation order
+    set seed [expr {[lsearch -exact $bench::corpora $corpus] + 1}]
+    set target [expr {$opts(-size) * 1024 * 1024}]
+    set fd [open $path.tmp w]
+    fconfigure $fd -encoding utf-8 -translation lf
+    # Generate in batches and write through csv_write
+    while {[tell $fd] < $target} {
+        set rows {}
+        for {set i 0} {$i < 1000} {incr i} {
+            lappend rows [record $corpus]
+        }
+        tclcsv::csv_write {*}[dialect_opts $corpus write] $fd $rows
+        flush $fd
+    }
+    close $fd
+    file rename -force $path.tmp $path
+    return $path
+}
+
+proc bench::open_corpus {path} {
+    set fd [open $path r]
+    fconfigure $fd -encoding utf-8 -translation lf
+    return $fd
+}
+
+# Returns the peak resident set size of the process in KB, or an empty
+# string if it cannot be determined on this platform. Where supported the
+# high water mark is reset first so each benchmark reports its own peak.
+proc bench::reset_peak_rss {} {
+    catch {
+        set fd [open /proc/self/clear_refs w]
+        puts -nonewline $fd 5
+        close $fd
+    }
+}
+
+proc bench::peak_rss {} {
+    if {[catch {
+        set fd [open /proc/self/status r]
+        set status [read $fd]
+        close $fd
+    }]} {
+        return ""
+    }
+    if {[regexp -line {^VmHWM:\s*(\d+)\s*kB} $status -> kb]} {
+        return $kb
+    }
+    return ""
+}
+
+# Runs SCRIPT -iterations times in the caller's context and returns the
+# best wall clock time in seconds.
+proc bench::best_time {script} {
+    variable opts
+    set best ""
+    for {set i 0} {$i < $opts(-iterations)} {incr i} {
+        set start [clock microseconds]
+        uplevel 1 $script
+        set elapsed [expr {[clock microseconds] - $start}]
+        if {$best eq "" || $elapsed < $best} {
+            set best $elapsed
+        }
+    }
+    return [expr {$best / 1e6}]
+}
+
+proc bench::record_result {benchmark corpus variant bytes rows seconds peak} {
+    variable results
+    variable opts
+    if {$seconds <= 0} {
+        set seconds 1e-6
+    }
+    lappend results [list \
+                         [clock format [clock seconds] -format %Y-%m-%dT%H:%M:%S] \
+                         $opts(-tag) \
+                         [info patchlevel] \
+                         $benchmark $corpus $variant \
+                         $bytes $rows \
+                         [format %.6f $seconds] \
+                         [format %.2f [expr {$bytes / $seconds / 1048576.0}]] \
+                         [format %.0f [expr {$rows / $seconds}]] \
+                         $peak]
+    puts [format "%-12s %-10s %-16s %10s MB/s %12s rows/s %10s KB" \
+              $benchmark $corpus $variant \
+              [lindex $results end 9] [lindex $results end 10] $peak]
+    flush stdout
+}
+
+proc bench::selected {name} {
+    variable opts
+    return [string match $opts(-match) $name]
+}
+
+# Returns the parsed rows of the corpus, timing the parse if the csv_read
+# benchmark is selected.
+proc bench::run_csv_read {corpus path} {
+    set opts [dialect_opts $corpus]
+    if {! [selected csv_read]} {
+        set fd [open_corpus $path]
+        set rows [tclcsv::csv_read {*}$opts $fd]
+        close $fd
+        return $rows
+    }
+    reset_peak_rss
+    set secs [best_time {
+        set fd [open_corpus $path]
+        set rows [tclcsv::csv_read {*}$opts $fd]
+        close $fd
+    }]
+    record_result csv_read $corpus default [file size $path] \
+        [llength $rows] $secs [peak_rss]
+    return $rows
+}
+
+proc bench::run_reader {corpus path batch} {
+    set opts [dialect_opts $corpus]
+    reset_peak_rss
+    set secs [best_time {
+        set fd [open_corpus $path]
+        set r [tclcsv::reader new {*}$opts $fd]
+        set nrows 0
+        while {! [$r eof]} {
+            incr nrows [llength [$r next $batch]]
+        }
+        $r destroy
+        close $fd
+    }]
+    record_result reader $corpus next-$batch [file size $path] \
+        $nrows $secs [peak_rss]
+}
+
+proc bench::run_csv_write {corpus path rows dialect} {
+    variable opts
+    set wopts [tclcsv::dialect $dialect write]
+    set out [file join $opts(-datadir) write-$corpus.out]
+    reset_peak_rss
+    set secs [best_time {
+        set fd [open $out w]
+        fconfigure $fd -encoding utf-8 -translation lf
+        tclcsv::csv_write {*}$wopts $fd $rows
+        close $fd
+    }]
+    record_result csv_write $corpus $dialect [file size $out] \
+        [llength $rows] $secs [peak_rss]
+    file delete $out
+}
+
+# Tcllib csv works a line at a time so corpora with embedded newlines
+# are skipped.
+proc bench::run_tcllib {corpus path} {
+    if {$corpus eq "multiline"} {
+        return
+    }
+    set sep [expr {$corpus eq "tsv" ? "\t" : ","}]
+    reset_peak_rss
+    set secs [best_time {
+        set fd [open_corpus $path]
+        set rows {}
+        while {[gets $fd line] >= 0} {
+            lappend rows [::csv::split $line $sep]
+        }
+        close $fd
+    }]
+    record_result tcllib-csv $corpus split [file size $path] \
+        [llength $rows] $secs [peak_rss]
+}
+
+proc bench::write_output {} {
+    variable opts
+    variable fields
+    variable results
+
+    if {$opts(-output) eq ""} {
+        return
+    }
+    set new [expr {![file exists $opts(-output)]}]
+    set fd [open $opts(-output) a]
+    fconfigure $fd -translation lf
+    if {$new} {
+        tclcsv::csv_write $fd [list $fields]
+    }
+    tclcsv::csv_write $fd $results
+    close $fd
+}
+
+proc bench::main {argv} {
+    variable opts
+    variable corpora
+
+    if {[llength $argv] % 2} {
+        error "Usage: bench.tcl ?-option value ...?"
+    }
+    foreach {opt val} $argv {
+        if {![info exists opts($opt)]} {
+            error "Unknown option $opt. Must be one of [join [lsort [array names opts]] {, }]."
+        }
+        set opts($opt) $val
+    }
+    if {![string is integer -strict $opts(-size)] || $opts(-size) <= 0} {
+        error "Invalid value for option -size."
+    }
+    if {![string is integer -strict $opts(-iterations)] || $opts(-iterations) <= 0} {
+        error "Invalid value for option -iterations."
+    }
+
+    set cleanup 0
+    if {$opts(-datadir) eq ""} {
+        set opts(-datadir) [file join [pwd] bench-data]
+        set cleanup [expr {! $opts(-keepdata)}]
+    }
+    file mkdir $opts(-datadir)
+
+    set have_tcllib [expr {![catch {package require csv}]}]
+
+    puts "tclcsv [package present tclcsv], Tcl [info patchlevel],\
+          corpus size $opts(-size) MB, best of $opts(-iterations)"
+    if {! $have_tcllib} {
+        puts "Tcllib csv package not found, comparisons skipped."
+    }
+
+    foreach corpus $corpora {
+        set path [corpus_file $corpus]
+        set rows [run_csv_read $corpus $path]
+        if {[selected reader]} {
+            foreach batch {1 100 10000} {
+                run_reader $corpus $path $batch
+            }
+        }
+        if {[selected csv_write]} {
+            foreach dialect {excel excel-tab} {
+                run_csv_write $corpus $path $rows $dialect
+            }
+        }
+        if {$have_tcllib && [selected tcllib-csv]} {
+            run_tcllib $corpus $path
+        }
+        unset rows
+    }
+
+    write_output
+
+    if {$cleanup} {
+        file delete -force $opts(-datadir)
+    }
+}
+
+bench::main $argv
@@ -0,0 +1,603 @@
+/*
+ * Copyright (c) 2015-2023, Ashok P. Nadkarni
+ * All rights reserved.
+ *
+ * See the file license.terms for license
+ */
+
+/*
+ * Micro-benchmark for the tokenizer state machines and csv_format_row.
+ * The core operation runs the Tcl independent tokenizer in csvcore.c with
+ * callbacks that do nothing, giving the cost of the state machine alone.
+ *
+ * Input is generated in memory and handed to the parser through its data
+ * buffer so no channel I/O, encoding conversion or script evaluation is
+ * included in the measurements. Built by "make tokbench" and run as
+ *
+ *   tokbench ?-size MB? ?-iterations N? ?-dialect NAME? ?-shape NAME? ?-noperf?
+ *
+ * One CSV record is written to stdout for each operation, dialect and
+ * input shape. On Linux, hardware counters are read with perf_event_open
+ * if permitted, in which case bytes per cycle is also reported.
+ */
+
+/* The harness hosts its own interpreter so it links to Tcl directly */
+#undef USE_TCL_STUBS
+#include "csv.h"
+
+#if defined(__linux__) && !defined(TOKBENCH_NO_PERF)
+#define TOKBENCH_PERF 1
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+typedef struct dialect_t {
+    const char *name;
+    const char *options;        /* Parser options as a Tcl list */
+    char delimiter;
+    int whitespace;             /* Use the whitespace tokenizer */
+} dialect_t;
+
+static const dialect_t dialects[] = {
+    {"excel", "-delimiter , -quote \\\"", ',', 0},
+    {"excel-tab", "-delimiter \\t -quote \\\"", '\t', 0},
+    {"customterm", "-delimiter , -quote \\\" -terminator \\n", ',', 0},
+    {"whitespace", "-delimiter { } -quote \\\"", ' ', 1},
+};
+#define NDIALECTS (sizeof(dialects)/sizeof(dialects[0]))
+
+static const char *shapes[] = {
+    "narrow", "wide", "quoted", "multiline", "utf8"
+};
+#define NSHAPES (sizeof(shapes)/sizeof(shapes[0]))
+
+enum counter_e { COUNTER_CYCLES, COUNTER_BRANCH_MISSES, COUNTER_CACHE_MISSES,
+                 NCOUNTERS };
+
+typedef struct measurement_t {
+    double seconds;
+    int have_counters;
+    uint64_t counters[NCOUNTERS];
+} measurement_t;
+
+/*
+ * Input generation. Uses the same LCG as bench.tcl so inputs are
+ * reproducible across platforms.
+ */
+
+static unsigned long seed;
+
+static unsigned long bench_rand(unsigned long n)
+{
+    seed = (seed * 1103515245 + 12345) & 0x7fffffff;
+    return (seed >> 8) % n;
+}
+
+static void gen_word(Tcl_DString *ds)
+{
+    unsigned long i, len = 3 + bench_rand(8);
+    for (i = 0; i < len; ++i) {
+        char c = (char) ('a' + bench_rand(26));
+        Tcl_DStringAppend(ds, &c, 1);
+    }
+}
+
+static void gen_utf8_word(Tcl_DString *ds)
+{
+    static const int ranges[][2] = {
+        {0xe0, 0x20}, {0x3b1, 0x18}, {0x430, 0x20}, {0x4e00, 0x200}
+    };
+    char buf[TCL_UTF_MAX];
+    unsigned long i, len = 2 + bench_rand(6);
+    for (i = 0; i < len; ++i) {
+        const int *range = ranges[bench_rand(4)];
+        int n = Tcl_UniCharToUtf(range[0] + (int) bench_rand(range[1]), buf);
+        Tcl_DStringAppend(ds, buf, n);
+    }
+}
+
+static void gen_number(Tcl_DString *ds, unsigned long limit)
+{
+    char buf[32];
+    sprintf(buf, "%lu", bench_rand(limit));
+    Tcl_DStringAppend(ds, buf, -1);
+}
+
+/* Appends a field, quoting it if it contains special characters */
+static void gen_field(Tcl_DString *ds, const char *s, Tcl_Size len,
+                      char delimiter)
+{
+    Tcl_Size i;
+    int quote = 0;
+
+    for (i = 0; i < len; ++i) {
+        if (s[i] == delimiter || s[i] == '"' || s[i] == '\n' ||
+            s[i] == ' ') {
+            quote = 1;
+            break;
+        }
+    }
+    if (! quote) {
+        Tcl_DStringAppend(ds, s, len);
+        return;
+    }
+    Tcl_DStringAppend(ds, "\"", 1);
+    for (i = 0; i < len; ++i) {
+        if (s[i] == '"')
+            Tcl_DStringAppend(ds, "\"", 1);
+        Tcl_DStringAppend(ds, &s[i], 1);
+    }
+    Tcl_DStringAppend(ds, "\"", 1);
+}
+
+static void gen_record(Tcl_DString *ds, const char *shape, char delimiter)
+{
+    Tcl_DString cell;
+    int i, ncells;
+
+    ncells = strcmp(shape, "wide") ? 5 : 50;
+    Tcl_DStringInit(&cell);
+    for (i = 0; i < ncells; ++i) {
+        Tcl_DStringSetLength(&cell, 0);
+        if (i == 0 || (ncells == 50 && i % 3 == 0)) {
+            gen_number(&cell, 1000000);
+        } else if (!strcmp(shape, "quoted") && i != 3) {
+            gen_word(&cell);
+            Tcl_DStringAppend(&cell, i == 2 ? " \"" : ", ", 2);
+            gen_word(&cell);
+            if (i == 2)
+                Tcl_DStringAppend(&cell, "\"", 1);
+        } else if (!strcmp(shape, "multiline") && (i & 1)) {
+            gen_word(&cell);
+            Tcl_DStringAppend(&cell, "\n", 1);
+            gen_word(&cell);
+        } else if (!strcmp(shape, "utf8") && i != 3) {
+            gen_utf8_word(&cell);
+        } else {
+            gen_word(&cell);
+        }
+        if (i != 0)
+            Tcl_DStringAppend(ds, &delimiter, 1);
+        gen_field(ds, Tcl_DStringValue(&cell), Tcl_DStringLength(&cell),
+                  delimiter);
+    }
+    Tcl_DStringAppend(ds, "\n", 1);
+    Tcl_DStringFree(&cell);
+}
+
+static void gen_input(Tcl_DString *ds, const char *shape, char delimiter,
+                      Tcl_Size size)
+{
+    seed = 1;
+    Tcl_DStringInit(ds);
+    while (Tcl_DStringLength(ds) < size)
+        gen_record(ds, shape, delimiter);
+}
+
+/*
+ * Timing and hardware counters
+ */
+
+static double now(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER freq, count;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return (double) count.QuadPart / (double) freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+}
+
+#ifdef TOKBENCH_PERF
+static int perf_fds[NCOUNTERS] = {-1, -1, -1};
+
+static int perf_open_counter(uint64_t config, int group_fd)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.disabled = group_fd == -1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+    return (int) syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+
+/* Returns 1 if counters are available, 0 otherwise */
+static int perf_init(void)
+{
+    static const uint64_t configs[NCOUNTERS] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_BRANCH_MISSES,
+        PERF_COUNT_HW_CACHE_MISSES
+    };
+    int i;
+
+    for (i = 0; i < NCOUNTERS; ++i) {
+        perf_fds[i] = perf_open_counter(configs[i], perf_fds[0]);
+        if (perf_fds[i] < 0) {
+            while (--i >= 0) {
+                close(perf_fds[i]);
+                perf_fds[i] = -1;
+            }
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void perf_start(void)
+{
+    ioctl(perf_fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(perf_fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+static int perf_stop(uint64_t counters[NCOUNTERS])
+{
+    uint64_t values[1 + NCOUNTERS];
+    int i;
+
+    ioctl(perf_fds[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    if (read(perf_fds[0], values, sizeof(values)) != sizeof(values))
+        return 0;
+    for (i = 0; i < NCOUNTERS; ++i)
+        counters[i] = values[1 + i];
+    return 1;
+}
+#endif
+
+static int use_perf;
+
+static void measure_start(measurement_t *m)
+{
+#ifdef TOKBENCH_PERF
+    if (use_perf)
+        perf_start();
+#endif
+    m->seconds = now();
+}
+
+static void measure_stop(measurement_t *m)
+{
+    m->seconds = now() - m->seconds;
+    m->have_counters = 0;
+#ifdef TOKBENCH_PERF
+    if (use_perf)
+        m->have_counters = perf_stop(m->counters);
+#endif
+}
+
+static void report(const char *op, const dialect_t *dialect, const char *shape,
+                   Tcl_Size bytes, Tcl_Size rows, int iterations,
+                   measurement_t *m)
+{
+    printf("%s,%s,%s,%" TCL_SIZE_MODIFIER "d,%" TCL_SIZE_MODIFIER "d,%d,%.0f,%.2f,%.0f",
+           op, dialect->name, shape, bytes, rows, iterations,
+           m->seconds * 1e9, bytes / m->seconds / 1048576.0,
+           rows / m->seconds);
+    if (m->have_counters) {
+        printf(",%.4f,%llu,%llu,%llu\n",
+               (double) bytes / (double) m->counters[COUNTER_CYCLES],
+               (unsigned long long) m->counters[COUNTER_CYCLES],
+               (unsigned long long) m->counters[COUNTER_BRANCH_MISSES],
+               (unsigned long long) m->counters[COUNTER_CACHE_MISSES]);
+    } else {
+        printf(",,,,\n");
+    }
+    fflush(stdout);
+}
+
+/* Keeps the measurement with the least elapsed time */
+static void keep_best(measurement_t *best, measurement_t *m, int iteration)
+{
+    if (iteration == 0 || m->seconds < best->seconds)
+        *best = *m;
+}
+
+/*
+ * Benchmarks
+ */
+
+static parser_t *create_parser(Tcl_Interp *ip, const dialect_t *dialect,
+                               const char *extra, Tcl_Obj *chanObj)
+{
+    Tcl_Obj *optsObj, **objs;
+    Tcl_Size nobjs;
+    parser_t *parser;
+    int nrows;
+
+    optsObj = Tcl_NewStringObj(dialect->options, -1);
+    Tcl_IncrRefCount(optsObj);
+    if (extra)
+        Tcl_AppendPrintfToObj(optsObj, " %s", extra);
+    Tcl_ListObjAppendElement(NULL, optsObj, chanObj);
+    if (Tcl_ListObjGetElements(ip, optsObj, &nobjs, &objs) != TCL_OK) {
+        Tcl_DecrRefCount(optsObj);
+        return NULL;
+    }
+    parser = parser_create(ip, (int) nobjs, objs, &nrows);
+    Tcl_DecrRefCount(optsObj);
+    if (parser && dialect->whitespace)
+        parser->core.delim_whitespace = 1;
+    return parser;
+}
+
+/*
+ * Tokenizes the input. If extra is not NULL, it is passed as additional
+ * parser options. On success, returns the parsed rows with a reference
+ * count of 1 if prowsObj is not NULL.
+ */
+static int bench_tokenize(Tcl_Interp *ip, const char *op,
+                          const dialect_t *dialect, const char *shape,
+                          const char *extra, Tcl_DString *input,
+                          Tcl_Obj *chanObj, int iterations,
+                          Tcl_Obj **prowsObj)
+{
+    measurement_t m, best;
+    parser_t *parser;
+    Tcl_Size nrows = 0;
+    size_t consumed;
+    int i, status;
+
+    for (i = 0; i < iterations; ++i) {
+        parser = create_parser(ip, dialect, extra, chanObj);
+        if (parser == NULL)
+            return TCL_ERROR;
+
+        measure_start(&m);
+        status = csv_core_feed(&parser->core, Tcl_DStringValue(input),
+                               Tcl_DStringLength(input), &consumed);
+        measure_stop(&m);
+
+        if (status != CSV_CORE_OK ||
+            consumed != (size_t) Tcl_DStringLength(input)) {
+            if (parser->errorObj)
+                Tcl_SetObjResult(ip, parser->errorObj);
+            else
+                Tcl_SetResult(ip, "Tokenizer did not consume input.",
+                              TCL_STATIC);
+            parser_free(parser);
+            return TCL_ERROR;
+        }
+        keep_best(&best, &m, i);
+        nrows = parser->lines;
+        if (prowsObj && i == iterations - 1) {
+            *prowsObj = parser->rowsObj;
+            Tcl_IncrRefCount(*prowsObj);
+        }
+        parser_free(parser);
+    }
+    report(op, dialect, shape, Tcl_DStringLength(input), nrows, iterations,
+           &best);
+    return TCL_OK;
+}
+
+static int count_field(void *ctx, const char *data, size_t len)
+{
+    return CSV_CORE_OK;
+}
+
+static int count_record(void *ctx)
+{
+    ++*(Tcl_Size *) ctx;
+    return CSV_CORE_OK;
+}
+
+/* Tokenizes the input with the core alone, without any Tcl_Obj's */
+static int bench_core(Tcl_Interp *ip, const dialect_t *dialect,
+                      const char *shape, Tcl_DString *input, int iterations)
+{
+    measurement_t m, best;
+    csv_core_t core;
+    Tcl_Size nrows = 0;
+    size_t consumed;
+    int i, status;
+
+    for (i = 0; i < iterations; ++i) {
+        csv_core_init(&core);
+        core.delimiter = dialect->delimiter;
+        core.delim_whitespace = dialect->whitespace;
+        if (!strcmp(dialect->name, "customterm"))
+            core.lineterminator = '\n';
+        core.on_field = count_field;
+        core.on_record = count_record;
+        core.ctx = &nrows;
+        nrows = 0;
+
+        measure_start(&m);
+        status = csv_core_feed(&core, Tcl_DStringValue(input),
+                               Tcl_DStringLength(input), &consumed);
+        if (status == CSV_CORE_OK)
+            status = csv_core_finish(&core);
+        measure_stop(&m);
+
+        csv_core_free(&core);
+        if (status != CSV_CORE_OK) {
+            Tcl_SetObjResult(ip, Tcl_NewStringObj(core.error, -1));
+            return TCL_ERROR;
+        }
+        keep_best(&best, &m, i);
+    }
+    report("core", dialect, shape, Tcl_DStringLength(input), nrows,
+           iterations, &best);
+    return TCL_OK;
+}
+
+static int bench_format(Tcl_Interp *ip, const dialect_t *dialect,
+                        const char *shape, Tcl_Obj *rowsObj, int iterations)
+{
+    struct csv_write_config config;
+    measurement_t m, best;
+    Tcl_DString ds;
+    Tcl_Obj **rows;
+    Tcl_Size r, nrows, nbytes = 0;
+    int i;
+
+    csv_write_config_init(&config);
+    config.delimiter = dialect->delimiter;
+    if (csv_write_config_finalize(ip, &config) != TCL_OK)
+        return TCL_ERROR;
+    if (Tcl_ListObjGetElements(ip, rowsObj, &nrows, &rows) != TCL_OK)
+        return TCL_ERROR;
+
+    Tcl_DStringInit(&ds);
+    for (i = 0; i < iterations; ++i) {
+        nbytes = 0;
+        measure_start(&m);
+        /* Same buffering as csv_write less the channel output */
+        for (r = 0; r < nrows; ++r) {
+            csv_format_row(NULL, &ds, rows[r], &config);
+            if (Tcl_DStringLength(&ds) > config.flushsize) {
+                nbytes += Tcl_DStringLength(&ds);
+                Tcl_DStringSetLength(&ds, 0);
+            }
+        }
+        nbytes += Tcl_DStringLength(&ds);
+        Tcl_DStringSetLength(&ds, 0);
+        measure_stop(&m);
+        keep_best(&best, &m, i);
+    }
+    Tcl_DStringFree(&ds);
+    report("format", dialect, shape, nbytes, nrows, iterations, &best);
+    return TCL_OK;
+}
+
+static int run(Tcl_Interp *ip, Tcl_Size size, int iterations,
+               const char *dialect_name, const char *shape_name)
+{
+    Tcl_DString input;
+    Tcl_Obj *chanObj, *rowsObj;
+    size_t d, s;
+    int status = TCL_OK;
+
+    /*
+     * parser_create requires a channel though it is never read since
+     * data is placed directly in the parser buffer.
+     */
+    if (Tcl_Eval(ip, "lindex [chan pipe] 0") != TCL_OK)
+        return TCL_ERROR;
+    chanObj = Tcl_GetObjResult(ip);
+    Tcl_IncrRefCount(chanObj);
+
+    printf("op,dialect,shape,bytes,rows,iterations,best_ns,mb_per_s,"
+           "rows_per_s,bytes_per_cycle,cycles,branch_misses,cache_misses\n");
+    for (d = 0; d < NDIALECTS && status == TCL_OK; ++d) {
+        const dialect_t *dialect = &dialects[d];
+        if (dialect_name && strcmp(dialect_name, dialect->name))
+            continue;
+        for (s = 0; s < NSHAPES && status == TCL_OK; ++s) {
+            if (shape_name && strcmp(shape_name, shapes[s]))
+                continue;
+            gen_input(&input, shapes[s], dialect->delimiter, size);
+            rowsObj = NULL;
+            status = bench_tokenize(ip, "tokenize", dialect, shapes[s],
+                                    NULL, &input, chanObj, iterations,
+                                    &rowsObj);
+            /*
+             * Sampling one record in a billion leaves only the state
+             * machine since no Tcl_Obj's are created for the other records.
+             */
+            if (status == TCL_OK)
+                status = bench_tokenize(ip, "scan", dialect, shapes[s],
+                                        "-sample {every 1000000000}",
+                                        &input, chanObj, iterations, NULL);
+            if (status == TCL_OK)
+                status = bench_core(ip, dialect, shapes[s], &input,
+                                    iterations);
+            if (status == TCL_OK)
+                status = bench_format(ip, dialect, shapes[s], rowsObj,
+                                      iterations);
+            if (rowsObj)
+                Tcl_DecrRefCount(rowsObj);
+            Tcl_DStringFree(&input);
+        }
+    }
+    Tcl_DecrRefCount(chanObj);
+    return status;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s ?-size MB? ?-iterations N? ?-dialect NAME?"
+            " ?-shape NAME? ?-noperf?\n", prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    Tcl_Interp *ip;
+    const char *dialect_name = NULL, *shape_name = NULL;
+    long size_mb = 8;
+    int i, iterations = 5, noperf = 0;
+
+    for (i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "-noperf")) {
+            noperf = 1;
+        } else if (i + 1 >= argc) {
+            usage(argv[0]);
+        } else if (!strcmp(argv[i], "-size")) {
+            size_mb = atol(argv[++i]);
+        } else if (!strcmp(argv[i], "-iterations")) {
+            iterations = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-dialect")) {
+            dialect_name = argv[++i];
+        } else if (!strcmp(argv[i], "-shape")) {
+            shape_name = argv[++i];
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (size_mb <= 0 || iterations <= 0)
+        usage(argv[0]);
+
+    Tcl_FindExecutable(argv[0]);
+    ip = Tcl_CreateInterp();
+    if (Tclcsv_Init(ip) != TCL_OK) {
+        fprintf(stderr, "%s\n", Tcl_GetStringResult(ip));
+        return 1;
+    }
+
+#ifdef TOKBENCH_PERF
+    if (! noperf) {
+        use_perf = perf_init();
+        if (! use_perf)
+            fprintf(stderr, "Hardware counters not available (see"
+                    " /proc/sys/kernel/perf_event_paranoid).\n");
+    }
+#else
+    (void) noperf;
+#endif
+
+    if (run(ip, (Tcl_Size) size_mb * 1024 * 1024, iterations,
+            dialect_name, shape_name) != TCL_OK) {
+        fprintf(stderr, "%s\n", Tcl_GetStringResult(ip));
+        Tcl_DeleteInterp(ip);
+        return 1;
+    }
+    Tcl_DeleteInterp(ip);
+    return 0;
+}
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 4
+ * fill-column: 78
+ * tab-width: 8
+ * End:
+ */